@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+static void __apn_bench_token_free(void *token) {
+    free(token);
+}
+
+static int __apn_bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+uint64_t apn_bench_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t apn_bench_cpu_ns(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return ((uint64_t) usage.ru_utime.tv_sec + (uint64_t) usage.ru_stime.tv_sec) * 1000000000ULL
+           + ((uint64_t) usage.ru_utime.tv_usec + (uint64_t) usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+uint64_t apn_bench_percentile(uint64_t *samples, size_t count, double p) {
+    if (0 == count) {
+        return 0;
+    }
+    qsort(samples, count, sizeof(uint64_t), __apn_bench_compare);
+    size_t index = (size_t) ((p / 100.0) * (double) (count - 1) + 0.5);
+    return samples[index < count ? index : count - 1];
+}
+
+uint32_t apn_bench_random(uint64_t *state) {
+    /* xorshift64* */
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t) ((x * 2685821657736338717ULL) >> 32);
+}
+
+apn_array_t *apn_bench_tokens(uint32_t count, double invalid_rate, uint64_t seed) {
+    static const char hex[] = "0123456789ABCDEF";
+    uint64_t state = seed ? seed : 88172645463325252ULL;
+    apn_array_t *tokens = apn_array_init(count, __apn_bench_token_free, NULL);
+    if (!tokens) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        char *token = malloc(65);
+        if (!token) {
+            apn_array_free(tokens);
+            return NULL;
+        }
+        for (uint32_t j = 0; j < 64; j++) {
+            token[j] = hex[apn_bench_random(&state) & 0x0F];
+        }
+        token[64] = '\0';
+        if ((double) apn_bench_random(&state) / 4294967296.0 < invalid_rate) {
+            memcpy(token, APN_BENCH_INVALID_PREFIX, strlen(APN_BENCH_INVALID_PREFIX));
+        } else if (0 == strncmp(token, APN_BENCH_INVALID_PREFIX, strlen(APN_BENCH_INVALID_PREFIX))) {
+            token[0] = '0';
+        }
+        apn_array_insert(tokens, token);
+    }
+    return tokens;
+}
+
+char *apn_bench_utf8_text(size_t size) {
+    /* "Notification 通知 " - 13 ASCII bytes and two 3-byte characters */
+    static const char pattern[] = "Notification \xE9\x80\x9A\xE7\x9F\xA5 ";
+    size_t pattern_size = sizeof(pattern) - 1;
+    char *text = malloc(size + 1);
+    if (!text) {
+        return NULL;
+    }
+    size_t pos = 0;
+    while (pos + pattern_size <= size) {
+        memcpy(text + pos, pattern, pattern_size);
+        pos += pattern_size;
+    }
+    while (pos < size) {
+        text[pos++] = 'x';
+    }
+    text[size] = '\0';
+    return text;
+}
+
+size_t apn_bench_parse_list(const char *list, double *values, size_t max_values) {
+    size_t count = 0;
+    const char *p = list;
+    while (*p && count < max_values) {
+        char *end = NULL;
+        values[count] = strtod(p, &end);
+        if (end == p) {
+            break;
+        }
+        count++;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+void apn_bench_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*str, out);
+    }
+    fputc('"', out);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_BENCH_H__
+#define __APN_BENCH_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "apn_array.h"
+
+/** Prefix of tokens which apn-mock-gateway is told to reject (-x dead) */
+#define APN_BENCH_INVALID_PREFIX "DEAD"
+
+uint64_t apn_bench_clock_ns(void);
+
+/** User + system CPU time of the process in nanoseconds */
+uint64_t apn_bench_cpu_ns(void);
+
+/** Returns the value at percentile `p` (0..100) of `count` samples. Sorts the samples. */
+uint64_t apn_bench_percentile(uint64_t *samples, size_t count, double p);
+
+/** Deterministic pseudo-random generator, so that runs are comparable between versions */
+uint32_t apn_bench_random(uint64_t *state);
+
+/**
+ * Generates `count` hex tokens. `invalid_rate` of them (0..1) start with ::APN_BENCH_INVALID_PREFIX,
+ * the others never do.
+ */
+apn_array_t *apn_bench_tokens(uint32_t count, double invalid_rate, uint64_t seed);
+
+/** Allocates a NULL-terminated UTF-8 string of exactly `size` bytes mixing ASCII and multi-byte characters */
+char *apn_bench_utf8_text(size_t size);
+
+/** Parses comma separated list of numbers, returns number of parsed values */
+size_t apn_bench_parse_list(const char *list, double *values, size_t max_values);
+
+void apn_bench_json_string(FILE *out, const char *str);
+
+#endif
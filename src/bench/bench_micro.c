@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the per-notification primitives. Every case is warmed up, then run for
+ * a number of repetitions of a fixed duration; the median ns/op and allocations/op are reported.
+ * Allocations are counted by interposing malloc() and friends, which is supported with glibc only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apn.h"
+#include "apn_array.h"
+#include "apn_strings.h"
+#include "apn_tokens.h"
+#include "apn_paload_private.h"
+#include "apn_binary_message_private.h"
+#include "bench.h"
+
+#define APN_MICRO_MAX_REPETITIONS 64
+#define APN_MICRO_ARRAY_ITEMS 64
+
+typedef void (*__apn_micro_fn)(void *data, uint32_t iterations);
+
+struct __apn_micro_case {
+    const char *name;
+    const char *input;
+    __apn_micro_fn run;
+    void *data;
+};
+
+/* Keeps results observable so that calls are not optimized away */
+static volatile uintptr_t __apn_micro_sink = 0;
+
+static uint64_t __apn_micro_allocs = 0;
+static uint8_t __apn_micro_counting = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    if (__apn_micro_counting) {
+        __apn_micro_allocs++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (__apn_micro_counting) {
+        __apn_micro_allocs++;
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (__apn_micro_counting) {
+        __apn_micro_allocs++;
+    }
+    return __libc_realloc(ptr, size);
+}
+#define APN_MICRO_COUNTS_ALLOCS 1
+#else
+#define APN_MICRO_COUNTS_ALLOCS 0
+#endif
+
+static void __apn_micro_hex_token_is_valid(void *data, uint32_t iterations) {
+    const char *token = data;
+    uintptr_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += apn_hex_token_is_valid(token);
+    }
+    __apn_micro_sink += sum;
+}
+
+static void __apn_micro_token_hex_to_binary(void *data, uint32_t iterations) {
+    const char *token = data;
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint8_t *binary = apn_token_hex_to_binary(token);
+        __apn_micro_sink += binary ? binary[31] : 0;
+        free(binary);
+    }
+}
+
+static void __apn_micro_string_is_utf8(void *data, uint32_t iterations) {
+    const char *text = data;
+    uintptr_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += apn_string_is_utf8(text);
+    }
+    __apn_micro_sink += sum;
+}
+
+static void __apn_micro_json_document(void *data, uint32_t iterations) {
+    const apn_payload_t *payload = data;
+    for (uint32_t i = 0; i < iterations; i++) {
+        char *json = apn_create_json_document_from_payload(payload);
+        __apn_micro_sink += json ? (uintptr_t) json[0] : 0;
+        free(json);
+    }
+}
+
+static void __apn_micro_binary_message(void *data, uint32_t iterations) {
+    const apn_payload_t *payload = data;
+    for (uint32_t i = 0; i < iterations; i++) {
+        apn_binary_message_t *message = apn_create_binary_message(payload);
+        __apn_micro_sink += message ? message->size : 0;
+        apn_binary_message_free(message);
+    }
+}
+
+/* One op is one insert into an array which grows from its default size */
+static void __apn_micro_array_insert(void *data, uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i += APN_MICRO_ARRAY_ITEMS) {
+        apn_array_t *array = apn_array_init(10, NULL, NULL);
+        if (!array) {
+            return;
+        }
+        for (uint32_t j = 0; j < APN_MICRO_ARRAY_ITEMS; j++) {
+            apn_array_insert(array, data);
+        }
+        __apn_micro_sink += apn_array_count(array);
+        apn_array_free(array);
+    }
+}
+
+static apn_payload_t *__apn_micro_payload(uint32_t body_size, uint32_t properties) {
+    apn_payload_t *payload = apn_payload_init();
+    char *body = apn_bench_utf8_text(body_size);
+    if (!payload || !body || APN_ERROR == apn_payload_set_body(payload, body)) {
+        free(body);
+        apn_payload_free(payload);
+        return NULL;
+    }
+    free(body);
+    apn_payload_set_badge(payload, 3);
+    apn_payload_set_sound(payload, "default");
+    for (uint32_t i = 0; i < properties; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%02u", i);
+        switch (i % 3) {
+            case 0:
+                apn_payload_add_custom_property_integer(payload, key, (int64_t) i * 1000);
+                break;
+            case 1:
+                apn_payload_add_custom_property_string(payload, key, "value");
+                break;
+            default:
+                apn_payload_add_custom_property_bool(payload, key, 1);
+                break;
+        }
+    }
+    return payload;
+}
+
+static void __apn_micro_measure(const struct __apn_micro_case *const c, uint32_t repetitions, uint64_t target_ns,
+                                FILE *out, uint8_t last) {
+    uint32_t iterations = 1;
+    uint64_t elapsed = 0;
+
+    /* Warm up and calibrate: double the number of iterations until one batch takes ~target_ns */
+    while (iterations < (1U << 30)) {
+        uint64_t start = apn_bench_clock_ns();
+        c->run(c->data, iterations);
+        elapsed = apn_bench_clock_ns() - start;
+        if (elapsed >= target_ns / 2) {
+            break;
+        }
+        iterations *= 2;
+    }
+    if (elapsed > 0 && elapsed < target_ns) {
+        uint64_t scaled = (uint64_t) iterations * target_ns / elapsed;
+        iterations = scaled < (1U << 30) ? (uint32_t) scaled : (1U << 30);
+    }
+    if (iterations < APN_MICRO_ARRAY_ITEMS && c->run == __apn_micro_array_insert) {
+        iterations = APN_MICRO_ARRAY_ITEMS;
+    }
+
+    uint64_t samples[APN_MICRO_MAX_REPETITIONS];
+    uint64_t allocs = 0;
+    for (uint32_t r = 0; r < repetitions; r++) {
+        __apn_micro_allocs = 0;
+        __apn_micro_counting = 1;
+        uint64_t start = apn_bench_clock_ns();
+        c->run(c->data, iterations);
+        samples[r] = apn_bench_clock_ns() - start;
+        __apn_micro_counting = 0;
+        allocs += __apn_micro_allocs;
+    }
+
+    uint64_t min = samples[0];
+    for (uint32_t r = 1; r < repetitions; r++) {
+        min = samples[r] < min ? samples[r] : min;
+    }
+    uint64_t median = apn_bench_percentile(samples, repetitions, 50);
+
+    fprintf(out, "    {\"name\": ");
+    apn_bench_json_string(out, c->name);
+    fprintf(out, ", \"input\": ");
+    apn_bench_json_string(out, c->input);
+    fprintf(out, ", \"iterations\": %u, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f", iterations,
+            (double) median / iterations, (double) min / iterations);
+    if (APN_MICRO_COUNTS_ALLOCS) {
+        fprintf(out, ", \"allocs_per_op\": %.2f", (double) allocs / ((double) iterations * repetitions));
+    } else {
+        fprintf(out, ", \"allocs_per_op\": null");
+    }
+    fprintf(out, "}%s\n", last ? "" : ",");
+    fflush(out);
+}
+
+static void __apn_micro_usage(void) {
+    fprintf(stderr, "Usage: apn-microbench [OPTION]\n");
+    fprintf(stderr, "    -h Print this message and exit\n");
+    fprintf(stderr, "    -r Repetitions of each case (default: 5, max: %d)\n", APN_MICRO_MAX_REPETITIONS);
+    fprintf(stderr, "    -t Duration of one repetition in milliseconds (default: 100)\n");
+    fprintf(stderr, "    -f Run only cases whose name contains the string\n");
+    fprintf(stderr, "    -o Write JSON result to file instead of stdout\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t repetitions = 5;
+    uint64_t target_ms = 100;
+    const char *filter = NULL;
+    const char *output = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "hr:t:f:o:")) != -1) {
+        switch (c) {
+            case 'r':
+                repetitions = (uint32_t) atoi(optarg);
+                break;
+            case 't':
+                target_ms = (uint64_t) atoi(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+            default:
+                __apn_micro_usage();
+                return 1;
+        }
+    }
+    if (0 == repetitions || repetitions > APN_MICRO_MAX_REPETITIONS || 0 == target_ms) {
+        __apn_micro_usage();
+        return 1;
+    }
+
+    static const uint32_t body_sizes[] = {200, 512, 1024, 2048};
+    static const uint32_t properties[] = {0, 10, 50};
+    char *bodies[4] = {NULL};
+    apn_payload_t *payloads[3] = {NULL};
+    char inputs[7][48];
+    struct __apn_micro_case cases[16];
+    size_t count = 0;
+    int ret = 0;
+
+    apn_array_t *tokens = apn_bench_tokens(1, 0, 0);
+    if (!tokens) {
+        fprintf(stderr, "Unable to generate token\n");
+        return 1;
+    }
+    char *token = apn_array_item_at_index(tokens, 0);
+
+    cases[count++] = (struct __apn_micro_case) {"apn_hex_token_is_valid", "64-char token",
+                                                __apn_micro_hex_token_is_valid, token};
+    cases[count++] = (struct __apn_micro_case) {"apn_token_hex_to_binary", "64-char token",
+                                                __apn_micro_token_hex_to_binary, token};
+    for (size_t i = 0; i < 4; i++) {
+        if (!(bodies[i] = apn_bench_utf8_text(body_sizes[i]))) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            ret = 1;
+            goto finish;
+        }
+        snprintf(inputs[i], sizeof(inputs[i]), "%u-byte UTF-8 string", body_sizes[i]);
+        cases[count++] = (struct __apn_micro_case) {"apn_string_is_utf8", inputs[i], __apn_micro_string_is_utf8,
+                                                    bodies[i]};
+    }
+    for (size_t i = 0; i < 3; i++) {
+        /* Keep the document within APN_PAYLOAD_MAX_SIZE with 50 properties */
+        uint32_t body_size = properties[i] < 50 ? 1024 : 200;
+        if (!(payloads[i] = __apn_micro_payload(body_size, properties[i]))) {
+            fprintf(stderr, "Unable to create payload\n");
+            ret = 1;
+            goto finish;
+        }
+        snprintf(inputs[4 + i], sizeof(inputs[4 + i]), "%u-byte body, %u custom properties", body_size,
+                 properties[i]);
+        cases[count++] = (struct __apn_micro_case) {"apn_create_json_document_from_payload", inputs[4 + i],
+                                                    __apn_micro_json_document, payloads[i]};
+        cases[count++] = (struct __apn_micro_case) {"apn_create_binary_message", inputs[4 + i],
+                                                    __apn_micro_binary_message, payloads[i]};
+    }
+    cases[count++] = (struct __apn_micro_case) {"apn_array_insert", "growing array of 64 items",
+                                                __apn_micro_array_insert, token};
+
+    size_t selected = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!filter || strstr(cases[i].name, filter)) {
+            cases[selected++] = cases[i];
+        }
+    }
+
+    FILE *out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Unable to open %s\n", output);
+        ret = 1;
+        goto finish;
+    }
+
+    fprintf(out, "{\n  \"library\": ");
+    apn_bench_json_string(out, apn_version_string());
+    fprintf(out, ",\n  \"repetitions\": %u,\n  \"target_ns\": %llu,\n  \"results\": [\n", repetitions,
+            (unsigned long long) (target_ms * 1000000ULL));
+    for (size_t i = 0; i < selected; i++) {
+        __apn_micro_measure(&cases[i], repetitions, target_ms * 1000000ULL, out, i + 1 == selected);
+    }
+    fprintf(out, "  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    finish:
+    for (size_t i = 0; i < 4; i++) {
+        free(bodies[i]);
+    }
+    for (size_t i = 0; i < 3; i++) {
+        apn_payload_free(payloads[i]);
+    }
+    apn_array_free(tokens);
+    return ret;
+}
@@ -0,0 +1,917 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * End-to-end throughput benchmark of apn_send(). Runs against a local apn-mock-gateway:
+ *
+ *     apn-mock-gateway -c cert.pem -k key.pem -p 2195 -x dead &
+ *     apn-bench -c cert.pem -k key.pem -p 2195 -n 1000,10000 -s 64,1024 -i 0,0.01 -o result.json
+ *
+ * With -T N every combination is also run on N threads, each sending the whole batch through its own
+ * context, to check that sends on different contexts scale without serialization.
+ *
+ * With -L N every combination is also sent through an apn_loop_t over N connections with each supported
+ * backend (epoll, io_uring), N batches at once, to compare syscalls and notifications/sec per core.
+ *
+ * With -P N every combination is also sent with apn_pool_send() through a pool of N connections.
+ *
+ * With -C FILE, the counters file of `apn-mock-gateway -C FILE`, every run also checks that the gateway
+ * accepted each notification but the rejected ones exactly once: none lost after an error response, none sent twice.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "apn.h"
+#include "apn_payload.h"
+#include "apn_pool.h"
+#include "apn_binary_message_private.h"
+#ifdef APN_HAVE_SYS_EPOLL_H
+#include "apn_loop.h"
+#endif
+#include "bench.h"
+
+#define APN_BENCH_MAX_VALUES 16
+#define APN_BENCH_MAX_BODY_SIZE 1800
+#define APN_BENCH_TRACE_CAPACITY (1 << 20)
+#define APN_BENCH_MAX_THREADS 256
+#define APN_BENCH_MAX_CONNECTIONS 1024
+/* Wait for error responses after the last frame of a batch, not part of the measured time */
+#define APN_BENCH_ERROR_TIMEOUT 200
+#define APN_BENCH_POOL_APP_ID "apn-bench"
+
+struct __apn_bench_config {
+    const char *cert;
+    const char *key;
+    const char *host;
+    uint16_t port;
+    double counts[APN_BENCH_MAX_VALUES];
+    size_t counts_size;
+    double sizes[APN_BENCH_MAX_VALUES];
+    size_t sizes_size;
+    double invalid_rates[APN_BENCH_MAX_VALUES];
+    size_t invalid_rates_size;
+    uint32_t repetitions;
+    uint32_t latency_samples;
+    uint32_t reconnect_samples;
+    const char *trace;
+    uint32_t threads;
+    uint32_t connections;
+    uint32_t pool_connections;
+    apn_socket_preset socket_preset;
+    /* Counters of apn-mock-gateway -C, accepted notifications first. NULL if not given */
+    const uint64_t *gateway_counters;
+    uint8_t verbose;
+};
+
+struct __apn_bench_result {
+    const char *mode;
+    uint32_t threads;
+    uint32_t connections;
+    uint32_t tokens;
+    uint32_t payload_size;
+    uint32_t frame_size;
+    double invalid_rate;
+    uint32_t invalid_reported;
+    double seconds;
+    double notifications_per_sec;
+    double bytes_per_sec;
+    double cpu_ns_per_notification;
+    /* Only counted by the loop modes, printed as null otherwise */
+    uint8_t syscalls_counted;
+    double syscalls_per_notification;
+    uint64_t latency_p50_ns;
+    uint64_t latency_p99_ns;
+    uint64_t reconnect_ns;
+    uint32_t errors;
+};
+
+struct __apn_bench_worker {
+    pthread_t thread;
+    apn_ctx_t *ctx;
+    const apn_payload_t *payload;
+    apn_array_t *tokens;
+    uint32_t errors;
+    uint64_t end;
+};
+
+/* Updated from the invalid token callback, which runs on every sending thread */
+static uint32_t __apn_bench_rejected = 0;
+
+static void __apn_bench_invalid_token(const char *const token, uint32_t index) {
+    (void) token;
+    (void) index;
+    __atomic_fetch_add(&__apn_bench_rejected, 1, __ATOMIC_RELAXED);
+}
+
+static void __apn_bench_pool_invalid_token(const char *const app_id, const char *const token) {
+    (void) app_id;
+    __apn_bench_invalid_token(token, 0);
+}
+
+static uint32_t __apn_bench_rejected_count(void) {
+    return __atomic_load_n(&__apn_bench_rejected, __ATOMIC_RELAXED);
+}
+
+static uint64_t __apn_bench_gateway_accepted(const struct __apn_bench_config *const config) {
+    return config->gateway_counters ? __atomic_load_n(&config->gateway_counters[0], __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * Checks that the gateway accepted all notifications of a run but the rejected ones, `accepted` is the gateway
+ * counter before the run. A notification lost after an error response or sent twice counts as an error
+ */
+static void __apn_bench_check_delivery(const struct __apn_bench_config *const config,
+                                       struct __apn_bench_result *const result, uint64_t accepted) {
+    if (!config->gateway_counters) {
+        return;
+    }
+    accepted = __apn_bench_gateway_accepted(config) - accepted;
+    uint32_t expected = result->tokens > result->invalid_reported ? result->tokens - result->invalid_reported : 0;
+    if (accepted != expected) {
+        result->errors++;
+        fprintf(stderr, "%s: gateway accepted %llu notification(s) of %u, expected %u\n", result->mode,
+                (unsigned long long) accepted, result->tokens, expected);
+    }
+}
+
+static void __apn_bench_usage(void) {
+    fprintf(stderr, "Usage: apn-bench -c CERT -k KEY [OPTION]\n");
+    fprintf(stderr, "    -c Path to certificate file\n");
+    fprintf(stderr, "    -k Path to private key file\n");
+    fprintf(stderr, "    -H Gateway host (default: 127.0.0.1)\n");
+    fprintf(stderr, "    -p Gateway port (default: 2195)\n");
+    fprintf(stderr, "    -n Comma separated token counts (default: 1000,10000)\n");
+    fprintf(stderr, "    -s Comma separated payload body sizes in bytes (default: 64,512,1536)\n");
+    fprintf(stderr, "    -i Comma separated invalid token rates, 0..1 (default: 0,0.001,0.01)\n");
+    fprintf(stderr, "    -r Repetitions of each run (default: 3)\n");
+    fprintf(stderr, "    -l Number of single-token sends used to measure latency (default: 1000)\n");
+    fprintf(stderr, "    -R Number of reconnects used to measure reconnect cost (default: 20)\n");
+    fprintf(stderr, "    -o Write JSON result to file instead of stdout\n");
+    fprintf(stderr, "    -t Record a trace of the last %d events to file, see apn-trace2json\n",
+            APN_BENCH_TRACE_CAPACITY);
+    fprintf(stderr, "    -T Also run every combination on N threads, one context per thread (default: 1, max: %d)\n",
+            APN_BENCH_MAX_THREADS);
+    fprintf(stderr, "    -L Also run every combination through an event loop over N connections (default: 0, max: %d)\n",
+            APN_BENCH_MAX_CONNECTIONS);
+    fprintf(stderr, "    -P Also run every combination through a pool of N connections (default: 0, max: %d)\n",
+            APN_BENCH_MAX_CONNECTIONS);
+    fprintf(stderr, "    -C Check delivery against the counters file of apn-mock-gateway -C\n");
+    fprintf(stderr, "    -S Socket profile: default, bulk or low-latency (default: default)\n");
+    fprintf(stderr, "    -v Print progress to stderr\n");
+    fprintf(stderr, "\nStart apn-mock-gateway with `-x dead` so that invalid tokens are rejected\n");
+}
+
+static apn_ctx_t *__apn_bench_context(const struct __apn_bench_config *const config, uint8_t trace) {
+    apn_ctx_t *ctx = apn_init();
+    if (!ctx) {
+        return NULL;
+    }
+    apn_set_behavior(ctx, APN_OPTION_RECONNECT | APN_OPTION_ASYNC_ERRORS | APN_OPTION_NO_CERT_MODE_CHECK);
+    apn_set_invalid_token_callback(ctx, __apn_bench_invalid_token);
+    apn_socket_profile_t profile;
+    apn_socket_profile_preset(&profile, config->socket_preset);
+    if (APN_ERROR == apn_set_socket_profile(ctx, &profile)
+        || (trace && config->trace && APN_ERROR == apn_trace_enable(ctx, APN_BENCH_TRACE_CAPACITY))
+        || APN_ERROR == apn_set_certificate(ctx, config->cert, config->key, NULL)
+        || APN_ERROR == apn_set_gateway(ctx, config->host, config->port)
+        || APN_ERROR == apn_connect(ctx)) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to connect to %s:%u: %s\n", config->host, config->port, error);
+        free(error);
+        apn_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static apn_payload_t *__apn_bench_payload(uint32_t body_size) {
+    apn_payload_t *payload = apn_payload_init();
+    char *body = apn_bench_utf8_text(body_size);
+    if (!payload || !body || APN_ERROR == apn_payload_set_body(payload, body)) {
+        free(body);
+        apn_payload_free(payload);
+        return NULL;
+    }
+    free(body);
+    apn_payload_set_badge(payload, 1);
+    apn_payload_set_sound(payload, "default");
+    apn_payload_set_priority(payload, APN_NOTIFICATION_PRIORITY_HIGH);
+    return payload;
+}
+
+static uint32_t __apn_bench_frame_size(const apn_payload_t *const payload) {
+    apn_binary_message_t *message = apn_create_binary_message(payload);
+    if (!message) {
+        return 0;
+    }
+    uint32_t size = message->size;
+    apn_binary_message_free(message);
+    return size;
+}
+
+/*
+ * Sends the batch and drains error responses to its tail; notifications Apple dropped after a rejected one
+ * are sent again by the library meanwhile. Returns the time of the last write or resend, the final wait
+ * for a response that does not come is not part of the send
+ */
+static uint64_t __apn_bench_send(apn_ctx_t *const ctx, const apn_payload_t *const payload, apn_array_t *const tokens,
+                                 uint32_t *const errors) {
+    if (APN_ERROR == apn_send(ctx, payload, tokens, NULL)) {
+        (*errors)++;
+    }
+    uint64_t end = apn_bench_clock_ns();
+    while (APN_ERROR == apn_check_errors(ctx, APN_BENCH_ERROR_TIMEOUT, NULL)) {
+        end = apn_bench_clock_ns();
+        if (APN_ERR_TOKEN_INVALID != errno && APN_ERR_SERVICE_SHUTDOWN != errno) {
+            (*errors)++;
+            break;
+        }
+    }
+    return end;
+}
+
+/* Notifications accepted by the gateway: all but the rejected ones, which the library sends again otherwise */
+static void __apn_bench_throughput(struct __apn_bench_result *const result, uint64_t cpu) {
+    uint32_t delivered = result->tokens > result->invalid_reported ? result->tokens - result->invalid_reported : 0;
+    if (result->seconds > 0) {
+        result->notifications_per_sec = delivered / result->seconds;
+        result->bytes_per_sec = (double) delivered * result->frame_size / result->seconds;
+    }
+    result->cpu_ns_per_notification = delivered ? (double) cpu / delivered : 0;
+}
+
+static void *__apn_bench_worker_run(void *arg) {
+    struct __apn_bench_worker *worker = arg;
+    worker->end = __apn_bench_send(worker->ctx, worker->payload, worker->tokens, &worker->errors);
+    return NULL;
+}
+
+/* Sends the batch on every worker concurrently, returns wall time in seconds until the last worker's last write */
+static double __apn_bench_send_threads(struct __apn_bench_worker *const workers, uint32_t threads,
+                                       uint32_t *const errors) {
+    uint64_t start = apn_bench_clock_ns();
+    uint64_t end = start;
+    uint32_t started = 0;
+    for (; started < threads; started++) {
+        if (0 != pthread_create(&workers[started].thread, NULL, __apn_bench_worker_run, &workers[started])) {
+            (*errors)++;
+            break;
+        }
+    }
+    for (uint32_t t = 0; t < started; t++) {
+        pthread_join(workers[t].thread, NULL);
+        *errors += workers[t].errors;
+        workers[t].errors = 0;
+        if (workers[t].end > end) {
+            end = workers[t].end;
+        }
+    }
+    return (double) (end - start) / 1e9;
+}
+
+static void __apn_bench_threads(const struct __apn_bench_config *const config, struct __apn_bench_worker *const workers,
+                                const apn_payload_t *const payload, apn_array_t *const tokens,
+                                struct __apn_bench_result *const result) {
+    for (uint32_t t = 0; t < config->threads; t++) {
+        workers[t].payload = payload;
+        workers[t].tokens = tokens;
+        workers[t].errors = 0;
+    }
+
+    /* Warm up */
+    __apn_bench_send_threads(workers, config->threads, &result->errors);
+    result->errors = 0;
+
+    double best = 0;
+    uint64_t cpu = 0;
+    for (uint32_t r = 0; r < config->repetitions; r++) {
+        uint32_t rejected = __apn_bench_rejected_count();
+        uint64_t accepted = __apn_bench_gateway_accepted(config);
+        uint64_t cpu_start = apn_bench_cpu_ns();
+        double seconds = __apn_bench_send_threads(workers, config->threads, &result->errors);
+        uint64_t cpu_used = apn_bench_cpu_ns() - cpu_start;
+        result->invalid_reported = __apn_bench_rejected_count() - rejected;
+        __apn_bench_check_delivery(config, result, accepted);
+        if (0 == r || seconds < best) {
+            best = seconds;
+            cpu = cpu_used;
+        }
+    }
+
+    result->seconds = best;
+    __apn_bench_throughput(result, cpu);
+
+    /* Error responses still pending on the workers refer to `tokens`, which are freed by the caller */
+    for (uint32_t t = 0; t < config->threads; t++) {
+        apn_close(workers[t].ctx);
+        if (APN_ERROR == apn_connect(workers[t].ctx)) {
+            result->errors++;
+        }
+    }
+}
+
+#ifdef APN_HAVE_SYS_EPOLL_H
+#define APN_BENCH_LOOP_BACKENDS 2
+
+static const apn_loop_backend __apn_bench_loop_backends[APN_BENCH_LOOP_BACKENDS] = {
+        APN_LOOP_BACKEND_EPOLL, APN_LOOP_BACKEND_IO_URING
+};
+static const char *const __apn_bench_loop_modes[APN_BENCH_LOOP_BACKENDS] = {"loop-epoll", "loop-io_uring"};
+
+/* Returns a loop over all `contexts` or NULL if the backend is not supported */
+static apn_loop_t *__apn_bench_loop(apn_loop_backend backend, apn_ctx_t *const *const contexts, uint32_t count) {
+    apn_loop_t *loop = apn_loop_init(backend);
+    if (!loop) {
+        return NULL;
+    }
+    apn_loop_set_error_timeout(loop, APN_BENCH_ERROR_TIMEOUT);
+    for (uint32_t i = 0; i < count; i++) {
+        if (APN_ERROR == apn_loop_add(loop, contexts[i])) {
+            apn_loop_free(loop);
+            return NULL;
+        }
+    }
+    return loop;
+}
+
+static uint64_t __apn_bench_loop_syscalls(const apn_loop_t *const loop) {
+    apn_loop_stats_t stats;
+    apn_loop_stats(loop, &stats);
+    return stats.waits + stats.io_calls;
+}
+
+static void __apn_bench_loop_send(const struct __apn_bench_config *const config, apn_loop_t *const loop,
+                                  const apn_payload_t *const payload, apn_array_t *const tokens,
+                                  struct __apn_bench_result *const result) {
+    /* Warm up */
+    (void) apn_loop_send(loop, payload, tokens, NULL);
+
+    double best = 0;
+    uint64_t cpu = 0;
+    uint64_t syscalls = 0;
+    for (uint32_t r = 0; r < config->repetitions; r++) {
+        uint32_t rejected = __apn_bench_rejected_count();
+        uint64_t accepted = __apn_bench_gateway_accepted(config);
+        uint64_t syscalls_start = __apn_bench_loop_syscalls(loop);
+        uint64_t cpu_start = apn_bench_cpu_ns();
+        uint64_t start = apn_bench_clock_ns();
+        if (APN_ERROR == apn_loop_send(loop, payload, tokens, NULL)) {
+            result->errors++;
+        }
+        /* The connection which finished last waited APN_BENCH_ERROR_TIMEOUT after its last write */
+        uint64_t elapsed = apn_bench_clock_ns() - start;
+        uint64_t linger = (uint64_t) APN_BENCH_ERROR_TIMEOUT * 1000000;
+        double seconds = (double) (elapsed > linger ? elapsed - linger : 0) / 1e9;
+        uint64_t cpu_used = apn_bench_cpu_ns() - cpu_start;
+        result->invalid_reported = __apn_bench_rejected_count() - rejected;
+        __apn_bench_check_delivery(config, result, accepted);
+        if (0 == r || seconds < best) {
+            best = seconds;
+            cpu = cpu_used;
+            syscalls = __apn_bench_loop_syscalls(loop) - syscalls_start;
+        }
+    }
+
+    result->seconds = best;
+    __apn_bench_throughput(result, cpu);
+    result->syscalls_counted = 1;
+    result->syscalls_per_notification = result->tokens ? (double) syscalls / result->tokens : 0;
+}
+#endif
+
+static apn_pool_t *__apn_bench_pool(const struct __apn_bench_config *const config) {
+    apn_pool_t *pool = apn_pool_init();
+    if (!pool) {
+        return NULL;
+    }
+    apn_identity_t identity;
+    memset(&identity, 0, sizeof(identity));
+    identity.app_id = APN_BENCH_POOL_APP_ID;
+    identity.certificate_file = config->cert;
+    identity.private_key_file = config->key;
+    identity.gateway_host = config->host;
+    identity.gateway_port = config->port;
+    identity.connections = config->pool_connections;
+    identity.options = APN_OPTION_NO_CERT_MODE_CHECK;
+    identity.socket_preset = config->socket_preset;
+    apn_pool_set_invalid_token_callback(pool, __apn_bench_pool_invalid_token);
+    if (APN_ERROR == apn_pool_add_identity(pool, &identity)) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to create connection pool: %s\n", error);
+        free(error);
+        apn_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static void __apn_bench_pool_send(const struct __apn_bench_config *const config, apn_pool_t *const pool,
+                                  const apn_payload_t *const payload, apn_array_t *const tokens,
+                                  struct __apn_bench_result *const result) {
+    /* Warm up: connections of the pool are opened on first use */
+    (void) apn_pool_send(pool, APN_BENCH_POOL_APP_ID, payload, tokens);
+
+    double best = 0;
+    uint64_t cpu = 0;
+    for (uint32_t r = 0; r < config->repetitions; r++) {
+        uint32_t rejected = __apn_bench_rejected_count();
+        uint64_t accepted = __apn_bench_gateway_accepted(config);
+        uint64_t cpu_start = apn_bench_cpu_ns();
+        uint64_t start = apn_bench_clock_ns();
+        if (APN_ERROR == apn_pool_send(pool, APN_BENCH_POOL_APP_ID, payload, tokens)) {
+            result->errors++;
+        }
+        /* The pool waits as long for an error response to the last frames before it returns */
+        uint64_t elapsed = apn_bench_clock_ns() - start;
+        uint64_t linger = (uint64_t) APN_BENCH_ERROR_TIMEOUT * 1000000;
+        double seconds = (double) (elapsed > linger ? elapsed - linger : 0) / 1e9;
+        uint64_t cpu_used = apn_bench_cpu_ns() - cpu_start;
+        result->invalid_reported = __apn_bench_rejected_count() - rejected;
+        __apn_bench_check_delivery(config, result, accepted);
+        if (0 == r || seconds < best) {
+            best = seconds;
+            cpu = cpu_used;
+        }
+    }
+
+    result->seconds = best;
+    __apn_bench_throughput(result, cpu);
+}
+
+static void __apn_bench_latency(apn_ctx_t *const ctx, const apn_payload_t *const payload, uint32_t samples,
+                                struct __apn_bench_result *const result) {
+    uint64_t *latencies = NULL;
+    apn_array_t *tokens = apn_bench_tokens(1, 0, 1);
+    if (0 == samples || !tokens || !(latencies = malloc(samples * sizeof(uint64_t)))) {
+        apn_array_free(tokens);
+        return;
+    }
+    for (uint32_t i = 0; i < samples; i++) {
+        uint64_t start = apn_bench_clock_ns();
+        if (APN_ERROR == apn_send(ctx, payload, tokens, NULL)) {
+            result->errors++;
+        }
+        latencies[i] = apn_bench_clock_ns() - start;
+    }
+    result->latency_p50_ns = apn_bench_percentile(latencies, samples, 50);
+    result->latency_p99_ns = apn_bench_percentile(latencies, samples, 99);
+    free(latencies);
+    apn_array_free(tokens);
+}
+
+static void __apn_bench_reconnect(apn_ctx_t *const ctx, uint32_t samples, struct __apn_bench_result *const result) {
+    uint64_t total = 0;
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < samples; i++) {
+        uint64_t start = apn_bench_clock_ns();
+        apn_close(ctx);
+        if (APN_ERROR == apn_connect(ctx)) {
+            result->errors++;
+            continue;
+        }
+        total += apn_bench_clock_ns() - start;
+        done++;
+    }
+    result->reconnect_ns = done ? total / done : 0;
+}
+
+static void __apn_bench_print(FILE *out, const struct __apn_bench_result *const result, uint8_t last) {
+    char syscalls[32] = "null";
+    if (result->syscalls_counted) {
+        snprintf(syscalls, sizeof(syscalls), "%.4f", result->syscalls_per_notification);
+    }
+    fprintf(out, "    {\"mode\": \"%s\", \"threads\": %u, \"connections\": %u, \"tokens\": %u, \"payload_size\": %u, "
+                 "\"frame_size\": %u, \"invalid_rate\": %g, \"invalid_reported\": %u, \"seconds\": %.6f, "
+                 "\"notifications_per_sec\": %.1f, \"bytes_per_sec\": %.1f, \"cpu_ns_per_notification\": %.1f, "
+                 "\"syscalls_per_notification\": %s, "
+                 "\"latency_p50_ns\": %llu, \"latency_p99_ns\": %llu, \"reconnect_ns\": %llu, \"errors\": %u}%s\n",
+            result->mode, result->threads, result->connections, result->tokens, result->payload_size,
+            result->frame_size, result->invalid_rate, result->invalid_reported, result->seconds,
+            result->notifications_per_sec, result->bytes_per_sec, result->cpu_ns_per_notification,
+            syscalls, (unsigned long long) result->latency_p50_ns,
+            (unsigned long long) result->latency_p99_ns, (unsigned long long) result->reconnect_ns, result->errors,
+            last ? "" : ",");
+}
+
+static int __apn_bench_run(const struct __apn_bench_config *const config, FILE *out) {
+    size_t combinations = config->counts_size * config->sizes_size * config->invalid_rates_size;
+    size_t total = config->threads > 1 ? combinations * 2 : combinations;
+    size_t done = 0;
+    int ret = 0;
+
+    apn_ctx_t *ctx = __apn_bench_context(config, 1);
+    if (!ctx) {
+        return 1;
+    }
+
+    struct __apn_bench_worker *workers = NULL;
+    apn_pool_t *pool = NULL;
+    if (config->pool_connections > 0) {
+        if (!(pool = __apn_bench_pool(config))) {
+            apn_free(ctx);
+            return 1;
+        }
+        total += combinations;
+    }
+#ifdef APN_HAVE_SYS_EPOLL_H
+    apn_ctx_t **loop_contexts = NULL;
+    apn_loop_t *loops[APN_BENCH_LOOP_BACKENDS] = {NULL};
+    if (config->connections > 0) {
+        if (!(loop_contexts = calloc(config->connections, sizeof(apn_ctx_t *)))) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            ret = 1;
+            goto finish;
+        }
+        for (uint32_t i = 0; i < config->connections; i++) {
+            if (!(loop_contexts[i] = __apn_bench_context(config, 0))) {
+                ret = 1;
+                goto finish;
+            }
+        }
+        for (uint32_t b = 0; b < APN_BENCH_LOOP_BACKENDS; b++) {
+            if ((loops[b] = __apn_bench_loop(__apn_bench_loop_backends[b], loop_contexts, config->connections))) {
+                total += combinations;
+            } else if (config->verbose) {
+                fprintf(stderr, "Skipping %s: %s\n", __apn_bench_loop_modes[b], strerror(errno));
+            }
+        }
+    }
+#endif
+    if (config->threads > 1) {
+        if (!(workers = calloc(config->threads, sizeof(struct __apn_bench_worker)))) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            ret = 1;
+            goto finish;
+        }
+        for (uint32_t t = 0; t < config->threads; t++) {
+            if (!(workers[t].ctx = __apn_bench_context(config, 0))) {
+                ret = 1;
+                goto finish;
+            }
+        }
+    }
+
+    fprintf(out, "{\n  \"library\": ");
+    apn_bench_json_string(out, apn_version_string());
+    fprintf(out, ",\n  \"gateway\": ");
+    apn_bench_json_string(out, config->host);
+    fprintf(out, ",\n  \"port\": %u,\n  \"repetitions\": %u,\n  \"results\": [\n", config->port, config->repetitions);
+
+    for (size_t s = 0; s < config->sizes_size; s++) {
+        uint32_t body_size = (uint32_t) config->sizes[s];
+        apn_payload_t *payload = __apn_bench_payload(body_size);
+        uint32_t frame_size = payload ? __apn_bench_frame_size(payload) : 0;
+        if (!payload || 0 == frame_size) {
+            fprintf(stderr, "Unable to build payload of %u bytes\n", body_size);
+            apn_payload_free(payload);
+            ret = 1;
+            goto finish;
+        }
+
+        for (size_t n = 0; n < config->counts_size; n++) {
+            for (size_t i = 0; i < config->invalid_rates_size; i++) {
+                struct __apn_bench_result result;
+                memset(&result, 0, sizeof(result));
+                result.mode = "send";
+                result.threads = 1;
+                result.connections = 1;
+                result.tokens = (uint32_t) config->counts[n];
+                result.payload_size = body_size;
+                result.frame_size = frame_size;
+                result.invalid_rate = config->invalid_rates[i];
+
+                apn_array_t *tokens = apn_bench_tokens(result.tokens, result.invalid_rate, 0);
+                if (!tokens) {
+                    fprintf(stderr, "Unable to generate tokens\n");
+                    apn_payload_free(payload);
+                    ret = 1;
+                    goto finish;
+                }
+
+                /* Warm up: TLS session, address cache, allocator */
+                __apn_bench_send(ctx, payload, tokens, &result.errors);
+                result.errors = 0;
+
+                double best = 0;
+                uint64_t cpu = 0;
+                for (uint32_t r = 0; r < config->repetitions; r++) {
+                    uint32_t rejected = __apn_bench_rejected_count();
+                    uint64_t accepted = __apn_bench_gateway_accepted(config);
+                    uint64_t cpu_start = apn_bench_cpu_ns();
+                    uint64_t start = apn_bench_clock_ns();
+                    double seconds = (double) (__apn_bench_send(ctx, payload, tokens, &result.errors) - start) / 1e9;
+                    uint64_t cpu_used = apn_bench_cpu_ns() - cpu_start;
+                    result.invalid_reported = __apn_bench_rejected_count() - rejected;
+                    __apn_bench_check_delivery(config, &result, accepted);
+                    if (0 == r || seconds < best) {
+                        best = seconds;
+                        cpu = cpu_used;
+                    }
+                }
+
+                result.seconds = best;
+                __apn_bench_throughput(&result, cpu);
+
+                __apn_bench_latency(ctx, payload, config->latency_samples, &result);
+                __apn_bench_reconnect(ctx, config->reconnect_samples, &result);
+
+                done++;
+                __apn_bench_print(out, &result, done == total);
+                fflush(out);
+                if (config->verbose) {
+                    fprintf(stderr, "[%zu/%zu] tokens=%u size=%u invalid=%g: %.0f notifications/sec\n", done, total,
+                            result.tokens, body_size, result.invalid_rate, result.notifications_per_sec);
+                }
+
+                if (workers) {
+                    struct __apn_bench_result threaded;
+                    memset(&threaded, 0, sizeof(threaded));
+                    threaded.mode = "threads";
+                    threaded.threads = config->threads;
+                    threaded.connections = config->threads;
+                    threaded.tokens = result.tokens * config->threads;
+                    threaded.payload_size = body_size;
+                    threaded.frame_size = frame_size;
+                    threaded.invalid_rate = result.invalid_rate;
+                    __apn_bench_threads(config, workers, payload, tokens, &threaded);
+
+                    done++;
+                    __apn_bench_print(out, &threaded, done == total);
+                    fflush(out);
+                    if (config->verbose) {
+                        fprintf(stderr, "[%zu/%zu] tokens=%u size=%u invalid=%g threads=%u: %.0f notifications/sec\n",
+                                done, total, threaded.tokens, body_size, threaded.invalid_rate, threaded.threads,
+                                threaded.notifications_per_sec);
+                    }
+                }
+                apn_array_free(tokens);
+
+#ifdef APN_HAVE_SYS_EPOLL_H
+                apn_array_t *loop_tokens = NULL;
+                if (config->connections > 0 &&
+                    !(loop_tokens = apn_bench_tokens(result.tokens * config->connections, result.invalid_rate, 0))) {
+                    fprintf(stderr, "Unable to generate tokens\n");
+                    apn_payload_free(payload);
+                    ret = 1;
+                    goto finish;
+                }
+                for (uint32_t b = 0; b < APN_BENCH_LOOP_BACKENDS; b++) {
+                    if (!loops[b]) {
+                        continue;
+                    }
+                    struct __apn_bench_result looped;
+                    memset(&looped, 0, sizeof(looped));
+                    looped.mode = __apn_bench_loop_modes[b];
+                    looped.threads = 1;
+                    looped.connections = config->connections;
+                    looped.tokens = result.tokens * config->connections;
+                    looped.payload_size = body_size;
+                    looped.frame_size = frame_size;
+                    looped.invalid_rate = result.invalid_rate;
+                    __apn_bench_loop_send(config, loops[b], payload, loop_tokens, &looped);
+
+                    done++;
+                    __apn_bench_print(out, &looped, done == total);
+                    fflush(out);
+                    if (config->verbose) {
+                        fprintf(stderr, "[%zu/%zu] tokens=%u size=%u invalid=%g %s connections=%u: "
+                                        "%.0f notifications/sec, %.4f syscalls/notification\n",
+                                done, total, looped.tokens, body_size, looped.invalid_rate, looped.mode,
+                                looped.connections, looped.notifications_per_sec, looped.syscalls_per_notification);
+                    }
+                }
+                apn_array_free(loop_tokens);
+#endif
+
+                if (pool) {
+                    struct __apn_bench_result pooled;
+                    memset(&pooled, 0, sizeof(pooled));
+                    pooled.mode = "pool";
+                    pooled.threads = config->pool_connections;
+                    pooled.connections = config->pool_connections;
+                    pooled.tokens = result.tokens * config->pool_connections;
+                    pooled.payload_size = body_size;
+                    pooled.frame_size = frame_size;
+                    pooled.invalid_rate = result.invalid_rate;
+
+                    apn_array_t *pool_tokens = apn_bench_tokens(pooled.tokens, pooled.invalid_rate, 0);
+                    if (!pool_tokens) {
+                        fprintf(stderr, "Unable to generate tokens\n");
+                        apn_payload_free(payload);
+                        ret = 1;
+                        goto finish;
+                    }
+                    __apn_bench_pool_send(config, pool, payload, pool_tokens, &pooled);
+                    apn_array_free(pool_tokens);
+
+                    done++;
+                    __apn_bench_print(out, &pooled, done == total);
+                    fflush(out);
+                    if (config->verbose) {
+                        fprintf(stderr, "[%zu/%zu] tokens=%u size=%u invalid=%g pool connections=%u: "
+                                        "%.0f notifications/sec\n",
+                                done, total, pooled.tokens, body_size, pooled.invalid_rate, pooled.connections,
+                                pooled.notifications_per_sec);
+                    }
+                }
+            }
+        }
+        apn_payload_free(payload);
+    }
+
+    fprintf(out, "  ]\n}\n");
+    if (config->trace && APN_ERROR == apn_trace_dump(ctx, config->trace)) {
+        fprintf(stderr, "Unable to write trace to %s: %s\n", config->trace, strerror(errno));
+        ret = 1;
+    }
+
+    finish:
+#ifdef APN_HAVE_SYS_EPOLL_H
+    for (uint32_t b = 0; b < APN_BENCH_LOOP_BACKENDS; b++) {
+        apn_loop_free(loops[b]);
+    }
+    if (loop_contexts) {
+        for (uint32_t i = 0; i < config->connections; i++) {
+            apn_free(loop_contexts[i]);
+        }
+        free(loop_contexts);
+    }
+#endif
+    if (workers) {
+        for (uint32_t t = 0; t < config->threads; t++) {
+            apn_free(workers[t].ctx);
+        }
+        free(workers);
+    }
+    apn_pool_free(pool);
+    apn_free(ctx);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    struct __apn_bench_config config;
+    const char *output = NULL;
+    const char *counters = NULL;
+    int c;
+
+    memset(&config, 0, sizeof(config));
+    config.host = "127.0.0.1";
+    config.port = 2195;
+    config.repetitions = 3;
+    config.latency_samples = 1000;
+    config.reconnect_samples = 20;
+    config.threads = 1;
+    config.counts_size = apn_bench_parse_list("1000,10000", config.counts, APN_BENCH_MAX_VALUES);
+    config.sizes_size = apn_bench_parse_list("64,512,1536", config.sizes, APN_BENCH_MAX_VALUES);
+    config.invalid_rates_size = apn_bench_parse_list("0,0.001,0.01", config.invalid_rates, APN_BENCH_MAX_VALUES);
+
+    while ((c = getopt(argc, argv, "hc:k:H:p:n:s:i:r:l:R:o:t:T:L:P:C:S:v")) != -1) {
+        switch (c) {
+            case 'c':
+                config.cert = optarg;
+                break;
+            case 'k':
+                config.key = optarg;
+                break;
+            case 'H':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.port = (uint16_t) atoi(optarg);
+                break;
+            case 'n':
+                config.counts_size = apn_bench_parse_list(optarg, config.counts, APN_BENCH_MAX_VALUES);
+                break;
+            case 's':
+                config.sizes_size = apn_bench_parse_list(optarg, config.sizes, APN_BENCH_MAX_VALUES);
+                break;
+            case 'i':
+                config.invalid_rates_size = apn_bench_parse_list(optarg, config.invalid_rates, APN_BENCH_MAX_VALUES);
+                break;
+            case 'r':
+                config.repetitions = (uint32_t) atoi(optarg);
+                break;
+            case 'l':
+                config.latency_samples = (uint32_t) atoi(optarg);
+                break;
+            case 'R':
+                config.reconnect_samples = (uint32_t) atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 't':
+                config.trace = optarg;
+                break;
+            case 'T':
+                config.threads = (uint32_t) atoi(optarg);
+                break;
+            case 'L':
+                config.connections = (uint32_t) atoi(optarg);
+                break;
+            case 'P':
+                config.pool_connections = (uint32_t) atoi(optarg);
+                break;
+            case 'C':
+                counters = optarg;
+                break;
+            case 'S':
+                if (0 == strcmp(optarg, "bulk")) {
+                    config.socket_preset = APN_SOCKET_PRESET_BULK;
+                } else if (0 == strcmp(optarg, "low-latency")) {
+                    config.socket_preset = APN_SOCKET_PRESET_LOW_LATENCY;
+                } else if (0 == strcmp(optarg, "default")) {
+                    config.socket_preset = APN_SOCKET_PRESET_DEFAULT;
+                } else {
+                    __apn_bench_usage();
+                    return 1;
+                }
+                break;
+            case 'v':
+                config.verbose = 1;
+                break;
+            case 'h':
+            default:
+                __apn_bench_usage();
+                return 1;
+        }
+    }
+
+    if (!config.cert || !config.key || 0 == config.counts_size || 0 == config.sizes_size
+        || 0 == config.invalid_rates_size || 0 == config.repetitions
+        || 0 == config.threads || config.threads > APN_BENCH_MAX_THREADS
+        || config.connections > APN_BENCH_MAX_CONNECTIONS || config.pool_connections > APN_BENCH_MAX_CONNECTIONS) {
+        __apn_bench_usage();
+        return 1;
+    }
+#ifndef APN_HAVE_SYS_EPOLL_H
+    if (config.connections > 0) {
+        fprintf(stderr, "Event loop is not supported on this platform\n");
+        return 1;
+    }
+#endif
+    for (size_t i = 0; i < config.sizes_size; i++) {
+        if (config.sizes[i] < 1 || config.sizes[i] > APN_BENCH_MAX_BODY_SIZE) {
+            fprintf(stderr, "Payload size must be between 1 and %d bytes\n", APN_BENCH_MAX_BODY_SIZE);
+            return 1;
+        }
+    }
+
+    if (counters) {
+        void *map = MAP_FAILED;
+        int fd = open(counters, O_RDONLY);
+        if (fd >= 0) {
+            map = mmap(NULL, 2 * sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+        if (MAP_FAILED == map) {
+            fprintf(stderr, "Unable to map %s: %s\n", counters, strerror(errno));
+            return 1;
+        }
+        config.gateway_counters = map;
+    }
+
+    FILE *out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Unable to open %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+
+    if (APN_ERROR == apn_library_init()) {
+        fprintf(stderr, "Unable to initialize library\n");
+        return 1;
+    }
+    int ret = __apn_bench_run(&config, out);
+    apn_library_free();
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
@@ -36,6 +36,8 @@
 #include "apn_strerror.h"
 #include "apn_log.h"
 #include "apn_ssl.h"
+#include "apn_stats_private.h"
+#include "apn_trace_private.h"
 
 #ifdef APN_HAVE_FCNTL_H
 #include <fcntl.h>
@@ -57,6 +59,34 @@
 #include <netdb.h>
 #endif
 
+#ifndef _WIN32
+#include <pthread.h>
+#include "apn_token_store.h"
+#include "apn_spool_private.h"
+#endif
+
+#ifdef APN_HAVE_HTTP2
+#include "apn_http2.h"
+#endif
+
+#define APN_CONNECT_TIMEOUT 10000
+#define APN_CONNECT_ATTEMPT_DELAY 250
+/* Poll timeout while sending, the wait is repeated until the connection becomes ready */
+#define APN_SEND_POLL_TIMEOUT 10000
+/* Time to wait for an error response after the last notification, see APN_OPTION_ASYNC_ERRORS */
+#define APN_ERROR_WAIT_TIMEOUT 1000
+/* Most notifications encrypted before the records are flushed to the transport, see APN_SSL_WRITE_BATCH */
+#define APN_SEND_BATCH_FRAMES 512
+
+/* Feedback tuple: timestamp (4 bytes), token length (2 bytes), token */
+#define APN_FEEDBACK_TUPLE_SIZE (sizeof(uint32_t) + sizeof(uint16_t) + APN_TOKEN_BINARY_SIZE)
+#define APN_FEEDBACK_BUFFER_SIZE (64 * 1024)
+#define APN_FEEDBACK_BATCH_SIZE 1024
+#define APN_FEEDBACK_DEFAULT_TIMEOUT 3000
+
+/* Time to wait for any frame while HTTP/2 requests are in flight */
+#define APN_HTTP2_RESPONSE_TIMEOUT 10000
+
 typedef enum __apn_apple_errors {
     APN_APNS_ERR_PROCESSING_ERROR = 1,
     APN_APNS_ERR_MISSING_DEVICE_TOKEN,
@@ -75,38 +105,112 @@ struct __apn_apple_server {
     uint16_t port;
 };
 
-static struct __apn_apple_server __apn_apple_servers[4] = {
+static struct __apn_apple_server __apn_apple_servers[6] = {
         {"gateway.sandbox.push.apple.com",  2195},
         {"gateway.push.apple.com",          2195},
         {"feedback.sandbox.push.apple.com", 2196},
-        {"feedback.push.apple.com",         2196}
+        {"feedback.push.apple.com",         2196},
+        {"api.sandbox.push.apple.com",      443},
+        {"api.push.apple.com",              443}
 };
 
-static apn_return __apn_send_binary_message(const apn_ctx_t *const ctx,
+static uint8_t __apn_prepare_binary_message(apn_ctx_t *const ctx, apn_binary_message_t *const binary_message,
+                                            apn_array_t *tokens, uint32_t id_base, uint32_t index);
+
+static uint8_t __apn_read_error_response(apn_ctx_t *const ctx, char *const buffer, size_t length);
+
+static apn_return __apn_check_idle(apn_ctx_t *const ctx, int *unsent);
+
+static apn_return __apn_send_binary_message(apn_ctx_t *const ctx,
                                             apn_binary_message_t *const binary_message,
                                             apn_array_t *tokens,
                                             uint32_t token_index,
+                                            uint32_t token_end_index,
+                                            uint32_t id_base,
                                             uint8_t *apple_error_code,
-                                            uint32_t *invalid_token_index);
+                                            uint32_t *error_id);
+static apn_return __apn_pending_error(apn_ctx_t *const ctx, uint8_t apple_error_code, uint32_t id,
+                                      uint32_t *token_index);
+static void __apn_unsent(apn_ctx_t *const ctx, uint32_t id, int errcode, uint32_t begin_id, uint32_t end_id);
+static void __apn_reconnect_failed(apn_ctx_t *const ctx);
 static apn_return __apn_connect(apn_ctx_t *const ctx, struct __apn_apple_server server);
+static apn_return __apn_resolve(apn_ctx_t *const ctx, struct __apn_apple_server server);
+static SOCKET __apn_connect_addresses(apn_ctx_t *const ctx);
 static void __apn_parse_apns_error(char *apns_error, uint8_t *apns_error_code, uint32_t *id);
 static apn_binary_message_t *__apn_payload_to_binary_message(const apn_ctx_t *const ctx,
                                                              const apn_payload_t *const payload);
-static int __apn_convert_apple_error(uint8_t apple_error_code);
 static void __apn_invalid_token_dtor(char *const token);
+static void __apn_store_invalid_token(apn_ctx_t *const ctx, const char *const token_hex);
+static void __apn_report_invalid_token(apn_ctx_t *const ctx, const apn_array_t *const tokens, uint32_t index);
+static void __apn_invalid_tokens_flush(apn_ctx_t *const ctx);
+static apn_return __apn_send(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
+                             uint32_t begin, uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end);
+static apn_return __apn_send_message(apn_ctx_t *const ctx, apn_binary_message_t *binary_message,
+                                     apn_array_t *tokens, uint32_t begin, uint32_t end, uint32_t id_base,
+                                     apn_array_t **invalid_tokens, uint32_t *sent_end);
+struct __apn_frames;
+static apn_return __apn_send_frames(apn_ctx_t *const ctx, struct __apn_frames *const frames, uint32_t begin,
+                                    uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end);
+static uint8_t __apn_pending_continued(const apn_ctx_t *const ctx, const apn_binary_message_t *const binary_message,
+                                       const apn_array_t *const tokens, uint32_t begin, uint32_t id_base);
+#ifdef APN_HAVE_HTTP2
+static apn_return __apn_send_http2(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
+                                   uint32_t begin, uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end);
+#endif
+static apn_return __apn_check_errors(apn_ctx_t *const ctx, uint32_t timeout, uint32_t *token_index,
+                                     uint8_t *responded);
+#ifndef _WIN32
+static apn_return __apn_send_spool_frames(apn_ctx_t *const ctx, const apn_spool_t *const spool, uint32_t begin,
+                                          uint32_t end, uint8_t *apple_error_code, uint32_t *error_id);
+#endif
+static apn_return __apn_feedback(apn_ctx_t *const ctx, apn_array_t **tokens);
+static apn_return __apn_feedback_read(apn_ctx_t *const ctx, apn_feedback_callback callback, void *user,
+                                      uint32_t timeout);
+
+static int __apn_library_init_error = 0;
+
+static void __apn_library_init_once(void) {
+    if (APN_ERROR == apn_ssl_init()) {
+        __apn_library_init_error = APN_ERR_FAILED_INIT;
+        return;
+    }
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        __apn_library_init_error = APN_ERR_FAILED_INIT;
+    }
+#endif
+}
+
+#ifdef _WIN32
+static INIT_ONCE __apn_library_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK __apn_library_init_once_win(PINIT_ONCE once, PVOID parameter, PVOID *context) {
+    (void) once;
+    (void) parameter;
+    (void) context;
+    __apn_library_init_once();
+    return TRUE;
+}
+#else
+static pthread_once_t __apn_library_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* Stores the outcome of a public call in the context, see apn_last_error() */
+static apn_return __apn_result(apn_ctx_t *const ctx, apn_return ret) {
+    ctx->last_error = (APN_ERROR == ret) ? errno : 0;
+    return ret;
+}
 
 apn_return apn_library_init() {
-    static uint8_t library_initialized = 0;
-    if (!library_initialized) {
-        apn_ssl_init();
-        library_initialized = 1;
 #ifdef _WIN32
-        WSADATA wsa_data;
-        if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-            errno = APN_ERR_FAILED_INIT;
-            return APN_ERROR;
-        }
+    InitOnceExecuteOnce(&__apn_library_once, __apn_library_init_once_win, NULL, NULL);
+#else
+    pthread_once(&__apn_library_once, __apn_library_init_once);
 #endif
+    if (__apn_library_init_error) {
+        errno = __apn_library_init_error;
+        return APN_ERROR;
     }
     return APN_SUCCESS;
 }
@@ -130,6 +234,10 @@ apn_ctx_t *apn_init() {
     }
     ctx->sock = -1;
     ctx->ssl = NULL;
+    ctx->ktls = 0;
+    ctx->mem_bio = 0;
+    apn_transport_socket(ctx, &ctx->transport);
+    ctx->custom_transport = 0;
     ctx->certificate_file = NULL;
     ctx->private_key_file = NULL;
     ctx->pkcs12_file = NULL;
@@ -137,9 +245,48 @@ apn_ctx_t *apn_init() {
     ctx->feedback = 0;
     ctx->private_key_pass = NULL;
     ctx->mode = APN_MODE_PRODUCTION;
+    ctx->options = 0;
     ctx->log_callback = NULL;
     ctx->log_level = APN_LOG_LEVEL_ERROR;
     ctx->invalid_token_callback = NULL;
+    ctx->invalid_tokens_sink = NULL;
+    ctx->invalid_tokens_user = NULL;
+    ctx->invalid_batch_tokens = NULL;
+    ctx->invalid_batch_count = 0;
+    ctx->pending_tokens = NULL;
+    ctx->pending_message = NULL;
+    ctx->pending_begin = 0;
+    ctx->pending_end = 0;
+    ctx->pending_id_base = 0;
+    ctx->next_id = 0;
+    ctx->unsent_callback = NULL;
+    ctx->unsent_user = NULL;
+    ctx->yield = NULL;
+    ctx->yield_index = 0;
+    ctx->token_store = NULL;
+    ctx->protocol = APN_PROTOCOL_BINARY;
+    ctx->topic = NULL;
+    ctx->auth_key_file = NULL;
+    ctx->auth_key_id = NULL;
+    ctx->auth_team_id = NULL;
+    ctx->ca_file = NULL;
+    ctx->response_callback = NULL;
+    ctx->response_user = NULL;
+    ctx->http2 = NULL;
+    ctx->gateway_host = NULL;
+    ctx->gateway_port = 0;
+    ctx->feedback_host = NULL;
+    ctx->feedback_port = 0;
+    ctx->addr_cache_ttl = APN_ADDR_CACHE_TTL;
+    ctx->idle_timeout = APN_IDLE_TIMEOUT;
+    ctx->last_io = 0;
+    memset(&ctx->addr_cache, 0, sizeof(ctx->addr_cache));
+    apn_stats_clear(&ctx->stats);
+    apn_rate_init(ctx, 0, 0);
+    apn_socket_init(ctx);
+    ctx->connection_id = 0;
+    ctx->trace = NULL;
+    ctx->last_error = 0;
     return ctx;
 }
 
@@ -151,19 +298,51 @@ void apn_free(apn_ctx_t *ctx) {
         apn_mem_free(ctx->private_key_pass);
         apn_mem_free(ctx->pkcs12_file);
         apn_mem_free(ctx->pkcs12_pass);
+        apn_mem_free(ctx->gateway_host);
+        apn_mem_free(ctx->feedback_host);
+        apn_mem_free(ctx->topic);
+        apn_mem_free(ctx->auth_key_file);
+        apn_mem_free(ctx->auth_key_id);
+        apn_mem_free(ctx->auth_team_id);
+        apn_mem_free(ctx->ca_file);
+        apn_mem_free(ctx->addr_cache.host);
+#ifdef APN_HAVE_HTTP2
+        apn_http2_free(ctx);
+#endif
+        apn_trace_free(ctx->trace);
         free(ctx);
     }
 }
 
+int apn_last_error(const apn_ctx_t *const ctx) {
+    assert(ctx);
+    return ctx->last_error;
+}
+
 void apn_close(apn_ctx_t *const ctx) {
     assert(ctx);
-    if(-1 == ctx->sock) {
+    ctx->pending_tokens = NULL;
+    if (ctx->pending_message) {
+        apn_binary_message_free(ctx->pending_message);
+        ctx->pending_message = NULL;
+    }
+    if(-1 == ctx->sock && !ctx->ssl) {
         return;
     }
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Connection closing...");
+    APN_TRACE(ctx, APN_TRACE_CLOSE, 0, 0);
+#ifdef APN_HAVE_HTTP2
+    apn_http2_close(ctx);
+#endif
     apn_ssl_close(ctx);
-    APN_CLOSE_SOCKET(ctx->sock);
-    ctx->sock = -1;
+    if (ctx->custom_transport) {
+        if (ctx->transport.close) {
+            ctx->transport.close(ctx->transport.user);
+        }
+    } else {
+        APN_CLOSE_SOCKET(ctx->sock);
+        ctx->sock = -1;
+    }
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Connection closed");
 }
 
@@ -220,11 +399,128 @@ void apn_set_mode(apn_ctx_t *const ctx, apn_connection_mode mode) {
     }
 }
 
+apn_return apn_set_protocol(apn_ctx_t *const ctx, apn_protocol protocol) {
+    assert(ctx);
+    if (protocol == APN_PROTOCOL_HTTP2) {
+#ifdef APN_HAVE_HTTP2
+        ctx->protocol = APN_PROTOCOL_HTTP2;
+#else
+        errno = APN_ERR_HTTP2_NOT_SUPPORTED;
+        return APN_ERROR;
+#endif
+    } else {
+        ctx->protocol = APN_PROTOCOL_BINARY;
+    }
+    return APN_SUCCESS;
+}
+
+apn_return apn_set_auth_key(apn_ctx_t *const ctx, const char *const key_file, const char *const key_id,
+                            const char *const team_id) {
+    assert(ctx);
+
+    apn_strfree(&ctx->auth_key_file);
+    apn_strfree(&ctx->auth_key_id);
+    apn_strfree(&ctx->auth_team_id);
+
+    if (key_file && strlen(key_file) > 0) {
+        if (NULL == (ctx->auth_key_file = apn_strndup(key_file, strlen(key_file)))) {
+            return APN_ERROR;
+        }
+        if (key_id && strlen(key_id) > 0) {
+            if (NULL == (ctx->auth_key_id = apn_strndup(key_id, strlen(key_id)))) {
+                return APN_ERROR;
+            }
+        }
+        if (team_id && strlen(team_id) > 0) {
+            if (NULL == (ctx->auth_team_id = apn_strndup(team_id, strlen(team_id)))) {
+                return APN_ERROR;
+            }
+        }
+    }
+    return APN_SUCCESS;
+}
+
+apn_return apn_set_ca_file(apn_ctx_t *const ctx, const char *const ca_file) {
+    assert(ctx);
+
+    apn_strfree(&ctx->ca_file);
+    if (ca_file && strlen(ca_file) > 0) {
+        if (NULL == (ctx->ca_file = apn_strndup(ca_file, strlen(ca_file)))) {
+            return APN_ERROR;
+        }
+    }
+    return APN_SUCCESS;
+}
+
+apn_return apn_set_topic(apn_ctx_t *const ctx, const char *const topic) {
+    assert(ctx);
+
+    apn_strfree(&ctx->topic);
+    if (topic && strlen(topic) > 0) {
+        if (NULL == (ctx->topic = apn_strndup(topic, strlen(topic)))) {
+            return APN_ERROR;
+        }
+    }
+    return APN_SUCCESS;
+}
+
+void apn_set_response_callback(apn_ctx_t *const ctx, apn_response_callback callback, void *user) {
+    assert(ctx);
+    ctx->response_callback = callback;
+    ctx->response_user = user;
+}
+
+apn_return apn_set_gateway(apn_ctx_t *const ctx, const char *const host, uint16_t port) {
+    assert(ctx);
+
+    apn_strfree(&ctx->gateway_host);
+    ctx->gateway_port = 0;
+
+    if (host && strlen(host) > 0) {
+        if (NULL == (ctx->gateway_host = apn_strndup(host, strlen(host)))) {
+            return APN_ERROR;
+        }
+        ctx->gateway_port = port;
+    }
+    return APN_SUCCESS;
+}
+
+apn_return apn_set_feedback_server(apn_ctx_t *const ctx, const char *const host, uint16_t port) {
+    assert(ctx);
+
+    apn_strfree(&ctx->feedback_host);
+    ctx->feedback_port = 0;
+
+    if (host && strlen(host) > 0) {
+        if (NULL == (ctx->feedback_host = apn_strndup(host, strlen(host)))) {
+            return APN_ERROR;
+        }
+        ctx->feedback_port = port;
+    }
+    return APN_SUCCESS;
+}
+
+void apn_set_address_cache_ttl(apn_ctx_t *const ctx, uint32_t ttl) {
+    assert(ctx);
+    ctx->addr_cache_ttl = ttl;
+    ctx->addr_cache.expires = 0;
+}
+
+void apn_set_idle_timeout(apn_ctx_t *const ctx, uint32_t timeout) {
+    assert(ctx);
+    ctx->idle_timeout = timeout;
+}
+
 void apn_set_behavior(apn_ctx_t * const ctx, uint32_t options) {
     assert(ctx);
     ctx->options = options;
 }
 
+void apn_set_adaptive_rate(apn_ctx_t *const ctx, uint32_t initial_rate, uint32_t max_rate) {
+    assert(ctx);
+    apn_rate_init(ctx, initial_rate, max_rate);
+}
+
 void apn_set_log_level(apn_ctx_t *const ctx, uint16_t level) {
     assert(ctx);
     ctx->log_level = level;
@@ -235,11 +531,81 @@ void apn_set_log_callback(apn_ctx_t *const ctx, log_callback funct) {
     ctx->log_callback = funct;
 }
 
+void apn_set_invalid_tokens_sink(apn_ctx_t *const ctx, apn_invalid_tokens_sink sink, void *user) {
+    assert(ctx);
+    __apn_invalid_tokens_flush(ctx);
+    ctx->invalid_tokens_sink = sink;
+    ctx->invalid_tokens_user = user;
+}
+
+void apn_invalid_tokens_bitmap_sink(const apn_array_t *const tokens, const uint32_t *const indices, uint32_t count,
+                                    void *user) {
+    (void) tokens;
+    apn_token_bitmap_t *bitmap = user;
+    for (uint32_t i = 0; i < count; i++) {
+        if (indices[i] < bitmap->size) {
+            uint8_t mask = (uint8_t) (1 << (indices[i] % 8));
+#ifdef _WIN32
+            InterlockedOr8((volatile char *) &bitmap->bits[indices[i] / 8], (char) mask);
+#else
+            __atomic_fetch_or(&bitmap->bits[indices[i] / 8], mask, __ATOMIC_RELAXED);
+#endif
+        }
+    }
+}
+
 void apn_set_invalid_token_callback(apn_ctx_t *const ctx, invalid_token_callback funct) {
     assert(ctx);
     ctx->invalid_token_callback = funct;
 }
 
+void apn_stats(const apn_ctx_t *const ctx, apn_stats_t *const stats) {
+    assert(ctx);
+    assert(stats);
+    apn_stats_snapshot(&ctx->stats, stats);
+}
+
+void apn_stats_reset(apn_ctx_t *const ctx) {
+    assert(ctx);
+    uint64_t send_buffer = APN_STATS_LOAD(ctx->stats.send_buffer);
+    apn_stats_clear(&ctx->stats);
+    APN_STATS_STORE(ctx->stats.send_rate, (uint64_t) ctx->rate.rate);
+    APN_STATS_STORE(ctx->stats.send_buffer, send_buffer);
+}
+
+apn_return apn_trace_enable(apn_ctx_t *const ctx, uint32_t capacity) {
+    assert(ctx);
+    struct __apn_trace *trace = apn_trace_init(capacity);
+    if (!trace) {
+        return APN_ERROR;
+    }
+    apn_trace_free(ctx->trace);
+    ctx->trace = trace;
+    return APN_SUCCESS;
+}
+
+void apn_trace_disable(apn_ctx_t *const ctx) {
+    assert(ctx);
+    apn_trace_free(ctx->trace);
+    ctx->trace = NULL;
+}
+
+apn_return apn_trace_dump(const apn_ctx_t *const ctx, const char *const path) {
+    assert(ctx);
+    assert(path);
+    if (!ctx->trace) {
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+    if (APN_ERROR == apn_trace_write(ctx->trace, path)) {
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to write trace to %s: %s (errno: %d)", path,
+                apn_error_string_r(errno, error, sizeof(error)), errno);
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
 apn_connection_mode apn_mode(const apn_ctx_t *const ctx) {
     assert(ctx);
     return ctx->mode;
@@ -272,12 +638,16 @@ const char *apn_private_key_pass(const apn_ctx_t *const ctx) {
 
 apn_return apn_connect(apn_ctx_t *const ctx) {
     struct __apn_apple_server server;
-    if (ctx->mode == APN_MODE_SANDBOX) {
-        server = __apn_apple_servers[0];
+    uint8_t http2 = (ctx->protocol == APN_PROTOCOL_HTTP2) ? 4 : 0;
+    if (ctx->gateway_host) {
+        server.host = ctx->gateway_host;
+        server.port = ctx->gateway_port;
+    } else if (ctx->mode == APN_MODE_SANDBOX) {
+        server = __apn_apple_servers[http2 + 0];
     } else {
-        server = __apn_apple_servers[1];
+        server = __apn_apple_servers[http2 + 1];
     }
-    return __apn_connect(ctx, server);
+    return __apn_result(ctx, __apn_connect(ctx, server));
 }
 
 #define __APN_CHECK_CONNECTION(__ctx) \
@@ -290,23 +660,119 @@ apn_return apn_connect(apn_ctx_t *const ctx) {
 
 apn_return apn_send(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
                     apn_array_t **invalid_tokens) {
+    return apn_send_range(ctx, payload, tokens, 0, apn_array_count(tokens), invalid_tokens, NULL);
+}
+
+apn_return apn_send_range(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
+                          uint32_t begin, uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end) {
+    apn_return ret = __apn_send(ctx, payload, tokens, begin, end, invalid_tokens, sent_end);
+    __apn_invalid_tokens_flush(ctx);
+    return __apn_result(ctx, ret);
+}
+
+static apn_return __apn_send(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
+                             uint32_t begin, uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end) {
     assert(ctx);
     assert(payload);
     assert(tokens);
-    assert(apn_array_count(tokens) > 0);
+    assert(begin < end && end <= apn_array_count(tokens));
 
     __APN_CHECK_CONNECTION(ctx)
 
+#ifdef APN_HAVE_HTTP2
+    if (APN_USE_HTTP2(ctx)) {
+        return __apn_send_http2(ctx, payload, tokens, begin, end, invalid_tokens, sent_end);
+    }
+#endif
+
+    /* Error response to notifications of the previous call, sent again if they were dropped */
+    int unsent = 0;
+    uint8_t responded = 0;
+    if (ctx->pending_tokens && APN_ERROR == __apn_check_errors(ctx, 0, NULL, &responded)) {
+        if (!ctx->ssl) {
+            return APN_ERROR;
+        }
+        unsent = responded ? errno : 0;
+    }
+    if (APN_ERROR == __apn_check_idle(ctx, &unsent)) {
+        return APN_ERROR;
+    }
+
     apn_binary_message_t *binary_message = __apn_payload_to_binary_message(ctx, payload);
     if (!binary_message) {
         return APN_ERROR;
     }
 
-    apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notification to %d device(s)...", apn_array_count(tokens));
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notification to %u device(s)...", end - begin);
 
+    uint32_t id_base = 0;
+    if (ctx->options & APN_OPTION_ASYNC_ERRORS) {
+        id_base = __apn_pending_continued(ctx, binary_message, tokens, begin, ctx->pending_id_base) ?
+                  ctx->pending_id_base : ctx->next_id;
+    }
+    apn_return ret = __apn_send_message(ctx, binary_message, tokens, begin, end, id_base, invalid_tokens, sent_end);
+    ctx->last_io = apn_clock_us();
+    if (APN_SUCCESS == ret && unsent) {
+        errno = unsent;
+        return APN_ERROR;
+    }
+    return ret;
+}
+
+/*
+ * Frames sent by __apn_send_frames(): copies of `binary_message` to `tokens` with identifiers from `id_base`,
+ * or the frames of `spool`, whose identifiers are frame indices. When the pending call is sent again, `resend`
+ * is set: an error response to a notification out of the range is not handled but returned in
+ * `apple_error_code` and `error_id`, and `binary_message` is kept for the caller.
+ */
+struct __apn_frames {
+    apn_binary_message_t *binary_message;
+    apn_array_t *tokens;
+    uint32_t id_base;
+    const struct __apn_spool_t *spool;
+    uint8_t resend;
+    uint8_t apple_error_code;
+    uint32_t error_id;
+};
+
+/*
+ * Sends `binary_message` to tokens [begin, end) with identifiers from `id_base`, reconnecting and resuming
+ * after errors. The message is freed, or kept as the template of the pending call with
+ * APN_OPTION_ASYNC_ERRORS. An error response to a notification of an earlier call makes the call return
+ * APN_ERROR if notifications written after that one could not be sent again, see __apn_pending_error().
+ */
+static apn_return __apn_send_message(apn_ctx_t *const ctx, apn_binary_message_t *binary_message,
+                                     apn_array_t *tokens, uint32_t begin, uint32_t end, uint32_t id_base,
+                                     apn_array_t **invalid_tokens, uint32_t *sent_end) {
+    struct __apn_frames frames = {binary_message, tokens, id_base, NULL, 0, 0, 0};
+    return __apn_send_frames(ctx, &frames, begin, end, invalid_tokens, sent_end);
+}
+
+/* Writes frames [begin, end), see __apn_send_binary_message() and __apn_send_spool_frames() */
+static apn_return __apn_write_frames(apn_ctx_t *const ctx, const struct __apn_frames *const frames, uint32_t begin,
+                                     uint32_t end, uint8_t *apple_error_code, uint32_t *error_id) {
+#ifndef _WIN32
+    if (frames->spool) {
+        return __apn_send_spool_frames(ctx, frames->spool, begin, end, apple_error_code, error_id);
+    }
+#endif
+    return __apn_send_binary_message(ctx, frames->binary_message, frames->tokens, begin, end, frames->id_base,
+                                     apple_error_code, error_id);
+}
+
+/*
+ * Sends frames [begin, end), reconnecting and resuming after errors: from the next frame after an invalid
+ * token or shutdown response, from the failed one otherwise. Invalid tokens are reported and collected into
+ * `invalid_tokens` if not NULL. With a message, see __apn_send_message(); a spool has no pending call and an
+ * error response to a frame out of the range fails the call. On error `sent_end` is set to the first frame
+ * not sent, can be NULL
+ */
+static apn_return __apn_send_frames(apn_ctx_t *const ctx, struct __apn_frames *const frames, uint32_t begin,
+                                    uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end) {
     apn_array_t *_invalid_tokens = NULL;
-    uint32_t start_index = 0;
+    uint32_t start_index = begin;
     uint8_t auto_reconnect = 0;
+    int unsent = 0;
 
     apn_return ret = APN_SUCCESS;
 
@@ -324,52 +790,127 @@ apn_return apn_send(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_arra
             }
         }
 
-        uint32_t invalid_token_index = 0;
+        uint32_t error_id = 0;
         uint8_t apple_error_code = 0;
-        ret = __apn_send_binary_message(ctx, binary_message, tokens, start_index, &apple_error_code,
-                                        &invalid_token_index);
+        ctx->yield_index = 0;
+        ret = __apn_write_frames(ctx, frames, start_index, end, &apple_error_code, &error_id);
+        apn_socket_uncork(ctx);
         if (ret == APN_SUCCESS) {
+            uint32_t written_end = ctx->yield_index ? ctx->yield_index : end;
+            if (frames->binary_message && (ctx->options & APN_OPTION_ASYNC_ERRORS)) {
+                if (!__apn_pending_continued(ctx, frames->binary_message, frames->tokens, begin, frames->id_base)) {
+                    if (ctx->pending_message) {
+                        apn_binary_message_free(ctx->pending_message);
+                    }
+                    ctx->pending_message = frames->binary_message;
+                    frames->binary_message = NULL;
+                    ctx->pending_tokens = frames->tokens;
+                    ctx->pending_begin = begin;
+                    ctx->pending_id_base = frames->id_base;
+                }
+                ctx->pending_end = written_end;
+                if (ctx->next_id < frames->id_base + end) {
+                    ctx->next_id = frames->id_base + end;
+                }
+            }
+            if (sent_end) {
+                *sent_end = written_end;
+            }
             break;
         } else {
-            uint16_t errcode = apple_error_code > 0 ? __apn_convert_apple_error(apple_error_code) : errno;
+            uint32_t invalid_token_index = error_id - frames->id_base;
+            uint16_t errcode = apple_error_code > 0 ? apn_convert_apple_error(apple_error_code) : errno;
+            if (apple_error_code > 0 && (invalid_token_index < begin || invalid_token_index >= end)) {
+                if (frames->spool) {
+                    apn_log(ctx, APN_LOG_LEVEL_ERROR, "Apple returned error code %d for unknown notification (id: %u)",
+                            apple_error_code, error_id);
+                    APN_STATS_INC(ctx, apple_errors);
+                    errno = errcode;
+                    break;
+                }
+                if (frames->resend) {
+                    frames->apple_error_code = apple_error_code;
+                    frames->error_id = error_id;
+                    errno = errcode;
+                    break;
+                }
+                /* Error response refers to a notification sent by an earlier call */
+                if (APN_ERROR == __apn_pending_error(ctx, apple_error_code, error_id, NULL)) {
+                    if (!ctx->ssl) {
+                        ret = APN_ERROR;
+                        break;
+                    }
+                    unsent = errno;
+                }
+                auto_reconnect = 0;
+                continue;
+            }
             if (errcode == APN_ERR_TOKEN_INVALID) {
-                const char *const invalid_token = (const char *const) apn_array_item_at_index(tokens,
-                                                                                              invalid_token_index);
+                char *spool_token = NULL;
+                const char *invalid_token = NULL;
+#ifndef _WIN32
+                if (frames->spool) {
+                    if (!(spool_token = apn_token_binary_to_hex(frames->spool->map + APN_SPOOL_FRAME_OFFSET(
+                            frames->spool, invalid_token_index) + APN_SPOOL_TOKEN_OFFSET))) {
+                        start_index = invalid_token_index;
+                        errno = ENOMEM;
+                        ret = APN_ERROR;
+                        break;
+                    }
+                    invalid_token = spool_token;
+                } else
+#endif
+                {
+                    invalid_token = (const char *) apn_array_item_at_index(frames->tokens, invalid_token_index);
+                }
                 apn_log(ctx, APN_LOG_LEVEL_ERROR, "Invalid token: %s (index: %u)", invalid_token,
                           invalid_token_index);
+                APN_STATS_INC(ctx, invalid_tokens);
+                __apn_store_invalid_token(ctx, invalid_token);
+                if (frames->tokens) {
+                    __apn_report_invalid_token(ctx, frames->tokens, invalid_token_index);
+                } else if (ctx->invalid_token_callback) {
+                    ctx->invalid_token_callback(invalid_token, invalid_token_index);
+                }
                 if (invalid_tokens) {
                     if (!_invalid_tokens) {
                         if (NULL ==
                             (_invalid_tokens = apn_array_init(10, (apn_array_dtor) __apn_invalid_token_dtor, NULL))) {
-                            apn_binary_message_free(binary_message);
-                            return APN_ERROR;
+                            free(spool_token);
+                            start_index = invalid_token_index + 1;
+                            ret = APN_ERROR;
+                            break;
                         }
                     }
                     apn_array_insert(_invalid_tokens, apn_strndup(invalid_token, APN_TOKEN_LENGTH));
-                    if (ctx->invalid_token_callback) {
-                        ctx->invalid_token_callback(invalid_token, invalid_token_index);
-                    }
                 }
+                free(spool_token);
+            } else if (apple_error_code > 0) {
+                APN_STATS_INC(ctx, apple_errors);
             }
 
-            char *error_string = apn_error_string(errcode);
-            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not send notification: %s (errno: %d)", error_string, errcode);
-            apn_strfree(&error_string);
+            char error_string[APN_ERROR_STRING_SIZE];
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not send notification: %s (errno: %d)",
+                    apn_error_string_r(errcode, error_string, sizeof(error_string)), errcode);
 
-            start_index = (errcode == APN_ERR_TOKEN_INVALID) ? invalid_token_index + 1 : invalid_token_index;
+            start_index = (errcode == APN_ERR_TOKEN_INVALID || errcode == APN_ERR_SERVICE_SHUTDOWN) ?
+                          invalid_token_index + 1 : invalid_token_index;
 
             uint32_t options = apn_behavior(ctx);
-            if (start_index < apn_array_count(tokens)) {
+            if (start_index < end) {
                 if (options & APN_OPTION_RECONNECT &&
                     (errcode == APN_ERR_CONNECTION_CLOSED
                      || errcode == APN_ERR_SERVICE_SHUTDOWN
                      || errcode == APN_ERR_NETWORK_TIMEDOUT
                      || errcode == APN_ERR_NETWORK_UNREACHABLE
                      || (errcode == APN_ERR_TOKEN_INVALID))) {
+                    apn_count_reconnect(ctx, errcode);
                     auto_reconnect = 1;
                     continue;
                 }
-            } else if (errcode == APN_ERR_TOKEN_INVALID) {
+                errno = errcode;
+                break;
+            } else if (errcode == APN_ERR_TOKEN_INVALID || errcode == APN_ERR_SERVICE_SHUTDOWN) {
                 errno = 0;
                 ret = APN_SUCCESS;
                 break;
@@ -380,185 +921,599 @@ apn_return apn_send(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_arra
         }
     }
 
-    apn_binary_message_free(binary_message);
+    if (frames->binary_message && !frames->apple_error_code) {
+        apn_binary_message_free(frames->binary_message);
+        frames->binary_message = NULL;
+    }
     if (invalid_tokens && _invalid_tokens) {
         *invalid_tokens = _invalid_tokens;
     }
+    if (APN_ERROR == ret && sent_end) {
+        *sent_end = start_index >= begin && start_index <= end ? start_index : begin;
+    }
+    if (APN_SUCCESS == ret && unsent) {
+        errno = unsent;
+        ret = APN_ERROR;
+    }
     return ret;
 }
 
-apn_return apn_feedback_connect(apn_ctx_t *const ctx) {
-    struct __apn_apple_server server;
-    if (ctx->mode == APN_MODE_SANDBOX) {
-        server = __apn_apple_servers[2];
-    } else {
-        server = __apn_apple_servers[3];
+#ifndef _WIN32
+apn_return apn_send_spool(apn_ctx_t *const ctx, const apn_spool_t *const spool, uint32_t begin, uint32_t end,
+                          apn_array_t **invalid_tokens) {
+    assert(ctx);
+    assert(spool);
+    assert(begin < end && end <= spool->count);
+
+    if (!ctx->ssl) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Connection was not opened");
+        errno = APN_ERR_NOT_CONNECTED;
+        return __apn_result(ctx, APN_ERROR);
+    }
+    if (APN_USE_HTTP2(ctx)) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Spools can be sent with the binary protocol only");
+        errno = EINVAL;
+        return __apn_result(ctx, APN_ERROR);
+    }
+    if (ctx->pending_tokens) {
+        apn_return pending = __apn_check_errors(ctx, 0, NULL, NULL);
+        __apn_invalid_tokens_flush(ctx);
+        if (APN_ERROR == pending && !ctx->ssl) {
+            return __apn_result(ctx, APN_ERROR);
+        }
+        ctx->pending_tokens = NULL;
+    }
+    if (APN_ERROR == __apn_check_idle(ctx, NULL)) {
+        return __apn_result(ctx, APN_ERROR);
     }
-    ctx->feedback = 1;
-    return __apn_connect(ctx, server);
-}
 
-apn_return apn_feedback(const apn_ctx_t *const ctx, apn_array_t **tokens) {
-    assert(ctx);
-    assert(tokens);
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notification to %u device(s) from a spool%s...", end - begin,
+            ctx->ktls ? " with sendfile()" : "");
 
-    fd_set read_set;
-    struct timeval timeout = {3, 0};
+    struct __apn_frames frames = {NULL, NULL, 0, spool, 0, 0, 0};
+    return __apn_result(ctx, __apn_send_frames(ctx, &frames, begin, end, invalid_tokens, NULL));
+}
+#endif
 
-    if (!ctx->ssl || ctx->feedback) {
-        errno = APN_ERR_NOT_CONNECTED;
-        return APN_ERROR;
+apn_return apn_check_errors(apn_ctx_t *const ctx, uint32_t timeout, uint32_t *token_index) {
+    uint8_t responded = 0;
+    apn_return ret = __apn_check_errors(ctx, timeout, token_index, &responded);
+    if (responded) {
+        /* errno is the error of the response, or why notifications after it were not sent again */
+        ret = APN_ERROR;
     }
+    __apn_invalid_tokens_flush(ctx);
+    return __apn_result(ctx, ret);
+}
 
-    *tokens = apn_array_init(10, (apn_array_dtor)__apn_invalid_token_dtor, NULL);
-    if (!*tokens) {
-        return APN_ERROR;
+/*
+ * Reads an error response to the pending call if any, see __apn_pending_error(). `responded` is set to 1
+ * if a response was read, can be NULL
+ */
+static apn_return __apn_check_errors(apn_ctx_t *const ctx, uint32_t timeout, uint32_t *token_index,
+                                     uint8_t *responded) {
+    assert(ctx);
+
+    if (!ctx->pending_tokens) {
+        return APN_SUCCESS;
     }
 
-    for (; ;) {
-        FD_ZERO(&read_set);
-        FD_SET(ctx->sock, &read_set);
+    __APN_CHECK_CONNECTION(ctx)
 
-        int select_returned = select(ctx->sock + 1, &read_set, NULL, NULL, &timeout);
-        if (select_returned < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            return APN_ERROR;
-        }
+    apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Checking for an error response...");
+    uint64_t wait_start = apn_clock_us();
+    APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_ERROR_WAIT, 0);
+    int ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ, timeout);
+    APN_STATS_INC(ctx, select_wakeups);
+    APN_STATS_RECORD_SINCE(ctx, error_wait_latency, wait_start);
+    APN_TRACE_END_SPAN(ctx, APN_TRACE_ERROR_WAIT, 0, 0);
+
+    if (ready < 0) {
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Waiting for the connection failed: %s (errno: %d)",
+                apn_error_string_r(errno, error, sizeof(error)), errno);
+        return APN_ERROR;
+    }
 
-        if (select_returned == 0) {
-            /* select() timed out */
-            break;
-        }
+    if (0 == ready) {
+        return APN_SUCCESS;
+    }
 
-        if (FD_ISSET(ctx->sock, &read_set)) {
-            char buffer[38];
-            int bytes_read = apn_ssl_read(ctx, buffer, sizeof(buffer));
-            if (bytes_read < 0) {
+    char apple_error_str[6];
+    if (0 >= apn_ssl_read(ctx, apple_error_str, sizeof(apple_error_str))) {
+        int errcode = errno;
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to read data from a socket: %s (errno: %d)",
+                apn_error_string_r(errcode, error, sizeof(error)), errcode);
+        apn_close(ctx);
+        if (ctx->options & APN_OPTION_RECONNECT) {
+            apn_count_reconnect(ctx, errcode);
+            if (APN_ERROR == apn_connect(ctx)) {
+                __apn_reconnect_failed(ctx);
                 return APN_ERROR;
-            } else if (bytes_read > 0) {
-                char *buffer_ref = buffer;
-                uint16_t token_length = 0;
-                uint8_t binary_token[APN_TOKEN_BINARY_SIZE];
-
-                buffer_ref += sizeof(uint32_t);
-                memcpy(&token_length, buffer_ref, sizeof(token_length));
-                buffer_ref += sizeof(token_length);
-                token_length = ntohs(token_length);
-                memcpy(&binary_token, buffer_ref, sizeof(binary_token));
-                char *token_hex = apn_token_binary_to_hex(binary_token);
-                if (NULL == token_hex) {
-                    apn_array_free(*tokens);
-                    return APN_ERROR;
-                }
-                apn_array_insert(*tokens, token_hex);
             }
-            break;
         }
+        errno = errcode;
+        return APN_ERROR;
     }
 
-    return APN_SUCCESS;
+    uint8_t apple_error_code = 0;
+    uint32_t id = 0;
+    __apn_parse_apns_error(apple_error_str, &apple_error_code, &id);
+    if (responded) {
+        *responded = 1;
+    }
+    return __apn_pending_error(ctx, apple_error_code, id, token_index);
 }
 
-uint32_t apn_version() {
-    return APN_VERSION_NUM;
-}
+#ifdef APN_HAVE_HTTP2
+struct __apn_http2_send {
+    apn_array_t *tokens;
+    apn_array_t **invalid_tokens;
+    apn_array_t *_invalid_tokens;
+    /* Requests to send again, at most APN_HTTP2_MAX_STREAMS together with requests in flight */
+    uint32_t *retry;
+    uint32_t retry_count;
+    /* Error of the last notification rejected for another reason than an invalid token */
+    int errcode;
+};
+
+static void __apn_http2_response(apn_ctx_t *const ctx, uint32_t index, uint16_t status, const char *const reason,
+                                 void *user) {
+    struct __apn_http2_send *send = user;
+    if (0 == status) {
+        send->retry[send->retry_count++] = index;
+        return;
+    }
+
+    const char *const token = (const char *const) apn_array_item_at_index(send->tokens, index);
+    if (200 == status) {
+        apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Notification to device with token %s has been accepted", token);
+    } else if (410 == status || (400 == status && reason && (0 == strcmp(reason, "BadDeviceToken")
+                                                             || 0 == strcmp(reason, "DeviceTokenNotForTopic")))) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Invalid token: %s (index: %u, status: %u, reason: %s)", token, index,
+                status, reason ? reason : "");
+        APN_STATS_INC(ctx, invalid_tokens);
+        __apn_store_invalid_token(ctx, token);
+        if (send->invalid_tokens) {
+            if (!send->_invalid_tokens) {
+                send->_invalid_tokens = apn_array_init(10, (apn_array_dtor) __apn_invalid_token_dtor, NULL);
+            }
+            if (!send->_invalid_tokens) {
+                send->errcode = ENOMEM;
+            } else {
+                apn_array_insert(send->_invalid_tokens, apn_strndup(token, APN_TOKEN_LENGTH));
+            }
+        }
+        __apn_report_invalid_token(ctx, send->tokens, index);
+    } else {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Notification to device with token %s was rejected (index: %u, status: %u, "
+                "reason: %s)", token, index, status, reason ? reason : "");
+        APN_STATS_INC(ctx, apple_errors);
+        switch (status) {
+            case 400:
+                send->errcode = APN_ERR_PROCESSING_ERROR;
+                break;
+            case 413:
+                send->errcode = APN_ERR_INVALID_PAYLOAD_SIZE;
+                break;
+            default:
+                send->errcode = APN_ERR_UNKNOWN;
+                break;
+        }
+    }
+    if (ctx->response_callback) {
+        ctx->response_callback(send->tokens, index, status, reason, ctx->response_user);
+    }
+}
+
+/*
+ * Keeps up to APN_HTTP2_MAX_STREAMS requests in flight. An invalid token fails its own request only;
+ * requests refused by GOAWAY or lost with the connection are sent again over a new connection.
+ */
+static apn_return __apn_send_http2(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
+                                   uint32_t begin, uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end) {
+    if (APN_ERROR == apn_http2_prepare(ctx, payload)) {
+        return APN_ERROR;
+    }
+
+    struct __apn_http2_send send;
+    send.tokens = tokens;
+    send.invalid_tokens = invalid_tokens;
+    send._invalid_tokens = NULL;
+    send.retry_count = 0;
+    send.errcode = 0;
+    if (NULL == (send.retry = malloc(sizeof(uint32_t) * APN_HTTP2_MAX_STREAMS))) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notification to %u device(s)...", end - begin);
+
+    uint32_t next = begin;
+    uint8_t yielded = 0;
+    apn_return ret = APN_SUCCESS;
+    ctx->yield_index = 0;
+
+    for (;;) {
+        apn_return io = APN_SUCCESS;
+        uint32_t available = apn_http2_available(ctx);
+        while (available > 0 && (send.retry_count > 0 || (next < end && !yielded))) {
+            uint32_t index = send.retry_count > 0 ? send.retry[--send.retry_count] : next++;
+            const char *token = (const char *) apn_array_item_at_index(tokens, index);
+
+#ifndef _WIN32
+            if (ctx->token_store) {
+                uint8_t binary_token[APN_TOKEN_BINARY_SIZE];
+                apn_token_hex_to_binary_r(token, binary_token);
+                if (apn_token_store_contains(ctx->token_store, binary_token, NULL)) {
+                    apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Token %s is in the token store, skipped", token);
+                    APN_STATS_INC(ctx, tokens_suppressed);
+                    continue;
+                }
+            }
+#endif
+
+            apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Sending notificaton to device with token %s...", token);
+            if (ctx->rate.rate > 0) {
+                apn_rate_pace(ctx);
+            }
+            if (APN_ERROR == (io = apn_http2_submit(ctx, token, index))) {
+                send.retry[send.retry_count++] = index;
+                break;
+            }
+            if (ctx->rate.rate > 0) {
+                apn_rate_sent(ctx, 0);
+            }
+            available--;
+            if (ctx->yield && *ctx->yield && next < end && !yielded) {
+                apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "Yielding the connection after %u notification(s)",
+                            next - begin);
+                ctx->yield_index = next;
+                yielded = 1;
+            }
+        }
+
+        if (APN_SUCCESS == io) {
+            if (0 == apn_http2_in_flight(ctx)) {
+                if (0 == send.retry_count && (next >= end || yielded)) {
+                    break;
+                }
+                /* Nothing in flight and no stream available: the server has sent GOAWAY */
+                errno = APN_ERR_SERVICE_SHUTDOWN;
+            } else if (APN_SUCCESS == apn_http2_run(ctx, APN_HTTP2_RESPONSE_TIMEOUT, __apn_http2_response, &send)) {
+                continue;
+            }
+        }
+
+        int errcode = errno;
+        send.retry_count += apn_http2_unfinished(ctx, send.retry + send.retry_count);
+        if (!(ctx->options & APN_OPTION_RECONNECT)
+            || (errcode != APN_ERR_CONNECTION_CLOSED
+                && errcode != APN_ERR_SERVICE_SHUTDOWN
+                && errcode != APN_ERR_NETWORK_TIMEDOUT
+                && errcode != APN_ERR_NETWORK_UNREACHABLE)) {
+            apn_close(ctx);
+            errno = errcode;
+            ret = APN_ERROR;
+            break;
+        }
+
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Reconnecting, %u notification(s) will be sent again...", send.retry_count);
+        apn_count_reconnect(ctx, errcode);
+        apn_close(ctx);
+        if (errcode != APN_ERR_SERVICE_SHUTDOWN) {
+#ifndef _WIN32
+            sleep(1);
+#else
+            Sleep(1000);
+#endif
+        }
+        if (APN_ERROR == (ret = apn_connect(ctx))) {
+            break;
+        }
+    }
+
+    if (APN_SUCCESS == ret) {
+        if (send.errcode) {
+            errno = send.errcode;
+            ret = APN_ERROR;
+        } else if (sent_end) {
+            *sent_end = yielded ? ctx->yield_index : end;
+        }
+    }
+    free(send.retry);
+    if (invalid_tokens && send._invalid_tokens) {
+        *invalid_tokens = send._invalid_tokens;
+    }
+    return ret;
+}
+#endif
+
+apn_return apn_feedback_connect(apn_ctx_t *const ctx) {
+    struct __apn_apple_server server;
+    if (ctx->feedback_host) {
+        server.host = ctx->feedback_host;
+        server.port = ctx->feedback_port;
+    } else if (ctx->mode == APN_MODE_SANDBOX) {
+        server = __apn_apple_servers[2];
+    } else {
+        server = __apn_apple_servers[3];
+    }
+    ctx->feedback = 1;
+    return __apn_result(ctx, __apn_connect(ctx, server));
+}
+
+apn_return apn_feedback(apn_ctx_t *const ctx, apn_array_t **tokens) {
+    return __apn_result(ctx, __apn_feedback(ctx, tokens));
+}
+
+apn_return apn_feedback_read(apn_ctx_t *const ctx, apn_feedback_callback callback, void *user, uint32_t timeout) {
+    return __apn_result(ctx, __apn_feedback_read(ctx, callback, user, timeout));
+}
+
+/* Adds tuples to the token store, if any, before passing them to the callback */
+static void __apn_feedback_deliver(apn_ctx_t *const ctx, const apn_feedback_tuple_t *tuples, uint32_t count,
+                                   apn_feedback_callback callback, void *user) {
+#ifndef _WIN32
+    if (ctx->token_store) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (APN_ERROR == apn_token_store_add(ctx->token_store, tuples[i].token, tuples[i].timestamp)) {
+                char error[APN_ERROR_STRING_SIZE];
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to add token to the token store: %s (errno: %d)",
+                        apn_error_string_r(errno, error, sizeof(error)), errno);
+                break;
+            }
+        }
+    }
+#endif
+    callback(tuples, count, user);
+}
+
+static apn_return __apn_feedback_read(apn_ctx_t *const ctx, apn_feedback_callback callback, void *user,
+                                      uint32_t timeout) {
+    assert(ctx);
+    assert(callback);
+
+    if (!ctx->ssl || !ctx->feedback) {
+        errno = APN_ERR_NOT_CONNECTED_FEEDBACK;
+        return APN_ERROR;
+    }
+
+    char *buffer = malloc(APN_FEEDBACK_BUFFER_SIZE);
+    apn_feedback_tuple_t *tuples = malloc(sizeof(apn_feedback_tuple_t) * APN_FEEDBACK_BATCH_SIZE);
+    if (!buffer || !tuples) {
+        free(buffer);
+        free(tuples);
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+
+    apn_return ret = APN_SUCCESS;
+    size_t buffered = 0;
+    uint64_t delivered = 0;
+
+    for (; ;) {
+        int ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ, timeout);
+        if (ready < 0) {
+            ret = APN_ERROR;
+            break;
+        }
+
+        if (ready == 0) {
+            /* Nothing was received during `timeout`, the service has nothing more to send */
+            break;
+        }
+
+        int bytes_read = apn_ssl_read(ctx, buffer + buffered, APN_FEEDBACK_BUFFER_SIZE - buffered);
+        if (bytes_read < 0) {
+            /* The service closes the connection after the last tuple */
+            if (errno != APN_ERR_CONNECTION_CLOSED) {
+                ret = APN_ERROR;
+            }
+            break;
+        }
+        buffered += (size_t) bytes_read;
+
+        /* Parse every complete tuple, an incomplete one is kept for the next read */
+        size_t offset = 0;
+        uint32_t count = 0;
+        while (buffered - offset >= APN_FEEDBACK_TUPLE_SIZE) {
+            const char *tuple = buffer + offset;
+            uint32_t timestamp = 0;
+            uint16_t token_length = 0;
+
+            memcpy(&token_length, tuple + sizeof(timestamp), sizeof(token_length));
+            if (APN_TOKEN_BINARY_SIZE != ntohs(token_length)) {
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Feedback tuple has invalid token length: %u", ntohs(token_length));
+                errno = APN_ERR_TOKEN_INVALID;
+                ret = APN_ERROR;
+                break;
+            }
+            memcpy(&timestamp, tuple, sizeof(timestamp));
+            tuples[count].timestamp = ntohl(timestamp);
+            memcpy(tuples[count].token, tuple + sizeof(timestamp) + sizeof(token_length), APN_TOKEN_BINARY_SIZE);
+            offset += APN_FEEDBACK_TUPLE_SIZE;
+
+            if (++count == APN_FEEDBACK_BATCH_SIZE) {
+                __apn_feedback_deliver(ctx, tuples, count, callback, user);
+                delivered += count;
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            __apn_feedback_deliver(ctx, tuples, count, callback, user);
+            delivered += count;
+        }
+        if (APN_ERROR == ret) {
+            break;
+        }
+
+        buffered -= offset;
+        if (buffered > 0 && offset > 0) {
+            memmove(buffer, buffer + offset, buffered);
+        }
+    }
+
+    if (APN_SUCCESS == ret && buffered > 0) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Feedback connection closed in the middle of a tuple, %u byte(s) dropped",
+                (uint32_t) buffered);
+    }
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "%llu feedback tuple(s) received", (unsigned long long) delivered);
+
+    free(buffer);
+    free(tuples);
+    return ret;
+}
+
+struct __apn_feedback_tokens {
+    apn_array_t *tokens;
+    int error;
+};
+
+static void __apn_feedback_collect(const apn_feedback_tuple_t *tuples, uint32_t count, void *user) {
+    struct __apn_feedback_tokens *collected = user;
+    for (uint32_t i = 0; i < count && !collected->error; i++) {
+        char *token_hex = apn_token_binary_to_hex(tuples[i].token);
+        if (NULL == token_hex) {
+            collected->error = errno;
+            break;
+        }
+        if (APN_ERROR == apn_array_insert(collected->tokens, token_hex)) {
+            collected->error = errno;
+            free(token_hex);
+        }
+    }
+}
+
+static apn_return __apn_feedback(apn_ctx_t *const ctx, apn_array_t **tokens) {
+    assert(ctx);
+    assert(tokens);
+
+    struct __apn_feedback_tokens collected = {NULL, 0};
+    collected.tokens = apn_array_init(10, (apn_array_dtor)__apn_invalid_token_dtor, NULL);
+    if (!collected.tokens) {
+        return APN_ERROR;
+    }
+
+    if (APN_ERROR == __apn_feedback_read(ctx, __apn_feedback_collect, &collected, APN_FEEDBACK_DEFAULT_TIMEOUT)) {
+        apn_array_free(collected.tokens);
+        return APN_ERROR;
+    }
+    if (collected.error) {
+        apn_array_free(collected.tokens);
+        errno = collected.error;
+        return APN_ERROR;
+    }
+
+    *tokens = collected.tokens;
+    return APN_SUCCESS;
+}
+
+uint32_t apn_version() {
+    return APN_VERSION_NUM;
+}
 
 const char *apn_version_string() {
     return APN_VERSION_STRING;
 }
 
-char *apn_error_string(int errnum) {
-    char error[250] = {0};
+static const char *__apn_error_message(int errnum) {
     switch (errnum) {
         case APN_ERR_FAILED_INIT:
-            apn_snprintf(error, sizeof(error) - 1, "unable to initialize library");
-            break;
+            return "unable to initialize library";
         case APN_ERR_NOT_CONNECTED:
-            apn_snprintf(error, sizeof(error) - 1, "no opened connection to Apple Push Notification Service");
-            break;
+            return "no opened connection to Apple Push Notification Service";
         case APN_ERR_NOT_CONNECTED_FEEDBACK:
-            apn_snprintf(error, sizeof(error) - 1, "no opened connection to Apple Feedback Service");
-            break;
+            return "no opened connection to Apple Feedback Service";
         case APN_ERR_CONNECTION_CLOSED:
-            apn_snprintf(error, sizeof(error) - 1, "connection was closed");
-            break;
+            return "connection was closed";
         case APN_ERR_NETWORK_TIMEDOUT:
-            apn_snprintf(error, sizeof(error) - 1, "connection timed out");
-            break;
+            return "connection timed out";
         case APN_ERR_NETWORK_UNREACHABLE:
-            apn_snprintf(error, sizeof(error) - 1, "network unreachable");
-            break;
+            return "network unreachable";
         case APN_ERR_TOKEN_INVALID:
-            apn_snprintf(error, sizeof(error) - 1, "invalid device token");
-            break;
+            return "invalid device token";
         case APN_ERR_TOKEN_TOO_MANY:
-            apn_snprintf(error, sizeof(error) - 1, "too many device tokens");
-            break;
+            return "too many device tokens";
         case APN_ERR_CERTIFICATE_IS_NOT_SET:
-            apn_snprintf(error, sizeof(error) - 1, "certificate is not set");
-            break;
+            return "certificate is not set";
         case APN_ERR_PRIVATE_KEY_IS_NOT_SET:
-            apn_snprintf(error, sizeof(error) - 1, "private key is not set");
-            break;
+            return "private key is not set";
         case APN_ERR_UNABLE_TO_USE_SPECIFIED_CERTIFICATE:
-            apn_snprintf(error, sizeof(error) - 1, "unable to use specified certificate");
-            break;
+            return "unable to use specified certificate";
         case APN_ERR_UNABLE_TO_USE_SPECIFIED_PRIVATE_KEY:
-            apn_snprintf(error, sizeof(error) - 1, "unable to use specified private key");
-            break;
+            return "unable to use specified private key";
         case APN_ERR_UNABLE_TO_USE_SPECIFIED_PKCS12:
-            apn_snprintf(error, sizeof(error) - 1, "unable to use specified PKCS12 file");
-            break;
+            return "unable to use specified PKCS12 file";
         case APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION:
-            apn_snprintf(error, sizeof(error) - 1, "unable to establish connection");
-            break;
+            return "unable to establish connection";
         case APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION:
-            apn_snprintf(error, sizeof(error) - 1, "unable to establish ssl connection");
-            break;
+            return "unable to establish ssl connection";
         case APN_ERR_SSL_WRITE_FAILED:
-            apn_snprintf(error, sizeof(error) - 1, "SSL_write failed");
-            break;
+            return "SSL_write failed";
         case APN_ERR_SSL_READ_FAILED:
-            apn_snprintf(error, sizeof(error) - 1, "SSL_read failed");
-            break;
+            return "SSL_read failed";
         case APN_ERR_INVALID_PAYLOAD_SIZE:
-            apn_snprintf(error, sizeof(error) - 1, "invalid notification payload size");
-            break;
+            return "invalid notification payload size";
         case APN_ERR_PAYLOAD_BADGE_INVALID_VALUE:
-            apn_snprintf(error, sizeof(error) - 1, "incorrect number to display as the badge on application icon");
-            break;
+            return "incorrect number to display as the badge on application icon";
         case APN_ERR_PAYLOAD_CUSTOM_PROPERTY_KEY_IS_ALREADY_USED:
-            apn_snprintf(error, sizeof(error) - 1, "specified custom property name is already used");
-            break;
+            return "specified custom property name is already used";
         case APN_ERR_PAYLOAD_COULD_NOT_CREATE_JSON_DOCUMENT:
-            apn_snprintf(error, sizeof(error) - 1, "could not create json document");
-            break;
+            return "could not create json document";
         case APN_ERR_STRING_CONTAINS_NON_UTF8_CHARACTERS:
-            apn_snprintf(error, sizeof(error) - 1, "non-UTF8 symbols detected in a string");
-            break;
+            return "non-UTF8 symbols detected in a string";
         case APN_ERR_PROCESSING_ERROR:
-            apn_snprintf(error, sizeof(error) - 1, "processing error");
-            break;
+            return "processing error";
         case APN_ERR_SERVICE_SHUTDOWN:
-            apn_snprintf(error, sizeof(error) - 1, "server closed the connection (service shutdown)");
-            break;
+            return "server closed the connection (service shutdown)";
         case APN_ERR_PAYLOAD_ALERT_IS_NOT_SET:
-            apn_snprintf(error, sizeof(error) - 1,
-                         "alert message text or key used to get a localized alert-message string or content-available flag must be set");
-            break;
+            return "alert message text or key used to get a localized alert-message string or content-available flag must be set";
+        case APN_ERR_APP_NOT_REGISTERED:
+            return "application is not registered in the pool";
+        case APN_ERR_TOKEN_STORE_INVALID:
+            return "file is not a token store or is corrupted";
+        case APN_ERR_HTTP2_NOT_SUPPORTED:
+            return "library is built without HTTP/2 support";
+        case APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY:
+            return "unable to use specified authentication key";
+        case APN_ERR_TOPIC_IS_NOT_SET:
+            return "topic is not set";
+        case APN_ERR_HTTP2_PROTOCOL_ERROR:
+            return "HTTP/2 protocol error";
+        case APN_ERR_SPOOL_INVALID:
+            return "file is not a spool or is truncated";
         default:
-            apn_strerror(errnum, error, sizeof(error) - 1);
-            break;
+            return NULL;
     }
-    return apn_strndup(error, sizeof(error));
+}
+
+const char *apn_error_string_r(int errnum, char *const buffer, size_t buffer_size) {
+    const char *message = __apn_error_message(errnum);
+    if (message) {
+        return message;
+    }
+    apn_strerror(errnum, buffer, buffer_size);
+    return buffer;
+}
+
+char *apn_error_string(int errnum) {
+    char error[APN_ERROR_STRING_SIZE] = {0};
+    const char *message = apn_error_string_r(errnum, error, sizeof(error));
+    return apn_strndup(message, strlen(message));
 }
 
 static apn_return __apn_connect(apn_ctx_t *const ctx, struct __apn_apple_server server) {
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Connecting to %s:%d...", server.host, server.port);
 
-    if (!ctx->pkcs12_file) {
+    if (APN_USE_HTTP2(ctx) && ctx->auth_key_file) {
+        if (!ctx->topic) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Topic not set (errno: %d)", APN_ERR_TOPIC_IS_NOT_SET);
+            errno = APN_ERR_TOPIC_IS_NOT_SET;
+            return APN_ERROR;
+        }
+    } else if (!ctx->pkcs12_file) {
         if (!ctx->certificate_file) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Certificate file not set (errno: %d)", APN_ERR_CERTIFICATE_IS_NOT_SET);
             errno = APN_ERR_CERTIFICATE_IS_NOT_SET;
@@ -571,78 +1526,285 @@ static apn_return __apn_connect(apn_ctx_t *const ctx, struct __apn_apple_server
         }
     }
 
-    if (ctx->sock == -1) {
-        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Resolving server hostname...");
+    if (ctx->sock == -1 && !ctx->ssl) {
+        ctx->connection_id++;
+        uint64_t start = apn_clock_us();
+        if (ctx->custom_transport) {
+            if (APN_USE_HTTP2(ctx)) {
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "HTTP/2 cannot run over a custom transport");
+                errno = EINVAL;
+                return APN_ERROR;
+            }
+            apn_log(ctx, APN_LOG_LEVEL_INFO, "Using custom transport");
+        } else {
+            APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_RESOLVE, 0);
+            apn_return resolved = __apn_resolve(ctx, server);
+            APN_TRACE_END_SPAN(ctx, APN_TRACE_RESOLVE, 0, 0);
+            if (APN_ERROR == resolved) {
+                APN_STATS_INC(ctx, connect_failures);
+                return APN_ERROR;
+            }
 
-        struct addrinfo hints;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = AI_NUMERICSERV;
+            APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_CONNECT, 0);
+            SOCKET sock = __apn_connect_addresses(ctx);
+            APN_TRACE_END_SPAN(ctx, APN_TRACE_CONNECT, 0, 0);
+            if (sock == -1) {
+                APN_STATS_INC(ctx, connect_failures);
+                errno = APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION;
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to establish connection");
+                return APN_ERROR;
+            }
+            ctx->sock = sock;
+            APN_STATS_INC(ctx, connects);
+            APN_STATS_RECORD_SINCE(ctx, connect_latency, start);
 
-        char str_port[6];
-        apn_snprintf(str_port, sizeof(str_port) - 1, "%d", server.port);
+            apn_log(ctx, APN_LOG_LEVEL_INFO, "Connection has been established");
+        }
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Initializing SSL connection...");
 
-        struct addrinfo *addrinfo = NULL;
-        if (0 != getaddrinfo(server.host, str_port, &hints, &addrinfo)) {
-            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to resolve hostname: getaddrinfo() failed");
-            errno  = APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION;
+        start = apn_clock_us();
+        APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_HANDSHAKE, 0);
+        apn_return handshaked = apn_ssl_connect(ctx, server.host);
+        APN_TRACE_END_SPAN(ctx, APN_TRACE_HANDSHAKE, 0, 0);
+        if (APN_ERROR == handshaked) {
+            int errcode = errno;
+            APN_STATS_INC(ctx, handshake_failures);
+            apn_close(ctx);
+            errno = errcode;
             return APN_ERROR;
         }
+        APN_STATS_INC(ctx, handshakes);
+        APN_STATS_RECORD_SINCE(ctx, handshake_latency, start);
+        ctx->last_io = apn_clock_us();
 
-        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Creating socket...");
-
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock < 0) {
-            char *error = apn_error_string(errno);
-            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to create socket: socket() failed: %s (errno: %d)", error,
-                      errno);
-            free(error);
+#ifdef APN_HAVE_HTTP2
+        if (APN_USE_HTTP2(ctx) && APN_ERROR == apn_http2_connect(ctx, server.host)) {
+            int errcode = errno;
+            apn_close(ctx);
+            errno = errcode;
             return APN_ERROR;
         }
-	    
-        ctx->sock = sock;
+#endif
+    }
+    return APN_SUCCESS;
+}
 
-#ifndef _WIN32
-        int sock_flags = fcntl(ctx->sock, F_GETFL, 0);
-        fcntl(ctx->sock, F_SETFL, sock_flags | O_NONBLOCK);
+static apn_return __apn_resolve(apn_ctx_t *const ctx, struct __apn_apple_server server) {
+    struct __apn_addr_cache *cache = &ctx->addr_cache;
+
+    if (cache->count > 0 && cache->host && 0 == strcmp(cache->host, server.host) && cache->port == server.port
+        && time(NULL) < cache->expires) {
+        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Using %u cached address(es) of %s", cache->count, server.host);
+        return APN_SUCCESS;
+    }
+
+    apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Resolving server hostname...");
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+    char str_port[6];
+    apn_snprintf(str_port, sizeof(str_port), "%d", server.port);
+
+    struct addrinfo *addrinfo = NULL;
+    int ret = getaddrinfo(server.host, str_port, &hints, &addrinfo);
+    if (0 != ret) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to resolve hostname: getaddrinfo() failed: %s", gai_strerror(ret));
+        errno = APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION;
+        return APN_ERROR;
+    }
+
+    apn_strfree(&cache->host);
+    cache->count = 0;
+    cache->expires = 0;
+
+    /* Interleave address families: IPv6, IPv4, IPv6, ... */
+    struct addrinfo *inet6 = addrinfo;
+    struct addrinfo *inet = addrinfo;
+    while (cache->count < APN_ADDR_CACHE_SIZE) {
+        while (inet6 && inet6->ai_family != AF_INET6) {
+            inet6 = inet6->ai_next;
+        }
+        while (inet && inet->ai_family != AF_INET) {
+            inet = inet->ai_next;
+        }
+        if (!inet6 && !inet) {
+            break;
+        }
+        struct addrinfo *next[2] = {inet6, inet};
+        for (uint8_t i = 0; i < 2 && cache->count < APN_ADDR_CACHE_SIZE; i++) {
+            if (next[i] && next[i]->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+                memcpy(&cache->addrs[cache->count], next[i]->ai_addr, next[i]->ai_addrlen);
+                cache->addr_lens[cache->count] = (socklen_t) next[i]->ai_addrlen;
+                cache->count++;
+            }
+        }
+        inet6 = inet6 ? inet6->ai_next : NULL;
+        inet = inet ? inet->ai_next : NULL;
+    }
+
+    freeaddrinfo(addrinfo);
+
+    if (0 == cache->count) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to resolve hostname: no addresses found");
+        errno = APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION;
+        return APN_ERROR;
+    }
+
+    if (ctx->addr_cache_ttl > 0) {
+        cache->host = apn_strndup(server.host, strlen(server.host));
+        cache->port = server.port;
+        cache->expires = time(NULL) + ctx->addr_cache_ttl;
+    }
+
+    apn_log(ctx, APN_LOG_LEVEL_DEBUG, "%u address(es) resolved", cache->count);
+    return APN_SUCCESS;
+}
+
+static int __apn_connect_in_progress() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
 #else
-        int sock_flags = 1;
-        ioctlsocket(ctx->sock, FIONBIO, (u_long *) &sock_flags);
+    return errno == EINPROGRESS;
 #endif
-        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Socket successfully created");
+}
+
+static void __apn_addr_string(const struct sockaddr_storage *const addr, char *const buffer, size_t buffer_size) {
+    const void *in_addr = (addr->ss_family == AF_INET6)
+                          ? (const void *) &((const struct sockaddr_in6 *) addr)->sin6_addr
+                          : (const void *) &((const struct sockaddr_in *) addr)->sin_addr;
+    if (!inet_ntop(addr->ss_family, (void *) in_addr, buffer, (socklen_t) buffer_size)) {
+        apn_strncpy(buffer, "<unknown>", buffer_size, 9);
+    }
+}
+
+static SOCKET __apn_connect_addresses(apn_ctx_t *const ctx) {
+    struct __apn_addr_cache *cache = &ctx->addr_cache;
+    SOCKET socks[APN_ADDR_CACHE_SIZE];
+    uint8_t started = 0;
+    uint8_t pending = 0;
+    SOCKET winner = -1;
+    uint64_t deadline = (apn_clock_us() / 1000) + APN_CONNECT_TIMEOUT;
+    uint64_t next_attempt = 0;
+
+    /*
+     * Happy Eyeballs (RFC 8305): a new attempt is started every APN_CONNECT_ATTEMPT_DELAY ms or as soon as
+     * an attempt fails, attempts in progress are not cancelled. The first connected socket wins.
+     */
+    while (winner == -1) {
+        uint64_t now = (apn_clock_us() / 1000);
+        if (now >= deadline) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not connect: connection timed out");
+            break;
+        }
 
-        uint8_t connected = 0;
-        while (addrinfo) {
-            char ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, (void *) &((struct sockaddr_in *) addrinfo->ai_addr)->sin_addr, ip, sizeof(ip));
+        while (winner == -1 && started < cache->count && (now >= next_attempt || 0 == pending)) {
+            char ip[INET6_ADDRSTRLEN];
+            uint8_t i = started++;
+            __apn_addr_string(&cache->addrs[i], ip, sizeof(ip));
             apn_log(ctx, APN_LOG_LEVEL_INFO, "Trying to connect to %s...", ip);
-            if (connect(ctx->sock, addrinfo->ai_addr, addrinfo->ai_addrlen) < 0) {
-                char *error = apn_error_string(errno);
-                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not to connect to: %s (errno: %d)", error, errno);
-                free(error);
+
+            socks[i] = socket(cache->addrs[i].ss_family, SOCK_STREAM, IPPROTO_TCP);
+            if (socks[i] < 0) {
+                char error[APN_ERROR_STRING_SIZE];
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to create socket: socket() failed: %s (errno: %d)",
+                        apn_error_string_r(errno, error, sizeof(error)), errno);
+                socks[i] = -1;
+                continue;
+            }
+#ifdef SO_NOSIGPIPE
+            int no_sigpipe = 1;
+            setsockopt(socks[i], SOL_SOCKET, SO_NOSIGPIPE, (void *) &no_sigpipe, sizeof(no_sigpipe));
+#endif
+            apn_socket_apply(ctx, socks[i]);
+#ifndef _WIN32
+            int sock_flags = fcntl(socks[i], F_GETFL, 0);
+            fcntl(socks[i], F_SETFL, sock_flags | O_NONBLOCK);
+#else
+            int sock_flags = 1;
+            ioctlsocket(socks[i], FIONBIO, (u_long *) &sock_flags);
+#endif
+            if (0 == connect(socks[i], (const struct sockaddr *) &cache->addrs[i], cache->addr_lens[i])) {
+                winner = socks[i];
+                socks[i] = -1;
+            } else if (__apn_connect_in_progress()) {
+                pending++;
+                next_attempt = now + APN_CONNECT_ATTEMPT_DELAY;
             } else {
-                connected = 1;
-                break;
+                char error[APN_ERROR_STRING_SIZE];
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not to connect to %s: %s (errno: %d)",
+                        ip, apn_error_string_r(errno, error, sizeof(error)), errno);
+                APN_CLOSE_SOCKET(socks[i]);
+                socks[i] = -1;
             }
-            addrinfo = addrinfo->ai_next;
         }
 
-        freeaddrinfo(addrinfo);
-	    
-        if (!connected) {
-            errno = APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION;
-            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to establish connection");
-            apn_close(ctx);
-            return APN_ERROR;
+        if (winner != -1 || 0 == pending) {
+            break;
         }
 
-        apn_log(ctx, APN_LOG_LEVEL_INFO, "Connection has been established");
-        apn_log(ctx, APN_LOG_LEVEL_INFO, "Initializing SSL connection...");
+        fd_set write_set;
+        SOCKET max_sock = 0;
+        FD_ZERO(&write_set);
+        for (uint8_t i = 0; i < started; i++) {
+            if (socks[i] != -1) {
+                FD_SET(socks[i], &write_set);
+                max_sock = socks[i] > max_sock ? socks[i] : max_sock;
+            }
+        }
 
-        return apn_ssl_connect(ctx);
+        uint64_t wait_until = (started < cache->count && next_attempt < deadline) ? next_attempt : deadline;
+        uint64_t wait = wait_until > now ? wait_until - now : 0;
+        struct timeval timeout = {(long) (wait / 1000), (long) ((wait % 1000) * 1000)};
+
+        int select_returned = select(max_sock + 1, NULL, &write_set, NULL, &timeout);
+        if (select_returned < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            char error[APN_ERROR_STRING_SIZE];
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "select() failed: %s (errno: %d)",
+                    apn_error_string_r(errno, error, sizeof(error)), errno);
+            break;
+        }
+
+        for (uint8_t i = 0; i < started && select_returned > 0; i++) {
+            if (socks[i] == -1 || !FD_ISSET(socks[i], &write_set)) {
+                continue;
+            }
+            int sock_error = 0;
+            socklen_t sock_error_len = sizeof(sock_error);
+            getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (void *) &sock_error, &sock_error_len);
+            pending--;
+            if (0 == sock_error) {
+                winner = socks[i];
+                socks[i] = -1;
+                break;
+            }
+            char ip[INET6_ADDRSTRLEN];
+            char error[APN_ERROR_STRING_SIZE];
+            __apn_addr_string(&cache->addrs[i], ip, sizeof(ip));
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not to connect to %s: %s (errno: %d)",
+                    ip, apn_error_string_r(sock_error, error, sizeof(error)), sock_error);
+            APN_CLOSE_SOCKET(socks[i]);
+            socks[i] = -1;
+        }
     }
-    return APN_SUCCESS;
+
+    for (uint8_t i = 0; i < started; i++) {
+        if (socks[i] != -1) {
+            APN_CLOSE_SOCKET(socks[i]);
+        }
+    }
+
+    if (winner == -1) {
+        /* Cached addresses may be stale */
+        cache->expires = 0;
+    }
+    return winner;
 }
 
 static void __apn_parse_apns_error(char *apns_error, uint8_t *apns_error_code, uint32_t *id) {
@@ -656,7 +1818,7 @@ static void __apn_parse_apns_error(char *apns_error, uint8_t *apns_error_code, u
         if (apns_error_code) {
             *apns_error_code = error_code;
         }
-        if (APN_APNS_ERR_INVALID_TOKEN == error_code && id) {
+        if (id) {
             uint32_t token_id = 0;
             memcpy(&token_id, apns_error, sizeof(uint32_t));
             *id = ntohl(token_id);
@@ -668,20 +1830,20 @@ static void __apn_parse_apns_error(char *apns_error, uint8_t *apns_error_code, u
 #define APN_MACRO_BREAK0
 #define APN_LOOP_BREAK(__loop) APN_MACRO_BREAK##__loop
 
-#define __API_SOCKET_READ(__ctx, __read_set, __buffer, __apple_error_flag, __loop, __current_tix, __invalid_tix) \
+#define __API_SOCKET_READ(__ctx, __ready, __buffer, __apple_error_flag, __loop, __current_tix, __invalid_tix) \
     __apple_error_flag = 0; \
-    if (FD_ISSET(__ctx->sock, __read_set)) { \
-        apn_log(__ctx, APN_LOG_LEVEL_DEBUG, "Socket has data for read"); \
-        apn_log(__ctx, APN_LOG_LEVEL_DEBUG, "Reading data from a socket..."); \
+    if ((__ready) & APN_TRANSPORT_READ) { \
+        apn_log_hot(__ctx, APN_LOG_LEVEL_DEBUG, "Socket has data for read"); \
+        apn_log_hot(__ctx, APN_LOG_LEVEL_DEBUG, "Reading data from a socket..."); \
         int __bytes_read = apn_ssl_read(__ctx, __buffer, sizeof(__buffer)); \
         if (0 < __bytes_read) { \
-            apn_log(__ctx, APN_LOG_LEVEL_DEBUG, "%d byte(s) has been read from a socket", __bytes_read); \
+            apn_log_hot(__ctx, APN_LOG_LEVEL_DEBUG, "%d byte(s) has been read from a socket", __bytes_read); \
             __apple_error_flag = 1; \
             APN_LOOP_BREAK(__loop) \
         } else { \
-            char *__error_str = apn_error_string(errno); \
-            apn_log(__ctx, APN_LOG_LEVEL_ERROR, "Unable to read data from a socket: %s (errno: %d)", __error_str, errno); \
-            free(__error_str); \
+            char __error_str[APN_ERROR_STRING_SIZE]; \
+            apn_log(__ctx, APN_LOG_LEVEL_ERROR, "Unable to read data from a socket: %s (errno: %d)", \
+                    apn_error_string_r(errno, __error_str, sizeof(__error_str)), errno); \
             if(__invalid_tix) {\
                 *__invalid_tix = __current_tix;\
             }\
@@ -689,99 +1851,534 @@ static void __apn_parse_apns_error(char *apns_error, uint8_t *apns_error_code, u
         } \
     }
 
-#define __APN_SELECT_ERROR(__returned_code) \
+#define __APN_POLL_ERROR(__returned_code) \
     if(__returned_code < 0) { \
-        char *__error_str = apn_error_string(errno); \
-        apn_log(ctx, APN_LOG_LEVEL_ERROR, "select() failed: %s (errno: %d)", __error_str, errno); \
-        free(__error_str); \
+        char __error_str[APN_ERROR_STRING_SIZE]; \
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Waiting for the connection failed: %s (errno: %d)", \
+                apn_error_string_r(errno, __error_str, sizeof(__error_str)), errno); \
         return APN_ERROR;\
     }
 
-static apn_return __apn_send_binary_message(const apn_ctx_t *const ctx,
+/*
+ * Apple closes the connection right after an error response, so a write fails once the response arrived while
+ * frames were being written. It is usually still readable and tells which notification failed.
+ * Returns 1 if the response was read into `buffer`
+ */
+static uint8_t __apn_read_error_response(apn_ctx_t *const ctx, char *const buffer, size_t length) {
+    if (0 < apn_ssl_poll(ctx, APN_TRANSPORT_READ, 0) && 0 < apn_ssl_read(ctx, buffer, length)) {
+        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Error response has been read after the failed write");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Checks a connection before the first frame of a send is written. A connection idle for longer than
+ * ctx->idle_timeout is reopened. One idle for at least APN_IDLE_PROBE_US is probed with a non-blocking read;
+ * it is readable only if the peer has closed it, and reopened then, or sent an error response to a notification
+ * of an earlier call, which is handled by __apn_pending_error(). If notifications of the pending call were left
+ * unsent, `unsent` is set to the error, can be NULL. Returns APN_ERROR if the connection could not be reopened.
+ */
+static apn_return __apn_check_idle(apn_ctx_t *const ctx, int *unsent) {
+    uint64_t idle = apn_clock_us() - ctx->last_io;
+    if (idle < APN_IDLE_PROBE_US) {
+        return APN_SUCCESS;
+    }
+
+    int errcode = 0;
+    if (ctx->idle_timeout > 0 && idle >= (uint64_t) ctx->idle_timeout * 1000000 &&
+        (ctx->options & APN_OPTION_RECONNECT)) {
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Connection has been idle for %llu seconds",
+                (unsigned long long) (idle / 1000000));
+    } else {
+        int ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ, 0);
+        APN_STATS_INC(ctx, select_wakeups);
+        if (0 == ready) {
+            return APN_SUCCESS;
+        }
+        char apple_error_str[6];
+        if (ready > 0 && 0 < apn_ssl_read(ctx, apple_error_str, sizeof(apple_error_str))) {
+            uint8_t apple_error_code = 0;
+            uint32_t id = 0;
+            uint8_t pending = NULL != ctx->pending_tokens;
+            __apn_parse_apns_error(apple_error_str, &apple_error_code, &id);
+            apn_return ret = __apn_pending_error(ctx, apple_error_code, id, NULL);
+            if (!ctx->ssl) {
+                return APN_ERROR;
+            }
+            /* Without a pending call the response refers to a send which already returned */
+            if (APN_ERROR == ret && pending && unsent) {
+                *unsent = errno;
+            }
+            return APN_SUCCESS;
+        }
+        errcode = errno ? errno : APN_ERR_CONNECTION_CLOSED;
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Idle connection is no longer usable: %s (errno: %d)",
+                apn_error_string_r(errcode, error, sizeof(error)), errcode);
+    }
+
+    apn_close(ctx);
+    if (!(ctx->options & APN_OPTION_RECONNECT)) {
+        errno = errcode;
+        return APN_ERROR;
+    }
+    APN_TRACE(ctx, APN_TRACE_RECONNECT, 0, errcode);
+    if (errcode) {
+        APN_STATS_INC(ctx, reconnects_stale);
+    } else {
+        APN_STATS_INC(ctx, reconnects_idle);
+    }
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "Reconnecting...");
+    return apn_connect(ctx);
+}
+
+/* Sets identifier and token `index` of a frame. Returns 1 if the token is in the token store and is skipped */
+static uint8_t __apn_prepare_binary_message(apn_ctx_t *const ctx, apn_binary_message_t *const binary_message,
+                                            apn_array_t *tokens, uint32_t id_base, uint32_t index) {
+    const char *token = (const char *) apn_array_item_at_index(tokens, index);
+    apn_binary_message_set_id(binary_message, id_base + index);
+    apn_binary_message_set_token_hex(binary_message, token);
+
+#ifndef _WIN32
+    if (ctx->token_store && apn_token_store_contains(ctx->token_store, binary_message->token_position, NULL)) {
+        apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Token %s is in the token store, skipped", token);
+        APN_STATS_INC(ctx, tokens_suppressed);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static apn_return __apn_send_binary_message(apn_ctx_t *const ctx,
                                             apn_binary_message_t *const binary_message,
                                             apn_array_t *tokens,
                                             uint32_t token_start_index,
+                                            uint32_t token_end_index,
+                                            uint32_t id_base,
                                             uint8_t *apple_error_code,
-                                            uint32_t *invalid_token_index) {
+                                            uint32_t *error_id) {
 
-    assert(token_start_index < apn_array_count(tokens));
+    assert(token_start_index < token_end_index && token_end_index <= apn_array_count(tokens));
 
-    fd_set write_set, read_set;
-    struct timeval timeout = {10, 0};
     uint8_t apple_returned_error = 0;
-    int select_returned = 0;
+    int ready = 0;
     char apple_error_str[6];
+    /*
+     * Frames encrypted into the write BIO before the records are written with one call, one frame
+     * when the send rate is limited or TLS writes to the socket directly
+     */
+    uint32_t batch_frames = (ctx->rate.rate > 0 || !ctx->mem_bio) ? 1 : APN_SSL_WRITE_BATCH / binary_message->size;
+    if (0 == batch_frames) {
+        batch_frames = 1;
+    } else if (batch_frames > APN_SEND_BATCH_FRAMES) {
+        batch_frames = APN_SEND_BATCH_FRAMES;
+    }
+    /* Token index of each frame of a batch and the end of its records among the encrypted bytes */
+    uint32_t batch_index[APN_SEND_BATCH_FRAMES];
+    size_t batch_end[APN_SEND_BATCH_FRAMES];
 
     uint32_t i = token_start_index;
-    for (; i < apn_array_count(tokens); i++) {
-        const char *token = (const char *) apn_array_item_at_index(tokens, i);
-        apn_binary_message_set_id(binary_message, i);
-        apn_binary_message_set_token_hex(binary_message, token);
+    while (i < token_end_index) {
+        if (__apn_prepare_binary_message(ctx, binary_message, tokens, id_base, i)) {
+            i++;
+            continue;
+        }
 
-        apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notificaton to device with token %s...", token);
+        if (ctx->rate.rate > 0) {
+            apn_rate_pace(ctx);
+        }
 
+        uint64_t write_start = apn_clock_us();
+        APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_WRITE_WAIT, id_base + i);
         do {
-            FD_ZERO(&write_set);
-            FD_ZERO(&read_set);
-            FD_SET(ctx->sock, &write_set);
-            FD_SET(ctx->sock, &read_set);
-            select_returned = select(ctx->sock + 1, &read_set, &write_set, NULL, &timeout);
-            apn_log(ctx, APN_LOG_LEVEL_DEBUG, "select() returned %d", select_returned);
-        } while (0 == select_returned || (0 > select_returned && EINTR == errno));
-
-        __APN_SELECT_ERROR(select_returned)
-        __API_SOCKET_READ(ctx, &read_set, apple_error_str, apple_returned_error, 1, i, invalid_token_index)
-
-        if (FD_ISSET(ctx->sock, &write_set)) {
-            apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Socket is ready for writing");
-            int bytes_written = apn_ssl_write(ctx, binary_message->message, binary_message->size);
-            if (0 >= bytes_written) {
-                char *error = apn_error_string(errno);
-                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to write data to a socket: %s (errno: %d)", error, errno);
-                free(error);
+            ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ | APN_TRANSPORT_WRITE, APN_SEND_POLL_TIMEOUT);
+            APN_STATS_INC(ctx, select_wakeups);
+            apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "Connection poll returned %d", ready);
+        } while (0 == ready);
+        APN_TRACE_END_SPAN(ctx, APN_TRACE_WRITE_WAIT, id_base + i, 0);
+        uint64_t writable_at = apn_clock_us();
+
+        __APN_POLL_ERROR(ready)
+        __API_SOCKET_READ(ctx, ready, apple_error_str, apple_returned_error, 1, id_base + i, error_id)
+
+        if (ready & APN_TRANSPORT_WRITE) {
+            apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "Socket is ready for writing");
+            uint32_t batch_start = i;
+            uint32_t frames = 0;
+            uint64_t bytes_written_total = 0;
+            uint8_t yielded = 0;
+            int errcode = 0;
+            apn_socket_cork(ctx);
+            uint64_t io_start = apn_clock_us();
+            for (; i < token_end_index && frames < batch_frames && !yielded; i++) {
+                if (i > batch_start && __apn_prepare_binary_message(ctx, binary_message, tokens, id_base, i)) {
+                    continue;
+                }
+                apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Sending notificaton to device with token %s...",
+                            (const char *) apn_array_item_at_index(tokens, i));
+                APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_WRITE, id_base + i);
+                int bytes_written = ctx->mem_bio ?
+                                    apn_ssl_encrypt(ctx, binary_message->message, binary_message->size) :
+                                    apn_ssl_write(ctx, binary_message->message, binary_message->size);
+                APN_TRACE_END_SPAN(ctx, APN_TRACE_WRITE, id_base + i, bytes_written > 0 ? bytes_written : 0);
+                if (0 >= bytes_written) {
+                    errcode = errno;
+                    break;
+                }
+                batch_index[frames] = i;
+                batch_end[frames] = apn_ssl_encrypted(ctx);
+                frames++;
+                bytes_written_total += (uint64_t) bytes_written;
+                yielded = ctx->yield && *ctx->yield && i + 1 < token_end_index;
+            }
+            size_t flushed = 0;
+            if (!errcode && ctx->mem_bio) {
+                io_start = apn_clock_us();
+                if (-1 == apn_ssl_flush(ctx, &flushed)) {
+                    errcode = errno;
+                }
+            }
+            if (errcode) {
+                char error[APN_ERROR_STRING_SIZE];
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to write data to a socket: %s (errno: %d)",
+                        apn_error_string_r(errcode, error, sizeof(error)), errcode);
+                if (__apn_read_error_response(ctx, apple_error_str, sizeof(apple_error_str))) {
+                    apple_returned_error = 1;
+                    break;
+                }
+                /* Frames whose records the transport took before the error are not written again */
+                uint32_t resume = batch_start;
+                for (uint32_t frame = 0; frame < frames && batch_end[frame] <= flushed; frame++) {
+                    resume = batch_index[frame] + 1;
+                }
+                *error_id = id_base + resume;
+                errno = errcode;
                 return APN_ERROR;
             }
-            apn_log(ctx, APN_LOG_LEVEL_DEBUG, "%d byte(s) has been written to a socket", bytes_written);
+            /* Time the socket was not writable, including waits while the records are written */
+            uint64_t blocked = writable_at - write_start + apn_clock_us() - io_start;
+            APN_STATS_ADD(ctx->stats.frames_sent, frames);
+            APN_STATS_ADD(ctx->stats.bytes_written, bytes_written_total);
+            APN_STATS_RECORD_SINCE(ctx, write_latency, write_start);
+            if (ctx->rate.rate > 0) {
+                apn_rate_sent(ctx, blocked);
+            }
+            apn_socket_sent(ctx, bytes_written_total, blocked);
+            apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "%u notification(s) have been written to a socket", frames);
+            if (yielded) {
+                apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "Yielding the connection after %u notification(s)",
+                            i - token_start_index);
+                ctx->yield_index = i;
+                break;
+            }
         }
-        apn_log(ctx, APN_LOG_LEVEL_INFO, "Notification has been sent");
     }
 
-    if (!apple_returned_error) {
-        timeout.tv_sec = 1;
+    apn_socket_uncork(ctx);
+    if (!apple_returned_error && !(ctx->options & APN_OPTION_ASYNC_ERRORS)) {
+        uint64_t wait_start = apn_clock_us();
+        APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_ERROR_WAIT, 0);
+        ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ, APN_ERROR_WAIT_TIMEOUT);
+        APN_STATS_INC(ctx, select_wakeups);
+        apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "Connection poll returned %d", ready);
+        APN_STATS_RECORD_SINCE(ctx, error_wait_latency, wait_start);
+        APN_TRACE_END_SPAN(ctx, APN_TRACE_ERROR_WAIT, 0, 0);
+
+        __APN_POLL_ERROR(ready)
+        __API_SOCKET_READ(ctx, ready, apple_error_str, apple_returned_error, 0, id_base + i, error_id)
+    }
+    if (apple_returned_error) {
+        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Parsing Apple response...", *apple_error_code);
+        __apn_parse_apns_error(apple_error_str, apple_error_code, error_id);
+        APN_TRACE(ctx, APN_TRACE_ERROR_RESPONSE, *error_id, *apple_error_code);
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Apple returned error code %d", *apple_error_code);
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
+#ifndef _WIN32
+/*
+ * Writes runs of consecutive frames not in the token store with one call, up to APN_SPOOL_CHUNK_SIZE bytes
+ * or one frame when the send rate is limited. On error `error_id` is the index of the first frame of the
+ * failed run or the identifier from the error response.
+ */
+static apn_return __apn_send_spool_frames(apn_ctx_t *const ctx, const apn_spool_t *const spool, uint32_t begin,
+                                          uint32_t end, uint8_t *apple_error_code, uint32_t *error_id) {
+    uint8_t apple_returned_error = 0;
+    int ready = 0;
+    char apple_error_str[6];
+    uint32_t chunk_frames = ctx->rate.rate > 0 ? 1 : APN_SPOOL_CHUNK_SIZE / spool->frame_size;
+
+    uint32_t i = begin;
+    while (i < end) {
+        if (ctx->token_store && apn_token_store_contains(ctx->token_store, spool->map + APN_SPOOL_FRAME_OFFSET(
+                spool, i) + APN_SPOOL_TOKEN_OFFSET, NULL)) {
+            apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Token of frame %u is in the token store, skipped", i);
+            APN_STATS_INC(ctx, tokens_suppressed);
+            i++;
+            continue;
+        }
+        uint32_t chunk_end = i + 1;
+        while (chunk_end < end && chunk_end - i < chunk_frames &&
+               !(ctx->token_store && apn_token_store_contains(ctx->token_store, spool->map + APN_SPOOL_FRAME_OFFSET(
+                       spool, chunk_end) + APN_SPOOL_TOKEN_OFFSET, NULL))) {
+            chunk_end++;
+        }
+
+        if (ctx->rate.rate > 0) {
+            apn_rate_pace(ctx);
+        }
+
+        uint64_t write_start = apn_clock_us();
+        APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_WRITE_WAIT, i);
         do {
-            FD_ZERO(&read_set);
-            FD_SET(ctx->sock, &read_set);
-            select_returned = select(ctx->sock + 1, &read_set, NULL, NULL, &timeout);
-            apn_log(ctx, APN_LOG_LEVEL_DEBUG, "select() returned %d", select_returned);
-        } while (0 > select_returned && EINTR == errno);
+            ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ | APN_TRANSPORT_WRITE, APN_SEND_POLL_TIMEOUT);
+            APN_STATS_INC(ctx, select_wakeups);
+        } while (0 == ready);
+        APN_TRACE_END_SPAN(ctx, APN_TRACE_WRITE_WAIT, i, 0);
+        uint64_t writable_at = apn_clock_us();
+
+        __APN_POLL_ERROR(ready)
+        __API_SOCKET_READ(ctx, ready, apple_error_str, apple_returned_error, 1, i, error_id)
+
+        if (ready & APN_TRANSPORT_WRITE) {
+            size_t offset = APN_SPOOL_FRAME_OFFSET(spool, i);
+            size_t length = (size_t) (chunk_end - i) * spool->frame_size;
+            apn_socket_cork(ctx);
+            uint64_t io_start = apn_clock_us();
+            APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_WRITE, i);
+            int bytes_written = ctx->ktls ?
+                                apn_ssl_sendfile(ctx, spool->fd, (off_t) offset, length) :
+                                apn_ssl_write(ctx, spool->map + offset, length);
+            APN_TRACE_END_SPAN(ctx, APN_TRACE_WRITE, i, bytes_written > 0 ? bytes_written : 0);
+            if (0 >= bytes_written) {
+                int errcode = errno;
+                char error[APN_ERROR_STRING_SIZE];
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to write data to a socket: %s (errno: %d)",
+                        apn_error_string_r(errcode, error, sizeof(error)), errcode);
+                if (__apn_read_error_response(ctx, apple_error_str, sizeof(apple_error_str))) {
+                    apple_returned_error = 1;
+                    break;
+                }
+                *error_id = i;
+                errno = errcode;
+                return APN_ERROR;
+            }
+            uint64_t blocked = writable_at - write_start + apn_clock_us() - io_start;
+            APN_STATS_ADD(ctx->stats.frames_sent, chunk_end - i);
+            APN_STATS_ADD(ctx->stats.bytes_written, bytes_written);
+            APN_STATS_RECORD_SINCE(ctx, write_latency, write_start);
+            if (ctx->rate.rate > 0) {
+                apn_rate_sent(ctx, blocked);
+            }
+            apn_socket_sent(ctx, (uint64_t) bytes_written, blocked);
+            apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "Frames %u - %u have been written to a socket", i, chunk_end - 1);
+            i = chunk_end;
+        }
+    }
 
-        __APN_SELECT_ERROR(select_returned)
-        __API_SOCKET_READ(ctx, &read_set, apple_error_str, apple_returned_error, 0, i, invalid_token_index)
+    apn_socket_uncork(ctx);
+    if (!apple_returned_error) {
+        uint64_t wait_start = apn_clock_us();
+        APN_TRACE_BEGIN_SPAN(ctx, APN_TRACE_ERROR_WAIT, 0);
+        ready = apn_ssl_poll(ctx, APN_TRANSPORT_READ, APN_ERROR_WAIT_TIMEOUT);
+        APN_STATS_INC(ctx, select_wakeups);
+        APN_STATS_RECORD_SINCE(ctx, error_wait_latency, wait_start);
+        APN_TRACE_END_SPAN(ctx, APN_TRACE_ERROR_WAIT, 0, 0);
+
+        __APN_POLL_ERROR(ready)
+        __API_SOCKET_READ(ctx, ready, apple_error_str, apple_returned_error, 0, i, error_id)
     }
     if (apple_returned_error) {
-        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Parsing Apple response...", *apple_error_code);
-        __apn_parse_apns_error(apple_error_str, apple_error_code, invalid_token_index);
+        __apn_parse_apns_error(apple_error_str, apple_error_code, error_id);
+        APN_TRACE(ctx, APN_TRACE_ERROR_RESPONSE, *error_id, *apple_error_code);
         apn_log(ctx, APN_LOG_LEVEL_ERROR, "Apple returned error code %d", *apple_error_code);
         return APN_ERROR;
     }
     return APN_SUCCESS;
 }
+#endif
+
+/*
+ * Handles an error response to a notification of an earlier call: reports an invalid token and, with
+ * APN_OPTION_RECONNECT, reopens the connection. Apple drops every notification written after the failed one,
+ * those of the pending call are sent again: from the next token for an invalid token or shutdown response to
+ * one of its notifications, all of them for a response to a call before it. A response read while they are sent
+ * again is handled the same way by the next iteration. Returns APN_SUCCESS with errno set to the error
+ * of the response if nothing was left unsent, APN_ERROR otherwise; the unsent ones are logged. With
+ * ctx->unsent_callback they are passed to it instead and only a connection that could not be reopened is
+ * an error.
+ */
+static apn_return __apn_pending_error(apn_ctx_t *const ctx, uint8_t apple_error_code, uint32_t id,
+                                      uint32_t *token_index) {
+    apn_binary_message_t *binary_message = ctx->pending_message;
+    ctx->pending_message = NULL;
+
+    for (;;) {
+        int errcode = apn_convert_apple_error(apple_error_code);
+        uint32_t index = id - ctx->pending_id_base;
+        apn_array_t *tokens = ctx->pending_tokens;
+        uint8_t pending = tokens && index >= ctx->pending_begin && index < ctx->pending_end;
+        uint8_t earlier = tokens && !pending && id < ctx->pending_id_base + ctx->pending_begin;
+        uint8_t resumable = errcode == APN_ERR_TOKEN_INVALID || errcode == APN_ERR_SERVICE_SHUTDOWN;
+
+        APN_TRACE(ctx, APN_TRACE_ERROR_RESPONSE, id, apple_error_code);
+
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Apple returned error code %d for previously sent notification (id: %u)",
+                apple_error_code, id);
+
+        if (pending) {
+            if (token_index) {
+                *token_index = index;
+            }
+            if (errcode == APN_ERR_TOKEN_INVALID) {
+                const char *const invalid_token = (const char *const) apn_array_item_at_index(tokens, index);
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Invalid token: %s (index: %u)", invalid_token, index);
+                __apn_store_invalid_token(ctx, invalid_token);
+                __apn_report_invalid_token(ctx, tokens, index);
+            }
+        }
+        if (errcode == APN_ERR_TOKEN_INVALID) {
+            APN_STATS_INC(ctx, invalid_tokens);
+        } else {
+            APN_STATS_INC(ctx, apple_errors);
+        }
+
+        uint32_t resume = ctx->pending_begin;
+        if (pending) {
+            resume = resumable ? index + 1 : index;
+        }
+        uint32_t end = ctx->pending_end;
+        uint32_t id_base = ctx->pending_id_base;
+        /* First notification dropped after the failed one, which is passed to ctx->unsent_callback on its own */
+        uint32_t dropped = pending ? index + 1 : resume;
+        /* Error of the failed notification if it was not reported above */
+        int rejected = pending && resumable ? 0 : errcode;
+        apn_close(ctx);
+
+        if (earlier) {
+            if (ctx->unsent_callback) {
+                __apn_unsent(ctx, id, rejected, id + 1, id_base + resume);
+                rejected = 0;
+            } else {
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Notifications with ids %u-%u were not sent again: they belong "
+                        "to an earlier call than the last one", id + 1, id_base + resume - 1);
+            }
+        }
+        if (ctx->options & APN_OPTION_RECONNECT) {
+            apn_log(ctx, APN_LOG_LEVEL_INFO, "Reconnecting...");
+            apn_count_reconnect(ctx, errcode);
+            if (APN_ERROR == apn_connect(ctx)) {
+                __apn_reconnect_failed(ctx);
+                if ((pending || earlier) && resume < end) {
+                    apn_log(ctx, APN_LOG_LEVEL_ERROR, "Notifications to tokens %u-%u were not sent", resume, end - 1);
+                    __apn_unsent(ctx, id, rejected, id_base + dropped, id_base + end);
+                }
+                if (binary_message) {
+                    apn_binary_message_free(binary_message);
+                }
+                return APN_ERROR;
+            }
+        }
+
+        if (!(pending || earlier) || resume >= end) {
+            if (binary_message) {
+                apn_binary_message_free(binary_message);
+            }
+            errno = errcode;
+            return pending ? APN_SUCCESS : APN_ERROR;
+        }
+        if (!ctx->ssl || (pending && !resumable)) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Notifications to tokens %u-%u were not sent", resume, end - 1);
+            __apn_unsent(ctx, id, rejected, id_base + dropped, id_base + end);
+            apn_binary_message_free(binary_message);
+            errno = errcode;
+            return ctx->unsent_callback && ctx->ssl ? APN_SUCCESS : APN_ERROR;
+        }
+
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notifications to tokens %u-%u again...", resume, end - 1);
+        volatile const uint32_t *yield = ctx->yield;
+        ctx->yield = NULL;
+        uint32_t sent_end = resume;
+        struct __apn_frames frames = {binary_message, tokens, id_base, NULL, 1, 0, 0};
+        apn_return ret = __apn_send_frames(ctx, &frames, resume, end, NULL, &sent_end);
+        ctx->yield = yield;
+        if (frames.apple_error_code) {
+            binary_message = frames.binary_message;
+            apple_error_code = frames.apple_error_code;
+            id = frames.error_id;
+            continue;
+        }
+        if (APN_ERROR == ret) {
+            __apn_unsent(ctx, id, rejected, id_base + sent_end, id_base + end);
+            return APN_ERROR;
+        }
+        errno = errcode;
+        return earlier && !ctx->unsent_callback ? APN_ERROR : APN_SUCCESS;
+    }
+}
+
+/* Passes notifications that are not sent again to ctx->unsent_callback if set, errno is kept */
+static void __apn_unsent(apn_ctx_t *const ctx, uint32_t id, int errcode, uint32_t begin_id, uint32_t end_id) {
+    if (!ctx->unsent_callback || (0 == errcode && begin_id >= end_id)) {
+        return;
+    }
+    int saved = errno;
+    ctx->unsent_callback(ctx->unsent_user, id, errcode, begin_id, end_id);
+    errno = saved;
+}
+
+/* Logs a failed reconnect after an error response, errno is kept */
+static void __apn_reconnect_failed(apn_ctx_t *const ctx) {
+    int errcode = errno;
+    char error[APN_ERROR_STRING_SIZE];
+    apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to reconnect: %s (errno: %d)",
+            apn_error_string_r(errcode, error, sizeof(error)), errcode);
+    errno = errcode;
+}
+
+/*
+ * Returns 1 if a send of `binary_message` to tokens from `begin` continues the pending call: same tokens array,
+ * identifiers and frames except token and identifier, starting where it ended. Errors of both are handled as
+ * one call, so ranges sent in chunks are sent again after a failed notification of any of them.
+ */
+static uint8_t __apn_pending_continued(const apn_ctx_t *const ctx, const apn_binary_message_t *const binary_message,
+                                       const apn_array_t *const tokens, uint32_t begin, uint32_t id_base) {
+    const apn_binary_message_t *pending = ctx->pending_message;
+    if (!pending || ctx->pending_tokens != tokens || ctx->pending_end != begin || ctx->pending_id_base != id_base
+        || pending->size != binary_message->size) {
+        return 0;
+    }
+    size_t token = (size_t) (binary_message->token_position - binary_message->message);
+    size_t id = (size_t) (binary_message->id_position - binary_message->message);
+    if (token != (size_t) (pending->token_position - pending->message)
+        || id != (size_t) (pending->id_position - pending->message)) {
+        return 0;
+    }
+    return 0 == memcmp(pending->message, binary_message->message, token)
+           && 0 == memcmp(pending->message + token + APN_TOKEN_BINARY_SIZE,
+                          binary_message->message + token + APN_TOKEN_BINARY_SIZE, id - token - APN_TOKEN_BINARY_SIZE)
+           && 0 == memcmp(pending->message + id + sizeof(uint32_t), binary_message->message + id + sizeof(uint32_t),
+                          binary_message->size - id - sizeof(uint32_t));
+}
 
 static apn_binary_message_t *__apn_payload_to_binary_message(const apn_ctx_t *const ctx,
                                                              const apn_payload_t *const payload) {
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Creating binary message from payload...");
     apn_binary_message_t *binary_message = apn_create_binary_message(payload);
     if (!binary_message) {
-        char *error = apn_error_string(errno);
-        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to create binary message: %s (errno: %d)", error, errno);
-        free(error);
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to create binary message: %s (errno: %d)",
+                apn_error_string_r(errno, error, sizeof(error)), errno);
         return NULL;
     }
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Binary message sucessfully created");
     return binary_message;
 }
 
-static int __apn_convert_apple_error(uint8_t apple_error_code) {
+int apn_convert_apple_error(uint8_t apple_error_code) {
     if (apple_error_code > 0) {
         switch (apple_error_code) {
             case APN_APNS_ERR_PROCESSING_ERROR:
@@ -803,3 +2400,87 @@ static int __apn_convert_apple_error(uint8_t apple_error_code) {
 static void __apn_invalid_token_dtor(char *const token) {
     free(token);
 }
+
+/* Passes a rejected token to the invalid token callback and to the sink */
+static void __apn_report_invalid_token(apn_ctx_t *const ctx, const apn_array_t *const tokens, uint32_t index) {
+    if (ctx->invalid_token_callback) {
+        ctx->invalid_token_callback((const char *) apn_array_item_at_index(tokens, index), index);
+    }
+    if (!ctx->invalid_tokens_sink) {
+        return;
+    }
+    if (ctx->invalid_batch_count > 0 && ctx->invalid_batch_tokens != tokens) {
+        __apn_invalid_tokens_flush(ctx);
+    }
+    ctx->invalid_batch_tokens = tokens;
+    ctx->invalid_batch[ctx->invalid_batch_count++] = index;
+    if (APN_INVALID_TOKENS_BATCH == ctx->invalid_batch_count) {
+        __apn_invalid_tokens_flush(ctx);
+    }
+}
+
+/* Passes collected indices to the sink, keeps errno */
+static void __apn_invalid_tokens_flush(apn_ctx_t *const ctx) {
+    if (0 == ctx->invalid_batch_count) {
+        return;
+    }
+    int errcode = errno;
+    uint32_t count = ctx->invalid_batch_count;
+    ctx->invalid_batch_count = 0;
+    if (ctx->invalid_tokens_sink) {
+        ctx->invalid_tokens_sink(ctx->invalid_batch_tokens, ctx->invalid_batch, count, ctx->invalid_tokens_user);
+    }
+    ctx->invalid_batch_tokens = NULL;
+    errno = errcode;
+}
+
+void apn_invalid_token(apn_ctx_t *const ctx, const apn_array_t *const tokens, uint32_t index) {
+    const char *const token = (const char *) apn_array_item_at_index(tokens, index);
+    apn_log(ctx, APN_LOG_LEVEL_ERROR, "Invalid token: %s (index: %u)", token, index);
+    APN_STATS_INC(ctx, invalid_tokens);
+    __apn_store_invalid_token(ctx, token);
+    __apn_report_invalid_token(ctx, tokens, index);
+}
+
+void apn_invalid_tokens_flush(apn_ctx_t *const ctx) {
+    __apn_invalid_tokens_flush(ctx);
+}
+
+static void __apn_store_invalid_token(apn_ctx_t *const ctx, const char *const token_hex) {
+#ifndef _WIN32
+    if (!ctx->token_store) {
+        return;
+    }
+    uint8_t token[APN_TOKEN_BINARY_SIZE];
+    apn_token_hex_to_binary_r(token_hex, token);
+    if (APN_ERROR == apn_token_store_add(ctx->token_store, token, (uint32_t) time(NULL))) {
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to add token to the token store: %s (errno: %d)",
+                apn_error_string_r(errno, error, sizeof(error)), errno);
+    }
+#else
+    (void) ctx;
+    (void) token_hex;
+#endif
+}
+
+void apn_count_reconnect(apn_ctx_t *const ctx, int errcode) {
+    APN_TRACE(ctx, APN_TRACE_RECONNECT, 0, errcode);
+    switch (errcode) {
+        case APN_ERR_TOKEN_INVALID:
+            APN_STATS_INC(ctx, reconnects_invalid_token);
+            break;
+        case APN_ERR_SERVICE_SHUTDOWN:
+            APN_STATS_INC(ctx, reconnects_shutdown);
+            apn_rate_shutdown(ctx);
+            break;
+        case APN_ERR_PROCESSING_ERROR:
+        case APN_ERR_INVALID_PAYLOAD_SIZE:
+        case APN_ERR_UNKNOWN:
+            APN_STATS_INC(ctx, reconnects_apple_error);
+            break;
+        default:
+            APN_STATS_INC(ctx, reconnects_io_error);
+            break;
+    }
+}
@@ -27,6 +27,8 @@
 #include "apn_binary_message.h"
 #include "apn_payload.h"
 #include "apn_array.h"
+#include "apn_stats.h"
+#include "apn_trace.h"
 
 #include <openssl/ssl.h>
 
@@ -40,6 +42,14 @@ typedef enum __apn_connection_mode {
     APN_MODE_SANDBOX = 1
 } apn_connection_mode;
 
+/** Protocol used to send notifications, see ::apn_set_protocol() */
+typedef enum __apn_protocol {
+    /** Legacy binary protocol (command 2), ports 2195 and 2196 */
+    APN_PROTOCOL_BINARY = 0,
+    /** HTTP/2 provider API, port 443 */
+    APN_PROTOCOL_HTTP2 = 1
+} apn_protocol;
+
 enum __apn_option {
     /**
      * Automatically establish new connection when connection is dropped.
@@ -50,7 +60,29 @@ enum __apn_option {
     /**
      * Print log messages to standard error
      */
-    APN_OPTION_LOG_STDERR = 1 << 2
+    APN_OPTION_LOG_STDERR = 1 << 2,
+    /**
+     * Do not wait for an error response after the last notification was written.
+     * ::apn_send() returns as soon as all notifications are written to a socket. An error response
+     * to these notifications is reported by the next call of ::apn_send() or ::apn_check_errors(), which
+     * send the notifications written after the failed one again. Those of a call before the last one
+     * cannot be sent again: the call which receives the response returns ::APN_ERROR.
+     * The tokens array passed to ::apn_send() is used by these calls and must stay alive until the next
+     * ::apn_send() or ::apn_check_errors() returns or the connection is closed; the payload is copied and can
+     * be freed as soon as ::apn_send() returns
+     */
+    APN_OPTION_ASYNC_ERRORS = 1 << 3,
+    /**
+     * Do not check that the certificate was issued for the connection mode (production or sandbox).
+     * Useful with a local server set by ::apn_set_gateway()
+     */
+    APN_OPTION_NO_CERT_MODE_CHECK = 1 << 4,
+    /**
+     * Hand TLS encryption to the kernel (Linux kTLS) after the handshake. The connection is made with TLS 1.2
+     * or later, preferring AES-GCM. Requires OpenSSL 3.0 built with kTLS and the `tls` kernel module;
+     * user-space TLS is used when either is unavailable. Lets ::apn_send_spool() send frames with sendfile()
+     */
+    APN_OPTION_KTLS = 1 << 5
 };
 
 typedef enum __apn_errors {
@@ -126,7 +158,28 @@ typedef enum __apn_errors {
     APN_ERR_SSL_INVALID_CERTIFICATE,
 
     /** Unknown error */
-    APN_ERR_UNKNOWN
+    APN_ERR_UNKNOWN,
+
+    /** No identity with the application id is registered in the pool. */
+    APN_ERR_APP_NOT_REGISTERED,
+
+    /** File is not a token store or is corrupted. */
+    APN_ERR_TOKEN_STORE_INVALID,
+
+    /** The library is built without HTTP/2 support. */
+    APN_ERR_HTTP2_NOT_SUPPORTED,
+
+    /** Unable to use specified authentication key to sign a provider token. */
+    APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY,
+
+    /** Topic is not set. It is required with token-based authentication. */
+    APN_ERR_TOPIC_IS_NOT_SET,
+
+    /** HTTP/2 session failed: the server violated the protocol or the session could not be created. */
+    APN_ERR_HTTP2_PROTOCOL_ERROR,
+
+    /** File is not a spool created by ::apn_spool_create() or is truncated. */
+    APN_ERR_SPOOL_INVALID
 
 } apn_errors;
 
@@ -142,11 +195,107 @@ typedef enum __apn_log_levels {
 typedef struct __apn_ctx_t apn_ctx_t;
 
 typedef void (*invalid_token_callback)(const char * const token, uint32_t index);
+
+/**
+ * Receives indices of tokens rejected by Apple as invalid, see ::apn_set_invalid_tokens_sink().
+ * `tokens` is the array passed to ::apn_send() which the indices refer to.
+ */
+typedef void (*apn_invalid_tokens_sink)(const apn_array_t * const tokens, const uint32_t * const indices,
+                                        uint32_t count, void *user);
+
 typedef void (*log_callback)(apn_log_levels level, const char * const log_message, uint32_t message_len);
 
+/**
+ * Tuple received from Apple Push Feedback Service
+ */
+typedef struct __apn_feedback_tuple_t {
+    /** Time (seconds since epoch) when the service determined that the application no longer exists on the device */
+    uint32_t timestamp;
+    /** Binary device token */
+    uint8_t token[32];
+} apn_feedback_tuple_t;
+
+typedef void (*apn_feedback_callback)(const apn_feedback_tuple_t *tuples, uint32_t count, void *user);
+
+/**
+ * Receives the response to a notification sent with ::APN_PROTOCOL_HTTP2, see ::apn_set_response_callback().
+ * `status` is the HTTP status, 200 if the notification was accepted. `reason` is the reason string of
+ * an error response, e.g. "BadDeviceToken", or NULL.
+ */
+typedef void (*apn_response_callback)(const apn_array_t * const tokens, uint32_t index, uint16_t status,
+                                      const char * const reason, void *user);
+
+/**
+ * Bitmap of invalid tokens, one bit per token of the array passed to ::apn_send(). Filled by
+ * ::apn_invalid_tokens_bitmap_sink(); the caller allocates `bits` and zeroes it before the send.
+ */
+typedef struct __apn_token_bitmap_t {
+    /** (size + 7) / 8 bytes, bit `i % 8` of byte `i / 8` is set if token `i` is invalid */
+    uint8_t *bits;
+    /** Number of bits, indices beyond it are ignored */
+    uint32_t size;
+} apn_token_bitmap_t;
+
+/** Presets of socket options, see ::apn_socket_profile_preset() */
+typedef enum __apn_socket_preset {
+    /** Options are left at system defaults */
+    APN_SOCKET_PRESET_DEFAULT = 0,
+    /** Large sends: 1 MiB send buffer grown by the autotuner up to 16 MiB, writes of a send are corked */
+    APN_SOCKET_PRESET_BULK = 1,
+    /** Small sends: Nagle's algorithm is disabled, at most 16 KiB of unsent data is queued in the kernel */
+    APN_SOCKET_PRESET_LOW_LATENCY = 2
+} apn_socket_preset;
+
+/**
+ * Socket options of a connection, see ::apn_set_socket_profile(). Zero fields leave options at system defaults
+ */
+typedef struct __apn_socket_profile_t {
+    /** Send buffer size (SO_SNDBUF), bytes */
+    uint32_t send_buffer;
+    /**
+     * Upper bound of the send buffer autotuner, bytes. Once a second the send buffer is doubled if the socket
+     * was not writable for more than a quarter of the second and the buffer is smaller than four
+     * bandwidth-delay products (throughput times RTT reported by `TCP_INFO`). 0 disables the autotuner
+     */
+    uint32_t send_buffer_max;
+    /** Socket is not writable while more than this number of bytes is not sent (TCP_NOTSENT_LOWAT) */
+    uint32_t notsent_lowat;
+    /** Idle time before the first TCP keepalive probe, seconds. 0 disables keepalive */
+    uint32_t keepalive_idle;
+    /** Time between keepalive probes, seconds */
+    uint32_t keepalive_interval;
+    /** Number of unanswered probes after which the connection is dropped */
+    uint32_t keepalive_count;
+    /** Disable Nagle's algorithm (TCP_NODELAY) */
+    uint8_t nodelay;
+    /**
+     * Cork the connection (TCP_CORK, TCP_NOPUSH on BSD) while notifications of one send are written, so only
+     * full segments are sent. The connection is uncorked before waiting for an error response.
+     * Ignored when the send rate is limited, see ::apn_set_adaptive_rate()
+     */
+    uint8_t cork;
+} apn_socket_profile_t;
+
+/**
+ * Initializes the library: OpenSSL and, on Windows, Winsock.
+ *
+ * Threading model: initialization runs exactly once, so this function can be called from several
+ * threads concurrently; ::apn_init() calls it as well. After that any number of threads can use the library
+ * at the same time as long as each `ctx` is used by one thread at a time. There is no global state
+ * touched by ::apn_send(): errors are reported through thread-local `errno` and per context with
+ * ::apn_last_error(), and SIGPIPE is suppressed per socket rather than by changing the process signal handler.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
 __apn_export__ apn_return apn_library_init()
         __apn_attribute_warn_unused_result__;
 
+/**
+ * Releases resources allocated by ::apn_library_init(). Must be called once, after all contexts are freed
+ * and no other thread uses the library. The library cannot be initialized again afterwards.
+ */
 __apn_export__ void apn_library_free();
 
 /**
@@ -202,6 +351,20 @@ __apn_export__ apn_ctx_t *apn_init()
  */
 __apn_export__ void apn_free(apn_ctx_t *ctx);
 
+/**
+ * Returns error code of the last ::apn_connect(), ::apn_send(), ::apn_check_errors(),
+ * ::apn_feedback_connect() or ::apn_feedback() call on a `ctx`, 0 if that call succeeded.
+ *
+ * Unlike `errno`, the value is kept with the context and is not overwritten by calls on other contexts
+ * or by unrelated system calls.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ *
+ * @return Error code, see ::apn_error_string()
+ */
+__apn_export__ int apn_last_error(const apn_ctx_t * const ctx)
+        __apn_attribute_nonnull__((1));
+
 /**
  * Opens Apple Push Notification Service connection.
  *
@@ -245,6 +408,146 @@ __apn_export__ void apn_close(apn_ctx_t * const ctx)
 __apn_export__ void apn_set_mode(apn_ctx_t * const ctx, apn_connection_mode mode)
         __apn_attribute_nonnull__((1));
 
+/**
+ * Sets protocol used by ::apn_connect() and ::apn_send().
+ *
+ * ::APN_PROTOCOL_HTTP2 connects to api.push.apple.com or api.sandbox.push.apple.com, port 443, and sends
+ * notifications as requests of one HTTP/2 connection: hundreds of them are in flight at once and each gets its
+ * own response. An invalid token fails only its own request, so the connection is never reopened because of it.
+ * ::APN_OPTION_ASYNC_ERRORS has no effect: ::apn_send() returns when all responses are received.
+ * The feedback service is available with the binary protocol only.
+ *
+ * Default protocol is ::APN_PROTOCOL_BINARY
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] protocol - Protocol.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR with `errno` set to ::APN_ERR_HTTP2_NOT_SUPPORTED if the library is built without HTTP/2.
+ */
+__apn_export__ apn_return apn_set_protocol(apn_ctx_t * const ctx, apn_protocol protocol)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets a key used for token-based authentication with ::APN_PROTOCOL_HTTP2. The connection is established
+ * without a client certificate and each request carries a provider token (JWT signed with ES256). The token is
+ * cached and signed again every 50 minutes or when Apple reports it as expired. The server is verified before
+ * the token is sent, see ::apn_set_ca_file().
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] key_file - Path to the authentication key (.p8 file). NULL - use certificate-based authentication.
+ * @param[in] key_id - Key identifier (10 characters), obtained from the developer account.
+ * @param[in] team_id - Team identifier (10 characters), obtained from the developer account.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_set_auth_key(apn_ctx_t * const ctx, const char * const key_file,
+                                           const char * const key_id, const char * const team_id)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets certificates of the authorities which the server is verified against with token-based authentication,
+ * see ::apn_set_auth_key(). The provider token can send notifications to every application of the team, so it
+ * is sent only after the certificate chain of the server and its host name are verified; the trusted
+ * certificates of the system are used by default. Useful with a local server set by ::apn_set_gateway().
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] ca_file - Path to a PEM file with one or more certificates. NULL - use those of the system.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_set_ca_file(apn_ctx_t * const ctx, const char * const ca_file)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets topic of notifications sent with ::APN_PROTOCOL_HTTP2, usually the bundle id of the application.
+ * Required with token-based authentication; with a certificate Apple uses the certificate subject if not set.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] topic - Topic. NULL - do not send a topic.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_set_topic(apn_ctx_t * const ctx, const char * const topic)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets a callback which receives the response to every notification sent with ::APN_PROTOCOL_HTTP2,
+ * including accepted ones. Invalid tokens are reported to ::apn_set_invalid_tokens_sink() as well.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] callback - Callback. NULL - do not report responses.
+ * @param[in] user - Pointer passed to `callback`.
+ */
+__apn_export__ void apn_set_response_callback(apn_ctx_t * const ctx, apn_response_callback callback, void *user)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets Apple Push Notification Service host and port used instead of the Apple's gateway selected by
+ * the connection mode, e.g. a local server for load testing.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] host - Host name or IP address. NULL - use the Apple's gateway.
+ * @param[in] port - Port.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_set_gateway(apn_ctx_t * const ctx, const char * const host, uint16_t port)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets Apple Push Feedback Service host and port used instead of the Apple's feedback service selected by
+ * the connection mode.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] host - Host name or IP address. NULL - use the Apple's feedback service.
+ * @param[in] port - Port.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_set_feedback_server(apn_ctx_t * const ctx, const char * const host, uint16_t port)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets time to live of resolved Apple Push Notification/Feedback Service addresses.
+ *
+ * Resolved addresses are cached in a `ctx` and reused by subsequent connections until cache expires,
+ * so reconnects skip DNS resolution. Default is 300 seconds.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] ttl - Time to live in seconds. 0 - disable cache.
+ */
+__apn_export__ void apn_set_address_cache_ttl(apn_ctx_t * const ctx, uint32_t ttl)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets idle timeout of a connection to Apple Push Notification Service (binary protocol).
+ *
+ * Apple and middleboxes drop idle connections, often silently. Before a send, a connection idle for longer than
+ * the timeout is closed and opened again. A connection idle for at least a second is probed with a non-blocking
+ * read: if the peer has closed it or sent an error response, it is reopened before the first notification is
+ * written rather than after a failed write. Reconnects require ::APN_OPTION_RECONNECT; without it, the send
+ * fails on a closed connection before anything is written. They are reported as
+ * `reconnects_idle` and `reconnects_stale` by ::apn_stats(). TCP keepalive is set by ::apn_set_socket_profile().
+ * Default is 600 seconds.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] timeout - Timeout in seconds. 0 - never recycle idle connections, probing is still done.
+ */
+__apn_export__ void apn_set_idle_timeout(apn_ctx_t * const ctx, uint32_t timeout)
+        __apn_attribute_nonnull__((1));
+
 /**
  * Set the log level.
  *
@@ -263,9 +566,36 @@ __apn_export__ void apn_set_log_level(apn_ctx_t * const ctx, uint16_t level)
 __apn_export__ void apn_set_log_callback(apn_ctx_t *const ctx, log_callback funct)
         __apn_attribute_nonnull__((1,2));
 
+/**
+ * Sets a function called for every token rejected by Apple as invalid, whether or not `invalid_tokens` is
+ * passed to ::apn_send().
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] funct An invalid token callback with a compatible signature.
+ */
 __apn_export__ void apn_set_invalid_token_callback(apn_ctx_t *const ctx, invalid_token_callback funct)
         __apn_attribute_nonnull__((1,2));
 
+/**
+ * Sets a sink for tokens rejected by Apple as invalid. Unlike ::apn_set_invalid_token_callback() and the
+ * `invalid_tokens` array of ::apn_send(), indices are collected without allocation and passed to the sink in
+ * batches, at the latest before ::apn_send() or ::apn_check_errors() returns.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] sink - Sink function. NULL - do not collect indices.
+ * @param[in] user - Pointer passed to `sink`.
+ */
+__apn_export__ void apn_set_invalid_tokens_sink(apn_ctx_t *const ctx, apn_invalid_tokens_sink sink, void *user)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sink which sets bits of the ::apn_token_bitmap_t passed as `user`: one bit per token instead of a copy of each
+ * invalid token. Bits are set atomically, so one bitmap can be shared by several contexts sending one array.
+ */
+__apn_export__ void apn_invalid_tokens_bitmap_sink(const apn_array_t * const tokens, const uint32_t * const indices,
+                                                   uint32_t count, void *user)
+        __apn_attribute_nonnull__((2, 4));
+
 /**
  * Sets path to an SSL certificate which will be used to establish secure connection.
  *
@@ -313,6 +643,100 @@ __apn_export__ void apn_set_behavior(apn_ctx_t * const ctx, uint32_t options)
 __apn_export__ uint32_t apn_behavior(const apn_ctx_t *const ctx)
     __apn_attribute_nonnull__((1));
 
+/**
+ * Enables the adaptive send-rate controller (AIMD).
+ *
+ * Notifications are paced at the current rate. Once a second the rate is increased by 250 notifications
+ * per second if the connection sent at the full rate without congestion, and multiplied by 0.7 if
+ * the socket was not writable for more than half of the second or the RTT doubled. A "shutdown" error
+ * response halves the rate. The current rate is reported as `send_rate` by ::apn_stats().
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] initial_rate - Initial rate, notifications per second. 0 disables the controller.
+ * @param[in] max_rate - Maximum rate, notifications per second. 0 for no limit.
+ */
+__apn_export__ void apn_set_adaptive_rate(apn_ctx_t * const ctx, uint32_t initial_rate, uint32_t max_rate)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Fills a socket profile with options of a preset.
+ *
+ * @param[out] profile - Pointer to a profile. Cannot be NULL.
+ * @param[in] preset - Preset.
+ */
+__apn_export__ void apn_socket_profile_preset(apn_socket_profile_t * const profile, apn_socket_preset preset)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets socket options of connections of a `ctx`. Options are set on every new socket before it is
+ * connected, and on the current one if a `ctx` is connected. The send buffer size as reported by
+ * the kernel is `send_buffer` of ::apn_stats(). Options are ignored with a transport set by ::apn_set_transport().
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] profile - Pointer to a profile, copied. NULL restores system defaults for new connections.
+ *
+ * @return ::APN_SUCCESS on success, otherwise ::APN_ERROR with errno set to EINVAL if
+ * `send_buffer_max` is less than `send_buffer`.
+ */
+__apn_export__ apn_return apn_set_socket_profile(apn_ctx_t * const ctx, const apn_socket_profile_t * const profile)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Takes a snapshot of counters and latency histograms of a `ctx`.
+ *
+ * Stats are collected all the time, updates are relaxed atomic increments. A snapshot can be taken
+ * while another thread sends using the same `ctx`; each field is consistent on its own.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[out] stats - Pointer to a structure to store the snapshot in. Cannot be NULL.
+ */
+__apn_export__ void apn_stats(const apn_ctx_t * const ctx, apn_stats_t * const stats)
+        __apn_attribute_nonnull__((1,2));
+
+/**
+ * Resets all counters and histograms of a `ctx` to zero.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ */
+__apn_export__ void apn_stats_reset(apn_ctx_t * const ctx)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Enables trace recorder of a `ctx`.
+ *
+ * Send pipeline events (resolve, connect, handshake, socket waits, writes, error responses) are recorded
+ * into a ring buffer of fixed-size events; when the ring is full the oldest events are overwritten.
+ * Recording an event costs a clock read and a 24-byte store. Enabling tracing again discards recorded events.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] capacity - Number of events to keep, rounded up to a power of two.
+ * ::APN_TRACE_DEFAULT_CAPACITY if 0.
+ *
+ * @return ::APN_SUCCESS on success, otherwise ::APN_ERROR with errno set.
+ */
+__apn_export__ apn_return apn_trace_enable(apn_ctx_t * const ctx, uint32_t capacity)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Disables trace recorder of a `ctx` and frees recorded events.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ */
+__apn_export__ void apn_trace_disable(apn_ctx_t * const ctx)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Writes recorded events to a file, see ::apn_trace_file_header_t for the format.
+ * The file can be converted to Chrome trace-event JSON with apn-trace2json.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] path - Path to file. Cannot be NULL.
+ *
+ * @return ::APN_SUCCESS on success, otherwise ::APN_ERROR with errno set.
+ */
+__apn_export__ apn_return apn_trace_dump(const apn_ctx_t * const ctx, const char * const path)
+        __apn_attribute_nonnull__((1, 2));
+
 /**
  * Returns the connection mode.
  *
@@ -368,6 +792,9 @@ __apn_export__ const char *apn_private_key_pass(const apn_ctx_t * const ctx)
  * @param[in] payload - Pointer to `payload` structure. Cannot be NULL.
  * @param[in, out] invalid_tokens - Array of invalid tokens. Each item is string.
  *
+ * With ::APN_PROTOCOL_HTTP2 notifications rejected for another reason than an invalid token do not stop
+ * sending: the others are still sent and the error of the last rejected one is returned.
+ *
  * @return
  *      - ::APN_SUCCESS on success.
  *      - ::APN_ERROR on failure with error information stored in `errno`.
@@ -375,6 +802,29 @@ __apn_export__ const char *apn_private_key_pass(const apn_ctx_t * const ctx)
 __apn_export__ apn_return apn_send(apn_ctx_t * const ctx, const apn_payload_t *payload, apn_array_t *tokens, apn_array_t **invalid_tokens)
         __apn_attribute_nonnull__((1,2,3));
 
+/**
+ * Checks whether Apple Push Notification Service returned an error response to notifications
+ * sent by the last call of ::apn_send() with ::APN_OPTION_ASYNC_ERRORS option.
+ *
+ * The tokens array passed to that ::apn_send() call must not be freed until this function is called or
+ * the connection is closed. If the error is caused by an invalid token, the invalid token callback is called.
+ * The connection is closed when an error response is received and re-established if
+ * ::APN_OPTION_RECONNECT option is set.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] timeout - Time in milliseconds to wait for an error response. 0 - do not wait.
+ * @param[out] token_index - Index of the token the error response refers to. Can be NULL.
+ * For ::APN_ERR_TOKEN_INVALID and ::APN_ERR_SERVICE_SHUTDOWN notifications to all tokens after this
+ * index were not delivered. They are sent again over the new connection and are checked by the next call.
+ *
+ * @return
+ *      - ::APN_SUCCESS if no error response was received.
+ *      - ::APN_ERROR on failure or error response with error information stored in `errno`. If the
+ *      notifications after the failed one could not be sent again, `errno` is the reason.
+ */
+__apn_export__ apn_return apn_check_errors(apn_ctx_t * const ctx, uint32_t timeout, uint32_t *token_index)
+        __apn_attribute_nonnull__((1));
+
 /**
  * Opens Apple Push Feedback Service connection.
  *
@@ -390,6 +840,8 @@ __apn_export__ apn_return apn_feedback_connect(apn_ctx_t * const ctx)
 /**
  * Returns array of device tokens which no longer exists.
  *
+ * The context is not const: the read buffer, the connection state and the last error are kept in it.
+ *
  * @param[in] ctx - Pointer to an initialized `::apn_ctx` structure. Cannot be NULL.
  * @param[in, out] tokens_array - Pointer to a device tokens array. The array should be freed - call ::apn_array_free()
  * function for it.
@@ -398,12 +850,54 @@ __apn_export__ apn_return apn_feedback_connect(apn_ctx_t * const ctx)
  *      - ::APN_SUCCESS on success.
  *      - ::APN_ERROR on failure with error information stored in `errno`.
  */
-__apn_export__ apn_return apn_feedback(const apn_ctx_t * const ctx, apn_array_t **tokens)
+__apn_export__ apn_return apn_feedback(apn_ctx_t * const ctx, apn_array_t **tokens)
         __apn_attribute_nonnull__((1, 2));
 
+/**
+ * Reads all tuples sent by Apple Push Feedback Service and passes them to `callback` in batches.
+ * Many tuples are parsed from each read, so a large backlog is drained at the speed of the network.
+ * Returns when the service closes the connection or nothing is received during `timeout`.
+ *
+ * @param[in] ctx - Pointer to an initialized `::apn_ctx` structure connected by ::apn_feedback_connect().
+ * Cannot be NULL.
+ * @param[in] callback - Function called for every batch of tuples. Tuples are valid only during the call.
+ * Cannot be NULL.
+ * @param[in] user - Pointer passed to `callback`.
+ * @param[in] timeout - Time in milliseconds to wait for data before the reading is finished.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`. Batches read before the failure
+ *      were passed to `callback`.
+ */
+__apn_export__ apn_return apn_feedback_read(apn_ctx_t * const ctx, apn_feedback_callback callback, void *user,
+                                            uint32_t timeout)
+        __apn_attribute_nonnull__((1, 2));
 
+/**
+ * Returns error message for an error code.
+ *
+ * @param[in] err_code - Error code, library or system errno.
+ *
+ * @return Pointer to NULL-terminated string. Returned string must be freed.
+ */
 __apn_export__ char *apn_error_string(int err_code);
 
+/** Size of a buffer enough to hold any message returned by ::apn_error_string_r() */
+#define APN_ERROR_STRING_SIZE 256
+
+/**
+ * Returns error message for an error code without allocating memory.
+ *
+ * @param[in] err_code - Error code, library or system errno.
+ * @param[in] buffer - Buffer for system error messages, ::APN_ERROR_STRING_SIZE bytes is enough.
+ * @param[in] buffer_size - Size of `buffer`.
+ *
+ * @return Pointer to NULL-terminated string, either a constant string or `buffer`. Must not be freed.
+ */
+__apn_export__ const char *apn_error_string_r(int err_code, char * const buffer, size_t buffer_size)
+        __apn_attribute_nonnull__((2));
+
 #ifdef __cplusplus
 }
 #endif
@@ -134,6 +134,20 @@ void apn_array_remove(apn_array_t *const array, uint32_t index) {
     array->items[index] = NULL;
 }
 
+uint32_t apn_array_compact(apn_array_t *const array) {
+    uint32_t i = 0;
+    uint32_t count = 0;
+    assert(array);
+
+    for (; i < array->count; i++) {
+        if (array->items[i]) {
+            array->items[count++] = array->items[i];
+        }
+    }
+    array->count = count;
+    return count;
+}
+
 apn_array_t *apn_array_copy(const apn_array_t *const array) {
     apn_array_t *dst = NULL;
     uint32_t i = 0;
@@ -58,6 +58,10 @@ __apn_export__ void * apn_array_item_at_index(const apn_array_t * const array, u
 __apn_export__ void apn_array_remove(apn_array_t * const array, uint32_t index)
         __apn_attribute_nonnull__((1));
 
+/** Drops items set to NULL by apn_array_remove(), the order of remaining items is kept. Returns new count */
+__apn_export__ uint32_t apn_array_compact(apn_array_t * const array)
+        __apn_attribute_nonnull__((1));
+
 #ifdef	__cplusplus
 }
 #endif
@@ -0,0 +1,816 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * HTTP/2 provider API transport. Each notification is a POST /3/device/<token> request on one multiplexed
+ * connection; the nghttp2 session is fed with data read from ctx->ssl and writes through it.
+ */
+
+#include "apn_http2.h"
+#include "apn_private.h"
+#include "apn_paload_private.h"
+#include "apn_strings.h"
+#include "apn_tokens.h"
+#include "apn_log.h"
+#include "apn_stats_private.h"
+#include "apn_trace_private.h"
+#include "src/jansson.h"
+
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/time.h>
+#endif
+
+#include <nghttp2/nghttp2.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ecdsa.h>
+
+#define APN_HTTP2_PATH_PREFIX "/3/device/"
+#define APN_HTTP2_PAYLOAD_MAX_SIZE 4096
+#define APN_HTTP2_READ_BUFFER_SIZE (16 * 1024)
+/* Error response body is {"reason":"..."}, with "timestamp" for 410 */
+#define APN_HTTP2_RESPONSE_SIZE 128
+/* Apple accepts a provider token for one hour and rejects tokens refreshed more often than every 20 minutes */
+#define APN_HTTP2_JWT_TTL (50 * 60)
+/* A token reported as expired is signed again only if it was issued at least this long ago */
+#define APN_HTTP2_JWT_MIN_AGE 60
+#define APN_HTTP2_JWT_SIZE 512
+
+struct __apn_http2_stream {
+    int32_t stream_id;
+    uint32_t index;
+    uint32_t jwt_generation;
+    uint32_t body_offset;
+    uint64_t submitted;
+    uint16_t status;
+    uint8_t in_use;
+    uint32_t response_length;
+    char response[APN_HTTP2_RESPONSE_SIZE];
+};
+
+struct __apn_http2 {
+    nghttp2_session *session;
+    char *authority;
+    uint8_t goaway;
+    uint8_t write_blocked;
+    int io_error;
+    apn_http2_response_handler handler;
+    void *handler_user;
+
+    uint32_t in_flight;
+    uint32_t free_count;
+    uint32_t free_slots[APN_HTTP2_MAX_STREAMS];
+    struct __apn_http2_stream streams[APN_HTTP2_MAX_STREAMS];
+
+    /* Request body and headers shared by the requests of one apn_send() */
+    char *body;
+    size_t body_length;
+    char expiration[24];
+    char priority[4];
+    const char *push_type;
+
+    /* Provider token, signed with `key` */
+    EVP_PKEY *key;
+    char authorization[sizeof("bearer ") + APN_HTTP2_JWT_SIZE];
+    time_t jwt_issued;
+    uint32_t jwt_generation;
+
+    uint8_t read_buffer[APN_HTTP2_READ_BUFFER_SIZE];
+};
+
+static void __apn_http2_reset_streams(struct __apn_http2 *const http2) {
+    http2->in_flight = 0;
+    http2->free_count = APN_HTTP2_MAX_STREAMS;
+    for (uint32_t i = 0; i < APN_HTTP2_MAX_STREAMS; i++) {
+        http2->streams[i].in_use = 0;
+        http2->free_slots[i] = APN_HTTP2_MAX_STREAMS - 1 - i;
+    }
+}
+
+static void __apn_http2_release(struct __apn_http2 *const http2, struct __apn_http2_stream *const stream) {
+    if (http2->session && stream->stream_id > 0) {
+        nghttp2_session_set_stream_user_data(http2->session, stream->stream_id, NULL);
+    }
+    stream->in_use = 0;
+    http2->free_slots[http2->free_count++] = (uint32_t) (stream - http2->streams);
+    http2->in_flight--;
+}
+
+static size_t __apn_http2_base64url(const uint8_t *const data, size_t length, char *const out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    size_t j = 0;
+    size_t i = 0;
+    for (; i + 2 < length; i += 3) {
+        uint32_t triple = ((uint32_t) data[i] << 16) | ((uint32_t) data[i + 1] << 8) | data[i + 2];
+        out[j++] = alphabet[(triple >> 18) & 0x3f];
+        out[j++] = alphabet[(triple >> 12) & 0x3f];
+        out[j++] = alphabet[(triple >> 6) & 0x3f];
+        out[j++] = alphabet[triple & 0x3f];
+    }
+    if (i < length) {
+        uint32_t triple = (uint32_t) data[i] << 16;
+        if (i + 1 < length) {
+            triple |= (uint32_t) data[i + 1] << 8;
+        }
+        out[j++] = alphabet[(triple >> 18) & 0x3f];
+        out[j++] = alphabet[(triple >> 12) & 0x3f];
+        if (i + 1 < length) {
+            out[j++] = alphabet[(triple >> 6) & 0x3f];
+        }
+    }
+    out[j] = '\0';
+    return j;
+}
+
+static apn_return __apn_http2_load_key(apn_ctx_t *const ctx) {
+    struct __apn_http2 *http2 = ctx->http2;
+    if (http2->key) {
+        return APN_SUCCESS;
+    }
+    if (!ctx->auth_key_id || !ctx->auth_team_id) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Key id and team id must be set with an authentication key");
+        errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY;
+        return APN_ERROR;
+    }
+    FILE *key_file = fopen(ctx->auth_key_file, "r");
+    if (!key_file) {
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to open file %s: %s (errno: %d)",
+                ctx->auth_key_file, apn_error_string_r(errno, error, sizeof(error)), errno);
+        errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY;
+        return APN_ERROR;
+    }
+    EVP_PKEY *key = PEM_read_PrivateKey(key_file, NULL, NULL, NULL);
+    fclose(key_file);
+    if (!key || EVP_PKEY_id(key) != EVP_PKEY_EC) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified authentication key: %s is not a PEM EC key",
+                ctx->auth_key_file);
+        EVP_PKEY_free(key);
+        errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY;
+        return APN_ERROR;
+    }
+    http2->key = key;
+    return APN_SUCCESS;
+}
+
+/* ES256 signature of `input`: raw r || s, 32 bytes each */
+static apn_return __apn_http2_sign(EVP_PKEY *const key, const char *const input, uint8_t *const signature) {
+    uint8_t der[128];
+    size_t der_length = sizeof(der);
+    apn_return ret = APN_ERROR;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    EVP_MD_CTX *md_ctx = EVP_MD_CTX_create();
+#else
+    EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+#endif
+    if (!md_ctx) {
+        return APN_ERROR;
+    }
+    if (1 == EVP_DigestSignInit(md_ctx, NULL, EVP_sha256(), NULL, key)
+        && 1 == EVP_DigestSignUpdate(md_ctx, input, strlen(input))
+        && 1 == EVP_DigestSignFinal(md_ctx, der, &der_length)) {
+        const uint8_t *p = der;
+        ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &p, (long) der_length);
+        if (sig) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+            const BIGNUM *r = sig->r;
+            const BIGNUM *s = sig->s;
+#else
+            const BIGNUM *r = NULL;
+            const BIGNUM *s = NULL;
+            ECDSA_SIG_get0(sig, &r, &s);
+#endif
+            int r_length = BN_num_bytes(r);
+            int s_length = BN_num_bytes(s);
+            if (r_length <= 32 && s_length <= 32) {
+                memset(signature, 0, 64);
+                BN_bn2bin(r, signature + 32 - r_length);
+                BN_bn2bin(s, signature + 64 - s_length);
+                ret = APN_SUCCESS;
+            }
+            ECDSA_SIG_free(sig);
+        }
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    EVP_MD_CTX_destroy(md_ctx);
+#else
+    EVP_MD_CTX_free(md_ctx);
+#endif
+    return ret;
+}
+
+/* Signs a new provider token if there is none or the cached one is about to expire */
+static apn_return __apn_http2_jwt(apn_ctx_t *const ctx) {
+    struct __apn_http2 *http2 = ctx->http2;
+    time_t now = time(NULL);
+    if (http2->jwt_issued > 0 && now - http2->jwt_issued < APN_HTTP2_JWT_TTL) {
+        return APN_SUCCESS;
+    }
+
+    /* base64url of header and claims (128 bytes each at most), two dots and 86 bytes of signature fit */
+    char json[128];
+    char input[APN_HTTP2_JWT_SIZE];
+    uint8_t signature[64];
+
+    int length = snprintf(json, sizeof(json), "{\"alg\":\"ES256\",\"kid\":\"%s\"}", ctx->auth_key_id);
+    if (length <= 0 || (size_t) length >= sizeof(json)) {
+        errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY;
+        return APN_ERROR;
+    }
+    size_t input_length = __apn_http2_base64url((const uint8_t *) json, (size_t) length, input);
+    input[input_length++] = '.';
+
+    length = snprintf(json, sizeof(json), "{\"iss\":\"%s\",\"iat\":%lld}", ctx->auth_team_id, (long long) now);
+    if (length <= 0 || (size_t) length >= sizeof(json)) {
+        errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY;
+        return APN_ERROR;
+    }
+    input_length += __apn_http2_base64url((const uint8_t *) json, (size_t) length, input + input_length);
+
+    if (APN_ERROR == __apn_http2_sign(http2->key, input, signature)) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to sign provider token with key %s", ctx->auth_key_file);
+        errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_AUTH_KEY;
+        return APN_ERROR;
+    }
+    input[input_length++] = '.';
+    __apn_http2_base64url(signature, sizeof(signature), input + input_length);
+
+    snprintf(http2->authorization, sizeof(http2->authorization), "bearer %s", input);
+    http2->jwt_issued = now;
+    http2->jwt_generation++;
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "Provider token has been signed (key id: %s, team id: %s)", ctx->auth_key_id,
+            ctx->auth_team_id);
+    return APN_SUCCESS;
+}
+
+/*
+ * Returns 1 if a request rejected with ExpiredProviderToken should be sent again: it carried an older token
+ * than the current one, or the current one is old enough to be signed again
+ */
+static uint8_t __apn_http2_token_expired(apn_ctx_t *const ctx, const struct __apn_http2_stream *const stream) {
+    struct __apn_http2 *http2 = ctx->http2;
+    if (stream->jwt_generation != http2->jwt_generation) {
+        return 1;
+    }
+    if (time(NULL) - http2->jwt_issued >= APN_HTTP2_JWT_MIN_AGE) {
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Provider token has expired");
+        http2->jwt_issued = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Copies the "reason" member of an error response body to `reason` */
+static const char *__apn_http2_reason(const struct __apn_http2_stream *const stream, char *const reason,
+                                      size_t reason_size) {
+    json_t *root = json_loadb(stream->response, stream->response_length, 0, NULL);
+    const char *value = root ? json_string_value(json_object_get(root, "reason")) : NULL;
+    if (value) {
+        snprintf(reason, reason_size, "%s", value);
+    }
+    json_decref(root);
+    return value ? reason : NULL;
+}
+
+static void __apn_http2_finish(apn_ctx_t *const ctx, struct __apn_http2_stream *const stream) {
+    struct __apn_http2 *http2 = ctx->http2;
+    char reason_buffer[APN_HTTP2_RESPONSE_SIZE];
+    const char *reason = NULL;
+    uint16_t status = stream->status;
+    uint32_t index = stream->index;
+
+    if (status > 0) {
+        APN_STATS_RECORD_SINCE(ctx, response_latency, stream->submitted);
+        if (status != 200) {
+            APN_TRACE(ctx, APN_TRACE_ERROR_RESPONSE, index, status);
+            if (stream->response_length > 0) {
+                reason = __apn_http2_reason(stream, reason_buffer, sizeof(reason_buffer));
+            }
+            if (403 == status && reason && 0 == strcmp(reason, "ExpiredProviderToken")
+                && __apn_http2_token_expired(ctx, stream)) {
+                status = 0;
+                reason = NULL;
+            }
+        }
+    }
+    __apn_http2_release(http2, stream);
+    if (http2->handler) {
+        http2->handler(ctx, index, status, reason, http2->handler_user);
+    }
+}
+
+static ssize_t __apn_http2_send_callback(nghttp2_session *session, const uint8_t *data, size_t length, int flags,
+                                         void *user_data) {
+    apn_ctx_t *ctx = user_data;
+    (void) session;
+    (void) flags;
+
+    int written = SSL_write(ctx->ssl, data, (int) length);
+    if (written > 0) {
+        APN_STATS_ADD(ctx->stats.bytes_written, written);
+        return written;
+    }
+    switch (SSL_get_error(ctx->ssl, written)) {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+            APN_TRACE(ctx, APN_TRACE_WRITE_BLOCKED, 0, length);
+            ctx->http2->write_blocked = 1;
+            return NGHTTP2_ERR_WOULDBLOCK;
+        case SSL_ERROR_SYSCALL:
+            switch (errno) {
+                case EINTR:
+                    return NGHTTP2_ERR_WOULDBLOCK;
+                case EPIPE:
+                    ctx->http2->io_error = APN_ERR_NETWORK_UNREACHABLE;
+                    break;
+                case ETIMEDOUT:
+                    ctx->http2->io_error = APN_ERR_NETWORK_TIMEDOUT;
+                    break;
+                default:
+                    ctx->http2->io_error = APN_ERR_SSL_WRITE_FAILED;
+                    break;
+            }
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        case SSL_ERROR_ZERO_RETURN:
+            ctx->http2->io_error = APN_ERR_CONNECTION_CLOSED;
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        default:
+            ctx->http2->io_error = APN_ERR_SSL_WRITE_FAILED;
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+}
+
+static ssize_t __apn_http2_read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                                     uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
+    apn_ctx_t *ctx = user_data;
+    struct __apn_http2_stream *stream = source->ptr;
+    (void) session;
+    (void) stream_id;
+
+    size_t remaining = ctx->http2->body_length - stream->body_offset;
+    size_t chunk = remaining < length ? remaining : length;
+    memcpy(buf, ctx->http2->body + stream->body_offset, chunk);
+    stream->body_offset += (uint32_t) chunk;
+    if (stream->body_offset == ctx->http2->body_length) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return (ssize_t) chunk;
+}
+
+static int __apn_http2_on_frame_send(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+    apn_ctx_t *ctx = user_data;
+    (void) session;
+    if (frame->hd.type == NGHTTP2_DATA && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+        APN_STATS_INC(ctx, frames_sent);
+    }
+    return 0;
+}
+
+static int __apn_http2_on_frame_not_send(nghttp2_session *session, const nghttp2_frame *frame, int lib_error_code,
+                                         void *user_data) {
+    apn_ctx_t *ctx = user_data;
+    struct __apn_http2 *http2 = ctx->http2;
+    (void) session;
+
+    if (frame->hd.type != NGHTTP2_HEADERS) {
+        return 0;
+    }
+    apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Request on stream %d was not sent: %s", frame->hd.stream_id,
+            nghttp2_strerror(lib_error_code));
+    /* The stream was never opened, so it is not closed either: finish the request here */
+    for (uint32_t i = 0; i < APN_HTTP2_MAX_STREAMS; i++) {
+        struct __apn_http2_stream *stream = &http2->streams[i];
+        if (stream->in_use && stream->stream_id == frame->hd.stream_id) {
+            stream->status = 0;
+            __apn_http2_finish(ctx, stream);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int __apn_http2_on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+    apn_ctx_t *ctx = user_data;
+    (void) session;
+    if (frame->hd.type == NGHTTP2_GOAWAY) {
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Server sent GOAWAY (last stream: %d, error code: %u)",
+                frame->goaway.last_stream_id, frame->goaway.error_code);
+        ctx->http2->goaway = 1;
+    }
+    return 0;
+}
+
+static int __apn_http2_on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                                 size_t name_length, const uint8_t *value, size_t value_length, uint8_t flags,
+                                 void *user_data) {
+    (void) flags;
+    (void) user_data;
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_RESPONSE
+        || name_length != sizeof(":status") - 1 || 0 != memcmp(name, ":status", name_length)) {
+        return 0;
+    }
+    struct __apn_http2_stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (stream) {
+        uint16_t status = 0;
+        for (size_t i = 0; i < value_length && value[i] >= '0' && value[i] <= '9'; i++) {
+            status = (uint16_t) (status * 10 + (value[i] - '0'));
+        }
+        stream->status = status;
+    }
+    return 0;
+}
+
+static int __apn_http2_on_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                                     const uint8_t *data, size_t length, void *user_data) {
+    (void) flags;
+    (void) user_data;
+    struct __apn_http2_stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (stream) {
+        size_t room = sizeof(stream->response) - stream->response_length;
+        size_t chunk = length < room ? length : room;
+        memcpy(stream->response + stream->response_length, data, chunk);
+        stream->response_length += (uint32_t) chunk;
+    }
+    return 0;
+}
+
+static int __apn_http2_on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code,
+                                       void *user_data) {
+    apn_ctx_t *ctx = user_data;
+    struct __apn_http2_stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!stream) {
+        return 0;
+    }
+    if (error_code != NGHTTP2_NO_ERROR) {
+        apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Stream %d closed: %s", stream_id, nghttp2_http2_strerror(error_code));
+        if (0 == stream->status || NGHTTP2_REFUSED_STREAM == error_code) {
+            stream->status = 0;
+        }
+    }
+    __apn_http2_finish(ctx, stream);
+    return 0;
+}
+
+static apn_return __apn_http2_write(apn_ctx_t *const ctx) {
+    struct __apn_http2 *http2 = ctx->http2;
+    http2->write_blocked = 0;
+    int ret = nghttp2_session_send(http2->session);
+    if (0 != ret) {
+        if (NGHTTP2_ERR_CALLBACK_FAILURE == ret && http2->io_error) {
+            char error[APN_ERROR_STRING_SIZE];
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to write data to a socket: %s (errno: %d)",
+                    apn_error_string_r(http2->io_error, error, sizeof(error)), http2->io_error);
+            errno = http2->io_error;
+        } else {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "HTTP/2 session failed: %s", nghttp2_strerror(ret));
+            errno = APN_ERR_HTTP2_PROTOCOL_ERROR;
+        }
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
+/* Reads everything available on ctx->ssl without blocking and passes it to the session */
+static apn_return __apn_http2_read(apn_ctx_t *const ctx) {
+    struct __apn_http2 *http2 = ctx->http2;
+    for (;;) {
+        int bytes_read = SSL_read(ctx->ssl, http2->read_buffer, sizeof(http2->read_buffer));
+        if (bytes_read > 0) {
+            ssize_t ret = nghttp2_session_mem_recv(http2->session, http2->read_buffer, (size_t) bytes_read);
+            if (ret < 0) {
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "HTTP/2 session failed: %s", nghttp2_strerror((int) ret));
+                errno = APN_ERR_HTTP2_PROTOCOL_ERROR;
+                return APN_ERROR;
+            }
+            continue;
+        }
+        int errcode = errno;
+        switch (SSL_get_error(ctx->ssl, bytes_read)) {
+            case SSL_ERROR_WANT_READ:
+                return APN_SUCCESS;
+            case SSL_ERROR_WANT_WRITE:
+                http2->write_blocked = 1;
+                return APN_SUCCESS;
+            case SSL_ERROR_SYSCALL:
+                if (EINTR == errcode) {
+                    continue;
+                }
+                errno = (0 == bytes_read) ? APN_ERR_CONNECTION_CLOSED
+                        : (ETIMEDOUT == errcode) ? APN_ERR_NETWORK_TIMEDOUT : APN_ERR_SSL_READ_FAILED;
+                break;
+            case SSL_ERROR_ZERO_RETURN:
+                errno = APN_ERR_CONNECTION_CLOSED;
+                break;
+            default:
+                errno = APN_ERR_SSL_READ_FAILED;
+                break;
+        }
+        if (APN_ERR_CONNECTION_CLOSED == errno && http2->goaway) {
+            errno = APN_ERR_SERVICE_SHUTDOWN;
+        }
+        return APN_ERROR;
+    }
+}
+
+apn_return apn_http2_connect(apn_ctx_t *const ctx, const char *const authority) {
+    assert(ctx->ssl);
+
+    struct __apn_http2 *http2 = ctx->http2;
+    if (!http2) {
+        if (NULL == (http2 = calloc(1, sizeof(struct __apn_http2)))) {
+            errno = ENOMEM;
+            return APN_ERROR;
+        }
+        ctx->http2 = http2;
+    }
+    apn_http2_close(ctx);
+
+    if (ctx->auth_key_file && APN_ERROR == __apn_http2_load_key(ctx)) {
+        return APN_ERROR;
+    }
+
+    apn_strfree(&http2->authority);
+    if (NULL == (http2->authority = apn_strndup(authority, strlen(authority)))) {
+        return APN_ERROR;
+    }
+
+    nghttp2_session_callbacks *callbacks = NULL;
+    if (0 != nghttp2_session_callbacks_new(&callbacks)) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    nghttp2_session_callbacks_set_send_callback(callbacks, __apn_http2_send_callback);
+    nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, __apn_http2_on_frame_send);
+    nghttp2_session_callbacks_set_on_frame_not_send_callback(callbacks, __apn_http2_on_frame_not_send);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, __apn_http2_on_frame_recv);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, __apn_http2_on_header);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, __apn_http2_on_data_chunk);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, __apn_http2_on_stream_close);
+    int ret = nghttp2_session_client_new(&http2->session, callbacks, ctx);
+    nghttp2_session_callbacks_del(callbacks);
+    if (0 != ret) {
+        http2->session = NULL;
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+
+    /* nghttp2 retries a blocked write with the same data, possibly from a moved buffer */
+    SSL_set_mode(ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_ENABLE_PUSH, 0}};
+    if (0 != nghttp2_submit_settings(http2->session, NGHTTP2_FLAG_NONE, settings,
+                                     sizeof(settings) / sizeof(settings[0]))
+        || APN_ERROR == __apn_http2_write(ctx)) {
+        int errcode = errno;
+        apn_http2_close(ctx);
+        errno = errcode;
+        return APN_ERROR;
+    }
+    apn_log(ctx, APN_LOG_LEVEL_INFO, "HTTP/2 session has been started");
+    return APN_SUCCESS;
+}
+
+void apn_http2_close(apn_ctx_t *const ctx) {
+    struct __apn_http2 *http2 = ctx->http2;
+    if (!http2) {
+        return;
+    }
+    if (http2->session) {
+        nghttp2_session_del(http2->session);
+        http2->session = NULL;
+    }
+    http2->goaway = 0;
+    http2->write_blocked = 0;
+    http2->io_error = 0;
+    __apn_http2_reset_streams(http2);
+}
+
+void apn_http2_free(apn_ctx_t *const ctx) {
+    struct __apn_http2 *http2 = ctx->http2;
+    if (!http2) {
+        return;
+    }
+    apn_http2_close(ctx);
+    EVP_PKEY_free(http2->key);
+    free(http2->body);
+    free(http2->authority);
+    free(http2);
+    ctx->http2 = NULL;
+}
+
+apn_return apn_http2_prepare(apn_ctx_t *const ctx, const apn_payload_t *const payload) {
+    struct __apn_http2 *http2 = ctx->http2;
+    char *body = apn_create_json_document_from_payload(payload);
+    if (!body) {
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to create json document: %s (errno: %d)",
+                apn_error_string_r(errno, error, sizeof(error)), errno);
+        return APN_ERROR;
+    }
+    size_t body_length = strlen(body);
+    if (body_length > APN_HTTP2_PAYLOAD_MAX_SIZE) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Payload is too large: %u byte(s), maximum is %u",
+                (uint32_t) body_length, APN_HTTP2_PAYLOAD_MAX_SIZE);
+        free(body);
+        errno = APN_ERR_INVALID_PAYLOAD_SIZE;
+        return APN_ERROR;
+    }
+    free(http2->body);
+    http2->body = body;
+    http2->body_length = body_length;
+
+    snprintf(http2->expiration, sizeof(http2->expiration), "%lld", (long long) payload->expiry);
+    snprintf(http2->priority, sizeof(http2->priority), "%d", (int) payload->priority);
+    http2->push_type = (payload->content_available && !payload->alert->body && !payload->alert->loc_key
+                        && payload->badge < 0 && !payload->sound) ? "background" : "alert";
+    return APN_SUCCESS;
+}
+
+uint32_t apn_http2_available(const apn_ctx_t *const ctx) {
+    const struct __apn_http2 *http2 = ctx->http2;
+    if (!http2 || !http2->session || http2->goaway) {
+        return 0;
+    }
+    uint32_t limit = nghttp2_session_get_remote_settings(http2->session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    if (limit > APN_HTTP2_MAX_STREAMS) {
+        limit = APN_HTTP2_MAX_STREAMS;
+    }
+    return limit > http2->in_flight ? limit - http2->in_flight : 0;
+}
+
+uint32_t apn_http2_in_flight(const apn_ctx_t *const ctx) {
+    return ctx->http2 ? ctx->http2->in_flight : 0;
+}
+
+#define __APN_HTTP2_NV(__name, __value) \
+    {(uint8_t *) (__name), (uint8_t *) (__value), sizeof(__name) - 1, strlen(__value), NGHTTP2_NV_FLAG_NONE}
+
+apn_return apn_http2_submit(apn_ctx_t *const ctx, const char *const token, uint32_t index) {
+    struct __apn_http2 *http2 = ctx->http2;
+    assert(http2 && http2->session && http2->body);
+
+    if (0 == http2->free_count) {
+        errno = APN_ERR_HTTP2_PROTOCOL_ERROR;
+        return APN_ERROR;
+    }
+    if (ctx->auth_key_file && APN_ERROR == __apn_http2_jwt(ctx)) {
+        return APN_ERROR;
+    }
+
+    char path[sizeof(APN_HTTP2_PATH_PREFIX) + APN_TOKEN_LENGTH];
+    snprintf(path, sizeof(path), APN_HTTP2_PATH_PREFIX "%.*s", APN_TOKEN_LENGTH, token);
+
+    nghttp2_nv headers[9] = {
+            __APN_HTTP2_NV(":method", "POST"),
+            __APN_HTTP2_NV(":scheme", "https"),
+            __APN_HTTP2_NV(":path", path),
+            __APN_HTTP2_NV(":authority", http2->authority),
+            __APN_HTTP2_NV("apns-push-type", http2->push_type),
+            __APN_HTTP2_NV("apns-priority", http2->priority),
+            __APN_HTTP2_NV("apns-expiration", http2->expiration)
+    };
+    size_t headers_count = 7;
+    if (ctx->topic) {
+        nghttp2_nv topic = __APN_HTTP2_NV("apns-topic", ctx->topic);
+        headers[headers_count++] = topic;
+    }
+    if (ctx->auth_key_file) {
+        nghttp2_nv authorization = __APN_HTTP2_NV("authorization", http2->authorization);
+        headers[headers_count++] = authorization;
+    }
+
+    struct __apn_http2_stream *stream = &http2->streams[http2->free_slots[--http2->free_count]];
+    stream->in_use = 1;
+    stream->index = index;
+    stream->jwt_generation = http2->jwt_generation;
+    stream->body_offset = 0;
+    stream->status = 0;
+    stream->response_length = 0;
+    stream->submitted = apn_clock_us();
+    stream->stream_id = -1;
+    http2->in_flight++;
+
+    nghttp2_data_provider body;
+    body.source.ptr = stream;
+    body.read_callback = __apn_http2_read_body;
+
+    int32_t stream_id = nghttp2_submit_request(http2->session, NULL, headers, headers_count, &body, stream);
+    if (stream_id < 0) {
+        __apn_http2_release(http2, stream);
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to submit request: %s", nghttp2_strerror(stream_id));
+        /* Stream ids are exhausted: the connection must be reopened */
+        errno = (NGHTTP2_ERR_STREAM_ID_NOT_AVAILABLE == stream_id) ? APN_ERR_CONNECTION_CLOSED
+                                                                   : APN_ERR_HTTP2_PROTOCOL_ERROR;
+        return APN_ERROR;
+    }
+    stream->stream_id = stream_id;
+    return APN_SUCCESS;
+}
+
+apn_return apn_http2_run(apn_ctx_t *const ctx, uint32_t timeout, apn_http2_response_handler handler, void *user) {
+    struct __apn_http2 *http2 = ctx->http2;
+    assert(http2 && http2->session);
+
+    http2->handler = handler;
+    http2->handler_user = user;
+    apn_return ret = APN_ERROR;
+
+    if (APN_ERROR == __apn_http2_write(ctx)) {
+        goto finish;
+    }
+    if (!nghttp2_session_want_read(http2->session) && !nghttp2_session_want_write(http2->session)) {
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "HTTP/2 session has been finished by the server");
+        errno = http2->goaway ? APN_ERR_SERVICE_SHUTDOWN : APN_ERR_CONNECTION_CLOSED;
+        goto finish;
+    }
+
+    if (0 == SSL_pending(ctx->ssl)) {
+        fd_set read_set, write_set;
+        struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+        int select_returned = 0;
+        uint64_t wait_start = apn_clock_us();
+        do {
+            FD_ZERO(&read_set);
+            FD_ZERO(&write_set);
+            FD_SET(ctx->sock, &read_set);
+            if (http2->write_blocked) {
+                FD_SET(ctx->sock, &write_set);
+            }
+            select_returned = select(ctx->sock + 1, &read_set, &write_set, NULL, &tv);
+            APN_STATS_INC(ctx, select_wakeups);
+        } while (0 > select_returned && EINTR == errno);
+        APN_STATS_RECORD_SINCE(ctx, error_wait_latency, wait_start);
+
+        if (select_returned < 0) {
+            char error[APN_ERROR_STRING_SIZE];
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "select() failed: %s (errno: %d)",
+                    apn_error_string_r(errno, error, sizeof(error)), errno);
+            goto finish;
+        }
+        if (0 == select_returned) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "No response within %u ms, %u request(s) in flight", timeout,
+                    http2->in_flight);
+            errno = APN_ERR_NETWORK_TIMEDOUT;
+            goto finish;
+        }
+        if (!FD_ISSET(ctx->sock, &read_set)) {
+            ret = __apn_http2_write(ctx);
+            goto finish;
+        }
+    }
+
+    if (APN_SUCCESS == __apn_http2_read(ctx)) {
+        ret = __apn_http2_write(ctx);
+    }
+
+    finish:
+    http2->handler = NULL;
+    http2->handler_user = NULL;
+    return ret;
+}
+
+uint32_t apn_http2_unfinished(apn_ctx_t *const ctx, uint32_t *const indices) {
+    struct __apn_http2 *http2 = ctx->http2;
+    uint32_t count = 0;
+    if (!http2) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < APN_HTTP2_MAX_STREAMS; i++) {
+        struct __apn_http2_stream *stream = &http2->streams[i];
+        if (stream->in_use) {
+            indices[count++] = stream->index;
+            __apn_http2_release(http2, stream);
+        }
+    }
+    return count;
+}
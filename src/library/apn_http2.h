@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_HTTP2_H__
+#define __APN_HTTP2_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+#include "apn_payload.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Requests in flight on one connection; the limit announced by the server applies if it is lower */
+#define APN_HTTP2_MAX_STREAMS 1000
+
+/*
+ * Called for each finished request with the HTTP status and the reason of an error response (or NULL).
+ * `status` is 0 if the request was refused or reset without a response and can be sent again.
+ */
+typedef void (*apn_http2_response_handler)(apn_ctx_t *const ctx, uint32_t index, uint16_t status,
+                                           const char *const reason, void *user);
+
+/** Starts an HTTP/2 session over the established TLS connection of `ctx` */
+apn_return apn_http2_connect(apn_ctx_t *const ctx, const char *const authority)
+        __apn_attribute_nonnull__((1, 2));
+
+/** Drops the session. Requests in flight are forgotten, see apn_http2_unfinished() */
+void apn_http2_close(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Frees the session, the authentication key and the cached provider token */
+void apn_http2_free(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Prepares the body and headers shared by requests submitted until the next call */
+apn_return apn_http2_prepare(apn_ctx_t *const ctx, const apn_payload_t *const payload)
+        __apn_attribute_nonnull__((1, 2));
+
+/** Returns number of requests which can be submitted now */
+uint32_t apn_http2_available(const apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Returns number of requests submitted and not finished yet */
+uint32_t apn_http2_in_flight(const apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Queues a request to `token`. `index` is passed back to the response handler */
+apn_return apn_http2_submit(apn_ctx_t *const ctx, const char *const token, uint32_t index)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Writes queued frames, waits up to `timeout` milliseconds for the socket and processes received frames.
+ * Finished requests are passed to `handler`. Fails with APN_ERR_NETWORK_TIMEDOUT if nothing was received
+ * within `timeout`
+ */
+apn_return apn_http2_run(apn_ctx_t *const ctx, uint32_t timeout, apn_http2_response_handler handler, void *user)
+        __apn_attribute_nonnull__((1, 3));
+
+/**
+ * Stores indices of requests in flight to `indices` (room for APN_HTTP2_MAX_STREAMS items) and forgets
+ * the requests. Returns number of stored indices
+ */
+uint32_t apn_http2_unfinished(apn_ctx_t *const ctx, uint32_t *const indices)
+        __apn_attribute_nonnull__((1, 2));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,20 +26,29 @@
 
 #define __APN_LOG_BUFFER 1024
 
-void apn_log(const apn_ctx_t *const ctx, apn_log_levels level, const char *const message, ...) {
-    if (ctx && ((ctx->log_callback || ctx->options & APN_OPTION_LOG_STDERR) && (ctx->log_level & level))) {
+void apn_log_write(const apn_ctx_t *const ctx, apn_log_levels level, const char *const message, ...) {
+    if (ctx && APN_LOG_ENABLED(ctx, level)) {
         va_list args;
         va_start(args, message);
 
-        char buffer[__APN_LOG_BUFFER] = {0};
+        char buffer[__APN_LOG_BUFFER];
 #ifdef _WIN32
-        vsnprintf_s(buffer, __APN_LOG_BUFFER, _TRUNCATE, message, args);
+        int length = vsnprintf_s(buffer, __APN_LOG_BUFFER, _TRUNCATE, message, args);
+        if (length < 0) {
+            length = (int) strlen(buffer);
+        }
 #else
-        vsnprintf(buffer, __APN_LOG_BUFFER, message, args);
+        int length = vsnprintf(buffer, __APN_LOG_BUFFER, message, args);
+        if (length < 0) {
+            buffer[0] = '\0';
+            length = 0;
+        } else if (length >= __APN_LOG_BUFFER) {
+            length = __APN_LOG_BUFFER - 1;
+        }
 #endif
 
-        if(ctx->log_callback && (ctx->log_level & level)) {
-            ctx->log_callback(level, buffer, __APN_LOG_BUFFER);
+        if(ctx->log_callback) {
+            ctx->log_callback(level, buffer, (uint32_t) length);
         }
 
         if(ctx->options & APN_OPTION_LOG_STDERR) {
@@ -25,8 +25,33 @@
 
 #include "apn_platform.h"
 #include "apn.h"
+#include "apn_private.h"
 
-void apn_log(const apn_ctx_t *const ctx, apn_log_levels level, const char *const message, ...)
+void apn_log_write(const apn_ctx_t *const ctx, apn_log_levels level, const char *const message, ...)
         __apn_attribute_nonnull__((1,3));
 
+#define APN_LOG_ENABLED(__ctx, __level) \
+    (((__ctx)->log_level & (__level)) && ((__ctx)->log_callback || ((__ctx)->options & APN_OPTION_LOG_STDERR)))
+
+/*
+ * The level is checked before the arguments are evaluated and the message is formatted,
+ * so disabled messages cost one branch.
+ */
+#define apn_log(__ctx, __level, ...) \
+    do { \
+        if (APN_LOG_ENABLED(__ctx, __level)) { \
+            apn_log_write(__ctx, __level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+/*
+ * Per-notification messages of the send loop. Compiled out when the library is built
+ * with APN_LOG_STRIP_HOT_PATH (CMake option CAPN_STRIP_HOT_PATH_LOGGING).
+ */
+#ifdef APN_LOG_STRIP_HOT_PATH
+#define apn_log_hot(__ctx, __level, ...) do { } while (0)
+#else
+#define apn_log_hot(__ctx, __level, ...) apn_log(__ctx, __level, __VA_ARGS__)
+#endif
+
 #endif
@@ -0,0 +1,945 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* syscall() and MAP_POPULATE are Linux extensions, hidden by the POSIX.1-2001 build flags */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "apn_loop.h"
+#include "apn_private.h"
+#include "apn_binary_message_private.h"
+#include "apn_strings.h"
+#include "apn_strerror.h"
+#include "apn_tokens.h"
+#include "apn_token_store.h"
+#include "apn_log.h"
+#include "apn_stats_private.h"
+#include "apn_trace_private.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef APN_HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* Encrypted frames written with one operation */
+#define APN_LOOP_BUFFER_SIZE (64 * 1024)
+/* Room left in the buffer for the TLS records of one frame: headers, MAC, padding and the 1/n-1 split */
+#define APN_LOOP_RECORD_OVERHEAD 256
+#define APN_LOOP_RECV_SIZE 4096
+#define APN_LOOP_EPOLL_EVENTS 256
+#define APN_LOOP_URING_ENTRIES 1024
+
+/* Operations in io_uring user data, the connection index is stored above them */
+#define APN_LOOP_OP_SEND 1
+#define APN_LOOP_OP_RECV 2
+#define APN_LOOP_OP_CANCEL 3
+#define APN_LOOP_OP_BITS 2
+
+enum __apn_loop_conn_state {
+    /* Frames of the range are being written */
+    APN_LOOP_CONN_SENDING,
+    /* All frames are written, waiting for an error response */
+    APN_LOOP_CONN_LINGER,
+    /* No error response came, waiting for the receive to be cancelled */
+    APN_LOOP_CONN_FINISHING,
+    /* Error response or I/O error, waiting for operations in flight to complete */
+    APN_LOOP_CONN_CLOSING,
+    APN_LOOP_CONN_DONE,
+    APN_LOOP_CONN_FAILED
+};
+
+struct __apn_loop_conn {
+    apn_ctx_t *ctx;
+    uint32_t index;
+    enum __apn_loop_conn_state state;
+    SOCKET sock;
+    /* Memory BIOs of ctx->ssl, set while the connection is attached */
+    BIO *rbio;
+    BIO *wbio;
+    apn_binary_message_t *message;
+    /* Tokens [begin, end) are sent by this connection */
+    uint32_t begin;
+    uint32_t end;
+    /* Next token to encrypt */
+    uint32_t next;
+    /* Frames of tokens before `written` are written to the socket */
+    uint32_t written;
+    /* Frames of tokens before `out_end` are encrypted into `out` */
+    uint32_t out_end;
+    uint32_t out_frames;
+    size_t out_length;
+    size_t out_sent;
+    uint8_t *out;
+    uint8_t *in;
+    uint8_t response[6];
+    uint8_t response_length;
+    /* Operations in flight (io_uring) */
+    uint8_t sending;
+    uint8_t receiving;
+    uint8_t cancelling;
+    /* Socket accepts data (epoll, edge-triggered) */
+    uint8_t writable;
+    uint64_t write_start;
+    uint64_t deadline;
+    uint8_t apple_error_code;
+    uint32_t error_id;
+    int errcode;
+};
+
+#ifdef APN_HAVE_LINUX_IO_URING_H
+struct __apn_uring {
+    int fd;
+    uint8_t *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Submission queue entries not passed to the kernel yet */
+    unsigned queued;
+    /* Receive buffers of the first `registered` connections are registered */
+    uint32_t registered;
+};
+#endif
+
+struct __apn_loop_t {
+    apn_loop_backend backend;
+    struct __apn_loop_conn *conns[APN_LOOP_MAX_CONTEXTS];
+    uint32_t count;
+    int epoll_fd;
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    struct __apn_uring uring;
+#endif
+    apn_loop_stats_t stats;
+    uint32_t error_timeout;
+    /* State of apn_loop_send() */
+    apn_array_t *tokens;
+    apn_array_t *invalid_tokens;
+    uint8_t collect_invalid_tokens;
+};
+
+static void __apn_loop_token_dtor(char *const token) {
+    free(token);
+}
+
+static uint64_t __apn_loop_clock_ms(void) {
+    return apn_clock_us() / 1000;
+}
+
+#ifdef APN_HAVE_LINUX_IO_URING_H
+
+static apn_return __apn_uring_init(struct __apn_uring *const uring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    /* Every connection has at most a send, a receive and a cancel in flight */
+    params.cq_entries = 4 * APN_LOOP_MAX_CONTEXTS;
+
+    memset(uring, 0, sizeof(struct __apn_uring));
+    uring->fd = (int) syscall(__NR_io_uring_setup, APN_LOOP_URING_ENTRIES, &params);
+    if (uring->fd < 0) {
+        return APN_ERROR;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(uring->fd);
+        uring->fd = -1;
+        errno = ENOSYS;
+        return APN_ERROR;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQ_RING);
+    if (MAP_FAILED == uring->ring) {
+        int errcode = errno;
+        close(uring->fd);
+        uring->fd = -1;
+        errno = errcode;
+        return APN_ERROR;
+    }
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQES);
+    if (MAP_FAILED == uring->sqes) {
+        int errcode = errno;
+        munmap(uring->ring, uring->ring_size);
+        close(uring->fd);
+        uring->fd = -1;
+        errno = errcode;
+        return APN_ERROR;
+    }
+
+    uring->sq_head = (unsigned *) (uring->ring + params.sq_off.head);
+    uring->sq_tail = (unsigned *) (uring->ring + params.sq_off.tail);
+    uring->sq_mask = (unsigned *) (uring->ring + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *) (uring->ring + params.sq_off.array);
+    uring->sq_entries = params.sq_entries;
+    uring->cq_head = (unsigned *) (uring->ring + params.cq_off.head);
+    uring->cq_tail = (unsigned *) (uring->ring + params.cq_off.tail);
+    uring->cq_mask = (unsigned *) (uring->ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (uring->ring + params.cq_off.cqes);
+    return APN_SUCCESS;
+}
+
+static void __apn_uring_free(struct __apn_uring *const uring) {
+    if (uring->fd < 0) {
+        return;
+    }
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->ring, uring->ring_size);
+    close(uring->fd);
+    uring->fd = -1;
+}
+
+/*
+ * Submits queued entries and waits for `min_complete` completions or `timeout_ms` (-1 - no timeout).
+ * Returns -1 on error other than timeout or interrupt.
+ */
+static int __apn_uring_enter(apn_loop_t *const loop, unsigned min_complete, int64_t timeout_ms) {
+    struct __apn_uring *uring = &loop->uring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+    }
+    int ret = (int) syscall(__NR_io_uring_enter, uring->fd, uring->queued, min_complete, flags, &arg, sizeof(arg));
+    loop->stats.waits++;
+    if (ret >= 0) {
+        uring->queued -= (unsigned) ret;
+        return 0;
+    }
+    return (ETIME == errno || EINTR == errno) ? 0 : -1;
+}
+
+/*
+ * Returns a cleared submission queue entry. Entries are read by the kernel in io_uring_enter() only,
+ * so the entry is published before it is filled.
+ */
+static struct io_uring_sqe *__apn_uring_sqe(apn_loop_t *const loop) {
+    struct __apn_uring *uring = &loop->uring;
+    unsigned tail = *uring->sq_tail;
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+        if (-1 == __apn_uring_enter(loop, 0, -1) ||
+            tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->queued++;
+    return sqe;
+}
+
+/* Registers receive buffers of all connections, receives fall back to IORING_OP_RECV if it fails */
+static void __apn_uring_register(apn_loop_t *const loop) {
+    struct __apn_uring *uring = &loop->uring;
+    if (uring->registered == loop->count) {
+        return;
+    }
+    if (uring->registered > 0) {
+        syscall(__NR_io_uring_register, uring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        uring->registered = 0;
+    }
+    struct iovec iov[APN_LOOP_MAX_CONTEXTS];
+    for (uint32_t i = 0; i < loop->count; i++) {
+        iov[i].iov_base = loop->conns[i]->in;
+        iov[i].iov_len = APN_LOOP_RECV_SIZE;
+    }
+    if (0 == syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_BUFFERS, iov, loop->count)) {
+        uring->registered = loop->count;
+    }
+}
+
+#endif
+
+static void __apn_loop_fail(struct __apn_loop_conn *const conn, int errcode, uint8_t apple_error_code,
+                            uint32_t error_id);
+static void __apn_loop_epoll_event(apn_loop_t *const loop, struct __apn_loop_conn *const conn, uint32_t events);
+
+static void __apn_loop_submit_send(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    struct io_uring_sqe *sqe = __apn_uring_sqe(loop);
+    if (!sqe) {
+        __apn_loop_fail(conn, EBUSY, 0, 0);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->sock;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->out + conn->out_sent);
+    sqe->len = (uint32_t) (conn->out_length - conn->out_sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ((uint64_t) conn->index << APN_LOOP_OP_BITS) | APN_LOOP_OP_SEND;
+    conn->sending = 1;
+#else
+    (void) loop;
+    (void) conn;
+#endif
+}
+
+static void __apn_loop_submit_recv(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    struct io_uring_sqe *sqe = __apn_uring_sqe(loop);
+    if (!sqe) {
+        __apn_loop_fail(conn, EBUSY, 0, 0);
+        return;
+    }
+    if (conn->index < loop->uring.registered) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t) conn->index;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->fd = conn->sock;
+    sqe->addr = (uint64_t) (uintptr_t) conn->in;
+    sqe->len = APN_LOOP_RECV_SIZE;
+    sqe->user_data = ((uint64_t) conn->index << APN_LOOP_OP_BITS) | APN_LOOP_OP_RECV;
+    conn->receiving = 1;
+#else
+    (void) loop;
+    (void) conn;
+#endif
+}
+
+static void __apn_loop_submit_cancel(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    struct io_uring_sqe *sqe = __apn_uring_sqe(loop);
+    if (!sqe) {
+        /* The receive completes when the socket is shut down */
+        shutdown(conn->sock, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ((uint64_t) conn->index << APN_LOOP_OP_BITS) | APN_LOOP_OP_RECV;
+    sqe->user_data = ((uint64_t) conn->index << APN_LOOP_OP_BITS) | APN_LOOP_OP_CANCEL;
+    conn->cancelling = 1;
+#else
+    (void) loop;
+    (void) conn;
+#endif
+}
+
+/* Stops the range on the first error, the connection is recovered when no operation is in flight */
+static void __apn_loop_fail(struct __apn_loop_conn *const conn, int errcode, uint8_t apple_error_code,
+                            uint32_t error_id) {
+    if (APN_LOOP_CONN_CLOSING == conn->state) {
+        return;
+    }
+    conn->state = APN_LOOP_CONN_CLOSING;
+    conn->errcode = errcode;
+    conn->apple_error_code = apple_error_code;
+    conn->error_id = error_id;
+    /* Completes the operations in flight */
+    shutdown(conn->sock, SHUT_RDWR);
+}
+
+/* Encrypts frames into the output buffer, returns 0 if there is nothing left to send */
+static uint8_t __apn_loop_encrypt(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+    apn_ctx_t *ctx = conn->ctx;
+    uint32_t frame_size = conn->message->size;
+    conn->out_frames = 0;
+    while (conn->next < conn->end &&
+           BIO_ctrl_pending(conn->wbio) + frame_size + APN_LOOP_RECORD_OVERHEAD <= APN_LOOP_BUFFER_SIZE) {
+        uint32_t i = conn->next++;
+        const char *token = (const char *) apn_array_item_at_index(loop->tokens, i);
+        if (APN_ERROR == apn_binary_message_set_token_hex(conn->message, token)) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Malformed token %s (index: %u) skipped", token, i);
+            continue;
+        }
+        if (ctx->token_store && apn_token_store_contains(ctx->token_store, conn->message->token_position, NULL)) {
+            apn_log_hot(ctx, APN_LOG_LEVEL_INFO, "Token %s is in the token store, skipped", token);
+            APN_STATS_INC(ctx, tokens_suppressed);
+            continue;
+        }
+        apn_binary_message_set_id(conn->message, i);
+        if ((int) frame_size != SSL_write(ctx->ssl, conn->message->message, (int) frame_size)) {
+            __apn_loop_fail(conn, APN_ERR_SSL_WRITE_FAILED, 0, 0);
+            return 0;
+        }
+        conn->out_frames++;
+    }
+    conn->out_sent = 0;
+    int length = BIO_read(conn->wbio, conn->out, APN_LOOP_BUFFER_SIZE);
+    conn->out_length = length > 0 ? (size_t) length : 0;
+    conn->out_end = conn->next;
+    conn->write_start = apn_clock_us();
+    return conn->out_length > 0;
+}
+
+/* Accounts `length` written bytes, returns 1 when the whole buffer is written */
+static uint8_t __apn_loop_sent(struct __apn_loop_conn *const conn, size_t length) {
+    conn->out_sent += length;
+    if (conn->out_sent < conn->out_length) {
+        return 0;
+    }
+    apn_ctx_t *ctx = conn->ctx;
+    conn->written = conn->out_end;
+    APN_STATS_ADD(ctx->stats.frames_sent, conn->out_frames);
+    APN_STATS_ADD(ctx->stats.bytes_written, (uint64_t) conn->out_frames * conn->message->size);
+    APN_STATS_RECORD_SINCE(ctx, write_latency, conn->write_start);
+    apn_log_hot(ctx, APN_LOG_LEVEL_DEBUG, "%u frame(s) in %zu byte(s) have been written to a socket",
+                conn->out_frames, conn->out_length);
+    return 1;
+}
+
+static void __apn_loop_linger(const apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+    conn->written = conn->end;
+    conn->state = APN_LOOP_CONN_LINGER;
+    conn->deadline = __apn_loop_clock_ms() + loop->error_timeout;
+}
+
+/* Starts the next write of a sending connection */
+static void __apn_loop_pump(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+    if (APN_LOOP_BACKEND_IO_URING == loop->backend) {
+        if (APN_LOOP_CONN_SENDING != conn->state || conn->sending) {
+            return;
+        }
+        if (conn->out_sent == conn->out_length && !__apn_loop_encrypt(loop, conn)) {
+            if (APN_LOOP_CONN_SENDING == conn->state) {
+                __apn_loop_linger(loop, conn);
+            }
+            return;
+        }
+        __apn_loop_submit_send(loop, conn);
+        return;
+    }
+
+    while (APN_LOOP_CONN_SENDING == conn->state && conn->writable) {
+        if (conn->out_sent == conn->out_length && !__apn_loop_encrypt(loop, conn)) {
+            if (APN_LOOP_CONN_SENDING == conn->state) {
+                __apn_loop_linger(loop, conn);
+            }
+            return;
+        }
+        ssize_t sent = send(conn->sock, conn->out + conn->out_sent, conn->out_length - conn->out_sent,
+                            MSG_NOSIGNAL);
+        loop->stats.io_calls++;
+        if (sent > 0) {
+            loop->stats.completions++;
+            __apn_loop_sent(conn, (size_t) sent);
+        } else if (sent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            conn->writable = 0;
+        } else if (sent < 0 && EINTR == errno) {
+            continue;
+        } else {
+            int errcode = sent < 0 && EPIPE != errno && ECONNRESET != errno ?
+                          APN_ERR_SSL_WRITE_FAILED : APN_ERR_CONNECTION_CLOSED;
+            /* The error response which made the peer close the connection may still be unread */
+            __apn_loop_epoll_event(loop, conn, EPOLLIN);
+            __apn_loop_fail(conn, errcode, 0, 0);
+        }
+    }
+}
+
+/* Feeds received bytes to TLS, an error response or the end of the connection stops the range */
+static void __apn_loop_received(struct __apn_loop_conn *const conn, const uint8_t *const data, size_t length) {
+    if (0 == length) {
+        __apn_loop_fail(conn, APN_ERR_CONNECTION_CLOSED, 0, 0);
+        return;
+    }
+    BIO_write(conn->rbio, data, (int) length);
+    while (conn->response_length < sizeof(conn->response)) {
+        int ret = SSL_read(conn->ctx->ssl, conn->response + conn->response_length,
+                           (int) (sizeof(conn->response) - conn->response_length));
+        if (ret > 0) {
+            conn->response_length += (uint8_t) ret;
+        } else if (SSL_ERROR_WANT_READ == SSL_get_error(conn->ctx->ssl, ret)) {
+            return;
+        } else {
+            __apn_loop_fail(conn, APN_ERR_CONNECTION_CLOSED, 0, 0);
+            return;
+        }
+    }
+    uint32_t id = 0;
+    memcpy(&id, conn->response + 2, sizeof(id));
+    if (8 == conn->response[0]) {
+        __apn_loop_fail(conn, 0, conn->response[1], ntohl(id));
+    } else {
+        __apn_loop_fail(conn, APN_ERR_CONNECTION_CLOSED, 0, 0);
+    }
+}
+
+static void __apn_loop_complete(apn_loop_t *const loop, uint64_t user_data, int32_t result) {
+    uint32_t index = (uint32_t) (user_data >> APN_LOOP_OP_BITS);
+    if (index >= loop->count) {
+        return;
+    }
+    struct __apn_loop_conn *conn = loop->conns[index];
+    loop->stats.completions++;
+    switch (user_data & ((1 << APN_LOOP_OP_BITS) - 1)) {
+        case APN_LOOP_OP_SEND:
+            conn->sending = 0;
+            if (result < 0) {
+                __apn_loop_fail(conn, -EPIPE == result || -ECONNRESET == result ?
+                                      APN_ERR_CONNECTION_CLOSED : APN_ERR_SSL_WRITE_FAILED, 0, 0);
+            } else if (APN_LOOP_CONN_SENDING == conn->state) {
+                __apn_loop_sent(conn, (size_t) result);
+                __apn_loop_pump(loop, conn);
+            }
+            break;
+        case APN_LOOP_OP_RECV:
+            conn->receiving = 0;
+            if (-ECANCELED == result && APN_LOOP_CONN_FINISHING == conn->state) {
+                break;
+            }
+            if (APN_LOOP_CONN_CLOSING == conn->state) {
+                break;
+            }
+            if (result < 0) {
+                __apn_loop_fail(conn, APN_ERR_CONNECTION_CLOSED, 0, 0);
+                break;
+            }
+            __apn_loop_received(conn, conn->in, (size_t) result);
+            if (APN_LOOP_CONN_SENDING == conn->state || APN_LOOP_CONN_LINGER == conn->state) {
+                __apn_loop_submit_recv(loop, conn);
+            }
+            break;
+        case APN_LOOP_OP_CANCEL:
+            conn->cancelling = 0;
+            break;
+    }
+}
+
+static void __apn_loop_epoll_event(apn_loop_t *const loop, struct __apn_loop_conn *const conn, uint32_t events) {
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        while (APN_LOOP_CONN_SENDING == conn->state || APN_LOOP_CONN_LINGER == conn->state) {
+            ssize_t received = recv(conn->sock, conn->in, APN_LOOP_RECV_SIZE, 0);
+            loop->stats.io_calls++;
+            if (received < 0 && EINTR == errno) {
+                continue;
+            }
+            if (received < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                break;
+            }
+            loop->stats.completions++;
+            if (received < 0) {
+                __apn_loop_fail(conn, APN_ERR_CONNECTION_CLOSED, 0, 0);
+                break;
+            }
+            __apn_loop_received(conn, conn->in, (size_t) received);
+        }
+    }
+    if (events & EPOLLOUT) {
+        conn->writable = 1;
+        __apn_loop_pump(loop, conn);
+    }
+}
+
+/* Waits for events or completions for at most `timeout_ms` and handles them */
+static apn_return __apn_loop_wait(apn_loop_t *const loop, int64_t timeout_ms) {
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    if (APN_LOOP_BACKEND_IO_URING == loop->backend) {
+        struct __apn_uring *uring = &loop->uring;
+        if (-1 == __apn_uring_enter(loop, 1, timeout_ms)) {
+            return APN_ERROR;
+        }
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int32_t result = cqe->res;
+            head++;
+            __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+            __apn_loop_complete(loop, user_data, result);
+            tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+        return APN_SUCCESS;
+    }
+#endif
+    struct epoll_event events[APN_LOOP_EPOLL_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, APN_LOOP_EPOLL_EVENTS, (int) timeout_ms);
+    loop->stats.waits++;
+    if (count < 0) {
+        return EINTR == errno ? APN_SUCCESS : APN_ERROR;
+    }
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.u32 < loop->count) {
+            __apn_loop_epoll_event(loop, loop->conns[events[i].data.u32], events[i].events);
+        }
+    }
+    return APN_SUCCESS;
+}
+
+/* Takes over the memory BIOs TLS of the connection runs over and starts sending from `conn->next` */
+static apn_return __apn_loop_attach(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+    apn_ctx_t *ctx = conn->ctx;
+    if (!ctx->ssl && APN_ERROR == apn_connect(ctx)) {
+        return APN_ERROR;
+    }
+    if (!ctx->mem_bio || ctx->custom_transport) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR,
+                "A loop sends over binary protocol connections on sockets without kernel TLS only");
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+
+    conn->rbio = SSL_get_rbio(ctx->ssl);
+    conn->wbio = SSL_get_wbio(ctx->ssl);
+    conn->sock = ctx->sock;
+    conn->state = APN_LOOP_CONN_SENDING;
+    conn->written = conn->next;
+    conn->out_length = conn->out_sent = 0;
+    conn->response_length = 0;
+    conn->errcode = 0;
+    conn->apple_error_code = 0;
+
+    if (APN_LOOP_BACKEND_EPOLL == loop->backend) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.u32 = conn->index;
+        loop->stats.io_calls++;
+        if (0 != epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->sock, &event)) {
+            conn->rbio = conn->wbio = NULL;
+            return APN_ERROR;
+        }
+        /* EPOLLOUT is reported once the socket is added */
+        conn->writable = 0;
+    } else {
+        __apn_loop_submit_recv(loop, conn);
+        __apn_loop_pump(loop, conn);
+    }
+    return APN_SUCCESS;
+}
+
+/* Stops watching the socket, so the context can be used on its own */
+static void __apn_loop_detach(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+    if (!conn->rbio) {
+        return;
+    }
+    if (APN_LOOP_BACKEND_EPOLL == loop->backend) {
+        loop->stats.io_calls++;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+    }
+    conn->rbio = conn->wbio = NULL;
+}
+
+/* Handles the error which stopped the range as apn_send() does and resumes after a reconnect */
+static void __apn_loop_recover(apn_loop_t *const loop, struct __apn_loop_conn *const conn) {
+    apn_ctx_t *ctx = conn->ctx;
+    int errcode = conn->errcode;
+    uint32_t resume = conn->written;
+
+    if (conn->apple_error_code > 0) {
+        errcode = apn_convert_apple_error(conn->apple_error_code);
+        APN_TRACE(ctx, APN_TRACE_ERROR_RESPONSE, conn->error_id, conn->apple_error_code);
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Apple returned error code %d", conn->apple_error_code);
+        if (conn->error_id >= conn->begin && conn->error_id < conn->end) {
+            resume = conn->error_id;
+            if (APN_ERR_TOKEN_INVALID == errcode) {
+                apn_invalid_token(ctx, loop->tokens, conn->error_id);
+                if (loop->collect_invalid_tokens) {
+                    if (!loop->invalid_tokens) {
+                        loop->invalid_tokens = apn_array_init(10, (apn_array_dtor) __apn_loop_token_dtor, NULL);
+                    }
+                    if (loop->invalid_tokens) {
+                        const char *token = (const char *) apn_array_item_at_index(loop->tokens, conn->error_id);
+                        apn_array_insert(loop->invalid_tokens, apn_strndup(token, APN_TOKEN_LENGTH));
+                    }
+                }
+            } else {
+                APN_STATS_INC(ctx, apple_errors);
+            }
+            if (APN_ERR_TOKEN_INVALID == errcode || APN_ERR_SERVICE_SHUTDOWN == errcode) {
+                resume++;
+            }
+        } else {
+            APN_STATS_INC(ctx, apple_errors);
+        }
+    }
+
+    char error_string[APN_ERROR_STRING_SIZE];
+    apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not send notification: %s (errno: %d)",
+            apn_error_string_r(errcode, error_string, sizeof(error_string)), errcode);
+
+    __apn_loop_detach(loop, conn);
+    apn_close(ctx);
+
+    if (resume >= conn->end) {
+        conn->errcode = errcode;
+        conn->state = (APN_ERR_TOKEN_INVALID == errcode || APN_ERR_SERVICE_SHUTDOWN == errcode) ?
+                      APN_LOOP_CONN_DONE : APN_LOOP_CONN_FAILED;
+        return;
+    }
+    if ((ctx->options & APN_OPTION_RECONNECT) &&
+        (errcode == APN_ERR_CONNECTION_CLOSED
+         || errcode == APN_ERR_SERVICE_SHUTDOWN
+         || errcode == APN_ERR_NETWORK_TIMEDOUT
+         || errcode == APN_ERR_NETWORK_UNREACHABLE
+         || errcode == APN_ERR_TOKEN_INVALID)) {
+        apn_count_reconnect(ctx, errcode);
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Reconnecting...");
+        conn->next = resume;
+        if (APN_SUCCESS == __apn_loop_attach(loop, conn)) {
+            return;
+        }
+        errcode = errno;
+    }
+    conn->errcode = errcode;
+    conn->state = APN_LOOP_CONN_FAILED;
+}
+
+apn_loop_t *apn_loop_init(apn_loop_backend backend) {
+    apn_loop_t *loop = calloc(1, sizeof(apn_loop_t));
+    if (!loop) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    loop->backend = backend;
+    loop->epoll_fd = -1;
+    loop->error_timeout = APN_LOOP_ERROR_TIMEOUT;
+    if (APN_LOOP_BACKEND_IO_URING == backend) {
+#ifdef APN_HAVE_LINUX_IO_URING_H
+        if (APN_ERROR == __apn_uring_init(&loop->uring)) {
+            int errcode = errno;
+            free(loop);
+            errno = errcode;
+            return NULL;
+        }
+#else
+        free(loop);
+        errno = ENOSYS;
+        return NULL;
+#endif
+    } else if (0 > (loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC))) {
+        int errcode = errno;
+        free(loop);
+        errno = errcode;
+        return NULL;
+    }
+    return loop;
+}
+
+void apn_loop_free(apn_loop_t *loop) {
+    if (!loop) {
+        return;
+    }
+    for (uint32_t i = 0; i < loop->count; i++) {
+        free(loop->conns[i]->out);
+        free(loop->conns[i]->in);
+        free(loop->conns[i]);
+    }
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    if (APN_LOOP_BACKEND_IO_URING == loop->backend) {
+        __apn_uring_free(&loop->uring);
+    }
+#endif
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+    }
+    free(loop);
+}
+
+apn_return apn_loop_add(apn_loop_t *const loop, apn_ctx_t *const ctx) {
+    assert(loop);
+    assert(ctx);
+    if (loop->count == APN_LOOP_MAX_CONTEXTS || APN_USE_HTTP2(ctx) || (ctx->options & APN_OPTION_KTLS)) {
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+    struct __apn_loop_conn *conn = calloc(1, sizeof(struct __apn_loop_conn));
+    if (!conn || !(conn->out = malloc(APN_LOOP_BUFFER_SIZE)) || !(conn->in = malloc(APN_LOOP_RECV_SIZE))) {
+        if (conn) {
+            free(conn->out);
+            free(conn);
+        }
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    conn->ctx = ctx;
+    conn->index = loop->count;
+    conn->state = APN_LOOP_CONN_DONE;
+    loop->conns[loop->count++] = conn;
+    return APN_SUCCESS;
+}
+
+apn_return apn_loop_send(apn_loop_t *const loop, const apn_payload_t *payload, apn_array_t *tokens,
+                         apn_array_t **invalid_tokens) {
+    assert(loop);
+    assert(payload);
+    assert(tokens);
+
+    if (0 == loop->count) {
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+
+    loop->tokens = tokens;
+    loop->invalid_tokens = NULL;
+    loop->collect_invalid_tokens = invalid_tokens ? 1 : 0;
+#ifdef APN_HAVE_LINUX_IO_URING_H
+    if (APN_LOOP_BACKEND_IO_URING == loop->backend) {
+        __apn_uring_register(loop);
+    }
+#endif
+
+    uint64_t count = apn_array_count(tokens);
+    for (uint32_t i = 0; i < loop->count; i++) {
+        struct __apn_loop_conn *conn = loop->conns[i];
+        apn_ctx_t *ctx = conn->ctx;
+        conn->begin = (uint32_t) (count * i / loop->count);
+        conn->end = (uint32_t) (count * (i + 1) / loop->count);
+        conn->next = conn->begin;
+        conn->state = APN_LOOP_CONN_DONE;
+        if (conn->begin == conn->end) {
+            continue;
+        }
+        if (ctx->pending_tokens) {
+            (void) apn_check_errors(ctx, 0, NULL);
+            ctx->pending_tokens = NULL;
+        }
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Sending notification to %u device(s)...", conn->end - conn->begin);
+        if (!(conn->message = apn_create_binary_message(payload)) || APN_ERROR == __apn_loop_attach(loop, conn)) {
+            conn->errcode = errno;
+            conn->state = APN_LOOP_CONN_FAILED;
+        }
+    }
+
+    apn_return ret = APN_SUCCESS;
+    for (;;) {
+        uint64_t now = __apn_loop_clock_ms();
+        int64_t timeout = -1;
+        uint32_t active = 0;
+        for (uint32_t i = 0; i < loop->count; i++) {
+            struct __apn_loop_conn *conn = loop->conns[i];
+            if (APN_LOOP_CONN_LINGER == conn->state && now >= conn->deadline) {
+                conn->state = APN_LOOP_CONN_FINISHING;
+                if (conn->receiving) {
+                    __apn_loop_submit_cancel(loop, conn);
+                }
+            }
+            if (APN_LOOP_CONN_CLOSING == conn->state && !conn->sending && !conn->receiving && !conn->cancelling) {
+                __apn_loop_recover(loop, conn);
+            }
+            if (APN_LOOP_CONN_FINISHING == conn->state && !conn->sending && !conn->receiving && !conn->cancelling) {
+                __apn_loop_detach(loop, conn);
+                conn->state = APN_LOOP_CONN_DONE;
+            }
+            switch (conn->state) {
+                case APN_LOOP_CONN_DONE:
+                case APN_LOOP_CONN_FAILED:
+                    break;
+                case APN_LOOP_CONN_LINGER: {
+                    int64_t left = (int64_t) (conn->deadline - now);
+                    if (timeout < 0 || left < timeout) {
+                        timeout = left;
+                    }
+                    active++;
+                    break;
+                }
+                case APN_LOOP_CONN_CLOSING:
+                case APN_LOOP_CONN_FINISHING:
+                    /* Nothing in flight on epoll, handle it in the next pass */
+                    if (APN_LOOP_BACKEND_EPOLL == loop->backend) {
+                        timeout = 0;
+                    }
+                    active++;
+                    break;
+                default:
+                    active++;
+                    break;
+            }
+        }
+        if (0 == active) {
+            break;
+        }
+        if (APN_ERROR == __apn_loop_wait(loop, timeout)) {
+            int errcode = errno;
+            char error[APN_ERROR_STRING_SIZE];
+            for (uint32_t i = 0; i < loop->count; i++) {
+                struct __apn_loop_conn *conn = loop->conns[i];
+                if (conn->state < APN_LOOP_CONN_DONE) {
+                    apn_log(conn->ctx, APN_LOG_LEVEL_ERROR, "Waiting for events failed: %s (errno: %d)",
+                            apn_error_string_r(errcode, error, sizeof(error)), errcode);
+                    __apn_loop_detach(loop, conn);
+                    apn_close(conn->ctx);
+                    conn->errcode = errcode;
+                    conn->state = APN_LOOP_CONN_FAILED;
+                }
+            }
+        }
+    }
+
+    int errcode = 0;
+    for (uint32_t i = 0; i < loop->count; i++) {
+        struct __apn_loop_conn *conn = loop->conns[i];
+        if (APN_LOOP_CONN_FAILED == conn->state && 0 == errcode) {
+            errcode = conn->errcode ? conn->errcode : APN_ERR_UNKNOWN;
+            ret = APN_ERROR;
+        }
+        apn_binary_message_free(conn->message);
+        conn->message = NULL;
+        apn_invalid_tokens_flush(conn->ctx);
+    }
+
+    if (invalid_tokens) {
+        *invalid_tokens = loop->invalid_tokens;
+    } else {
+        apn_array_free(loop->invalid_tokens);
+    }
+    loop->invalid_tokens = NULL;
+    loop->tokens = NULL;
+    errno = errcode;
+    return ret;
+}
+
+void apn_loop_set_error_timeout(apn_loop_t *const loop, uint32_t timeout) {
+    assert(loop);
+    loop->error_timeout = timeout;
+}
+
+void apn_loop_stats(const apn_loop_t *const loop, apn_loop_stats_t *const stats) {
+    assert(loop);
+    assert(stats);
+    *stats = loop->stats;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_LOOP_H__
+#define __APN_LOOP_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+#include "apn_array.h"
+#include "apn_payload.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of contexts driven by one loop */
+#define APN_LOOP_MAX_CONTEXTS 1024
+
+/** Default time in milliseconds to wait for an error response after the last frame, as ::apn_send() does */
+#define APN_LOOP_ERROR_TIMEOUT 1000
+
+/**
+ * I/O backends of a loop
+ */
+typedef enum __apn_loop_backend {
+    /** Readiness notification with epoll, one send() or recv() per buffer */
+    APN_LOOP_BACKEND_EPOLL = 0,
+    /** Batched submissions to io_uring, receive buffers registered with the kernel. Linux 5.11 or later */
+    APN_LOOP_BACKEND_IO_URING = 1
+} apn_loop_backend;
+
+/**
+ * Event loop which sends over many binary protocol connections from a single thread (Linux only).
+ *
+ * While a loop sends, it moves the records of the memory BIOs TLS of each connection runs over (see
+ * apn_transport.h) itself: frames of many notifications are encrypted into one buffer which is written with
+ * a single operation, and all sockets are served by one epoll_wait() or io_uring_enter() call. The contexts are connected and reconnected with ::apn_connect() as usual, so a
+ * reconnect blocks the loop for the duration of the handshake.
+ */
+typedef struct __apn_loop_t apn_loop_t;
+
+/**
+ * System calls made by a loop
+ */
+typedef struct __apn_loop_stats_t {
+    /** epoll_wait() or io_uring_enter() calls */
+    uint64_t waits;
+    /** send(), recv() and epoll_ctl() calls, 0 with io_uring */
+    uint64_t io_calls;
+    /** Completed sends and receives */
+    uint64_t completions;
+} apn_loop_stats_t;
+
+/**
+ * Creates a loop.
+ *
+ * @param[in] backend - I/O backend.
+ *
+ * @return Pointer to a loop or NULL on error with errno set, ENOSYS if the backend is not supported by the
+ * kernel. Must be freed with ::apn_loop_free()
+ */
+__apn_export__ apn_loop_t *apn_loop_init(apn_loop_backend backend)
+        __apn_attribute_warn_unused_result__;
+
+/**
+ * Frees a loop. The contexts are not freed.
+ *
+ * @param[in] loop - Pointer to a loop, can be NULL.
+ */
+__apn_export__ void apn_loop_free(apn_loop_t *loop);
+
+/**
+ * Adds a context to a loop. The context must use the binary protocol over a socket, without ::APN_OPTION_KTLS
+ * and a transport set by ::apn_set_transport(). It is connected by ::apn_loop_send() if needed. It can be used
+ * on its own between sends but must outlive the loop.
+ *
+ * @param[in] loop - Pointer to a loop. Cannot be NULL.
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_loop_add(apn_loop_t *const loop, apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Sets the time to wait for an error response after the last frame of each connection.
+ * Default is ::APN_LOOP_ERROR_TIMEOUT
+ *
+ * @param[in] loop - Pointer to a loop. Cannot be NULL.
+ * @param[in] timeout - Timeout in milliseconds.
+ */
+__apn_export__ void apn_loop_set_error_timeout(apn_loop_t *const loop, uint32_t timeout)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sends a notification to `tokens`, split into equal contiguous ranges, one per context. Behaves as ::apn_send()
+ * on each context: invalid tokens are reported to the context callbacks and collected in `invalid_tokens`,
+ * the context's token store and stats are used, and sending resumes after errors when ::APN_OPTION_RECONNECT
+ * is set. Error responses are waited for after the last frame of each connection, see
+ * ::apn_loop_set_error_timeout().
+ *
+ * @param[in] loop - Pointer to a loop with at least one context. Cannot be NULL.
+ * @param[in] payload - Pointer to `payload` structure. Cannot be NULL.
+ * @param[in] tokens - Array of device tokens. Cannot be NULL.
+ * @param[out] invalid_tokens - Pointer to a array which will contain invalid tokens. Can be NULL.
+ * Must be freed with ::apn_array_free()
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR if a connection failed, with the error of the first one stored in `errno`.
+ */
+__apn_export__ apn_return apn_loop_send(apn_loop_t *const loop, const apn_payload_t *payload, apn_array_t *tokens,
+                                        apn_array_t **invalid_tokens)
+        __apn_attribute_nonnull__((1, 2, 3));
+
+/**
+ * Returns counters of system calls made by a loop since it was created.
+ *
+ * @param[in] loop - Pointer to a loop. Cannot be NULL.
+ * @param[out] stats - Pointer to a structure to fill. Cannot be NULL.
+ */
+__apn_export__ void apn_loop_stats(const apn_loop_t *const loop, apn_loop_stats_t *const stats)
+        __apn_attribute_nonnull__((1, 2));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
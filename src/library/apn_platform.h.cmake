@@ -31,14 +31,20 @@
 #cmakedefine APN_HAVE_NETDB_H
 #cmakedefine APN_HAVE_CTYPE_H
 #cmakedefine APN_HAVE_FCNTL_H
+#cmakedefine APN_HAVE_NETINET_TCP_H
 #cmakedefine APN_HAVE_STRINGS_H
 #cmakedefine APN_HAVE_NETINET_IN_H
 #cmakedefine APN_HAVE_SYS_SOCKET_H
+#cmakedefine APN_HAVE_SYS_SENDFILE_H
+#cmakedefine APN_HAVE_SYS_EPOLL_H
+#cmakedefine APN_HAVE_LINUX_IO_URING_H
 
 #cmakedefine APN_HAVE_STRERROR_R
 #cmakedefine APN_HAVE_GLIBC_STRERROR_R
 #cmakedefine APN_HAVE_POSIX_STRERROR_R
 
+#cmakedefine APN_HAVE_HTTP2
+
 typedef enum __apn_return {
     APN_SUCCESS,
     APN_ERROR
@@ -0,0 +1,1221 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apn_pool.h"
+#include "apn_private.h"
+#include "apn_stats_private.h"
+#include "apn_strings.h"
+#include "apn_tokens.h"
+
+/** Maximum number of tokens in a batch built by apn_pool_push() while all workers are busy */
+#define APN_POOL_CHUNK_SIZE 1000
+
+/** Number of tokens a connection takes at a time from its range of an ::apn_pool_send() array */
+#define APN_POOL_RANGE_CHUNK 256
+
+/** Interval between adjustments of the number of active connections */
+#define APN_POOL_TUNE_INTERVAL_US 5000000
+
+/** Longest sleep waiting for a token bucket, a low lane job checks the high lane after it */
+#define APN_POOL_BUCKET_WAIT_US 10000
+
+/** Time after which a notification without an error response is taken as accepted, milliseconds */
+#define APN_POOL_SETTLE_TIMEOUT 200
+
+/** Maximum number of unconfirmed segments of a connection, see struct __apn_pool_segment */
+#define APN_POOL_SEGMENTS 16
+
+/* Completion counter of a set of jobs. Guarded by the mutex of the application */
+struct __apn_pool_group {
+    uint32_t pending;
+    int error;
+};
+
+/*
+ * Token array sent by apn_pool_send(). Every connection has a range [begin, end) packed in one
+ * 64-bit word: the owner takes chunks from the front, a connection whose range is empty steals
+ * the back half of the largest remaining range. Both are done with compare-and-swap.
+ */
+struct __apn_pool_campaign {
+    uint32_t ranges_count;
+    uint64_t *ranges;
+};
+
+struct __apn_pool_job {
+    const apn_payload_t *payload;
+    apn_array_t *tokens;
+    uint32_t begin;
+    uint32_t end;
+    uint8_t owns_tokens;
+    apn_pool_lane lane;
+    /* Set when the job has been sent; it is completed once its tokens are no longer needed */
+    uint8_t done;
+    /* Segments and retry jobs referring to the tokens of the job. Guarded by the mutex of the application */
+    uint32_t refs;
+    /* Job whose dropped notifications this job sends again, completed after it */
+    struct __apn_pool_job *parent;
+    struct __apn_pool_group *group;
+    struct __apn_pool_campaign *campaign;
+    uint32_t range;
+    struct __apn_pool_job *next;
+};
+
+/*
+ * Tokens [begin, end) of a job written by a connection with identifiers from `id_base`. Apple drops every
+ * notification written after a failed one: the library sends those of its pending call again and passes
+ * the others to __apn_pool_unsent(), which queues them again. A segment is confirmed once no error response
+ * arrived APN_POOL_SETTLE_TIMEOUT after it was written, or after a reconnect if it is not part of the
+ * pending call; its job is completed after its last segment.
+ */
+struct __apn_pool_segment {
+    struct __apn_pool_job *job;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t id_base;
+    uint64_t written;
+};
+
+/* Token bucket, `rate` tokens per second up to `burst`. No limit if `rate` is 0 */
+struct __apn_pool_bucket {
+    pthread_mutex_t mutex;
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t updated;
+};
+
+struct __apn_pool_queue {
+    struct __apn_pool_job *head;
+    struct __apn_pool_job *tail;
+    uint32_t queued;
+    struct __apn_pool_bucket bucket;
+};
+
+struct __apn_pool_app;
+
+struct __apn_pool_connection {
+    struct __apn_pool_app *app;
+    apn_ctx_t *ctx;
+    pthread_t thread;
+    uint32_t index;
+    uint8_t started;
+    /* Unconfirmed segments, oldest first. Used by the worker thread only */
+    struct __apn_pool_segment segments[APN_POOL_SEGMENTS];
+    uint32_t segments_count;
+    /* ctx->connection_id when the segments were last confirmed */
+    uint32_t connection_id;
+};
+
+struct __apn_pool_app {
+    apn_pool_t *pool;
+    char *app_id;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct __apn_pool_queue lanes[APN_POOL_LANES];
+    /* Low lane batch being filled by apn_pool_push() */
+    struct __apn_pool_job *batch;
+    struct __apn_pool_group stream;
+    uint32_t idle;
+    uint8_t stop;
+    uint32_t connections_count;
+    struct __apn_pool_connection *connections;
+    /* Connections with index below `active` take jobs. Tuned only with the adaptive rate enabled */
+    uint32_t active;
+    uint32_t max_rate;
+    uint64_t tune_at;
+    uint64_t tune_shutdowns;
+    uint64_t tune_decreases;
+};
+
+struct __apn_pool_t {
+    pthread_mutex_t mutex;
+    struct __apn_pool_app *apps[APN_POOL_MAX_APPS];
+    uint32_t apps_count;
+    apn_pool_invalid_token_callback invalid_token_callback;
+    apn_pool_invalid_tokens_sink invalid_tokens_sink;
+    void *invalid_tokens_user;
+};
+
+static void __apn_pool_token_free(char *token) {
+    free(token);
+}
+
+/* Invalid tokens sink of a connection context, called from its worker thread */
+static void __apn_pool_invalid_tokens(const apn_array_t *const tokens, const uint32_t *const indices, uint32_t count,
+                                      void *user) {
+    struct __apn_pool_connection *connection = user;
+    const apn_pool_t *pool = connection->app->pool;
+    if (pool->invalid_token_callback) {
+        for (uint32_t i = 0; i < count; i++) {
+            pool->invalid_token_callback(connection->app->app_id, apn_array_item_at_index(tokens, indices[i]));
+        }
+    }
+    if (pool->invalid_tokens_sink) {
+        pool->invalid_tokens_sink(connection->app->app_id, tokens, indices, count, pool->invalid_tokens_user);
+    }
+}
+
+static struct __apn_pool_app *__apn_pool_find(apn_pool_t *const pool, const char *const app_id) {
+    uint32_t count = __atomic_load_n(&pool->apps_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        if (0 == strcmp(pool->apps[i]->app_id, app_id)) {
+            return pool->apps[i];
+        }
+    }
+    errno = APN_ERR_APP_NOT_REGISTERED;
+    return NULL;
+}
+
+static apn_pool_lane __apn_pool_lane_of(const apn_payload_t *const payload) {
+    return APN_NOTIFICATION_PRIORITY_HIGH == apn_payload_priority(payload) ? APN_POOL_LANE_HIGH : APN_POOL_LANE_LOW;
+}
+
+/* Must be called with the mutex of the application locked */
+static void __apn_pool_enqueue(struct __apn_pool_app *const app, struct __apn_pool_job *const job) {
+    struct __apn_pool_queue *lane = &app->lanes[job->lane];
+    job->group->pending++;
+    job->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = job;
+    } else {
+        lane->head = job;
+    }
+    lane->tail = job;
+    __atomic_store_n(&lane->queued, lane->queued + 1, __ATOMIC_RELEASE);
+}
+
+/* Must be called with the mutex of the application locked */
+static struct __apn_pool_job *__apn_pool_dequeue(struct __apn_pool_app *const app, apn_pool_lane index) {
+    struct __apn_pool_queue *lane = &app->lanes[index];
+    struct __apn_pool_job *job = lane->head;
+    if (job) {
+        lane->head = job->next;
+        if (!lane->head) {
+            lane->tail = NULL;
+        }
+        __atomic_store_n(&lane->queued, lane->queued - 1, __ATOMIC_RELEASE);
+    }
+    return job;
+}
+
+/* Must be called with the mutex of the application locked */
+static struct __apn_pool_job *__apn_pool_take(struct __apn_pool_app *const app) {
+    struct __apn_pool_job *job = __apn_pool_dequeue(app, APN_POOL_LANE_HIGH);
+    if (!job) {
+        job = __apn_pool_dequeue(app, APN_POOL_LANE_LOW);
+    }
+    if (!job && app->batch) {
+        /* An idle worker does not wait for the batch to fill up */
+        job = app->batch;
+        app->batch = NULL;
+        job->end = apn_array_count(job->tokens);
+        job->group->pending++;
+        job->next = NULL;
+    }
+    return job;
+}
+
+/* Must be called with the mutex of the application locked */
+static void __apn_pool_wake(struct __apn_pool_app *const app) {
+    /* Inactive connections wait on the same condition and would swallow a signal */
+    if (__atomic_load_n(&app->active, __ATOMIC_RELAXED) < app->connections_count) {
+        pthread_cond_broadcast(&app->work);
+    } else {
+        pthread_cond_signal(&app->work);
+    }
+}
+
+static void __apn_pool_release(struct __apn_pool_app *const app, struct __apn_pool_job *const job);
+
+/* Must be called with the mutex of the application locked */
+static void __apn_pool_complete(struct __apn_pool_app *const app, struct __apn_pool_job *const job, int error) {
+    struct __apn_pool_group *group = job->group;
+    struct __apn_pool_job *parent = job->parent;
+    if (error && !group->error) {
+        group->error = error;
+    }
+    if (job->owns_tokens) {
+        apn_array_free(job->tokens);
+    }
+    free(job);
+    if (0 == --group->pending) {
+        pthread_cond_broadcast(&app->done);
+    }
+    if (parent) {
+        __apn_pool_release(app, parent);
+    }
+}
+
+/* Drops a reference to a job and completes it if it is done. Must be called with the mutex of the application locked */
+static void __apn_pool_release(struct __apn_pool_app *const app, struct __apn_pool_job *const job) {
+    if (0 == --job->refs && job->done) {
+        __apn_pool_complete(app, job, 0);
+    }
+}
+
+static void __apn_pool_sleep_us(uint64_t delay) {
+    struct timespec ts = {(time_t) (delay / 1000000), (long) (delay % 1000000) * 1000};
+    while (-1 == nanosleep(&ts, &ts) && EINTR == errno) {
+    }
+}
+
+static void __apn_pool_bucket_init(struct __apn_pool_bucket *const bucket) {
+    pthread_mutex_init(&bucket->mutex, NULL);
+    bucket->rate = 0;
+    bucket->burst = 0;
+    bucket->tokens = 0;
+    bucket->updated = 0;
+}
+
+/*
+ * Takes up to `wanted` tokens, waiting for at least one. Returns 0 if none became available within
+ * APN_POOL_BUCKET_WAIT_US
+ */
+static uint32_t __apn_pool_bucket_take(struct __apn_pool_bucket *const bucket, uint32_t wanted) {
+    pthread_mutex_lock(&bucket->mutex);
+    for (uint8_t waited = 0;; waited = 1) {
+        if (0 == bucket->rate) {
+            pthread_mutex_unlock(&bucket->mutex);
+            return wanted;
+        }
+        uint64_t now = apn_clock_us();
+        bucket->tokens += (double) (now - bucket->updated) * bucket->rate / 1e6;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+        bucket->updated = now;
+        if (bucket->tokens >= 1) {
+            uint32_t granted = bucket->tokens < wanted ? (uint32_t) bucket->tokens : wanted;
+            bucket->tokens -= granted;
+            pthread_mutex_unlock(&bucket->mutex);
+            return granted;
+        }
+        if (waited) {
+            pthread_mutex_unlock(&bucket->mutex);
+            return 0;
+        }
+        uint64_t delay = (uint64_t) ((1 - bucket->tokens) * 1e6 / bucket->rate) + 1;
+        pthread_mutex_unlock(&bucket->mutex);
+        __apn_pool_sleep_us(delay < APN_POOL_BUCKET_WAIT_US ? delay : APN_POOL_BUCKET_WAIT_US);
+        pthread_mutex_lock(&bucket->mutex);
+    }
+}
+
+#define __APN_POOL_RANGE(__begin, __end) (((uint64_t) (__begin) << 32) | (uint64_t) (__end))
+#define __APN_POOL_RANGE_BEGIN(__range) ((uint32_t) ((__range) >> 32))
+#define __APN_POOL_RANGE_END(__range) ((uint32_t) (__range))
+
+/* Takes the next chunk of range `index`, returns 0 if the range is empty */
+static uint8_t __apn_pool_range_take(struct __apn_pool_campaign *const campaign, uint32_t index,
+                                     uint32_t *begin, uint32_t *end) {
+    uint64_t *range = &campaign->ranges[index];
+    uint64_t value = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t range_begin = __APN_POOL_RANGE_BEGIN(value);
+        uint32_t range_end = __APN_POOL_RANGE_END(value);
+        if (range_begin >= range_end) {
+            return 0;
+        }
+        uint32_t chunk_end = range_end - range_begin > APN_POOL_RANGE_CHUNK ?
+                             range_begin + APN_POOL_RANGE_CHUNK : range_end;
+        if (__atomic_compare_exchange_n(range, &value, __APN_POOL_RANGE(chunk_end, range_end), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *begin = range_begin;
+            *end = chunk_end;
+            return 1;
+        }
+    }
+}
+
+/* Gives back the unsent part of a chunk taken by __apn_pool_range_take(), only the owner moves `begin` */
+static void __apn_pool_range_return(struct __apn_pool_campaign *const campaign, uint32_t index, uint32_t begin) {
+    uint64_t *range = &campaign->ranges[index];
+    uint64_t value = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(range, &value, __APN_POOL_RANGE(begin, __APN_POOL_RANGE_END(value)), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+/*
+ * Moves the back half of the largest range to the empty range `index`, returns 0 if nothing is left.
+ * Only the connection owning range `index` stores into it while it is empty, thieves skip empty ranges.
+ */
+static uint8_t __apn_pool_range_steal(struct __apn_pool_campaign *const campaign, uint32_t index) {
+    for (;;) {
+        uint32_t victim = 0;
+        uint32_t victim_size = 0;
+        for (uint32_t i = 0; i < campaign->ranges_count; i++) {
+            uint64_t value = __atomic_load_n(&campaign->ranges[i], __ATOMIC_ACQUIRE);
+            uint32_t range_begin = __APN_POOL_RANGE_BEGIN(value);
+            uint32_t range_end = __APN_POOL_RANGE_END(value);
+            uint32_t size = range_end > range_begin ? range_end - range_begin : 0;
+            if (i != index && size > victim_size) {
+                victim = i;
+                victim_size = size;
+            }
+        }
+        if (0 == victim_size) {
+            return 0;
+        }
+
+        uint64_t value = __atomic_load_n(&campaign->ranges[victim], __ATOMIC_ACQUIRE);
+        uint32_t range_begin = __APN_POOL_RANGE_BEGIN(value);
+        uint32_t range_end = __APN_POOL_RANGE_END(value);
+        if (range_begin >= range_end) {
+            continue;
+        }
+        uint32_t middle = range_begin + (range_end - range_begin) / 2;
+        if (__atomic_compare_exchange_n(&campaign->ranges[victim], &value, __APN_POOL_RANGE(range_begin, middle),
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&campaign->ranges[index], __APN_POOL_RANGE(middle, range_end), __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+}
+
+/*
+ * Removes a connection when Apple shut down a connection since the last adjustment, adds one when
+ * all active connections run at the maximum rate and none of them had to slow down.
+ * Called by workers without the mutex locked; one of them does the adjustment.
+ */
+static void __apn_pool_tune(struct __apn_pool_app *const app) {
+    uint64_t now = apn_clock_us();
+    uint64_t tune_at = __atomic_load_n(&app->tune_at, __ATOMIC_RELAXED);
+    if (0 == app->max_rate || now < tune_at ||
+        !__atomic_compare_exchange_n(&app->tune_at, &tune_at, now + APN_POOL_TUNE_INTERVAL_US, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uint32_t active = __atomic_load_n(&app->active, __ATOMIC_RELAXED);
+    uint64_t shutdowns = 0;
+    uint64_t decreases = 0;
+    uint32_t saturated = 0;
+    for (uint32_t i = 0; i < app->connections_count; i++) {
+        apn_stats_t *stats = &app->connections[i].ctx->stats;
+        shutdowns += APN_STATS_LOAD(stats->reconnects_shutdown);
+        decreases += APN_STATS_LOAD(stats->rate_decreases);
+        if (i < active && APN_STATS_LOAD(stats->send_rate) * 10 >= (uint64_t) app->max_rate * 9) {
+            saturated++;
+        }
+    }
+
+    if (shutdowns > app->tune_shutdowns) {
+        if (active > 1) {
+            __atomic_store_n(&app->active, active - 1, __ATOMIC_RELAXED);
+        }
+    } else if (decreases == app->tune_decreases && saturated == active && active < app->connections_count) {
+        pthread_mutex_lock(&app->mutex);
+        __atomic_store_n(&app->active, active + 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&app->work);
+        pthread_mutex_unlock(&app->mutex);
+    }
+    app->tune_shutdowns = shutdowns;
+    app->tune_decreases = decreases;
+}
+
+/* Must be called with the mutex of the application locked */
+static void __apn_pool_finish(struct __apn_pool_app *const app, struct __apn_pool_job *const job, int error) {
+    job->done = 1;
+    if (error && !job->group->error) {
+        job->group->error = error;
+    }
+    if (0 == job->refs) {
+        __apn_pool_complete(app, job, 0);
+    }
+}
+
+/* Queues tokens [begin, end) of a job again, they were dropped after a failed notification */
+static void __apn_pool_retry(struct __apn_pool_app *const app, struct __apn_pool_job *const job, uint32_t begin,
+                             uint32_t end) {
+    struct __apn_pool_job *retry = calloc(1, sizeof(struct __apn_pool_job));
+    pthread_mutex_lock(&app->mutex);
+    if (!retry) {
+        if (!job->group->error) {
+            job->group->error = ENOMEM;
+        }
+        pthread_mutex_unlock(&app->mutex);
+        return;
+    }
+    retry->payload = job->payload;
+    retry->tokens = job->tokens;
+    retry->begin = begin;
+    retry->end = end;
+    retry->lane = job->lane;
+    retry->group = job->group;
+    /* The job owning the tokens is kept until all its retries are completed */
+    retry->parent = job->parent ? job->parent : job;
+    retry->parent->refs++;
+    __apn_pool_enqueue(app, retry);
+    __apn_pool_wake(app);
+    pthread_mutex_unlock(&app->mutex);
+}
+
+/* Confirms the first `count` segments of a connection */
+static void __apn_pool_segments_drop(struct __apn_pool_connection *const connection, uint32_t count) {
+    if (0 == count) {
+        return;
+    }
+    struct __apn_pool_app *app = connection->app;
+    pthread_mutex_lock(&app->mutex);
+    for (uint32_t i = 0; i < count; i++) {
+        __apn_pool_release(app, connection->segments[i].job);
+    }
+    pthread_mutex_unlock(&app->mutex);
+    connection->segments_count -= count;
+    memmove(connection->segments, connection->segments + count,
+            sizeof(struct __apn_pool_segment) * connection->segments_count);
+}
+
+/* Records tokens [begin, end) of a job written as the pending call of the context of a connection */
+static void __apn_pool_segment_add(struct __apn_pool_connection *const connection, struct __apn_pool_job *const job,
+                                   uint32_t begin, uint32_t end) {
+    uint32_t id_base = connection->ctx->pending_id_base;
+    uint64_t now = apn_clock_us();
+    if (connection->segments_count > 0) {
+        struct __apn_pool_segment *last = &connection->segments[connection->segments_count - 1];
+        if (last->job == job && last->id_base == id_base && last->end == begin) {
+            last->end = end;
+            last->written = now;
+            return;
+        }
+    }
+    struct __apn_pool_segment *segment = &connection->segments[connection->segments_count++];
+    segment->job = job;
+    segment->begin = begin;
+    segment->end = end;
+    segment->id_base = id_base;
+    segment->written = now;
+    pthread_mutex_lock(&connection->app->mutex);
+    job->refs++;
+    pthread_mutex_unlock(&connection->app->mutex);
+}
+
+/*
+ * Confirms segments after a call which read error responses that arrived until `read_at`. After a reconnect
+ * only the segments of the pending call are left, they were written again
+ */
+static void __apn_pool_segments_sync(struct __apn_pool_connection *const connection, uint64_t read_at) {
+    apn_ctx_t *ctx = connection->ctx;
+    uint32_t confirmed = 0;
+    if (!ctx->pending_tokens) {
+        confirmed = connection->segments_count;
+    } else if (connection->connection_id != ctx->connection_id) {
+        uint64_t now = apn_clock_us();
+        for (uint32_t i = 0; i < connection->segments_count; i++) {
+            struct __apn_pool_segment *segment = &connection->segments[i];
+            if (segment->job->tokens == ctx->pending_tokens && segment->id_base == ctx->pending_id_base) {
+                segment->written = now;
+            } else {
+                confirmed = i + 1;
+            }
+        }
+    } else {
+        while (confirmed < connection->segments_count &&
+               connection->segments[confirmed].written + APN_POOL_SETTLE_TIMEOUT * 1000 <= read_at) {
+            confirmed++;
+        }
+    }
+    connection->connection_id = ctx->connection_id;
+    __apn_pool_segments_drop(connection, confirmed);
+}
+
+/*
+ * Unsent callback of a connection context, see apn_unsent_callback: reports the failed notification and queues
+ * the dropped ones again. Called from the worker thread of the connection
+ */
+static void __apn_pool_unsent(void *user, uint32_t id, int errcode, uint32_t begin_id, uint32_t end_id) {
+    struct __apn_pool_connection *connection = user;
+    struct __apn_pool_app *app = connection->app;
+    uint32_t resolved = 0;
+    for (uint32_t i = 0; i < connection->segments_count; i++) {
+        struct __apn_pool_segment *segment = &connection->segments[i];
+        struct __apn_pool_job *job = segment->job;
+        uint32_t first_id = segment->id_base + segment->begin;
+        uint32_t last_id = segment->id_base + segment->end;
+        if (errcode && id >= first_id && id < last_id) {
+            if (APN_ERR_TOKEN_INVALID == errcode) {
+                uint32_t index = id - segment->id_base;
+                __apn_pool_invalid_tokens(job->tokens, &index, 1, connection);
+            } else if (APN_ERR_SERVICE_SHUTDOWN != errcode) {
+                pthread_mutex_lock(&app->mutex);
+                if (!job->group->error) {
+                    job->group->error = errcode;
+                }
+                pthread_mutex_unlock(&app->mutex);
+            }
+        }
+        uint32_t retry_begin = first_id > begin_id ? first_id : begin_id;
+        uint32_t retry_end = last_id < end_id ? last_id : end_id;
+        if (retry_begin < retry_end) {
+            __apn_pool_retry(app, job, retry_begin - segment->id_base, retry_end - segment->id_base);
+        }
+        if (last_id <= end_id) {
+            resolved = i + 1;
+        }
+    }
+    __apn_pool_segments_drop(connection, resolved);
+}
+
+/*
+ * Waits until the segments of a connection are confirmed. Invalid tokens are reported through the callback,
+ * notifications dropped after a failed one are sent again or queued
+ */
+static void __apn_pool_settle(struct __apn_pool_connection *const connection) {
+    while (connection->segments_count > 0) {
+        uint64_t now = apn_clock_us();
+        uint64_t confirmed_at = connection->segments[connection->segments_count - 1].written +
+                                APN_POOL_SETTLE_TIMEOUT * 1000;
+        uint32_t timeout = confirmed_at > now ? (uint32_t) ((confirmed_at - now + 999) / 1000) : 0;
+        /* No response within the timeout confirms all segments */
+        if (APN_SUCCESS == apn_check_errors(connection->ctx, timeout, NULL)) {
+            now = confirmed_at;
+        }
+        __apn_pool_segments_sync(connection, now);
+    }
+}
+
+/*
+ * Sends tokens [begin, end) of a job. A low lane send stops after the current frame when a high lane
+ * job is queued, `sent_end` is set to the first token not sent
+ */
+static int __apn_pool_send_range(struct __apn_pool_connection *const connection, struct __apn_pool_job *const job,
+                                 uint32_t begin, uint32_t end, uint32_t *sent_end) {
+    struct __apn_pool_app *app = connection->app;
+    apn_ctx_t *ctx = connection->ctx;
+    int error = 0;
+    *sent_end = begin;
+    if (!ctx->ssl && APN_ERROR == apn_connect(ctx)) {
+        return errno ? errno : APN_ERR_UNABLE_TO_ESTABLISH_CONNECTION;
+    }
+    if (APN_POOL_SEGMENTS == connection->segments_count) {
+        __apn_pool_settle(connection);
+    }
+
+    uint64_t start = apn_clock_us();
+    ctx->yield = APN_POOL_LANE_LOW == job->lane ? &app->lanes[APN_POOL_LANE_HIGH].queued : NULL;
+    /* Errors of earlier notifications are passed to __apn_pool_unsent(), only tokens not sent fail the job */
+    if (APN_ERROR == apn_send_range(ctx, job->payload, job->tokens, begin, end, NULL, sent_end) && *sent_end < end) {
+        error = errno ? errno : APN_ERR_UNKNOWN;
+    }
+    ctx->yield = NULL;
+    if (!error && *sent_end > begin && ctx->pending_tokens == job->tokens) {
+        __apn_pool_segment_add(connection, job, begin, *sent_end);
+    }
+    __apn_pool_segments_sync(connection, start);
+    return error;
+}
+
+static int __apn_pool_run(struct __apn_pool_connection *const connection, struct __apn_pool_job *const job);
+
+/* Sends queued high lane jobs, called by a low lane job between frames */
+static void __apn_pool_run_high(struct __apn_pool_connection *const connection) {
+    struct __apn_pool_app *app = connection->app;
+    while (__atomic_load_n(&app->lanes[APN_POOL_LANE_HIGH].queued, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&app->mutex);
+        struct __apn_pool_job *job = __apn_pool_dequeue(app, APN_POOL_LANE_HIGH);
+        pthread_mutex_unlock(&app->mutex);
+        if (!job) {
+            break;
+        }
+        int error = __apn_pool_run(connection, job);
+        pthread_mutex_lock(&app->mutex);
+        __apn_pool_finish(app, job, error);
+        pthread_mutex_unlock(&app->mutex);
+    }
+}
+
+/*
+ * Sends a job in chunks limited by the token bucket of its lane. A connection which fails leaves
+ * the rest of its range of an apn_pool_send() array to be stolen by the others
+ */
+static int __apn_pool_run(struct __apn_pool_connection *const connection, struct __apn_pool_job *const job) {
+    struct __apn_pool_app *app = connection->app;
+    struct __apn_pool_bucket *bucket = &app->lanes[job->lane].bucket;
+    for (;;) {
+        if (APN_POOL_LANE_LOW == job->lane) {
+            __apn_pool_run_high(connection);
+        }
+
+        uint32_t begin = job->begin;
+        uint32_t end = job->end;
+        if (job->campaign) {
+            if (!__apn_pool_range_take(job->campaign, job->range, &begin, &end)) {
+                if (!__apn_pool_range_steal(job->campaign, job->range)) {
+                    return 0;
+                }
+                continue;
+            }
+        } else if (begin >= end) {
+            return 0;
+        }
+
+        uint32_t granted = __apn_pool_bucket_take(bucket, end - begin);
+        uint32_t sent_end = begin;
+        int error = 0;
+        if (granted > 0) {
+            error = __apn_pool_send_range(connection, job, begin, begin + granted, &sent_end);
+        }
+        if (job->campaign) {
+            if (sent_end < end) {
+                __apn_pool_range_return(job->campaign, job->range, sent_end);
+            }
+        } else {
+            job->begin = sent_end;
+        }
+        if (error) {
+            return error;
+        }
+        __apn_pool_tune(app);
+    }
+}
+
+/* Sends jobs of the application through one connection, high lane first */
+static void *__apn_pool_worker(void *arg) {
+    struct __apn_pool_connection *connection = arg;
+    struct __apn_pool_app *app = connection->app;
+
+    pthread_mutex_lock(&app->mutex);
+    for (;;) {
+        struct __apn_pool_job *job = NULL;
+        if (connection->index < __atomic_load_n(&app->active, __ATOMIC_RELAXED)) {
+            job = __apn_pool_take(app);
+        }
+        if (!job) {
+            if (connection->segments_count > 0) {
+                pthread_mutex_unlock(&app->mutex);
+                __apn_pool_settle(connection);
+                pthread_mutex_lock(&app->mutex);
+                continue;
+            }
+            if (app->stop) {
+                break;
+            }
+            if (connection->index >= __atomic_load_n(&app->active, __ATOMIC_RELAXED)) {
+                /* Inactive connection, woken up by __apn_pool_tune() */
+                pthread_cond_wait(&app->work, &app->mutex);
+                continue;
+            }
+            app->idle++;
+            pthread_cond_wait(&app->work, &app->mutex);
+            app->idle--;
+            continue;
+        }
+        pthread_mutex_unlock(&app->mutex);
+
+        int error = __apn_pool_run(connection, job);
+        __apn_pool_tune(app);
+
+        pthread_mutex_lock(&app->mutex);
+        __apn_pool_finish(app, job, error);
+    }
+    pthread_mutex_unlock(&app->mutex);
+    return NULL;
+}
+
+static void __apn_pool_app_free(struct __apn_pool_app *app) {
+    if (!app) {
+        return;
+    }
+    pthread_mutex_lock(&app->mutex);
+    if (app->batch) {
+        app->batch->end = apn_array_count(app->batch->tokens);
+        __apn_pool_enqueue(app, app->batch);
+        app->batch = NULL;
+    }
+    app->stop = 1;
+    pthread_cond_broadcast(&app->work);
+    pthread_mutex_unlock(&app->mutex);
+
+    for (uint32_t i = 0; i < app->connections_count; i++) {
+        struct __apn_pool_connection *connection = &app->connections[i];
+        if (connection->started) {
+            pthread_join(connection->thread, NULL);
+        }
+        apn_free(connection->ctx);
+    }
+    free(app->connections);
+
+    for (uint32_t i = 0; i < APN_POOL_LANES; i++) {
+        pthread_mutex_destroy(&app->lanes[i].bucket.mutex);
+    }
+    pthread_cond_destroy(&app->work);
+    pthread_cond_destroy(&app->done);
+    pthread_mutex_destroy(&app->mutex);
+    free(app->app_id);
+    free(app);
+}
+
+static apn_ctx_t *__apn_pool_context(const apn_identity_t *const identity,
+                                     struct __apn_pool_connection *const connection) {
+    apn_ctx_t *ctx = apn_init();
+    if (!ctx) {
+        return NULL;
+    }
+    apn_set_log_level(ctx, identity->log_level);
+    apn_set_log_callback(ctx, identity->log_callback);
+    apn_set_invalid_tokens_sink(ctx, __apn_pool_invalid_tokens, connection);
+    ctx->unsent_callback = __apn_pool_unsent;
+    ctx->unsent_user = connection;
+    apn_set_token_store(ctx, identity->token_store);
+    apn_set_mode(ctx, identity->mode);
+    apn_set_behavior(ctx, identity->options | APN_OPTION_RECONNECT | APN_OPTION_ASYNC_ERRORS);
+    if (identity->initial_rate > 0) {
+        apn_set_adaptive_rate(ctx, identity->initial_rate,
+                              identity->max_rate > 0 ? identity->max_rate : APN_POOL_DEFAULT_MAX_RATE);
+    }
+    if (APN_SOCKET_PRESET_DEFAULT != identity->socket_preset) {
+        apn_socket_profile_t profile;
+        apn_socket_profile_preset(&profile, identity->socket_preset);
+        apn_set_socket_profile(ctx, &profile);
+    }
+
+    apn_return ret = apn_set_protocol(ctx, identity->protocol);
+    if (APN_SUCCESS == ret) {
+        if (identity->auth_key_file) {
+            ret = apn_set_auth_key(ctx, identity->auth_key_file, identity->auth_key_id, identity->auth_team_id);
+        } else if (identity->pkcs12_file) {
+            ret = apn_set_pkcs12_file(ctx, identity->pkcs12_file, identity->pkcs12_pass);
+        } else {
+            ret = apn_set_certificate(ctx, identity->certificate_file, identity->private_key_file,
+                                      identity->private_key_pass);
+        }
+    }
+    if (APN_SUCCESS == ret && identity->topic) {
+        ret = apn_set_topic(ctx, identity->topic);
+    }
+    if (APN_SUCCESS == ret && identity->gateway_host) {
+        ret = apn_set_gateway(ctx, identity->gateway_host, identity->gateway_port);
+    }
+    if (APN_ERROR == ret) {
+        int errcode = errno;
+        apn_free(ctx);
+        errno = errcode;
+        return NULL;
+    }
+    return ctx;
+}
+
+apn_pool_t *apn_pool_init(void) {
+    if (APN_ERROR == apn_library_init()) {
+        return NULL;
+    }
+    apn_pool_t *pool = calloc(1, sizeof(apn_pool_t));
+    if (!pool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+void apn_pool_free(apn_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    for (uint32_t i = 0; i < pool->apps_count; i++) {
+        __apn_pool_app_free(pool->apps[i]);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+apn_return apn_pool_add_identity(apn_pool_t *const pool, const apn_identity_t *const identity) {
+    assert(pool);
+    assert(identity);
+
+    if (!identity->app_id) {
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+    if (identity->auth_key_file) {
+        if (APN_PROTOCOL_HTTP2 != identity->protocol) {
+            errno = EINVAL;
+            return APN_ERROR;
+        }
+        if (!identity->topic) {
+            errno = APN_ERR_TOPIC_IS_NOT_SET;
+            return APN_ERROR;
+        }
+    } else {
+        if (!identity->pkcs12_file && !identity->certificate_file) {
+            errno = APN_ERR_CERTIFICATE_IS_NOT_SET;
+            return APN_ERROR;
+        }
+        if (!identity->pkcs12_file && !identity->private_key_file) {
+            errno = APN_ERR_PRIVATE_KEY_IS_NOT_SET;
+            return APN_ERROR;
+        }
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (__apn_pool_find(pool, identity->app_id)) {
+        pthread_mutex_unlock(&pool->mutex);
+        errno = EEXIST;
+        return APN_ERROR;
+    }
+    if (pool->apps_count >= APN_POOL_MAX_APPS) {
+        pthread_mutex_unlock(&pool->mutex);
+        errno = ENOSPC;
+        return APN_ERROR;
+    }
+
+    struct __apn_pool_app *app = calloc(1, sizeof(struct __apn_pool_app));
+    if (!app) {
+        pthread_mutex_unlock(&pool->mutex);
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    app->pool = pool;
+    pthread_mutex_init(&app->mutex, NULL);
+    pthread_cond_init(&app->work, NULL);
+    pthread_cond_init(&app->done, NULL);
+    for (uint32_t i = 0; i < APN_POOL_LANES; i++) {
+        __apn_pool_bucket_init(&app->lanes[i].bucket);
+    }
+
+    uint32_t connections_count = identity->connections > 0 ? identity->connections : 1;
+    if (identity->initial_rate > 0) {
+        app->max_rate = identity->max_rate > 0 ? identity->max_rate : APN_POOL_DEFAULT_MAX_RATE;
+        app->active = 1;
+        app->tune_at = apn_clock_us() + APN_POOL_TUNE_INTERVAL_US;
+    } else {
+        app->active = connections_count;
+    }
+    app->app_id = apn_strndup(identity->app_id, strlen(identity->app_id));
+    app->connections = calloc(connections_count, sizeof(struct __apn_pool_connection));
+    if (!app->app_id || !app->connections) {
+        __apn_pool_app_free(app);
+        pthread_mutex_unlock(&pool->mutex);
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+
+    for (; app->connections_count < connections_count; app->connections_count++) {
+        struct __apn_pool_connection *connection = &app->connections[app->connections_count];
+        connection->app = app;
+        connection->index = app->connections_count;
+        if (NULL == (connection->ctx = __apn_pool_context(identity, connection))) {
+            int errcode = errno;
+            __apn_pool_app_free(app);
+            pthread_mutex_unlock(&pool->mutex);
+            errno = errcode;
+            return APN_ERROR;
+        }
+        int ret = pthread_create(&connection->thread, NULL, __apn_pool_worker, connection);
+        if (0 != ret) {
+            app->connections_count++;
+            __apn_pool_app_free(app);
+            pthread_mutex_unlock(&pool->mutex);
+            errno = ret;
+            return APN_ERROR;
+        }
+        connection->started = 1;
+    }
+
+    pool->apps[pool->apps_count] = app;
+    __atomic_store_n(&pool->apps_count, pool->apps_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->mutex);
+    return APN_SUCCESS;
+}
+
+void apn_pool_set_invalid_token_callback(apn_pool_t *const pool, apn_pool_invalid_token_callback callback) {
+    assert(pool);
+    pool->invalid_token_callback = callback;
+}
+
+void apn_pool_set_invalid_tokens_sink(apn_pool_t *const pool, apn_pool_invalid_tokens_sink sink, void *user) {
+    assert(pool);
+    pool->invalid_tokens_sink = sink;
+    pool->invalid_tokens_user = user;
+}
+
+apn_return apn_pool_set_lane_rate(apn_pool_t *const pool, const char *const app_id, apn_pool_lane lane,
+                                  uint32_t rate, uint32_t burst) {
+    assert(pool);
+    assert(app_id);
+    assert(lane < APN_POOL_LANES);
+
+    struct __apn_pool_app *app = __apn_pool_find(pool, app_id);
+    if (!app) {
+        return APN_ERROR;
+    }
+    struct __apn_pool_bucket *bucket = &app->lanes[lane].bucket;
+    pthread_mutex_lock(&bucket->mutex);
+    bucket->rate = rate;
+    bucket->burst = burst > 0 ? burst : rate;
+    bucket->tokens = bucket->burst;
+    bucket->updated = apn_clock_us();
+    pthread_mutex_unlock(&bucket->mutex);
+    return APN_SUCCESS;
+}
+
+apn_return apn_pool_push(apn_pool_t *const pool, const char *const app_id, const char *const token,
+                         const apn_payload_t *const payload) {
+    assert(pool);
+    assert(app_id);
+    assert(token);
+    assert(payload);
+
+    struct __apn_pool_app *app = __apn_pool_find(pool, app_id);
+    if (!app) {
+        return APN_ERROR;
+    }
+    if (!apn_hex_token_is_valid(token)) {
+        errno = APN_ERR_TOKEN_INVALID;
+        return APN_ERROR;
+    }
+    char *token_copy = apn_strndup(token, APN_TOKEN_LENGTH);
+    if (!token_copy) {
+        return APN_ERROR;
+    }
+
+    apn_pool_lane lane = __apn_pool_lane_of(payload);
+    struct __apn_pool_job *job = NULL;
+
+    pthread_mutex_lock(&app->mutex);
+    if (APN_POOL_LANE_HIGH == lane) {
+        /* High lane tokens are queued right away, joining a queued job with the same payload */
+        struct __apn_pool_job *tail = app->lanes[APN_POOL_LANE_HIGH].tail;
+        if (tail && tail->owns_tokens && tail->payload == payload && tail->end < APN_POOL_CHUNK_SIZE) {
+            job = tail;
+        }
+    } else {
+        if (app->batch && app->batch->payload != payload) {
+            app->batch->end = apn_array_count(app->batch->tokens);
+            __apn_pool_enqueue(app, app->batch);
+            app->batch = NULL;
+        }
+        job = app->batch;
+    }
+    uint8_t created = 0;
+    if (!job) {
+        job = calloc(1, sizeof(struct __apn_pool_job));
+        if (!job || NULL == (job->tokens = apn_array_init(64, (apn_array_dtor) __apn_pool_token_free, NULL))) {
+            pthread_mutex_unlock(&app->mutex);
+            free(job);
+            free(token_copy);
+            errno = ENOMEM;
+            return APN_ERROR;
+        }
+        job->payload = payload;
+        job->owns_tokens = 1;
+        job->lane = lane;
+        job->group = &app->stream;
+        created = 1;
+    }
+    if (APN_ERROR == apn_array_insert(job->tokens, token_copy)) {
+        if (created) {
+            apn_array_free(job->tokens);
+            free(job);
+        }
+        pthread_mutex_unlock(&app->mutex);
+        free(token_copy);
+        return APN_ERROR;
+    }
+
+    if (APN_POOL_LANE_HIGH == lane) {
+        job->end = apn_array_count(job->tokens);
+        if (created) {
+            __apn_pool_enqueue(app, job);
+        }
+        /* Busy workers yield to the high lane at the next frame */
+        __apn_pool_wake(app);
+        pthread_mutex_unlock(&app->mutex);
+        return APN_SUCCESS;
+    }
+
+    app->batch = job;
+    if (apn_array_count(app->batch->tokens) >= APN_POOL_CHUNK_SIZE) {
+        app->batch->end = apn_array_count(app->batch->tokens);
+        __apn_pool_enqueue(app, app->batch);
+        app->batch = NULL;
+        __apn_pool_wake(app);
+    } else if (app->idle > 0) {
+        __apn_pool_wake(app);
+    }
+    pthread_mutex_unlock(&app->mutex);
+    return APN_SUCCESS;
+}
+
+apn_return apn_pool_flush(apn_pool_t *const pool) {
+    assert(pool);
+
+    int error = 0;
+    uint32_t count = __atomic_load_n(&pool->apps_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        struct __apn_pool_app *app = pool->apps[i];
+        pthread_mutex_lock(&app->mutex);
+        if (app->batch) {
+            app->batch->end = apn_array_count(app->batch->tokens);
+            __apn_pool_enqueue(app, app->batch);
+            app->batch = NULL;
+            __apn_pool_wake(app);
+        }
+        while (app->stream.pending > 0) {
+            pthread_cond_wait(&app->done, &app->mutex);
+        }
+        if (app->stream.error && !error) {
+            error = app->stream.error;
+        }
+        app->stream.error = 0;
+        pthread_mutex_unlock(&app->mutex);
+    }
+    if (error) {
+        errno = error;
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
+apn_return apn_pool_send(apn_pool_t *const pool, const char *const app_id, const apn_payload_t *const payload,
+                         apn_array_t *const tokens) {
+    assert(pool);
+    assert(app_id);
+    assert(payload);
+    assert(tokens);
+
+    struct __apn_pool_app *app = __apn_pool_find(pool, app_id);
+    if (!app) {
+        return APN_ERROR;
+    }
+    uint32_t count = apn_array_count(tokens);
+    if (0 == count) {
+        return APN_SUCCESS;
+    }
+
+    /*
+     * Each connection starts with a contiguous range and steals from the others when done. Ranges of
+     * inactive connections are taken over by the active ones
+     */
+    uint32_t parts = app->connections_count < count ? app->connections_count : count;
+    apn_pool_lane lane = __apn_pool_lane_of(payload);
+    struct __apn_pool_group group = {0, 0};
+    struct __apn_pool_campaign campaign = {parts, NULL};
+    if (NULL == (campaign.ranges = malloc(sizeof(uint64_t) * parts))) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    struct __apn_pool_job *jobs = NULL;
+    for (uint32_t i = 0; i < parts; i++) {
+        struct __apn_pool_job *job = calloc(1, sizeof(struct __apn_pool_job));
+        if (!job) {
+            while (jobs) {
+                struct __apn_pool_job *next = jobs->next;
+                free(jobs);
+                jobs = next;
+            }
+            free(campaign.ranges);
+            errno = ENOMEM;
+            return APN_ERROR;
+        }
+        campaign.ranges[i] = __APN_POOL_RANGE((uint64_t) count * i / parts, (uint64_t) count * (i + 1) / parts);
+        job->payload = payload;
+        job->tokens = tokens;
+        job->lane = lane;
+        job->group = &group;
+        job->campaign = &campaign;
+        job->range = i;
+        job->next = jobs;
+        jobs = job;
+    }
+
+    pthread_mutex_lock(&app->mutex);
+    while (jobs) {
+        struct __apn_pool_job *next = jobs->next;
+        __apn_pool_enqueue(app, jobs);
+        jobs = next;
+    }
+    pthread_cond_broadcast(&app->work);
+    while (group.pending > 0) {
+        pthread_cond_wait(&app->done, &app->mutex);
+    }
+    pthread_mutex_unlock(&app->mutex);
+    free(campaign.ranges);
+
+    if (group.error) {
+        errno = group.error;
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
+static void __apn_pool_histogram_add(apn_histogram_t *const dst, const apn_histogram_t *const src) {
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    for (uint32_t i = 0; i < APN_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+apn_return apn_pool_stats(apn_pool_t *const pool, const char *const app_id, apn_stats_t *const stats) {
+    assert(pool);
+    assert(app_id);
+    assert(stats);
+
+    struct __apn_pool_app *app = __apn_pool_find(pool, app_id);
+    if (!app) {
+        return APN_ERROR;
+    }
+    memset(stats, 0, sizeof(apn_stats_t));
+    for (uint32_t i = 0; i < app->connections_count; i++) {
+        apn_stats_t snapshot;
+        apn_stats(app->connections[i].ctx, &snapshot);
+        stats->frames_sent += snapshot.frames_sent;
+        stats->bytes_written += snapshot.bytes_written;
+        stats->invalid_tokens += snapshot.invalid_tokens;
+        stats->apple_errors += snapshot.apple_errors;
+        stats->connects += snapshot.connects;
+        stats->connect_failures += snapshot.connect_failures;
+        stats->handshakes += snapshot.handshakes;
+        stats->handshake_failures += snapshot.handshake_failures;
+        stats->reconnects_invalid_token += snapshot.reconnects_invalid_token;
+        stats->reconnects_shutdown += snapshot.reconnects_shutdown;
+        stats->reconnects_apple_error += snapshot.reconnects_apple_error;
+        stats->reconnects_io_error += snapshot.reconnects_io_error;
+        stats->reconnects_idle += snapshot.reconnects_idle;
+        stats->reconnects_stale += snapshot.reconnects_stale;
+        stats->select_wakeups += snapshot.select_wakeups;
+        stats->rate_decreases += snapshot.rate_decreases;
+        stats->tokens_suppressed += snapshot.tokens_suppressed;
+        stats->ktls_handshakes += snapshot.ktls_handshakes;
+        stats->send_rate += snapshot.send_rate;
+        stats->send_buffer += snapshot.send_buffer;
+        __apn_pool_histogram_add(&stats->connect_latency, &snapshot.connect_latency);
+        __apn_pool_histogram_add(&stats->handshake_latency, &snapshot.handshake_latency);
+        __apn_pool_histogram_add(&stats->write_latency, &snapshot.write_latency);
+        __apn_pool_histogram_add(&stats->error_wait_latency, &snapshot.error_wait_latency);
+        __apn_pool_histogram_add(&stats->response_latency, &snapshot.response_latency);
+    }
+    return APN_SUCCESS;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_POOL_H__
+#define __APN_POOL_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+#include "apn_token_store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of identities in a pool */
+#define APN_POOL_MAX_APPS 64
+
+/** Maximum rate of a connection with the adaptive rate enabled, if not set, notifications per second */
+#define APN_POOL_DEFAULT_MAX_RATE 5000
+
+typedef struct __apn_pool_t apn_pool_t;
+
+/**
+ * Scheduling lanes. Notifications with ::APN_NOTIFICATION_PRIORITY_HIGH go to the high lane, others
+ * to the low lane. A connection sending a low lane batch switches to queued high lane notifications
+ * after the current frame.
+ */
+typedef enum __apn_pool_lane {
+    APN_POOL_LANE_HIGH = 0,
+    APN_POOL_LANE_LOW = 1
+} apn_pool_lane;
+
+#define APN_POOL_LANES 2
+
+/**
+ * Called from a worker thread for each token rejected by Apple as invalid.
+ * Must be thread-safe when the pool has more than one connection.
+ */
+typedef void (*apn_pool_invalid_token_callback)(const char * const app_id, const char * const token);
+
+/**
+ * Called from a worker thread with a batch of indices of tokens rejected by Apple as invalid, see
+ * ::apn_invalid_tokens_sink. For ::apn_pool_send() `tokens` is the array passed to it, so one
+ * ::apn_token_bitmap_t can collect results of all connections. Must be thread-safe when the pool has more
+ * than one connection.
+ */
+typedef void (*apn_pool_invalid_tokens_sink)(const char * const app_id, const apn_array_t * const tokens,
+                                             const uint32_t * const indices, uint32_t count, void *user);
+
+/**
+ * Certificate identity of an application and its connection pool settings.
+ * Either `pkcs12_file` or `certificate_file` and `private_key_file` must be set, or `auth_key_file`
+ * with ::APN_PROTOCOL_HTTP2. Strings are copied by ::apn_pool_add_identity()
+ */
+typedef struct __apn_identity_t {
+    /** Application id used to route notifications, e.g. bundle id. Required */
+    const char *app_id;
+    const char *pkcs12_file;
+    const char *pkcs12_pass;
+    const char *certificate_file;
+    const char *private_key_file;
+    const char *private_key_pass;
+    apn_connection_mode mode;
+    /** Gateway host, Apple gateway for `mode` if NULL */
+    const char *gateway_host;
+    uint16_t gateway_port;
+    /** Gateway protocol, see ::apn_set_protocol() */
+    apn_protocol protocol;
+    /** Token-based authentication key, see ::apn_set_auth_key(). HTTP/2 only */
+    const char *auth_key_file;
+    const char *auth_key_id;
+    const char *auth_team_id;
+    /** Topic (bundle id) of notifications, see ::apn_set_topic(). HTTP/2 only */
+    const char *topic;
+    /** Number of connections, each served by its own thread. 1 if 0 */
+    uint32_t connections;
+    /**
+     * Initial rate of a connection, notifications per second. If set, connections are paced by the adaptive
+     * rate controller (see ::apn_set_adaptive_rate()) and the pool starts with one active connection. Another
+     * one is activated when all active connections run at `max_rate`, one is deactivated when Apple shuts
+     * down a connection. 0 disables both
+     */
+    uint32_t initial_rate;
+    /** Maximum rate of a connection, ::APN_POOL_DEFAULT_MAX_RATE if 0 */
+    uint32_t max_rate;
+    /** Additional APN_OPTION_* flags. ::APN_OPTION_RECONNECT and ::APN_OPTION_ASYNC_ERRORS are always set */
+    uint32_t options;
+    /** Socket options of the connections, see ::apn_socket_profile_preset() */
+    apn_socket_preset socket_preset;
+    /** Token store shared by the connections, see ::apn_set_token_store(). Can be NULL */
+    apn_token_store_t *token_store;
+    log_callback log_callback;
+    uint16_t log_level;
+} apn_identity_t;
+
+/**
+ * Creates a pool: a registry of certificate identities, each with its own connections and worker threads.
+ * Notifications are routed by application id, so one process can serve many applications.
+ *
+ * @return Pointer to a pool or NULL on error with errno set. Must be freed with ::apn_pool_free()
+ */
+__apn_export__ apn_pool_t *apn_pool_init(void)
+        __apn_attribute_warn_unused_result__;
+
+/**
+ * Sends queued notifications, stops worker threads, closes connections and frees the pool.
+ *
+ * @param[in] pool - Pointer to a pool, can be NULL.
+ */
+__apn_export__ void apn_pool_free(apn_pool_t *pool);
+
+/**
+ * Registers an identity and starts its worker threads. Connections are opened on first send.
+ *
+ * @param[in] pool - Pointer to a pool. Cannot be NULL.
+ * @param[in] identity - Identity settings. Cannot be NULL.
+ *
+ * @return ::APN_SUCCESS on success, otherwise ::APN_ERROR with errno set.
+ */
+__apn_export__ apn_return apn_pool_add_identity(apn_pool_t * const pool, const apn_identity_t * const identity)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Sets a function called for tokens rejected as invalid. Must be set before notifications are sent.
+ */
+__apn_export__ void apn_pool_set_invalid_token_callback(apn_pool_t * const pool,
+                                                        apn_pool_invalid_token_callback callback)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets a sink for batches of invalid token indices with a user pointer. Must be set before notifications are sent.
+ */
+__apn_export__ void apn_pool_set_invalid_tokens_sink(apn_pool_t * const pool, apn_pool_invalid_tokens_sink sink,
+                                                     void *user)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Limits the rate of a lane of an application with a token bucket shared by all its connections.
+ *
+ * @param[in] pool - Pointer to a pool. Cannot be NULL.
+ * @param[in] app_id - Application id. Cannot be NULL.
+ * @param[in] lane - Lane.
+ * @param[in] rate - Notifications per second, 0 for no limit (default).
+ * @param[in] burst - Bucket size, the number of notifications which can be sent at once. `rate` if 0.
+ *
+ * @return ::APN_SUCCESS on success, ::APN_ERROR if the application is not registered.
+ */
+__apn_export__ apn_return apn_pool_set_lane_rate(apn_pool_t * const pool, const char * const app_id,
+                                                 apn_pool_lane lane, uint32_t rate, uint32_t burst)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Queues a notification to one device. Low lane tokens are batched and sent by the workers of the application;
+ * a batch is handed to a worker as soon as one is idle. High lane tokens are queued at once.
+ * Returns without waiting for I/O.
+ *
+ * The payload must not be modified or freed until ::apn_pool_flush() returns.
+ *
+ * @param[in] pool - Pointer to a pool. Cannot be NULL.
+ * @param[in] app_id - Application id. Cannot be NULL.
+ * @param[in] token - Device token, hex string. Cannot be NULL.
+ * @param[in] payload - Notification payload. Cannot be NULL.
+ *
+ * @return ::APN_SUCCESS on success, otherwise ::APN_ERROR with errno set.
+ */
+__apn_export__ apn_return apn_pool_push(apn_pool_t * const pool, const char * const app_id,
+                                        const char * const token, const apn_payload_t * const payload)
+        __apn_attribute_nonnull__((1, 2, 3, 4));
+
+/**
+ * Waits until all notifications queued with ::apn_pool_push() are sent and error responses are collected.
+ *
+ * @param[in] pool - Pointer to a pool. Cannot be NULL.
+ *
+ * @return ::APN_SUCCESS if all batches were sent, otherwise ::APN_ERROR with errno set to the first error.
+ */
+__apn_export__ apn_return apn_pool_flush(apn_pool_t * const pool)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sends a notification to all tokens of an array using all connections of the application and waits
+ * until it is sent. Can be called from several threads at the same time.
+ *
+ * @param[in] pool - Pointer to a pool. Cannot be NULL.
+ * @param[in] app_id - Application id. Cannot be NULL.
+ * @param[in] payload - Notification payload. Cannot be NULL.
+ * @param[in] tokens - Array of device tokens, hex strings. Cannot be NULL.
+ *
+ * @return ::APN_SUCCESS on success, otherwise ::APN_ERROR with errno set to the first error.
+ */
+__apn_export__ apn_return apn_pool_send(apn_pool_t * const pool, const char * const app_id,
+                                        const apn_payload_t * const payload, apn_array_t * const tokens)
+        __apn_attribute_nonnull__((1, 2, 3, 4));
+
+/**
+ * Takes a snapshot of stats summed over all connections of an application.
+ *
+ * @param[in] pool - Pointer to a pool. Cannot be NULL.
+ * @param[in] app_id - Application id. Cannot be NULL.
+ * @param[out] stats - Pointer to a structure to store the snapshot in. Cannot be NULL.
+ *
+ * @return ::APN_SUCCESS on success, ::APN_ERROR if the application is not registered.
+ */
+__apn_export__ apn_return apn_pool_stats(apn_pool_t * const pool, const char * const app_id,
+                                         apn_stats_t * const stats)
+        __apn_attribute_nonnull__((1, 2, 3));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,11 +27,49 @@
 #include <time.h>
 #include "apn_platform.h"
 #include "apn.h"
+#include "apn_stats.h"
+#include "apn_trace.h"
+#include "apn_transport.h"
+#include "apn_rate_private.h"
+#include "apn_socket_private.h"
+
+#ifdef APN_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define APN_ADDR_CACHE_SIZE 16
+/* Number of invalid token indices collected before they are passed to the sink */
+#define APN_INVALID_TOKENS_BATCH 64
+#define APN_ADDR_CACHE_TTL 300
+/* Connections idle for longer than this number of seconds are recycled before a send */
+#define APN_IDLE_TIMEOUT 600
+/* Connections idle for at least this number of microseconds are probed before a send */
+#define APN_IDLE_PROBE_US 1000000
+
+struct __apn_addr_cache {
+    char *host;
+    uint16_t port;
+    time_t expires;
+    uint8_t count;
+    struct sockaddr_storage addrs[APN_ADDR_CACHE_SIZE];
+    socklen_t addr_lens[APN_ADDR_CACHE_SIZE];
+};
+
+/* HTTP/2 is used for notifications only, the feedback service speaks the binary protocol */
+#define APN_USE_HTTP2(__ctx) ((__ctx)->protocol == APN_PROTOCOL_HTTP2 && !(__ctx)->feedback)
+
+/*
+ * Receives notifications an asynchronous error response made Apple drop and that are not sent again, see
+ * __apn_pending_error(). `errcode` is the error of notification `id` if it was not reported as an invalid token:
+ * it belongs to an earlier call than the pending one or failed for another reason; 0 otherwise. Notifications with
+ * identifiers [begin_id, end_id) were dropped, the range can be empty
+ */
+typedef void (*apn_unsent_callback)(void *user, uint32_t id, int errcode, uint32_t begin_id, uint32_t end_id);
+
 struct __apn_ctx_t {
     uint8_t feedback;
     uint16_t log_level;
@@ -44,11 +82,104 @@ struct __apn_ctx_t {
     char *pkcs12_file;
     char *pkcs12_pass;
     SSL *ssl;
+    /* Records of ctx->ssl are encrypted by the kernel, data is written to the socket directly */
+    uint8_t ktls;
+    /* TLS of ctx->ssl runs over memory BIOs, records are moved by ctx->transport */
+    uint8_t mem_bio;
+    /* I/O under TLS of binary protocol connections, the socket transport unless custom_transport is set */
+    apn_transport_t transport;
+    /* ctx->transport was set by apn_set_transport(), no socket is opened */
+    uint8_t custom_transport;
     log_callback log_callback;
     invalid_token_callback invalid_token_callback;
+    apn_invalid_tokens_sink invalid_tokens_sink;
+    void *invalid_tokens_user;
+    /* Indices not passed to invalid_tokens_sink yet, all refer to invalid_batch_tokens */
+    const apn_array_t *invalid_batch_tokens;
+    uint32_t invalid_batch_count;
+    uint32_t invalid_batch[APN_INVALID_TOKENS_BATCH];
+    /*
+     * Last call with APN_OPTION_ASYNC_ERRORS: tokens [pending_begin, pending_end) were written with
+     * identifiers from pending_id_base. Its frame template is owned and is used to send notifications
+     * after a failed one again
+     */
+    apn_array_t *pending_tokens;
+    struct __apn_binary_message_t *pending_message;
+    uint32_t pending_begin;
+    uint32_t pending_end;
+    uint32_t pending_id_base;
+    uint32_t next_id;
+    /* Set by the owner of the context to send dropped notifications itself, see apn_pool.c */
+    apn_unsent_callback unsent_callback;
+    void *unsent_user;
+    char *gateway_host;
+    uint16_t gateway_port;
+    char *feedback_host;
+    uint16_t feedback_port;
+    uint32_t addr_cache_ttl;
+    uint32_t idle_timeout;
+    /* Time of the handshake or of the last send, see apn_clock_us() */
+    uint64_t last_io;
+    struct __apn_addr_cache addr_cache;
+    apn_stats_t stats;
+    uint32_t connection_id;
+    struct __apn_trace *trace;
+    struct __apn_rate rate;
+    struct __apn_socket sockopts;
+    /* Stop sending a range after the current frame when *yield is not zero, see apn_send_range() */
+    volatile const uint32_t *yield;
+    uint32_t yield_index;
+    /* Tokens skipped by apn_send(), see apn_set_token_store(). Not owned */
+    struct __apn_token_store_t *token_store;
+    apn_protocol protocol;
+    char *topic;
+    char *auth_key_file;
+    char *auth_key_id;
+    char *auth_team_id;
+    /* Certificates which the server is verified against with token-based authentication, see apn_set_ca_file() */
+    char *ca_file;
+    apn_response_callback response_callback;
+    void *response_user;
+    /* HTTP/2 session and cached provider token, see apn_http2.c. NULL until the first HTTP/2 connection */
+    struct __apn_http2 *http2;
+    int last_error;
 };
 
 
+/**
+ * Sends a notification to tokens [begin, end) of `tokens`. Notification identifiers are assigned by
+ * token index, as with ::apn_send(), so several connections can send disjoint ranges of one array.
+ *
+ * If `ctx->yield` is set and becomes non-zero, sending stops after the current frame and `sent_end`
+ * is set to the index of the first token not sent; otherwise it is set to `end`. When the binary protocol
+ * fails, it is set to the first token not sent as well. Can be NULL.
+ */
+apn_return apn_send_range(apn_ctx_t *const ctx, const apn_payload_t *payload, apn_array_t *tokens,
+                          uint32_t begin, uint32_t end, apn_array_t **invalid_tokens, uint32_t *sent_end)
+        __apn_attribute_nonnull__((1, 2, 3));
+
+/** Maps a status code of an error response to ::apn_errors */
+int apn_convert_apple_error(uint8_t apple_error_code);
+
+/** Counts a reconnect caused by `errcode` in stats and trace */
+void apn_count_reconnect(apn_ctx_t *const ctx, int errcode)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Handles token `index` of `tokens` rejected by Apple as invalid as ::apn_send() does: counts it, adds it to
+ * the token store and reports it to the invalid token callback and sink
+ */
+void apn_invalid_token(apn_ctx_t *const ctx, const apn_array_t *const tokens, uint32_t index)
+        __apn_attribute_nonnull__((1, 2));
+
+/** Sets `transport` to the transport over ctx->sock */
+void apn_transport_socket(apn_ctx_t *const ctx, apn_transport_t *const transport)
+        __apn_attribute_nonnull__((1, 2));
+
+/** Passes invalid token indices collected for the sink, see ::apn_set_invalid_tokens_sink() */
+void apn_invalid_tokens_flush(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
 #ifdef __cplusplus
 }
 #endif
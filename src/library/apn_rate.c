@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "apn_platform.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "apn_private.h"
+#include "apn_rate_private.h"
+#include "apn_socket_private.h"
+#include "apn_stats_private.h"
+#include "apn_log.h"
+
+static void __apn_rate_set(apn_ctx_t *const ctx, double rate) {
+    if (rate < APN_RATE_MIN) {
+        rate = APN_RATE_MIN;
+    } else if (ctx->rate.max_rate > 0 && rate > ctx->rate.max_rate) {
+        rate = ctx->rate.max_rate;
+    }
+    ctx->rate.rate = rate;
+    APN_STATS_STORE(ctx->stats.send_rate, (uint64_t) rate);
+}
+
+static void __apn_rate_decrease(apn_ctx_t *const ctx, double factor, const char *const reason) {
+    __apn_rate_set(ctx, ctx->rate.rate * factor);
+    APN_STATS_INC(ctx, rate_decreases);
+    apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Send rate decreased to %.0f/s: %s", ctx->rate.rate, reason);
+}
+
+static void __apn_rate_adjust(apn_ctx_t *const ctx, uint64_t now) {
+    struct __apn_rate *rate = &ctx->rate;
+    uint64_t window = now - rate->window_start;
+
+    uint64_t rtt = apn_socket_rtt(ctx);
+    if (rtt > 0) {
+        rate->rtt = rate->rtt ? (rate->rtt * 7 + rtt) / 8 : rtt;
+        if (0 == rate->rtt_min || rtt < rate->rtt_min) {
+            rate->rtt_min = rtt;
+        }
+    }
+
+    if (rate->window_shutdowns > 0) {
+        /* Already decreased by apn_rate_shutdown() */
+    } else if (rate->window_blocked * 2 > window) {
+        __apn_rate_decrease(ctx, APN_RATE_DECREASE, "socket is not writable");
+    } else if (rate->rtt_min > 0 && rate->rtt > rate->rtt_min * 2) {
+        __apn_rate_decrease(ctx, APN_RATE_DECREASE, "RTT has grown");
+    } else if (rate->window_frames * 10 >= (uint64_t) (rate->rate * (double) window / 1e6) * 9) {
+        /* Increase only if the connection actually sent at the current rate */
+        __apn_rate_set(ctx, rate->rate + APN_RATE_INCREASE);
+    }
+
+    rate->window_start = now;
+    rate->window_blocked = 0;
+    rate->window_frames = 0;
+    rate->window_shutdowns = 0;
+}
+
+void apn_rate_init(apn_ctx_t *const ctx, uint32_t initial_rate, uint32_t max_rate) {
+    memset(&ctx->rate, 0, sizeof(ctx->rate));
+    ctx->rate.max_rate = max_rate;
+    if (initial_rate > 0) {
+        __apn_rate_set(ctx, initial_rate);
+    } else {
+        APN_STATS_STORE(ctx->stats.send_rate, 0);
+    }
+}
+
+void apn_rate_pace(apn_ctx_t *const ctx) {
+    struct __apn_rate *rate = &ctx->rate;
+    uint64_t now = apn_clock_us();
+    if (0 == rate->window_start) {
+        rate->window_start = now;
+        rate->next_send = now;
+    }
+    if (rate->next_send > now) {
+        uint64_t delay = rate->next_send - now;
+#ifdef _WIN32
+        Sleep((DWORD) (delay / 1000));
+#else
+        struct timespec ts = {(time_t) (delay / 1000000), (long) (delay % 1000000) * 1000};
+        while (-1 == nanosleep(&ts, &ts) && EINTR == errno) {
+        }
+#endif
+    } else if (now - rate->next_send > APN_RATE_WINDOW_US) {
+        /* Do not send a burst after an idle period */
+        rate->next_send = now;
+    }
+    rate->next_send += (uint64_t) (1e6 / rate->rate);
+}
+
+void apn_rate_sent(apn_ctx_t *const ctx, uint64_t blocked_us) {
+    struct __apn_rate *rate = &ctx->rate;
+    rate->window_frames++;
+    rate->window_blocked += blocked_us;
+    uint64_t now = apn_clock_us();
+    if (now - rate->window_start >= APN_RATE_WINDOW_US) {
+        __apn_rate_adjust(ctx, now);
+    }
+}
+
+void apn_rate_shutdown(apn_ctx_t *const ctx) {
+    if (0 == ctx->rate.rate) {
+        return;
+    }
+    if (ctx->rate.window_shutdowns++ > 0) {
+        return;
+    }
+    __apn_rate_decrease(ctx, APN_RATE_SHUTDOWN_DECREASE, "service shutdown");
+}
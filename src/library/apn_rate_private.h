@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_RATE_PRIVATE_H__
+#define __APN_RATE_PRIVATE_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Length of a measurement window, the rate is adjusted once per window */
+#define APN_RATE_WINDOW_US 1000000
+
+/** Rate is never decreased below this number of notifications per second */
+#define APN_RATE_MIN 10
+
+/** Additive increase per window without congestion, notifications per second */
+#define APN_RATE_INCREASE 250
+
+/** Multiplicative decrease on write blocking or RTT inflation */
+#define APN_RATE_DECREASE 0.7
+
+/** Multiplicative decrease on "shutdown" error response */
+#define APN_RATE_SHUTDOWN_DECREASE 0.5
+
+/**
+ * AIMD controller of the frame rate of one connection. Congestion is signalled by
+ * a "shutdown" error response, by the socket being not writable for more than half of a window,
+ * or by the smoothed RTT doubling compared to the lowest RTT seen. The rate is decreased at most once per window.
+ */
+struct __apn_rate {
+    /* Notifications per second, 0 if the controller is disabled */
+    double rate;
+    double max_rate;
+    uint64_t next_send;
+    uint64_t window_start;
+    uint64_t window_blocked;
+    uint32_t window_frames;
+    uint32_t window_shutdowns;
+    uint64_t rtt;
+    uint64_t rtt_min;
+};
+
+void apn_rate_init(apn_ctx_t *const ctx, uint32_t initial_rate, uint32_t max_rate)
+        __apn_attribute_nonnull__((1));
+
+/** Sleeps until the next notification can be written */
+void apn_rate_pace(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Accounts a written notification and time spent waiting for the socket to become writable */
+void apn_rate_sent(apn_ctx_t *const ctx, uint64_t blocked_us)
+        __apn_attribute_nonnull__((1));
+
+void apn_rate_shutdown(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
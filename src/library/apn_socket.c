@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* struct tcp_info of glibc is hidden by the POSIX.1-2001 build flags */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "apn_platform.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "apn_private.h"
+#include "apn_socket_private.h"
+#include "apn_stats_private.h"
+#include "apn_log.h"
+
+#ifdef APN_HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef APN_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
+#if defined(TCP_CORK)
+#define APN_TCP_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define APN_TCP_CORK TCP_NOPUSH
+#endif
+
+#if defined(TCP_KEEPIDLE)
+#define APN_TCP_KEEPIDLE TCP_KEEPIDLE
+#elif defined(TCP_KEEPALIVE) && defined(__APPLE__)
+#define APN_TCP_KEEPIDLE TCP_KEEPALIVE
+#endif
+
+#define APN_SOCKET_BULK_SEND_BUFFER (1 << 20)
+#define APN_SOCKET_BULK_SEND_BUFFER_MAX (16 << 20)
+#define APN_SOCKET_LOW_LATENCY_NOTSENT_LOWAT (16 << 10)
+#define APN_SOCKET_KEEPALIVE_IDLE 60
+#define APN_SOCKET_KEEPALIVE_INTERVAL 10
+#define APN_SOCKET_KEEPALIVE_COUNT 6
+/* The connection is corked only if the send buffer holds at least this number of segments */
+#define APN_SOCKET_CORK_MIN_SEGMENTS 4
+
+static void __apn_socket_set(apn_ctx_t *const ctx, SOCKET sock, int level, int option, int value,
+                             const char *const name) {
+    if (0 != setsockopt(sock, level, option, (void *) &value, sizeof(value))) {
+        char error[APN_ERROR_STRING_SIZE];
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to set %s to %d: %s (errno: %d)", name, value,
+                apn_error_string_r(errno, error, sizeof(error)), errno);
+    }
+}
+
+/*
+ * Stores the send buffer size reported by the kernel in stats and returns it as a size to request
+ * with SO_SNDBUF: Linux reports twice the requested size
+ */
+static uint32_t __apn_socket_send_buffer(apn_ctx_t *const ctx, SOCKET sock) {
+    int value = 0;
+    socklen_t value_len = sizeof(value);
+    if (0 != getsockopt(sock, SOL_SOCKET, SO_SNDBUF, (void *) &value, &value_len) || value < 0) {
+        value = 0;
+    }
+    APN_STATS_STORE(ctx->stats.send_buffer, (uint64_t) value);
+#ifdef __linux__
+    value /= 2;
+#endif
+    return (uint32_t) value;
+}
+
+void apn_socket_profile_preset(apn_socket_profile_t *const profile, apn_socket_preset preset) {
+    assert(profile);
+    memset(profile, 0, sizeof(apn_socket_profile_t));
+    switch (preset) {
+        case APN_SOCKET_PRESET_BULK:
+            profile->send_buffer = APN_SOCKET_BULK_SEND_BUFFER;
+            profile->send_buffer_max = APN_SOCKET_BULK_SEND_BUFFER_MAX;
+            profile->cork = 1;
+            break;
+        case APN_SOCKET_PRESET_LOW_LATENCY:
+            profile->notsent_lowat = APN_SOCKET_LOW_LATENCY_NOTSENT_LOWAT;
+            profile->nodelay = 1;
+            break;
+        case APN_SOCKET_PRESET_DEFAULT:
+        default:
+            return;
+    }
+    profile->keepalive_idle = APN_SOCKET_KEEPALIVE_IDLE;
+    profile->keepalive_interval = APN_SOCKET_KEEPALIVE_INTERVAL;
+    profile->keepalive_count = APN_SOCKET_KEEPALIVE_COUNT;
+}
+
+apn_return apn_set_socket_profile(apn_ctx_t *const ctx, const apn_socket_profile_t *const profile) {
+    assert(ctx);
+    if (profile && profile->send_buffer_max > 0 && profile->send_buffer_max < profile->send_buffer) {
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+    apn_socket_uncork(ctx);
+    if (profile) {
+        ctx->sockopts.profile = *profile;
+    } else {
+        memset(&ctx->sockopts.profile, 0, sizeof(apn_socket_profile_t));
+    }
+    if (-1 != ctx->sock && !ctx->custom_transport) {
+        apn_socket_apply(ctx, ctx->sock);
+    }
+    return APN_SUCCESS;
+}
+
+void apn_socket_init(apn_ctx_t *const ctx) {
+    memset(&ctx->sockopts, 0, sizeof(ctx->sockopts));
+}
+
+void apn_socket_apply(apn_ctx_t *const ctx, SOCKET sock) {
+    const apn_socket_profile_t *profile = &ctx->sockopts.profile;
+
+    if (profile->send_buffer > 0) {
+        __apn_socket_set(ctx, sock, SOL_SOCKET, SO_SNDBUF, (int) profile->send_buffer, "SO_SNDBUF");
+    }
+#ifdef TCP_NODELAY
+    if (profile->nodelay) {
+        __apn_socket_set(ctx, sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    if (profile->notsent_lowat > 0) {
+        __apn_socket_set(ctx, sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (int) profile->notsent_lowat,
+                         "TCP_NOTSENT_LOWAT");
+    }
+#endif
+    if (profile->keepalive_idle > 0) {
+        __apn_socket_set(ctx, sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef APN_TCP_KEEPIDLE
+        __apn_socket_set(ctx, sock, IPPROTO_TCP, APN_TCP_KEEPIDLE, (int) profile->keepalive_idle, "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+        if (profile->keepalive_interval > 0) {
+            __apn_socket_set(ctx, sock, IPPROTO_TCP, TCP_KEEPINTVL, (int) profile->keepalive_interval,
+                             "TCP_KEEPINTVL");
+        }
+#endif
+#ifdef TCP_KEEPCNT
+        if (profile->keepalive_count > 0) {
+            __apn_socket_set(ctx, sock, IPPROTO_TCP, TCP_KEEPCNT, (int) profile->keepalive_count, "TCP_KEEPCNT");
+        }
+#endif
+    }
+
+    ctx->sockopts.corked = 0;
+    ctx->sockopts.mss = 0;
+    ctx->sockopts.window_start = 0;
+    ctx->sockopts.window_bytes = 0;
+    ctx->sockopts.window_blocked = 0;
+    uint32_t send_buffer = __apn_socket_send_buffer(ctx, sock);
+    ctx->sockopts.send_buffer = profile->send_buffer > 0 ? profile->send_buffer : send_buffer;
+}
+
+void apn_socket_cork(apn_ctx_t *const ctx) {
+#ifdef APN_TCP_CORK
+    struct __apn_socket *sockopts = &ctx->sockopts;
+    if (!sockopts->profile.cork || sockopts->corked || ctx->rate.rate > 0 || -1 == ctx->sock || ctx->custom_transport) {
+        return;
+    }
+#ifdef TCP_MAXSEG
+    if (0 == sockopts->mss) {
+        int mss = 0;
+        socklen_t mss_len = sizeof(mss);
+        if (0 != getsockopt(ctx->sock, IPPROTO_TCP, TCP_MAXSEG, (void *) &mss, &mss_len) || mss <= 0) {
+            mss = 1;
+        }
+        sockopts->mss = (uint32_t) mss;
+    }
+    /* A corked tail waits for the cork timer (200 ms) if the send buffer cannot hold a few segments */
+    if ((uint64_t) sockopts->send_buffer < (uint64_t) sockopts->mss * APN_SOCKET_CORK_MIN_SEGMENTS) {
+        return;
+    }
+#endif
+    __apn_socket_set(ctx, ctx->sock, IPPROTO_TCP, APN_TCP_CORK, 1, "TCP_CORK");
+    sockopts->corked = 1;
+#else
+    (void) ctx;
+#endif
+}
+
+void apn_socket_uncork(apn_ctx_t *const ctx) {
+#ifdef APN_TCP_CORK
+    if (ctx->sockopts.corked) {
+        ctx->sockopts.corked = 0;
+        if (-1 != ctx->sock) {
+            __apn_socket_set(ctx, ctx->sock, IPPROTO_TCP, APN_TCP_CORK, 0, "TCP_CORK");
+        }
+    }
+#else
+    (void) ctx;
+#endif
+}
+
+uint64_t apn_socket_rtt(const apn_ctx_t *const ctx) {
+#if defined(APN_HAVE_NETINET_TCP_H) && defined(TCP_INFO) && defined(__linux__)
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (0 == getsockopt(ctx->sock, IPPROTO_TCP, TCP_INFO, &info, &info_len)) {
+        return info.tcpi_rtt;
+    }
+#else
+    (void) ctx;
+#endif
+    return 0;
+}
+
+/* Doubles the send buffer if it limited the throughput of the last window, returns 1 if it was resized */
+static uint8_t __apn_socket_tune(apn_ctx_t *const ctx, uint64_t window) {
+    struct __apn_socket *sockopts = &ctx->sockopts;
+    uint32_t send_buffer_max = sockopts->profile.send_buffer_max;
+    if (sockopts->window_blocked * 4 <= window || sockopts->send_buffer >= send_buffer_max) {
+        return 0;
+    }
+    uint64_t rtt = apn_socket_rtt(ctx);
+    uint64_t bdp = sockopts->window_bytes * rtt / window;
+    if (0 == rtt || (uint64_t) sockopts->send_buffer >= bdp * 4) {
+        return 0;
+    }
+    uint64_t send_buffer = (uint64_t) sockopts->send_buffer * 2;
+    sockopts->send_buffer = send_buffer > send_buffer_max ? send_buffer_max : (uint32_t) send_buffer;
+    __apn_socket_set(ctx, ctx->sock, SOL_SOCKET, SO_SNDBUF, (int) sockopts->send_buffer, "SO_SNDBUF");
+    apn_log(ctx, APN_LOG_LEVEL_DEBUG, "Send buffer increased to %u bytes, bandwidth-delay product: %llu bytes, "
+            "RTT: %llu us", sockopts->send_buffer, (unsigned long long) bdp, (unsigned long long) rtt);
+    return 1;
+}
+
+void apn_socket_sent(apn_ctx_t *const ctx, uint64_t bytes, uint64_t blocked_us) {
+    struct __apn_socket *sockopts = &ctx->sockopts;
+    if (-1 == ctx->sock || ctx->custom_transport) {
+        return;
+    }
+    uint64_t now = apn_clock_us();
+    if (0 == sockopts->window_start) {
+        sockopts->window_start = now;
+    }
+    sockopts->window_bytes += bytes;
+    sockopts->window_blocked += blocked_us;
+    uint64_t window = now - sockopts->window_start;
+    if (window < APN_SOCKET_TUNE_WINDOW_US) {
+        return;
+    }
+    if (0 == sockopts->profile.send_buffer) {
+        /* Grown by the kernel unless the autotuner has set it */
+        uint32_t send_buffer = __apn_socket_send_buffer(ctx, ctx->sock);
+        if (send_buffer > sockopts->send_buffer) {
+            sockopts->send_buffer = send_buffer;
+        }
+    }
+    if (sockopts->profile.send_buffer_max > 0 && __apn_socket_tune(ctx, window)) {
+        __apn_socket_send_buffer(ctx, ctx->sock);
+    }
+    sockopts->window_start = now;
+    sockopts->window_bytes = 0;
+    sockopts->window_blocked = 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_SOCKET_PRIVATE_H__
+#define __APN_SOCKET_PRIVATE_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Length of a measurement window of the send buffer autotuner */
+#define APN_SOCKET_TUNE_WINDOW_US 1000000
+
+/**
+ * Socket options of a `ctx` and state of the send buffer autotuner. The send buffer is doubled, up to
+ * `send_buffer_max`, after a window in which the socket was not writable for more than a quarter of
+ * the time while the buffer held less than four bandwidth-delay products measured by TCP_INFO.
+ * The buffer is never shrunk. The buffer size reported by the kernel is refreshed once per window.
+ */
+struct __apn_socket {
+    apn_socket_profile_t profile;
+    /* Send buffer requested by the profile or the autotuner, bytes. 0 if not known */
+    uint32_t send_buffer;
+    uint64_t window_start;
+    uint64_t window_bytes;
+    uint64_t window_blocked;
+    /* Maximum segment size of the connection, 0 until the connection is corked for the first time */
+    uint32_t mss;
+    uint8_t corked;
+};
+
+void apn_socket_init(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Sets options of the profile on a socket created for `ctx`, before it is connected */
+void apn_socket_apply(apn_ctx_t *const ctx, SOCKET sock)
+        __apn_attribute_nonnull__((1));
+
+/** Corks the connection if the profile asks for it and the send rate is not limited */
+void apn_socket_cork(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Uncorks the connection, partial segments are sent immediately */
+void apn_socket_uncork(apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/** Accounts bytes written and time spent waiting for the socket to become writable */
+void apn_socket_sent(apn_ctx_t *const ctx, uint64_t bytes, uint64_t blocked_us)
+        __apn_attribute_nonnull__((1));
+
+/** Smoothed RTT of the connection in microseconds, 0 if the platform does not report it */
+uint64_t apn_socket_rtt(const apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* O_CLOEXEC is POSIX.1-2008, the build asks for POSIX.1-2001 only */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apn_spool_private.h"
+#include "apn_binary_message_private.h"
+#include "apn_tokens.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+static void __apn_spool_unmap(apn_spool_t *const spool) {
+    if (spool->map) {
+        munmap((void *) spool->map, spool->map_size);
+        spool->map = NULL;
+    }
+    if (spool->fd >= 0) {
+        close(spool->fd);
+        spool->fd = -1;
+    }
+}
+
+apn_return apn_spool_create(const char *const path, const apn_payload_t *const payload,
+                            const apn_array_t *const tokens) {
+    assert(path);
+    assert(payload);
+    assert(tokens);
+
+    uint32_t count = apn_array_count(tokens);
+    if (0 == count) {
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+
+    apn_binary_message_t *binary_message = apn_create_binary_message(payload);
+    if (!binary_message) {
+        return APN_ERROR;
+    }
+
+    uint32_t frame_size = binary_message->size;
+    size_t size = sizeof(struct __apn_spool_header) + (size_t) count * frame_size;
+    uint8_t *map = MAP_FAILED;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || 0 != ftruncate(fd, (off_t) size) ||
+        MAP_FAILED == (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))) {
+        goto error;
+    }
+
+    struct __apn_spool_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, APN_SPOOL_MAGIC, sizeof(header.magic));
+    header.version = APN_SPOOL_VERSION;
+    header.frame_size = frame_size;
+    header.count = count;
+
+    uint8_t *frame = map + sizeof(header);
+    for (uint32_t i = 0; i < count; i++, frame += frame_size) {
+        apn_binary_message_set_id(binary_message, i);
+        if (APN_ERROR == apn_binary_message_set_token_hex(binary_message,
+                                                          (const char *) apn_array_item_at_index(tokens, i))) {
+            goto error;
+        }
+        memcpy(frame, binary_message->message, frame_size);
+    }
+    /* The header is written last, so an interrupted build never looks like a valid spool */
+    memcpy(map, &header, sizeof(header));
+
+    munmap(map, size);
+    close(fd);
+    apn_binary_message_free(binary_message);
+    return APN_SUCCESS;
+
+    error:
+    {
+        int errcode = errno;
+        if (MAP_FAILED != map) {
+            munmap(map, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        apn_binary_message_free(binary_message);
+        errno = errcode;
+        return APN_ERROR;
+    }
+}
+
+apn_spool_t *apn_spool_open(const char *const path) {
+    assert(path);
+
+    apn_spool_t *spool = calloc(1, sizeof(apn_spool_t));
+    if (!spool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if ((spool->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        free(spool);
+        return NULL;
+    }
+
+    struct stat st;
+    if (0 != fstat(spool->fd, &st)) {
+        goto error;
+    }
+    if ((size_t) st.st_size < sizeof(struct __apn_spool_header)) {
+        errno = APN_ERR_SPOOL_INVALID;
+        goto error;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, spool->fd, 0);
+    if (MAP_FAILED == map) {
+        goto error;
+    }
+    spool->map = map;
+    spool->map_size = (size_t) st.st_size;
+
+    struct __apn_spool_header header;
+    memcpy(&header, spool->map, sizeof(header));
+    spool->frame_size = header.frame_size;
+    spool->count = header.count;
+    if (0 != memcmp(header.magic, APN_SPOOL_MAGIC, sizeof(header.magic)) ||
+        APN_SPOOL_VERSION != header.version ||
+        header.frame_size <= APN_SPOOL_TOKEN_OFFSET + APN_TOKEN_BINARY_SIZE ||
+        header.frame_size > APN_SPOOL_CHUNK_SIZE ||
+        0 == header.count ||
+        APN_SPOOL_FRAME_OFFSET(spool, header.count) != spool->map_size ||
+        2 != spool->map[APN_SPOOL_FRAME_OFFSET(spool, 0)]) {
+        errno = APN_ERR_SPOOL_INVALID;
+        goto error;
+    }
+
+    /* Frames are read in order */
+    posix_madvise((void *) spool->map, spool->map_size, POSIX_MADV_SEQUENTIAL);
+    return spool;
+
+    error:
+    {
+        int errcode = errno;
+        __apn_spool_unmap(spool);
+        free(spool);
+        errno = errcode;
+        return NULL;
+    }
+}
+
+void apn_spool_close(apn_spool_t *spool) {
+    if (!spool) {
+        return;
+    }
+    __apn_spool_unmap(spool);
+    free(spool);
+}
+
+uint32_t apn_spool_count(const apn_spool_t *const spool) {
+    assert(spool);
+    return spool->count;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_SPOOL_H__
+#define __APN_SPOOL_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+#include "apn_array.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * File of ready to send binary frames of one notification, one frame per device token. Frame `i` has
+ * notification identifier `i`, so error responses refer to frames by index.
+ *
+ * A spool is built once with ::apn_spool_create() and sent with ::apn_send_spool(), which writes whole
+ * runs of frames with one call. With kernel TLS (::APN_OPTION_KTLS) the frames go from the page cache to the
+ * socket with sendfile() and are never copied to user space. The file uses the host byte order.
+ */
+typedef struct __apn_spool_t apn_spool_t;
+
+/**
+ * Builds a spool, the file is replaced if it exists.
+ *
+ * @param[in] path - Path to the spool file. Cannot be NULL.
+ * @param[in] payload - Pointer to `payload` structure. Cannot be NULL.
+ * @param[in] tokens - Array of device tokens in hex. Cannot be NULL or empty.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`, ::APN_ERR_TOKEN_INVALID if a token
+ *      is malformed. The file is removed.
+ */
+__apn_export__ apn_return apn_spool_create(const char *const path, const apn_payload_t *const payload,
+                                           const apn_array_t *const tokens)
+        __apn_attribute_nonnull__((1, 2, 3));
+
+/**
+ * Opens a spool read-only.
+ *
+ * @param[in] path - Path to the spool file. Cannot be NULL.
+ *
+ * @return Pointer to a spool or NULL on error with errno set, ::APN_ERR_SPOOL_INVALID if the file is not a spool.
+ * Must be closed with ::apn_spool_close()
+ */
+__apn_export__ apn_spool_t *apn_spool_open(const char *const path)
+        __apn_attribute_nonnull__((1))
+        __apn_attribute_warn_unused_result__;
+
+/**
+ * Unmaps and closes a spool.
+ *
+ * @param[in] spool - Pointer to a spool, can be NULL.
+ */
+__apn_export__ void apn_spool_close(apn_spool_t *spool);
+
+/**
+ * Returns number of frames in a spool.
+ */
+__apn_export__ uint32_t apn_spool_count(const apn_spool_t *const spool)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sends frames [`begin`, `end`) of a spool over the binary protocol connection of `ctx`.
+ *
+ * Errors are handled as by ::apn_send(): sending resumes after an invalid token when ::APN_OPTION_RECONNECT
+ * is set, frames whose tokens are in the token store are skipped. Rejected tokens are passed to the invalid
+ * token callback and collected in `invalid_tokens`; the sink set with ::apn_set_invalid_tokens_sink() is
+ * not called because there is no token array. Error responses are always waited for before returning,
+ * ::APN_OPTION_ASYNC_ERRORS is ignored.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure with an open binary protocol connection.
+ * Cannot be NULL.
+ * @param[in] spool - Pointer to a spool. Cannot be NULL.
+ * @param[in] begin - Index of the first frame to send.
+ * @param[in] end - Index after the last frame to send, `begin` < `end` <= ::apn_spool_count().
+ * @param[out] invalid_tokens - Pointer to a array which will contain invalid tokens in hex. Can be NULL.
+ * Must be freed with ::apn_array_free()
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_send_spool(apn_ctx_t *const ctx, const apn_spool_t *const spool, uint32_t begin,
+                                         uint32_t end, apn_array_t **invalid_tokens)
+        __apn_attribute_nonnull__((1, 2));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
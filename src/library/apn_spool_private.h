@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_SPOOL_PRIVATE_H__
+#define __APN_SPOOL_PRIVATE_H__
+
+#include "apn_platform.h"
+#include "apn_spool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define APN_SPOOL_MAGIC "CAPNSPL1"
+#define APN_SPOOL_VERSION 1
+
+/* Bytes written by one write() or sendfile(), rounded down to whole frames */
+#define APN_SPOOL_CHUNK_SIZE (64 * 1024)
+
+/* Offset of the device token in a frame: command, frame length, item id, item length */
+#define APN_SPOOL_TOKEN_OFFSET 8
+
+/* File layout: header, `count` frames of `frame_size` bytes */
+struct __apn_spool_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t frame_size;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct __apn_spool_t {
+    int fd;
+    const uint8_t *map;
+    size_t map_size;
+    uint32_t frame_size;
+    uint32_t count;
+};
+
+/* Offset of frame `index` in the file */
+#define APN_SPOOL_FRAME_OFFSET(__spool, __index) \
+    (sizeof(struct __apn_spool_header) + (size_t) (__index) * (__spool)->frame_size)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
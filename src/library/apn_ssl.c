@@ -24,18 +24,44 @@
 #include "apn_private.h"
 #include "apn_log.h"
 #include "apn_strings.h"
+#include "apn_trace_private.h"
+#include "apn_stats_private.h"
 
 #ifndef _WIN32
+#include <pthread.h>
 #include <signal.h>
+#include <sys/select.h>
 #endif
 
 #ifdef APN_HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
 
+#ifdef APN_HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define APN_SSL_ERROR_STRING_SIZE 256
+/* Time to wait for the transport to become readable or writable, milliseconds */
+#define APN_SSL_IO_TIMEOUT 10000
+
+/* Time `__timeout` milliseconds from now, see apn_clock_us() */
+#define APN_SSL_DEADLINE(__timeout) (apn_clock_us() + (uint64_t) (__timeout) * 1000)
+/* Bytes read from the transport into the read BIO at once */
+#define APN_SSL_READ_SIZE 16384
+
+/*
+ * Kernel TLS needs OpenSSL 3.0 built with it. Once the kernel encrypts records, data is written to the
+ * socket with MSG_NOSIGNAL, bypassing SSL_write()
+ */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && defined(MSG_NOSIGNAL)
+#define APN_SSL_KTLS
+#endif
 
 #define APN_CERT_EXTENSION_PRODUCTION "1.2.840.113635.100.6.3.2"
 #define APN_CERT_EXTENSION_SANDBOX    "1.2.840.113635.100.6.3.1"
@@ -75,31 +101,211 @@ static void __apn_ssl_info_callback(const SSL *ssl, int where, int ret)
 static int __apn_ssl_password_callback(char *buf, int size, int rwflag, void *password)
         __apn_attribute_nonnull__((1, 4));
 
-void apn_ssl_init() {
+static const char *__apn_ssl_error_string(char *const buffer, size_t buffer_size)
+        __apn_attribute_nonnull__((1));
+
+static int __apn_ssl_flush(const apn_ctx_t *const ctx, uint64_t deadline, size_t *flushed)
+        __apn_attribute_nonnull__((1));
+
+static int __apn_ssl_fill(const apn_ctx_t *const ctx, uint64_t deadline)
+        __apn_attribute_nonnull__((1));
+
+static apn_return __apn_ssl_handshake_error(const apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+static uint32_t __apn_ssl_remaining(uint64_t deadline);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+ * OpenSSL before 1.1.0 is thread-safe only when the application provides locking callbacks.
+ * The default thread id callback (address of errno) is per thread, so only locks are set up.
+ */
+#ifdef _WIN32
+typedef CRITICAL_SECTION __apn_ssl_mutex_t;
+#define __APN_SSL_MUTEX_INIT(__mutex) (InitializeCriticalSection(__mutex), 0)
+#define __APN_SSL_MUTEX_DESTROY(__mutex) DeleteCriticalSection(__mutex)
+#define __APN_SSL_MUTEX_LOCK(__mutex) EnterCriticalSection(__mutex)
+#define __APN_SSL_MUTEX_UNLOCK(__mutex) LeaveCriticalSection(__mutex)
+#else
+typedef pthread_mutex_t __apn_ssl_mutex_t;
+#define __APN_SSL_MUTEX_INIT(__mutex) pthread_mutex_init(__mutex, NULL)
+#define __APN_SSL_MUTEX_DESTROY(__mutex) pthread_mutex_destroy(__mutex)
+#define __APN_SSL_MUTEX_LOCK(__mutex) pthread_mutex_lock(__mutex)
+#define __APN_SSL_MUTEX_UNLOCK(__mutex) pthread_mutex_unlock(__mutex)
+#endif
+
+static __apn_ssl_mutex_t *__apn_ssl_locks = NULL;
+static int __apn_ssl_locks_count = 0;
+
+static void __apn_ssl_locking_callback(int mode, int n, const char *file, int line) {
+    (void) file;
+    (void) line;
+    if (mode & CRYPTO_LOCK) {
+        __APN_SSL_MUTEX_LOCK(&__apn_ssl_locks[n]);
+    } else {
+        __APN_SSL_MUTEX_UNLOCK(&__apn_ssl_locks[n]);
+    }
+}
+#endif
+
+#ifdef MSG_NOSIGNAL
+/*
+ * Socket BIO which writes with MSG_NOSIGNAL: writing to a connection closed by the peer
+ * returns EPIPE instead of raising SIGPIPE, without touching the process signal disposition.
+ */
+static BIO_METHOD *__apn_ssl_bio_method = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static BIO_METHOD __apn_ssl_bio_method_storage;
+#endif
+
+static int __apn_ssl_bio_write(BIO *bio, const char *data, int length) {
+    int fd = -1;
+    BIO_get_fd(bio, &fd);
+    errno = 0;
+    int ret = (int) send(fd, data, (size_t) length, MSG_NOSIGNAL);
+    BIO_clear_retry_flags(bio);
+    if (ret <= 0 && BIO_sock_should_retry(ret)) {
+        BIO_set_retry_write(bio);
+    }
+    return ret;
+}
+
+static BIO_METHOD *__apn_ssl_bio_method_new(void) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    __apn_ssl_bio_method_storage = *BIO_s_socket();
+    __apn_ssl_bio_method_storage.bwrite = __apn_ssl_bio_write;
+    return &__apn_ssl_bio_method_storage;
+#else
+    BIO_METHOD *socket_method = (BIO_METHOD *) BIO_s_socket();
+    BIO_METHOD *method = BIO_meth_new(BIO_TYPE_SOCKET, "capn socket");
+    if (method) {
+        BIO_meth_set_write(method, __apn_ssl_bio_write);
+        BIO_meth_set_read(method, BIO_meth_get_read(socket_method));
+        BIO_meth_set_puts(method, BIO_meth_get_puts(socket_method));
+        BIO_meth_set_ctrl(method, BIO_meth_get_ctrl(socket_method));
+        BIO_meth_set_create(method, BIO_meth_get_create(socket_method));
+        BIO_meth_set_destroy(method, BIO_meth_get_destroy(socket_method));
+    }
+    return method;
+#endif
+}
+#endif
+
+apn_return apn_ssl_init() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
     SSL_load_error_strings();
     SSL_library_init();
+
+    __apn_ssl_locks_count = CRYPTO_num_locks();
+    __apn_ssl_locks = malloc(sizeof(__apn_ssl_mutex_t) * (size_t) __apn_ssl_locks_count);
+    if (!__apn_ssl_locks) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    for (int i = 0; i < __apn_ssl_locks_count; i++) {
+        __APN_SSL_MUTEX_INIT(&__apn_ssl_locks[i]);
+    }
+    CRYPTO_set_locking_callback(__apn_ssl_locking_callback);
+#else
+    if (!OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL)) {
+        return APN_ERROR;
+    }
+#endif
+#ifdef MSG_NOSIGNAL
+    if (NULL == (__apn_ssl_bio_method = __apn_ssl_bio_method_new())) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+#endif
+    return APN_SUCCESS;
 }
 
 void apn_ssl_free() {
+#if defined(MSG_NOSIGNAL) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+    BIO_meth_free(__apn_ssl_bio_method);
+    __apn_ssl_bio_method = NULL;
+#endif
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (__apn_ssl_locks) {
+        CRYPTO_set_locking_callback(NULL);
+        for (int i = 0; i < __apn_ssl_locks_count; i++) {
+            __APN_SSL_MUTEX_DESTROY(&__apn_ssl_locks[i]);
+        }
+        free(__apn_ssl_locks);
+        __apn_ssl_locks = NULL;
+    }
     ERR_free_strings();
     EVP_cleanup();
+#endif
 }
 
-apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
+apn_return apn_ssl_connect(apn_ctx_t *const ctx, const char *const host) {
     assert(ctx);
+    assert(host);
 
+    char ssl_error_str[APN_SSL_ERROR_STRING_SIZE];
     SSL_CTX *ssl_ctx = NULL;
-    if (NULL == (ssl_ctx = SSL_CTX_new(TLSv1_client_method()))) {
+    uint8_t http2 = APN_USE_HTTP2(ctx);
+    uint8_t ktls = (ctx->options & APN_OPTION_KTLS) ? 1 : 0;
+    if (ktls && ctx->custom_transport) {
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Kernel TLS needs a socket, using user-space TLS over the custom transport");
+        ktls = 0;
+    }
+    if (NULL == (ssl_ctx = SSL_CTX_new((http2 || ktls) ? SSLv23_client_method() : TLSv1_client_method()))) {
         apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not initialize SSL context: %s",
-                  ERR_error_string(ERR_get_error(), NULL));
+                  __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
         return APN_ERROR;
     }
 
     SSL_CTX_set_ex_data(ssl_ctx, 0, ctx);
     SSL_CTX_set_info_callback(ssl_ctx, __apn_ssl_info_callback);
 
+    if (http2 || ktls) {
+        /* The provider API requires TLS 1.2 or later, the kernel does not implement earlier versions */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+#else
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+#endif
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    if (http2) {
+        /* HTTP/2 is negotiated with ALPN */
+        SSL_CTX_set_alpn_protos(ssl_ctx, (const unsigned char *) "\x02h2", 3);
+    }
+#endif
+    if (ktls) {
+#ifdef APN_SSL_KTLS
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+        /* Prefer ciphers the kernel can take over */
+        SSL_CTX_set_cipher_list(ssl_ctx, "AESGCM:HIGH:!aNULL:!MD5");
+#else
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Kernel TLS is not supported by this build, using user-space TLS");
+#endif
+    }
+
     X509 * cert = NULL;
 
+    if (http2 && ctx->auth_key_file) {
+        /* Token-based authentication: no client certificate */
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Using authentication key %s (key id: %s, team id: %s)",
+                ctx->auth_key_file, ctx->auth_key_id ? ctx->auth_key_id : "",
+                ctx->auth_team_id ? ctx->auth_team_id : "");
+        /* The provider token can push to every app of the team, it is sent to a verified server only */
+        if (ctx->ca_file ? !SSL_CTX_load_verify_locations(ssl_ctx, ctx->ca_file, NULL)
+                         : !SSL_CTX_set_default_verify_paths(ssl_ctx)) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to load trusted certificates%s%s: %s",
+                    ctx->ca_file ? " from " : "", ctx->ca_file ? ctx->ca_file : "",
+                    __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
+            SSL_CTX_free(ssl_ctx);
+            errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+            return APN_ERROR;
+        }
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+        goto ssl_new;
+    }
+
     if (ctx->pkcs12_file && ctx->pkcs12_pass) {
         FILE *pkcs12_file = NULL;
 #ifdef _WIN32
@@ -108,10 +314,9 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
         pkcs12_file = fopen(ctx->pkcs12_file, "r");
 #endif
         if (!pkcs12_file) {
-            char *error = apn_error_string(errno);
-            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to open file %s: %s (errno: %d)", ctx->pkcs12_file, error,
-                      errno);
-            free(error);
+            char error[APN_ERROR_STRING_SIZE];
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to open file %s: %s (errno: %d)",
+                    ctx->pkcs12_file, apn_error_string_r(errno, error, sizeof(error)), errno);
             SSL_CTX_free(ssl_ctx);
             errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_PKCS12;
             return APN_ERROR;
@@ -125,7 +330,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
         if (!PKCS12_parse(pkcs12_cert, ctx->pkcs12_pass, &private_key, &cert, NULL)) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified PKCS#12 file: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             PKCS12_free(pkcs12_cert);
             SSL_CTX_free(ssl_ctx);
             errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_PKCS12;
@@ -135,7 +340,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
         if (!SSL_CTX_use_certificate(ssl_ctx, cert)) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified PKCS#12 file: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             X509_free(cert);
             EVP_PKEY_free(private_key);
             SSL_CTX_free(ssl_ctx);
@@ -145,7 +350,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
         if (!SSL_CTX_use_PrivateKey(ssl_ctx, private_key)) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified PKCS#12 file: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             X509_free(cert);
             EVP_PKEY_free(private_key);
             SSL_CTX_free(ssl_ctx);
@@ -161,10 +366,9 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
         cert_file = fopen(ctx->certificate_file, "r");
 #endif
         if (!cert_file) {
-            char *error = apn_error_string(errno);
-            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to open file %s: %s (errno: %d)", ctx->pkcs12_file, error,
-                      errno);
-            free(error);
+            char error[APN_ERROR_STRING_SIZE];
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to open file %s: %s (errno: %d)",
+                    ctx->pkcs12_file, apn_error_string_r(errno, error, sizeof(error)), errno);
             X509_free(cert);
             SSL_CTX_free(ssl_ctx);
             errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_CERTIFICATE;
@@ -174,7 +378,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
         cert = PEM_read_X509(cert_file, NULL, NULL, NULL);
         if (!cert) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified certificate: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             SSL_CTX_free(ssl_ctx);
             fclose(cert_file);
             errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_CERTIFICATE;
@@ -184,7 +388,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
         if (!SSL_CTX_use_certificate(ssl_ctx, cert)) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified certificate: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             X509_free(cert);
             SSL_CTX_free(ssl_ctx);
             errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_CERTIFICATE;
@@ -207,7 +411,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
         if (!SSL_CTX_use_PrivateKey_file(ssl_ctx, ctx->private_key_file, SSL_FILETYPE_PEM)) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified private key: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             apn_strfree(&password);
             X509_free(cert);
             SSL_CTX_free(ssl_ctx);
@@ -219,7 +423,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
         if (!SSL_CTX_check_private_key(ssl_ctx)) {
             apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to use specified private key: %s",
-                      ERR_error_string(ERR_get_error(), NULL));
+                      __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
             errno = APN_ERR_UNABLE_TO_USE_SPECIFIED_PRIVATE_KEY;
             X509_free(cert);
             SSL_CTX_free(ssl_ctx);
@@ -232,11 +436,10 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
 
     time_t expires = 0;
     uint8_t expired = __apn_cert_expired(cert, &expires);
+    uint32_t cert_mode = __apn_cert_mode(cert);
 
     X509_free(cert);
 
-    uint32_t cert_mode = __apn_cert_mode(cert);
-
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Certificate subject: %s", subject);
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Certificate issuer: %s", issuer);
     apn_log(ctx, APN_LOG_LEVEL_INFO, "Certificate mode: %s (%d)",
@@ -250,11 +453,19 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
         goto invalid_cert;
     } else {
         char str_time[20];
-        strftime(str_time, sizeof(str_time), "%Y-%m-%d %H:%M:%S", gmtime(&expires));
+        struct tm tm;
+#ifdef _WIN32
+        gmtime_s(&tm, &expires);
+#else
+        gmtime_r(&expires, &tm);
+#endif
+        strftime(str_time, sizeof(str_time), "%Y-%m-%d %H:%M:%S", &tm);
         apn_log(ctx, APN_LOG_LEVEL_INFO, "Certificate expires at %s", str_time);
     }
 
-    if (apn_mode(ctx) == APN_MODE_PRODUCTION && !(cert_mode & APN_CERT_MODE_PRODUCTION)) {
+    if (ctx->options & APN_OPTION_NO_CERT_MODE_CHECK) {
+        apn_log(ctx, APN_LOG_LEVEL_INFO, "Certificate mode check is disabled");
+    } else if (apn_mode(ctx) == APN_MODE_PRODUCTION && !(cert_mode & APN_CERT_MODE_PRODUCTION)) {
         apn_log(ctx, APN_LOG_LEVEL_ERROR,
                 "Invalid certificate. You are using a PRODUCTION mode, but certificate was created for usage in %s",
                 __apn_cert_mode_string(cert_mode));
@@ -266,6 +477,7 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
         goto invalid_cert;
     }
 
+    ssl_new:
     ctx->ssl = SSL_new(ssl_ctx);
     SSL_CTX_free(ssl_ctx);
 
@@ -275,25 +487,151 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
         return APN_ERROR;
     }
 
-    int ret = 0;
-
-    if (-1 == (ret = SSL_set_fd(ctx->ssl, ctx->sock))) {
-        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to attach socket to SSL: SSL_set_fd() failed (%d)",
-                  SSL_get_error(ctx->ssl, ret));
+    if (http2) {
+        SSL_set_tlsext_host_name(ctx->ssl, host);
+    }
+    if (SSL_get_verify_mode(ctx->ssl) & SSL_VERIFY_PEER) {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+        /* The certificate must be issued for the host connected to, an address is matched as such */
+        X509_VERIFY_PARAM *param = SSL_get0_param(ctx->ssl);
+        X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+        if (!X509_VERIFY_PARAM_set1_ip_asc(param, host) && !X509_VERIFY_PARAM_set1_host(param, host, 0)) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to verify host name %s: %s", host,
+                    __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)));
+            errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+            return APN_ERROR;
+        }
+#else
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Host name of the server cannot be verified: OpenSSL 1.0.2 or later "
+                "is required for token-based authentication");
         errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
         return APN_ERROR;
+#endif
+    }
+
+    int ret = 0;
+
+    /* HTTP/2 and kernel TLS read and write the socket through OpenSSL, everything else runs over memory BIOs */
+    ctx->mem_bio = !http2;
+#ifdef APN_SSL_KTLS
+    if (ktls) {
+        ctx->mem_bio = 0;
+    }
+#endif
+
+    if (ctx->mem_bio) {
+        BIO *rbio = BIO_new(BIO_s_mem());
+        BIO *wbio = BIO_new(BIO_s_mem());
+        if (!rbio || !wbio) {
+            BIO_free(rbio);
+            BIO_free(wbio);
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to attach transport to SSL: BIO_new() failed");
+            errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+            return APN_ERROR;
+        }
+        /* An empty read BIO means "retry", not end of file */
+        BIO_set_mem_eof_return(rbio, -1);
+        SSL_set_bio(ctx->ssl, rbio, wbio);
+    } else {
+#ifdef MSG_NOSIGNAL
+        BIO *bio = BIO_new(__apn_ssl_bio_method);
+        if (!bio) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to attach socket to SSL: BIO_new() failed");
+            errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+            return APN_ERROR;
+        }
+        BIO_set_fd(bio, ctx->sock, BIO_NOCLOSE);
+        SSL_set_bio(ctx->ssl, bio, bio);
+#else
+        if (-1 == (ret = SSL_set_fd(ctx->ssl, ctx->sock))) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Unable to attach socket to SSL: SSL_set_fd() failed (%d)",
+                      SSL_get_error(ctx->ssl, ret));
+            errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+            return APN_ERROR;
+        }
+#endif
     }
 
-    if (1 > (ret = SSL_connect(ctx->ssl))) {
-        char *error = apn_error_string(errno);
+    /* The whole handshake is limited to APN_SSL_IO_TIMEOUT, each wait gets the time left */
+    uint64_t deadline = APN_SSL_DEADLINE(APN_SSL_IO_TIMEOUT);
+    while (1 > (ret = SSL_connect(ctx->ssl))) {
+        int ssl_error = SSL_get_error(ctx->ssl, ret);
+        if (ctx->mem_bio && ssl_error == SSL_ERROR_WANT_READ) {
+            /* Records of the client go out before records of the server are awaited */
+            if (0 == __apn_ssl_flush(ctx, deadline, NULL) && 0 == __apn_ssl_fill(ctx, deadline)) {
+                continue;
+            }
+            return __apn_ssl_handshake_error(ctx);
+        }
+        if (!ctx->mem_bio && (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)) {
+            /* Socket is non-blocking: wait until handshake can proceed */
+            fd_set set;
+            uint32_t remaining = __apn_ssl_remaining(deadline);
+            struct timeval timeout = {(long) (remaining / 1000), (long) (remaining % 1000) * 1000};
+            FD_ZERO(&set);
+            FD_SET(ctx->sock, &set);
+            int select_returned = 0;
+            if (remaining > 0) {
+                select_returned = select(ctx->sock + 1,
+                                         (ssl_error == SSL_ERROR_WANT_READ) ? &set : NULL,
+                                         (ssl_error == SSL_ERROR_WANT_WRITE) ? &set : NULL,
+                                         NULL, &timeout);
+            }
+            if (select_returned > 0 || (select_returned < 0 && errno == EINTR)) {
+                continue;
+            }
+            if (select_returned == 0) {
+                apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not initialize SSL connection: handshake timed out");
+                errno = APN_ERR_NETWORK_TIMEDOUT;
+                return APN_ERROR;
+            }
+        }
+        long verify_result = SSL_get_verify_result(ctx->ssl);
+        if (X509_V_OK != verify_result) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Server certificate of %s was not verified: %s", host,
+                    X509_verify_cert_error_string(verify_result));
+        }
+        char error[APN_ERROR_STRING_SIZE];
         apn_log(ctx, APN_LOG_LEVEL_ERROR,
                   "Could not initialize SSL connection: SSL_connect() failed: %s, %s (errno: %d):",
-                  ERR_error_string((unsigned long) SSL_get_error(ctx->ssl, ret), NULL), error, errno);
-        free(error);
+                  __apn_ssl_error_string(ssl_error_str, sizeof(ssl_error_str)),
+                  apn_error_string_r(errno, error, sizeof(error)), errno);
+        errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
         return APN_ERROR;
     }
+    /* The last flight of the client, Finished for TLS 1.3, is still in the write BIO */
+    if (ctx->mem_bio && 0 != __apn_ssl_flush(ctx, deadline, NULL)) {
+        return __apn_ssl_handshake_error(ctx);
+    }
     apn_log(ctx, APN_LOG_LEVEL_INFO, "SSL connection has been established");
 
+    if (http2) {
+        const unsigned char *protocol = NULL;
+        unsigned int protocol_length = 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+        SSL_get0_alpn_selected(ctx->ssl, &protocol, &protocol_length);
+#endif
+        if (2 != protocol_length || 0 != memcmp(protocol, "h2", 2)) {
+            apn_log(ctx, APN_LOG_LEVEL_ERROR, "Server does not support HTTP/2");
+            errno = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+            return APN_ERROR;
+        }
+    }
+
+    ctx->ktls = 0;
+#ifdef APN_SSL_KTLS
+    if (ktls) {
+        if (BIO_get_ktls_send(SSL_get_wbio(ctx->ssl))) {
+            ctx->ktls = 1;
+            APN_STATS_INC(ctx, ktls_handshakes);
+            apn_log(ctx, APN_LOG_LEVEL_INFO, "TLS encryption has been handed to the kernel (%s)",
+                    SSL_get_cipher_name(ctx->ssl));
+        } else {
+            apn_log(ctx, APN_LOG_LEVEL_INFO, "Kernel TLS is not available for %s, using user-space TLS",
+                    SSL_get_cipher_name(ctx->ssl));
+        }
+    }
+#endif
 
     return APN_SUCCESS;
 
@@ -304,16 +642,202 @@ apn_return apn_ssl_connect(apn_ctx_t *const ctx) {
     return APN_ERROR;
 }
 
+/* Maps errno of a failed write to the transport */
+static int __apn_ssl_write_errno(int errcode) {
+    switch (errcode) {
+        case EPIPE:
+        case ECONNRESET:
+            return APN_ERR_NETWORK_UNREACHABLE;
+        case ETIMEDOUT:
+            return APN_ERR_NETWORK_TIMEDOUT;
+        default:
+            return APN_ERR_SSL_WRITE_FAILED;
+    }
+}
+
+/* Maps errno of a failed read from the transport */
+static int __apn_ssl_read_errno(int errcode) {
+    switch (errcode) {
+        case EPIPE:
+            return APN_ERR_NETWORK_UNREACHABLE;
+        case ETIMEDOUT:
+            return APN_ERR_NETWORK_TIMEDOUT;
+        default:
+            return APN_ERR_SSL_READ_FAILED;
+    }
+}
+
+static int __apn_ssl_transport_poll(const apn_ctx_t *const ctx, int events, uint32_t timeout) {
+    int ready = 0;
+    do {
+        ready = ctx->transport.poll(ctx->transport.user, events, timeout);
+    } while (0 > ready && EINTR == errno);
+    return ready;
+}
+
+/* Milliseconds left until `deadline`, 0 once it has passed */
+static uint32_t __apn_ssl_remaining(uint64_t deadline) {
+    uint64_t now = apn_clock_us();
+    return now < deadline ? (uint32_t) ((deadline - now + 999) / 1000) : 0;
+}
+
+static int __apn_ssl_wait_writable(const apn_ctx_t *const ctx, size_t length, uint32_t timeout) {
+    APN_TRACE(ctx, APN_TRACE_WRITE_BLOCKED, 0, length);
+    int ready = timeout > 0 ? __apn_ssl_transport_poll(ctx, APN_TRANSPORT_WRITE, timeout) : 0;
+    if (0 == ready) {
+        errno = APN_ERR_NETWORK_TIMEDOUT;
+        return -1;
+    }
+    return ready < 0 ? -1 : 0;
+}
+
+/* Drops `length` bytes written to the transport from the head of the write BIO */
+static void __apn_ssl_discard(BIO *const bio, size_t length) {
+    char scratch[1024];
+    while (length > 0) {
+        int discarded = BIO_read(bio, scratch, (int) (length < sizeof(scratch) ? length : sizeof(scratch)));
+        if (discarded <= 0) {
+            break;
+        }
+        length -= (size_t) discarded;
+    }
+}
+
+/*
+ * Writes all records pending in the write BIO to the transport in one call when it takes them, waiting
+ * until `deadline` (see apn_clock_us()). If `deadline` is 0, returns as soon as the transport would block.
+ * `flushed` is set to the number of bytes written, can be NULL. Returns 0 or -1 with errno set.
+ */
+static int __apn_ssl_flush(const apn_ctx_t *const ctx, uint64_t deadline, size_t *flushed) {
+    BIO *wbio = SSL_get_wbio(ctx->ssl);
+    char *pending = NULL;
+    long length = 0;
+    if (flushed) {
+        *flushed = 0;
+    }
+    while (0 < (length = BIO_get_mem_data(wbio, &pending))) {
+        apn_iovec_t iov = {pending, (size_t) length};
+        int written = ctx->transport.writev(ctx->transport.user, &iov, 1);
+        if (written > 0 && flushed) {
+            *flushed += (size_t) written;
+        }
+        if (written == length) {
+            (void) BIO_reset(wbio);
+            break;
+        } else if (written > 0) {
+            __apn_ssl_discard(wbio, (size_t) written);
+        } else if (written < 0 && EINTR == errno) {
+            continue;
+        } else if (written < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            if (0 == deadline) {
+                break;
+            }
+            if (-1 == __apn_ssl_wait_writable(ctx, (size_t) length, __apn_ssl_remaining(deadline))) {
+                if (APN_ERR_NETWORK_TIMEDOUT != errno) {
+                    errno = __apn_ssl_write_errno(errno);
+                }
+                return -1;
+            }
+        } else {
+            errno = (0 == written) ? APN_ERR_CONNECTION_CLOSED : __apn_ssl_write_errno(errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Moves records of the peer from the transport to the read BIO, waiting for them until `deadline`
+ * (see apn_clock_us()). Returns 0 or -1 with errno set
+ */
+static int __apn_ssl_fill(const apn_ctx_t *const ctx, uint64_t deadline) {
+    char buffer[APN_SSL_READ_SIZE];
+    for (; ;) {
+        int received = ctx->transport.read(ctx->transport.user, buffer, sizeof(buffer));
+        if (received > 0) {
+            BIO_write(SSL_get_rbio(ctx->ssl), buffer, received);
+            return 0;
+        } else if (0 == received) {
+            errno = APN_ERR_CONNECTION_CLOSED;
+            return -1;
+        } else if (EINTR == errno) {
+            continue;
+        } else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+            uint32_t remaining = __apn_ssl_remaining(deadline);
+            int ready = remaining > 0 ? __apn_ssl_transport_poll(ctx, APN_TRANSPORT_READ, remaining) : 0;
+            if (0 < ready) {
+                continue;
+            }
+            errno = (0 == ready) ? APN_ERR_NETWORK_TIMEDOUT : __apn_ssl_read_errno(errno);
+            return -1;
+        } else {
+            errno = __apn_ssl_read_errno(errno);
+            return -1;
+        }
+    }
+}
+
+static apn_return __apn_ssl_handshake_error(const apn_ctx_t *const ctx) {
+    int errcode = errno;
+    char error[APN_ERROR_STRING_SIZE];
+    if (APN_ERR_NETWORK_TIMEDOUT == errcode) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not initialize SSL connection: handshake timed out");
+    } else {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Could not initialize SSL connection: %s (errno: %d)",
+                apn_error_string_r(errcode, error, sizeof(error)), errcode);
+        errcode = APN_ERR_UNABLE_TO_ESTABLISH_SSL_CONNECTION;
+    }
+    errno = errcode;
+    return APN_ERROR;
+}
+
+#ifdef APN_SSL_KTLS
+/* The kernel encrypts the records, OpenSSL is not involved */
+static int __apn_ssl_ktls_write(const apn_ctx_t *const ctx, const uint8_t *message, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t sent = send(ctx->sock, message + total, length - total, MSG_NOSIGNAL);
+        if (sent > 0) {
+            total += (size_t) sent;
+        } else if (sent < 0 && EINTR == errno) {
+            continue;
+        } else if (sent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            if (-1 == __apn_ssl_wait_writable(ctx, length - total, APN_SSL_IO_TIMEOUT)) {
+                return -1;
+            }
+        } else {
+            errno = (0 == sent) ? APN_ERR_CONNECTION_CLOSED : __apn_ssl_write_errno(errno);
+            return -1;
+        }
+    }
+    return (int) total;
+}
+#endif
+
 int apn_ssl_write(const apn_ctx_t *const ctx, const uint8_t *message, size_t length) {
     int bytes_written = 0;
     int bytes_written_total = 0;
 
+#ifdef APN_SSL_KTLS
+    if (ctx->ktls) {
+        return __apn_ssl_ktls_write(ctx, message, length);
+    }
+#endif
+
+    if (ctx->mem_bio) {
+        if (-1 == apn_ssl_encrypt(ctx, message, length) || -1 == __apn_ssl_flush(ctx, APN_SSL_DEADLINE(APN_SSL_IO_TIMEOUT), NULL)) {
+            return -1;
+        }
+        return (int) length;
+    }
+
     while (length > 0) {
         bytes_written = SSL_write(ctx->ssl, message, (int) length);
         if (bytes_written <= 0) {
             switch (SSL_get_error(ctx->ssl, bytes_written)) {
                 case SSL_ERROR_WANT_WRITE:
                 case SSL_ERROR_WANT_READ:
+                    APN_TRACE(ctx, APN_TRACE_WRITE_BLOCKED, 0, length);
                     continue;
                 case SSL_ERROR_SYSCALL:
                     switch (errno) {
@@ -345,6 +869,41 @@ int apn_ssl_write(const apn_ctx_t *const ctx, const uint8_t *message, size_t len
     return bytes_written_total;
 }
 
+int apn_ssl_encrypt(const apn_ctx_t *const ctx, const uint8_t *message, size_t length) {
+    assert(ctx->mem_bio);
+    /* A memory BIO takes everything: the whole message is encrypted by one call */
+    int bytes_written = SSL_write(ctx->ssl, message, (int) length);
+    if (bytes_written <= 0) {
+        errno = (SSL_ERROR_ZERO_RETURN == SSL_get_error(ctx->ssl, bytes_written)) ?
+                APN_ERR_CONNECTION_CLOSED : APN_ERR_SSL_WRITE_FAILED;
+        return -1;
+    }
+    return bytes_written;
+}
+
+size_t apn_ssl_encrypted(const apn_ctx_t *const ctx) {
+    return ctx->mem_bio ? BIO_ctrl_pending(SSL_get_wbio(ctx->ssl)) : 0;
+}
+
+int apn_ssl_flush(const apn_ctx_t *const ctx, size_t *flushed) {
+    if (!ctx->mem_bio) {
+        if (flushed) {
+            *flushed = 0;
+        }
+        return 0;
+    }
+    return __apn_ssl_flush(ctx, APN_SSL_DEADLINE(APN_SSL_IO_TIMEOUT), flushed);
+}
+
+int apn_ssl_poll(const apn_ctx_t *const ctx, int events, uint32_t timeout) {
+    /* Records already taken from the transport would never make it readable again */
+    if ((events & APN_TRANSPORT_READ) && ctx->ssl &&
+        (SSL_pending(ctx->ssl) > 0 || (ctx->mem_bio && BIO_ctrl_pending(SSL_get_rbio(ctx->ssl)) > 0))) {
+        return APN_TRANSPORT_READ;
+    }
+    return __apn_ssl_transport_poll(ctx, events, timeout);
+}
+
 int apn_ssl_read(const apn_ctx_t *const ctx, char *buff, size_t length) {
     int read;
     for (; ;) {
@@ -353,8 +912,12 @@ int apn_ssl_read(const apn_ctx_t *const ctx, char *buff, size_t length) {
             break;
         }
         switch (SSL_get_error(ctx->ssl, read)) {
-            case SSL_ERROR_WANT_WRITE:
             case SSL_ERROR_WANT_READ:
+                if (ctx->mem_bio && -1 == __apn_ssl_fill(ctx, APN_SSL_DEADLINE(APN_SSL_IO_TIMEOUT))) {
+                    return -1;
+                }
+                continue;
+            case SSL_ERROR_WANT_WRITE:
                 continue;
             case SSL_ERROR_SYSCALL:
                 switch (errno) {
@@ -382,20 +945,80 @@ int apn_ssl_read(const apn_ctx_t *const ctx, char *buff, size_t length) {
     return read;
 }
 
-void apn_ssl_close(apn_ctx_t *const ctx) {
-    if (ctx->ssl) {
 #ifndef _WIN32
-        signal(SIGPIPE, SIG_IGN);
+int apn_ssl_sendfile(const apn_ctx_t *const ctx, int fd, off_t offset, size_t length) {
+#if defined(APN_SSL_KTLS) && defined(APN_HAVE_SYS_SENDFILE_H)
+    assert(ctx->ktls);
+
+    /* sendfile() has no MSG_NOSIGNAL: SIGPIPE is blocked in this thread and one raised by it is discarded */
+    sigset_t pipe_set, old_set, pending_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending_set);
+    int pipe_pending = sigismember(&pending_set, SIGPIPE);
+
+    size_t total = 0;
+    int errcode = 0;
+    while (total < length) {
+        ssize_t sent = sendfile(ctx->sock, fd, &offset, length - total);
+        if (sent > 0) {
+            total += (size_t) sent;
+        } else if (sent < 0 && EINTR == errno) {
+            continue;
+        } else if (sent < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            if (-1 == __apn_ssl_wait_writable(ctx, length - total, APN_SSL_IO_TIMEOUT)) {
+                errcode = errno;
+                break;
+            }
+        } else {
+            /* 0 means the file is shorter than expected */
+            errcode = sent < 0 ? errno : APN_ERR_SSL_WRITE_FAILED;
+            break;
+        }
+    }
+
+    if (EPIPE == errcode && !pipe_pending) {
+        struct timespec no_wait = {0, 0};
+        sigtimedwait(&pipe_set, NULL, &no_wait);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (errcode) {
+        errno = errcode < APN_ERR_FAILED_INIT ? __apn_ssl_write_errno(errcode) : errcode;
+        return -1;
+    }
+    return (int) total;
+#else
+    (void) ctx;
+    (void) fd;
+    (void) offset;
+    (void) length;
+    errno = APN_ERR_SSL_WRITE_FAILED;
+    return -1;
 #endif
-        if (!SSL_shutdown(ctx->ssl)) {
+}
+#endif
+
+void apn_ssl_close(apn_ctx_t *const ctx) {
+    if (ctx->ssl) {
+        if (ctx->ktls) {
+            /* The socket BIO would write close_notify as application data */
+            SSL_set_quiet_shutdown(ctx->ssl, 1);
+        }
+        if (ctx->mem_bio) {
+            /* close_notify is sent only if the transport takes it without waiting, the peer's one is not awaited */
+            SSL_shutdown(ctx->ssl);
+            __apn_ssl_flush(ctx, 0, NULL);
+        } else if (!SSL_shutdown(ctx->ssl)) {
+            /* close_notify is written through the MSG_NOSIGNAL BIO or to a SO_NOSIGPIPE socket */
             shutdown(ctx->sock, SHUT_RDWR);
             SSL_shutdown(ctx->ssl);
         }
-#ifndef _WIN32
-        signal(SIGPIPE, SIG_DFL);
-#endif
         SSL_free(ctx->ssl);
         ctx->ssl = NULL;
+        ctx->ktls = 0;
+        ctx->mem_bio = 0;
     }
 }
 
@@ -428,6 +1051,12 @@ static void __apn_ssl_info_callback(const SSL *ssl, int where, int ret) {
     }
 }
 
+/* Unlike ERR_error_string() with NULL buffer, writes to the caller's buffer and is thread-safe */
+static const char *__apn_ssl_error_string(char *const buffer, size_t buffer_size) {
+    ERR_error_string_n(ERR_get_error(), buffer, buffer_size);
+    return buffer;
+}
+
 static int __apn_ssl_password_callback(char *buf, int size, int rwflag, void *password) {
     (void) rwflag;
     if (!password || size <= 0) {
@@ -27,12 +27,17 @@
 #include "apn.h"
 #include <openssl/err.h>
 #include <openssl/pkcs12.h>
+#include <openssl/x509v3.h>
 
-void apn_ssl_init();
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+apn_return apn_ssl_init();
 void apn_ssl_free();
 
-apn_return apn_ssl_connect(apn_ctx_t *const ctx)
-        __apn_attribute_nonnull__((1));
+apn_return apn_ssl_connect(apn_ctx_t *const ctx, const char *const host)
+        __apn_attribute_nonnull__((1, 2));
 
 void apn_ssl_close(apn_ctx_t *const ctx)
         __apn_attribute_nonnull__((1));
@@ -43,4 +48,48 @@ int apn_ssl_write(const apn_ctx_t *const ctx, const uint8_t *message, size_t len
 int apn_ssl_read(const apn_ctx_t *const ctx, char *buff, size_t length)
         __apn_attribute_nonnull__((1,2));
 
+/*
+ * Plaintext bytes encrypted with apn_ssl_encrypt() before the records are flushed to the transport
+ * by apn_ssl_flush(), so that the transport is written once per batch of notifications
+ */
+#define APN_SSL_WRITE_BATCH (64 * 1024)
+
+/**
+ * Encrypts `length` bytes into records kept in the write BIO, nothing is written to the transport.
+ * Can be used only when `ctx->mem_bio` is set. Returns `length` or -1 with errno set.
+ */
+int apn_ssl_encrypt(const apn_ctx_t *const ctx, const uint8_t *message, size_t length)
+        __apn_attribute_nonnull__((1,2));
+
+/**
+ * Returns the number of bytes of records encrypted by apn_ssl_encrypt() and not yet written to the transport.
+ */
+size_t apn_ssl_encrypted(const apn_ctx_t *const ctx)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Writes records encrypted by apn_ssl_encrypt() to the transport, waiting until it takes all of them.
+ * `flushed` is set to the number of bytes the transport took, also on error, can be NULL.
+ * Returns 0 or -1 with errno set.
+ */
+int apn_ssl_flush(const apn_ctx_t *const ctx, size_t *flushed)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Waits up to `timeout` milliseconds until the connection becomes readable or writable, `events` is a mask
+ * of APN_TRANSPORT_READ and APN_TRANSPORT_WRITE. Data already read from the transport but not returned by
+ * apn_ssl_read() makes it readable at once. Returns a mask of ready events, 0 on timeout or -1 with errno set.
+ */
+int apn_ssl_poll(const apn_ctx_t *const ctx, int events, uint32_t timeout)
+        __apn_attribute_nonnull__((1));
+
+#ifndef _WIN32
+/**
+ * Writes `length` bytes of file `fd` from `offset` with sendfile(). The kernel encrypts them, so it
+ * can be used only when `ctx->ktls` is set. Returns the number of bytes written or -1 with errno set.
+ */
+int apn_ssl_sendfile(const apn_ctx_t *const ctx, int fd, off_t offset, size_t length)
+        __apn_attribute_nonnull__((1));
+#endif
+
 #endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "apn_platform.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "apn_strings.h"
+#include "apn_stats_private.h"
+
+#define APN_STATS_SUB_BUCKETS (1 << (APN_HISTOGRAM_PRECISION - 1))
+
+struct __apn_stats_buffer {
+    char *data;
+    size_t size;
+    size_t length;
+};
+
+struct __apn_stats_counter {
+    const char *name;
+    const char *help;
+    const char *label;
+    size_t offset;
+};
+
+struct __apn_stats_histogram {
+    const char *name;
+    const char *help;
+    size_t offset;
+};
+
+static const struct __apn_stats_counter __apn_stats_counters[] = {
+        {"frames_sent",        "Notifications written to a socket",                        NULL,
+                offsetof(apn_stats_t, frames_sent)},
+        {"bytes_written",      "Bytes written to a socket",                                NULL,
+                offsetof(apn_stats_t, bytes_written)},
+        {"invalid_tokens",     "Tokens rejected by Apple as invalid",                      NULL,
+                offsetof(apn_stats_t, invalid_tokens)},
+        {"apple_errors",       "Error responses other than invalid token",                 NULL,
+                offsetof(apn_stats_t, apple_errors)},
+        {"connects",           "TCP connections established",                              NULL,
+                offsetof(apn_stats_t, connects)},
+        {"connect_failures",   "TCP connections which could not be established",           NULL,
+                offsetof(apn_stats_t, connect_failures)},
+        {"handshakes",         "TLS handshakes completed",                                 NULL,
+                offsetof(apn_stats_t, handshakes)},
+        {"handshake_failures", "TLS handshakes failed",                                    NULL,
+                offsetof(apn_stats_t, handshake_failures)},
+        {"reconnects",         "Reconnects by cause",                                      "invalid_token",
+                offsetof(apn_stats_t, reconnects_invalid_token)},
+        {"reconnects",         "Reconnects by cause",                                      "shutdown",
+                offsetof(apn_stats_t, reconnects_shutdown)},
+        {"reconnects",         "Reconnects by cause",                                      "apple_error",
+                offsetof(apn_stats_t, reconnects_apple_error)},
+        {"reconnects",         "Reconnects by cause",                                      "io_error",
+                offsetof(apn_stats_t, reconnects_io_error)},
+        {"reconnects",         "Reconnects by cause",                                      "idle",
+                offsetof(apn_stats_t, reconnects_idle)},
+        {"reconnects",         "Reconnects by cause",                                      "stale",
+                offsetof(apn_stats_t, reconnects_stale)},
+        {"select_wakeups",     "Returns from select()",                                    NULL,
+                offsetof(apn_stats_t, select_wakeups)},
+        {"rate_decreases",     "Send rate decreases by the adaptive rate controller",      NULL,
+                offsetof(apn_stats_t, rate_decreases)},
+        {"tokens_suppressed",  "Notifications skipped as the token is in the token store", NULL,
+                offsetof(apn_stats_t, tokens_suppressed)},
+        {"ktls_handshakes",    "TLS handshakes followed by kernel TLS offload",            NULL,
+                offsetof(apn_stats_t, ktls_handshakes)}
+};
+
+static const struct __apn_stats_counter __apn_stats_gauges[] = {
+        {"send_rate",          "Current send rate, notifications per second",              NULL,
+                offsetof(apn_stats_t, send_rate)},
+        {"send_buffer",        "Send buffer size of the connection, bytes",                NULL,
+                offsetof(apn_stats_t, send_buffer)}
+};
+
+static const struct __apn_stats_histogram __apn_stats_histograms[] = {
+        {"connect",     "TCP connect time including name resolution",   offsetof(apn_stats_t, connect_latency)},
+        {"handshake",   "TLS handshake time",                           offsetof(apn_stats_t, handshake_latency)},
+        {"write",       "Time to write one notification",               offsetof(apn_stats_t, write_latency)},
+        {"error_wait",  "Time spent waiting for an error response",     offsetof(apn_stats_t, error_wait_latency)},
+        {"response",    "Time from sending a notification to its response", offsetof(apn_stats_t, response_latency)}
+};
+
+#define APN_STATS_COUNT(__array) (sizeof(__array) / sizeof(__array[0]))
+
+static uint32_t __apn_histogram_bucket(uint64_t value) {
+    if (value < 2 * APN_STATS_SUB_BUCKETS) {
+        return (uint32_t) value;
+    }
+#ifdef _WIN32
+    uint32_t msb = 0;
+    while (value >> (msb + 1)) {
+        msb++;
+    }
+#else
+    uint32_t msb = 63 - (uint32_t) __builtin_clzll(value);
+#endif
+    uint32_t shift = msb - (APN_HISTOGRAM_PRECISION - 1);
+    uint32_t bucket = shift * APN_STATS_SUB_BUCKETS + (uint32_t) (value >> shift);
+    return bucket < APN_HISTOGRAM_BUCKETS ? bucket : APN_HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t __apn_histogram_bucket_upper_bound(uint32_t bucket) {
+    if (bucket < 2 * APN_STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint32_t shift = bucket / APN_STATS_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = bucket - shift * APN_STATS_SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+uint64_t apn_clock_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000
+           + (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+#endif
+}
+
+void apn_histogram_record(apn_histogram_t *const histogram, uint64_t value) {
+    APN_STATS_ADD(histogram->buckets[__apn_histogram_bucket(value)], 1);
+    APN_STATS_ADD(histogram->count, 1);
+    APN_STATS_ADD(histogram->sum, value);
+    uint64_t max = APN_STATS_LOAD(histogram->max);
+    while (value > max && !APN_STATS_CAS(histogram->max, max, value)) {
+        max = APN_STATS_LOAD(histogram->max);
+    }
+}
+
+uint64_t apn_histogram_percentile(const apn_histogram_t *const histogram, double percentile) {
+    if (0 == histogram->count) {
+        return 0;
+    }
+    if (percentile < 0) {
+        percentile = 0;
+    } else if (percentile > 100) {
+        percentile = 100;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < APN_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = __apn_histogram_bucket_upper_bound(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void apn_stats_snapshot(const apn_stats_t *const stats, apn_stats_t *const snapshot) {
+    /* apn_stats_t consists of uint64_t fields only */
+    uint64_t *src = (uint64_t *) stats;
+    uint64_t *dst = (uint64_t *) snapshot;
+    for (size_t i = 0; i < sizeof(apn_stats_t) / sizeof(uint64_t); i++) {
+        dst[i] = APN_STATS_LOAD(src[i]);
+    }
+}
+
+void apn_stats_clear(apn_stats_t *const stats) {
+    uint64_t *fields = (uint64_t *) stats;
+    for (size_t i = 0; i < sizeof(apn_stats_t) / sizeof(uint64_t); i++) {
+        APN_STATS_STORE(fields[i], 0);
+    }
+}
+
+static apn_return __apn_stats_append(struct __apn_stats_buffer *const buffer, const char *const format, ...) {
+    for (;;) {
+        size_t available = buffer->size - buffer->length;
+        va_list args;
+        va_start(args, format);
+        int ret = vsnprintf(buffer->data + buffer->length, available, format, args);
+        va_end(args);
+        if (ret < 0) {
+            return APN_ERROR;
+        }
+        if ((size_t) ret < available) {
+            buffer->length += (size_t) ret;
+            return APN_SUCCESS;
+        }
+        size_t size = buffer->size * 2 + (size_t) ret;
+        char *data = realloc(buffer->data, size);
+        if (!data) {
+            errno = ENOMEM;
+            return APN_ERROR;
+        }
+        buffer->data = data;
+        buffer->size = size;
+    }
+}
+
+static apn_return __apn_stats_buffer_init(struct __apn_stats_buffer *const buffer) {
+    buffer->length = 0;
+    buffer->size = 4096;
+    buffer->data = malloc(buffer->size);
+    if (!buffer->data) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    buffer->data[0] = '\0';
+    return APN_SUCCESS;
+}
+
+static char *__apn_stats_buffer_finish(struct __apn_stats_buffer *const buffer, apn_return ret) {
+    if (APN_ERROR == ret) {
+        free(buffer->data);
+        return NULL;
+    }
+    return buffer->data;
+}
+
+#define __APN_STATS_FIELD(__stats, __offset) (*(const uint64_t *) ((const char *) (__stats) + (__offset)))
+#define __APN_STATS_HISTOGRAM(__stats, __offset) ((const apn_histogram_t *) ((const char *) (__stats) + (__offset)))
+
+char *apn_stats_json(const apn_stats_t *const stats) {
+    struct __apn_stats_buffer buffer;
+    apn_return ret = APN_SUCCESS;
+
+    if (APN_ERROR == __apn_stats_buffer_init(&buffer)) {
+        return NULL;
+    }
+
+    ret = __apn_stats_append(&buffer, "{");
+    for (size_t i = 0; i < APN_STATS_COUNT(__apn_stats_counters) && APN_SUCCESS == ret; i++) {
+        const struct __apn_stats_counter *counter = &__apn_stats_counters[i];
+        ret = __apn_stats_append(&buffer, "\"%s%s%s\":%llu,", counter->name, counter->label ? "_" : "",
+                                 counter->label ? counter->label : "",
+                                 (unsigned long long) __APN_STATS_FIELD(stats, counter->offset));
+    }
+    for (size_t i = 0; i < APN_STATS_COUNT(__apn_stats_gauges) && APN_SUCCESS == ret; i++) {
+        ret = __apn_stats_append(&buffer, "\"%s\":%llu,", __apn_stats_gauges[i].name,
+                                 (unsigned long long) __APN_STATS_FIELD(stats, __apn_stats_gauges[i].offset));
+    }
+    for (size_t i = 0; i < APN_STATS_COUNT(__apn_stats_histograms) && APN_SUCCESS == ret; i++) {
+        const apn_histogram_t *histogram = __APN_STATS_HISTOGRAM(stats, __apn_stats_histograms[i].offset);
+        ret = __apn_stats_append(&buffer,
+                                 "%s\"%s_us\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,"
+                                 "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu}",
+                                 i > 0 ? "," : "", __apn_stats_histograms[i].name,
+                                 (unsigned long long) histogram->count, (unsigned long long) histogram->sum,
+                                 (unsigned long long) histogram->max,
+                                 (unsigned long long) apn_histogram_percentile(histogram, 50),
+                                 (unsigned long long) apn_histogram_percentile(histogram, 90),
+                                 (unsigned long long) apn_histogram_percentile(histogram, 99),
+                                 (unsigned long long) apn_histogram_percentile(histogram, 99.9));
+    }
+    if (APN_SUCCESS == ret) {
+        ret = __apn_stats_append(&buffer, "}");
+    }
+    return __apn_stats_buffer_finish(&buffer, ret);
+}
+
+char *apn_stats_prometheus(const apn_stats_t *const stats, const char *const prefix) {
+    struct __apn_stats_buffer buffer;
+    const char *name_prefix = prefix ? prefix : "capn";
+    apn_return ret = APN_SUCCESS;
+
+    if (APN_ERROR == __apn_stats_buffer_init(&buffer)) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < APN_STATS_COUNT(__apn_stats_counters) && APN_SUCCESS == ret; i++) {
+        const struct __apn_stats_counter *counter = &__apn_stats_counters[i];
+        uint64_t value = __APN_STATS_FIELD(stats, counter->offset);
+        if (0 == i || 0 != strcmp(counter->name, __apn_stats_counters[i - 1].name)) {
+            ret = __apn_stats_append(&buffer, "# HELP %s_%s_total %s\n# TYPE %s_%s_total counter\n", name_prefix,
+                                     counter->name, counter->help, name_prefix, counter->name);
+        }
+        if (APN_SUCCESS == ret) {
+            if (counter->label) {
+                ret = __apn_stats_append(&buffer, "%s_%s_total{cause=\"%s\"} %llu\n", name_prefix, counter->name,
+                                         counter->label, (unsigned long long) value);
+            } else {
+                ret = __apn_stats_append(&buffer, "%s_%s_total %llu\n", name_prefix, counter->name,
+                                         (unsigned long long) value);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < APN_STATS_COUNT(__apn_stats_gauges) && APN_SUCCESS == ret; i++) {
+        const struct __apn_stats_counter *gauge = &__apn_stats_gauges[i];
+        ret = __apn_stats_append(&buffer, "# HELP %s_%s %s\n# TYPE %s_%s gauge\n%s_%s %llu\n", name_prefix,
+                                 gauge->name, gauge->help, name_prefix, gauge->name, name_prefix, gauge->name,
+                                 (unsigned long long) __APN_STATS_FIELD(stats, gauge->offset));
+    }
+
+    for (size_t i = 0; i < APN_STATS_COUNT(__apn_stats_histograms) && APN_SUCCESS == ret; i++) {
+        const char *name = __apn_stats_histograms[i].name;
+        const apn_histogram_t *histogram = __APN_STATS_HISTOGRAM(stats, __apn_stats_histograms[i].offset);
+        uint64_t cumulative = 0;
+
+        ret = __apn_stats_append(&buffer, "# HELP %s_%s_seconds %s\n# TYPE %s_%s_seconds histogram\n", name_prefix,
+                                 name, __apn_stats_histograms[i].help, name_prefix, name);
+        /* Every bound is emitted on every scrape so that rate() and histogram_quantile() see a stable series
+         * set. The last bucket also collects clamped values and is only covered by le="+Inf". */
+        for (uint32_t b = 0; b < APN_HISTOGRAM_BUCKETS - 1 && APN_SUCCESS == ret; b++) {
+            cumulative += histogram->buckets[b];
+            ret = __apn_stats_append(&buffer, "%s_%s_seconds_bucket{le=\"%.6f\"} %llu\n", name_prefix, name,
+                                     (double) (__apn_histogram_bucket_upper_bound(b) + 1) / 1e6,
+                                     (unsigned long long) cumulative);
+        }
+        if (APN_SUCCESS == ret) {
+            ret = __apn_stats_append(&buffer,
+                                     "%s_%s_seconds_bucket{le=\"+Inf\"} %llu\n%s_%s_seconds_sum %.6f\n"
+                                     "%s_%s_seconds_count %llu\n",
+                                     name_prefix, name, (unsigned long long) histogram->count, name_prefix, name,
+                                     (double) histogram->sum / 1e6, name_prefix, name,
+                                     (unsigned long long) histogram->count);
+        }
+    }
+    return __apn_stats_buffer_finish(&buffer, ret);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_STATS_H__
+#define __APN_STATS_H__
+
+#include "apn_platform.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of significant bits kept by a histogram bucket. Values are recorded with
+ * a relative error below 1 / 2^(APN_HISTOGRAM_PRECISION - 1), i.e. 12.5%
+ */
+#define APN_HISTOGRAM_PRECISION 4
+
+/** Number of histogram buckets, enough for values up to 2^36 microseconds (~19 hours) */
+#define APN_HISTOGRAM_BUCKETS 272
+
+/**
+ * Log-linear latency histogram (HDR style). Values are in microseconds
+ */
+typedef struct __apn_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[APN_HISTOGRAM_BUCKETS];
+} apn_histogram_t;
+
+/**
+ * Counters and latency histograms of a context. All fields are uint64_t.
+ * A snapshot is taken with ::apn_stats()
+ */
+typedef struct __apn_stats_t {
+    /** Notifications written to a socket */
+    uint64_t frames_sent;
+    /** Bytes written to a socket */
+    uint64_t bytes_written;
+    /** Tokens rejected by Apple with "invalid token" error */
+    uint64_t invalid_tokens;
+    /** Other error responses received from Apple */
+    uint64_t apple_errors;
+    /** TCP connection attempts which succeeded */
+    uint64_t connects;
+    /** TCP connection attempts which failed */
+    uint64_t connect_failures;
+    /** TLS handshakes which succeeded */
+    uint64_t handshakes;
+    /** TLS handshakes which failed */
+    uint64_t handshake_failures;
+    /** Reconnects after "invalid token" error */
+    uint64_t reconnects_invalid_token;
+    /** Reconnects after "shutdown" error */
+    uint64_t reconnects_shutdown;
+    /** Reconnects after other error response */
+    uint64_t reconnects_apple_error;
+    /** Reconnects after I/O error or connection closed by peer */
+    uint64_t reconnects_io_error;
+    /** Connections recycled before a send after being idle for longer than the idle timeout */
+    uint64_t reconnects_idle;
+    /** Connections found closed by the peer before a send, see ::apn_set_idle_timeout() */
+    uint64_t reconnects_stale;
+    /** Returns from select(), or from the poll function of a transport set by ::apn_set_transport() */
+    uint64_t select_wakeups;
+    /** Decreases of the send rate by the adaptive rate controller */
+    uint64_t rate_decreases;
+    /** Notifications not sent because the token is in the token store */
+    uint64_t tokens_suppressed;
+    /** TLS handshakes after which encryption was handed to the kernel, see ::APN_OPTION_KTLS */
+    uint64_t ktls_handshakes;
+    /** Current send rate, notifications per second. 0 if the adaptive rate controller is disabled */
+    uint64_t send_rate;
+    /** Send buffer size of the connection in bytes as reported by the kernel, see ::apn_set_socket_profile() */
+    uint64_t send_buffer;
+    /** TCP connect time, including name resolution */
+    apn_histogram_t connect_latency;
+    /** TLS handshake time */
+    apn_histogram_t handshake_latency;
+    /** Time to write one notification, including waiting for the socket to become writable */
+    apn_histogram_t write_latency;
+    /** Time spent waiting for an error response */
+    apn_histogram_t error_wait_latency;
+    /** Time from sending a notification to its response, HTTP/2 only */
+    apn_histogram_t response_latency;
+} apn_stats_t;
+
+/**
+ * Returns the value below which `percentile` (0 - 100) percent of recorded values fall.
+ *
+ * @param[in] histogram - Pointer to histogram
+ * @param[in] percentile - Percentile, 0 - 100
+ *
+ * @return Value in microseconds or 0 if histogram is empty
+ */
+__apn_export__ uint64_t apn_histogram_percentile(const apn_histogram_t * const histogram, double percentile)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Formats stats as JSON document.
+ * Histograms are represented by count, sum, max, p50, p90, p99 and p999, all in microseconds.
+ *
+ * @param[in] stats - Pointer to stats snapshot
+ *
+ * @return Pointer to NULL-terminated string or NULL on error. Returned string must be freed
+ */
+__apn_export__ char *apn_stats_json(const apn_stats_t * const stats)
+        __apn_attribute_nonnull__((1))
+        __apn_attribute_warn_unused_result__;
+
+/**
+ * Formats stats in Prometheus text exposition format.
+ * Histograms are exported in seconds.
+ *
+ * @param[in] stats - Pointer to stats snapshot
+ * @param[in] prefix - Metric name prefix, "capn" if NULL
+ *
+ * @return Pointer to NULL-terminated string or NULL on error. Returned string must be freed
+ */
+__apn_export__ char *apn_stats_prometheus(const apn_stats_t * const stats, const char * const prefix)
+        __apn_attribute_nonnull__((1))
+        __apn_attribute_warn_unused_result__;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_STATS_PRIVATE_H__
+#define __APN_STATS_PRIVATE_H__
+
+#include "apn_platform.h"
+#include "apn_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stats are updated with relaxed atomics: counters are exact, a snapshot taken while
+ * another thread sends is consistent per field but not across fields.
+ */
+#ifdef _WIN32
+#define APN_STATS_ADD(__var, __value) \
+    InterlockedExchangeAdd64((volatile LONG64 *) &(__var), (LONG64) (__value))
+#define APN_STATS_LOAD(__var) \
+    ((uint64_t) InterlockedCompareExchange64((volatile LONG64 *) &(__var), 0, 0))
+#define APN_STATS_STORE(__var, __value) \
+    InterlockedExchange64((volatile LONG64 *) &(__var), (LONG64) (__value))
+#define APN_STATS_CAS(__var, __expected, __value) \
+    ((LONG64) (__expected) == InterlockedCompareExchange64((volatile LONG64 *) &(__var), (LONG64) (__value), \
+                                                            (LONG64) (__expected)))
+#else
+#define APN_STATS_ADD(__var, __value) \
+    ((void) __atomic_fetch_add(&(__var), (uint64_t) (__value), __ATOMIC_RELAXED))
+#define APN_STATS_LOAD(__var) \
+    __atomic_load_n(&(__var), __ATOMIC_RELAXED)
+#define APN_STATS_STORE(__var, __value) \
+    __atomic_store_n(&(__var), (uint64_t) (__value), __ATOMIC_RELAXED)
+#define APN_STATS_CAS(__var, __expected, __value) \
+    __atomic_compare_exchange_n(&(__var), &(__expected), (uint64_t) (__value), 0, __ATOMIC_RELAXED, \
+                                __ATOMIC_RELAXED)
+#endif
+
+#define APN_STATS_INC(__ctx, __field) APN_STATS_ADD((__ctx)->stats.__field, 1)
+
+/** Monotonic clock in microseconds */
+uint64_t apn_clock_us(void);
+
+void apn_histogram_record(apn_histogram_t * const histogram, uint64_t value)
+        __apn_attribute_nonnull__((1));
+
+/** Records time elapsed since `start` (as returned by apn_clock_us()) */
+#define APN_STATS_RECORD_SINCE(__ctx, __histogram, __start) \
+    apn_histogram_record(&(__ctx)->stats.__histogram, apn_clock_us() - (__start))
+
+void apn_stats_snapshot(const apn_stats_t * const stats, apn_stats_t * const snapshot)
+        __apn_attribute_nonnull__((1, 2));
+
+void apn_stats_clear(apn_stats_t * const stats)
+        __apn_attribute_nonnull__((1));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
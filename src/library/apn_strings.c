@@ -190,11 +190,11 @@ apn_array_t * apn_strsplit(char * const string, const char * const delim) {
     apn_array_t *array = apn_array_init(10, (apn_array_dtor)__apn_str_dtor, NULL);
     if(array) {
         char *token = NULL;
-#ifdef _WIN32
         char *context = NULL;
+#ifdef _WIN32
         token = strtok_s(string, delim, &context);
 #else
-        token = strtok(string, delim);
+        token = strtok_r(string, delim, &context);
 #endif
         while (token) {
             char *substr = apn_strndup(token, strlen(token));
@@ -206,7 +206,7 @@ apn_array_t * apn_strsplit(char * const string, const char * const delim) {
 #ifdef _WIN32
             token = strtok_s(NULL, delim, &context);
 #else
-            token = strtok(NULL, delim);
+            token = strtok_r(NULL, delim, &context);
 #endif
         }
     }
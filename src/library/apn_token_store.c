@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* O_CLOEXEC is POSIX.1-2008, the build asks for POSIX.1-2001 only */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apn_token_store.h"
+#include "apn_private.h"
+#include "apn_strings.h"
+#include "apn_tokens.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define APN_TOKEN_STORE_MAGIC "CAPNTOKS"
+#define APN_TOKEN_STORE_VERSION 1
+#define APN_TOKEN_STORE_MIN_CAPACITY 1024
+#define APN_TOKEN_STORE_MAX_CAPACITY (1U << 28)
+
+/*
+ * Bloom filter bits per slot. The table is at most half full, so there are at least 32 bits per token
+ * and with two bits per token a lookup of an absent token reaches the table in less than 0.5% of cases.
+ */
+#define APN_TOKEN_STORE_BLOOM_BITS 16
+
+/*
+ * File layout: header, Bloom filter (capacity * APN_TOKEN_STORE_BLOOM_BITS bits), slots (capacity).
+ * Removed tokens are not cleared from the filter, it is rebuilt when the table grows.
+ */
+struct __apn_token_store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+struct __apn_token_store_slot {
+    uint8_t token[APN_TOKEN_BINARY_SIZE];
+    uint32_t timestamp;
+    uint32_t used;
+};
+
+struct __apn_token_store_t {
+    char *path;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    struct __apn_token_store_header *header;
+    uint64_t *bloom;
+    struct __apn_token_store_slot *slots;
+    uint64_t mask;
+    pthread_rwlock_t lock;
+};
+
+static uint64_t __apn_token_store_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t __apn_token_store_hash(const uint8_t *const token) {
+    uint64_t words[APN_TOKEN_BINARY_SIZE / sizeof(uint64_t)];
+    memcpy(words, token, sizeof(words));
+    return __apn_token_store_mix(words[0] ^ __apn_token_store_mix(words[1] ^ __apn_token_store_mix(
+            words[2] ^ __apn_token_store_mix(words[3]))));
+}
+
+static size_t __apn_token_store_bloom_size(uint64_t capacity) {
+    return (size_t) (capacity * APN_TOKEN_STORE_BLOOM_BITS / 8);
+}
+
+static size_t __apn_token_store_file_size(uint64_t capacity) {
+    return sizeof(struct __apn_token_store_header) + __apn_token_store_bloom_size(capacity) +
+           (size_t) capacity * sizeof(struct __apn_token_store_slot);
+}
+
+static void __apn_token_store_bloom_bits(const apn_token_store_t *const store, uint64_t hash, uint64_t *const bit1,
+                                         uint64_t *const bit2) {
+    uint64_t bits_mask = (store->mask + 1) * APN_TOKEN_STORE_BLOOM_BITS - 1;
+    *bit1 = (hash >> 32) & bits_mask;
+    *bit2 = __apn_token_store_mix(hash) & bits_mask;
+}
+
+static uint8_t __apn_token_store_bloom_test(const apn_token_store_t *const store, uint64_t hash) {
+    uint64_t bit1, bit2;
+    __apn_token_store_bloom_bits(store, hash, &bit1, &bit2);
+    return (store->bloom[bit1 >> 6] & (1ULL << (bit1 & 63))) && (store->bloom[bit2 >> 6] & (1ULL << (bit2 & 63)));
+}
+
+static void __apn_token_store_bloom_set(apn_token_store_t *const store, uint64_t hash) {
+    uint64_t bit1, bit2;
+    __apn_token_store_bloom_bits(store, hash, &bit1, &bit2);
+    store->bloom[bit1 >> 6] |= 1ULL << (bit1 & 63);
+    store->bloom[bit2 >> 6] |= 1ULL << (bit2 & 63);
+}
+
+/* Returns the slot holding `token` or the empty slot where it would be inserted, NULL with errno set if the
+ * table has neither after `capacity` probes. The table is at most half full, so only a damaged file gets there */
+static struct __apn_token_store_slot *__apn_token_store_find(const apn_token_store_t *const store,
+                                                             const uint8_t *const token, uint64_t hash) {
+    uint64_t i = hash & store->mask;
+    for (uint64_t probes = 0; probes <= store->mask; probes++, i = (i + 1) & store->mask) {
+        struct __apn_token_store_slot *slot = &store->slots[i];
+        if (!slot->used || 0 == memcmp(slot->token, token, APN_TOKEN_BINARY_SIZE)) {
+            return slot;
+        }
+    }
+    errno = APN_ERR_TOKEN_STORE_INVALID;
+    return NULL;
+}
+
+static apn_return __apn_token_store_map(apn_token_store_t *const store, int fd, size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map) {
+        return APN_ERROR;
+    }
+    store->fd = fd;
+    store->map = map;
+    store->map_size = size;
+    store->header = map;
+    return APN_SUCCESS;
+}
+
+static void __apn_token_store_set_layout(apn_token_store_t *const store) {
+    uint64_t capacity = store->header->capacity;
+    store->bloom = (uint64_t *) (store->map + sizeof(struct __apn_token_store_header));
+    store->slots = (struct __apn_token_store_slot *) (store->map + sizeof(struct __apn_token_store_header) +
+                                                      __apn_token_store_bloom_size(capacity));
+    store->mask = capacity - 1;
+}
+
+static void __apn_token_store_unmap(apn_token_store_t *const store) {
+    if (store->map) {
+        munmap(store->map, store->map_size);
+        store->map = NULL;
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+        store->fd = -1;
+    }
+}
+
+/* Opens and locks `path`, truncates it if `create` is set */
+static int __apn_token_store_open_file(const char *const path, uint8_t create) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (create ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (0 != flock(fd, LOCK_EX | LOCK_NB)) {
+        int errcode = errno;
+        close(fd);
+        errno = errcode;
+        return -1;
+    }
+    return fd;
+}
+
+static apn_return __apn_token_store_create(apn_token_store_t *const store, int fd, uint64_t capacity) {
+    size_t size = __apn_token_store_file_size(capacity);
+    if (0 != ftruncate(fd, (off_t) size)) {
+        return APN_ERROR;
+    }
+    if (APN_ERROR == __apn_token_store_map(store, fd, size)) {
+        return APN_ERROR;
+    }
+    memcpy(store->header->magic, APN_TOKEN_STORE_MAGIC, sizeof(store->header->magic));
+    store->header->version = APN_TOKEN_STORE_VERSION;
+    store->header->slot_size = sizeof(struct __apn_token_store_slot);
+    store->header->capacity = capacity;
+    store->header->count = 0;
+    __apn_token_store_set_layout(store);
+    return APN_SUCCESS;
+}
+
+static apn_return __apn_token_store_load(apn_token_store_t *const store, int fd, size_t size) {
+    if (size < sizeof(struct __apn_token_store_header)) {
+        errno = APN_ERR_TOKEN_STORE_INVALID;
+        return APN_ERROR;
+    }
+    if (APN_ERROR == __apn_token_store_map(store, fd, size)) {
+        return APN_ERROR;
+    }
+    const struct __apn_token_store_header *header = store->header;
+    if (0 != memcmp(header->magic, APN_TOKEN_STORE_MAGIC, sizeof(header->magic)) ||
+        APN_TOKEN_STORE_VERSION != header->version ||
+        sizeof(struct __apn_token_store_slot) != header->slot_size ||
+        header->capacity < APN_TOKEN_STORE_MIN_CAPACITY || header->capacity > APN_TOKEN_STORE_MAX_CAPACITY ||
+        0 != (header->capacity & (header->capacity - 1)) ||
+        header->count > header->capacity / 2 ||
+        __apn_token_store_file_size(header->capacity) != size) {
+        errno = APN_ERR_TOKEN_STORE_INVALID;
+        return APN_ERROR;
+    }
+    __apn_token_store_set_layout(store);
+    return APN_SUCCESS;
+}
+
+apn_token_store_t *apn_token_store_open(const char *const path, uint32_t capacity) {
+    assert(path);
+
+    apn_token_store_t *store = calloc(1, sizeof(apn_token_store_t));
+    if (!store) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    store->fd = -1;
+    if (NULL == (store->path = apn_strndup(path, strlen(path)))) {
+        free(store);
+        return NULL;
+    }
+
+    uint64_t slots = APN_TOKEN_STORE_MIN_CAPACITY;
+    uint64_t requested = 2 * (uint64_t) (capacity > 0 ? capacity : APN_TOKEN_STORE_DEFAULT_CAPACITY);
+    while (slots < requested && slots < APN_TOKEN_STORE_MAX_CAPACITY) {
+        slots <<= 1;
+    }
+
+    apn_return ret = APN_ERROR;
+    struct stat st;
+    int fd = __apn_token_store_open_file(path, 0);
+    if (fd >= 0) {
+        if (0 == fstat(fd, &st)) {
+            ret = 0 == st.st_size ?
+                  __apn_token_store_create(store, fd, slots) :
+                  __apn_token_store_load(store, fd, (size_t) st.st_size);
+        }
+        if (APN_ERROR == ret && store->fd < 0) {
+            int errcode = errno;
+            close(fd);
+            errno = errcode;
+        }
+    }
+    if (APN_SUCCESS == ret) {
+        int errcode = pthread_rwlock_init(&store->lock, NULL);
+        if (0 != errcode) {
+            errno = errcode;
+            ret = APN_ERROR;
+        }
+    }
+    if (APN_ERROR == ret) {
+        int errcode = errno;
+        __apn_token_store_unmap(store);
+        free(store->path);
+        free(store);
+        errno = errcode;
+        return NULL;
+    }
+    return store;
+}
+
+void apn_token_store_close(apn_token_store_t *store) {
+    if (!store) {
+        return;
+    }
+    __apn_token_store_unmap(store);
+    pthread_rwlock_destroy(&store->lock);
+    free(store->path);
+    free(store);
+}
+
+/* Rebuilds the table with twice as many slots in a new file which replaces the store file */
+static apn_return __apn_token_store_grow(apn_token_store_t *const store) {
+    uint64_t capacity = (store->mask + 1) * 2;
+    if (capacity > APN_TOKEN_STORE_MAX_CAPACITY) {
+        errno = ENOSPC;
+        return APN_ERROR;
+    }
+
+    size_t path_size = strlen(store->path) + sizeof(".tmp");
+    char *tmp_path = malloc(path_size);
+    if (!tmp_path) {
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    snprintf(tmp_path, path_size, "%s.tmp", store->path);
+
+    apn_token_store_t grown;
+    memset(&grown, 0, sizeof(grown));
+    grown.fd = -1;
+
+    int fd = __apn_token_store_open_file(tmp_path, 1);
+    if (fd < 0 || APN_ERROR == __apn_token_store_create(&grown, fd, capacity)) {
+        int errcode = errno;
+        if (grown.fd < 0 && fd >= 0) {
+            close(fd);
+        }
+        __apn_token_store_unmap(&grown);
+        unlink(tmp_path);
+        free(tmp_path);
+        errno = errcode;
+        return APN_ERROR;
+    }
+
+    /* The new table has twice the slots of the old one, so it cannot fill up */
+    uint64_t count = 0;
+    for (uint64_t i = 0; i <= store->mask; i++) {
+        const struct __apn_token_store_slot *slot = &store->slots[i];
+        if (slot->used) {
+            uint64_t hash = __apn_token_store_hash(slot->token);
+            *__apn_token_store_find(&grown, slot->token, hash) = *slot;
+            __apn_token_store_bloom_set(&grown, hash);
+            count++;
+        }
+    }
+    grown.header->count = count;
+
+    if (0 != rename(tmp_path, store->path)) {
+        int errcode = errno;
+        __apn_token_store_unmap(&grown);
+        unlink(tmp_path);
+        free(tmp_path);
+        errno = errcode;
+        return APN_ERROR;
+    }
+    free(tmp_path);
+
+    __apn_token_store_unmap(store);
+    store->fd = grown.fd;
+    store->map = grown.map;
+    store->map_size = grown.map_size;
+    store->header = grown.header;
+    __apn_token_store_set_layout(store);
+    return APN_SUCCESS;
+}
+
+apn_return apn_token_store_add(apn_token_store_t *const store, const uint8_t *const token, uint32_t timestamp) {
+    assert(store);
+    assert(token);
+
+    apn_return ret = APN_SUCCESS;
+    uint64_t hash = __apn_token_store_hash(token);
+
+    pthread_rwlock_wrlock(&store->lock);
+    struct __apn_token_store_slot *slot = __apn_token_store_find(store, token, hash);
+    if (!slot) {
+        ret = APN_ERROR;
+    } else if (slot->used) {
+        if (timestamp > slot->timestamp) {
+            slot->timestamp = timestamp;
+        }
+    } else {
+        if ((store->header->count + 1) * 2 > store->mask + 1) {
+            ret = __apn_token_store_grow(store);
+            if (APN_SUCCESS == ret && !(slot = __apn_token_store_find(store, token, hash))) {
+                ret = APN_ERROR;
+            }
+        }
+        if (APN_SUCCESS == ret) {
+            memcpy(slot->token, token, APN_TOKEN_BINARY_SIZE);
+            slot->timestamp = timestamp;
+            slot->used = 1;
+            __apn_token_store_bloom_set(store, hash);
+            store->header->count++;
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return ret;
+}
+
+uint8_t apn_token_store_remove(apn_token_store_t *const store, const uint8_t *const token) {
+    assert(store);
+    assert(token);
+
+    uint8_t removed = 0;
+    uint64_t hash = __apn_token_store_hash(token);
+
+    pthread_rwlock_wrlock(&store->lock);
+    struct __apn_token_store_slot *slot = __apn_token_store_find(store, token, hash);
+    if (slot && slot->used) {
+        /* Backward shift deletion: move following entries of the probe sequence into the hole */
+        uint64_t i = (uint64_t) (slot - store->slots);
+        uint64_t j = i;
+        for (uint64_t probes = 0; probes < store->mask; probes++) {
+            j = (j + 1) & store->mask;
+            if (!store->slots[j].used) {
+                break;
+            }
+            uint64_t home = __apn_token_store_hash(store->slots[j].token) & store->mask;
+            uint8_t in_place = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!in_place) {
+                store->slots[i] = store->slots[j];
+                i = j;
+            }
+        }
+        memset(&store->slots[i], 0, sizeof(struct __apn_token_store_slot));
+        store->header->count--;
+        removed = 1;
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return removed;
+}
+
+uint8_t apn_token_store_contains(apn_token_store_t *const store, const uint8_t *const token,
+                                 uint32_t *timestamp) {
+    assert(store);
+    assert(token);
+
+    uint8_t found = 0;
+    uint64_t hash = __apn_token_store_hash(token);
+
+    pthread_rwlock_rdlock(&store->lock);
+    if (__apn_token_store_bloom_test(store, hash)) {
+        const struct __apn_token_store_slot *slot = __apn_token_store_find(store, token, hash);
+        if (slot && slot->used) {
+            found = 1;
+            if (timestamp) {
+                *timestamp = slot->timestamp;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return found;
+}
+
+uint32_t apn_token_store_count(apn_token_store_t *const store) {
+    assert(store);
+    pthread_rwlock_rdlock(&store->lock);
+    uint32_t count = (uint32_t) store->header->count;
+    pthread_rwlock_unlock(&store->lock);
+    return count;
+}
+
+apn_return apn_token_store_sync(apn_token_store_t *const store) {
+    assert(store);
+    pthread_rwlock_rdlock(&store->lock);
+    int ret = msync(store->map, store->map_size, MS_SYNC);
+    pthread_rwlock_unlock(&store->lock);
+    return 0 == ret ? APN_SUCCESS : APN_ERROR;
+}
+
+void apn_set_token_store(apn_ctx_t *const ctx, apn_token_store_t *const store) {
+    assert(ctx);
+    ctx->token_store = store;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_TOKEN_STORE_H__
+#define __APN_TOKEN_STORE_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Capacity of a new store if 0 is passed to ::apn_token_store_open(), tokens */
+#define APN_TOKEN_STORE_DEFAULT_CAPACITY 65536
+
+/**
+ * Persistent set of device tokens which must not receive notifications: tokens rejected by Apple as
+ * invalid and tokens reported by the feedback service, each with a timestamp.
+ *
+ * The set is an open addressing hash table in a memory mapped file, so it survives restarts and is loaded
+ * without reading the whole file. A Bloom filter in front of the table answers for most tokens which are not in
+ * the set with two memory reads. The file is locked while open and uses the host byte order.
+ *
+ * A store can be shared by several contexts, e.g. connections of a pool, and used from several threads.
+ */
+typedef struct __apn_token_store_t apn_token_store_t;
+
+/**
+ * Opens a store, creates the file if it does not exist.
+ *
+ * @param[in] path - Path to the store file. Cannot be NULL.
+ * @param[in] capacity - Initial capacity of a new store, tokens. ::APN_TOKEN_STORE_DEFAULT_CAPACITY if 0.
+ * The store grows when it is half full.
+ *
+ * @return Pointer to a store or NULL on error with errno set: ::APN_ERR_TOKEN_STORE_INVALID if the file is not
+ * a store, EWOULDBLOCK if it is opened by another process. Must be closed with ::apn_token_store_close()
+ */
+__apn_export__ apn_token_store_t *apn_token_store_open(const char *const path, uint32_t capacity)
+        __apn_attribute_nonnull__((1))
+        __apn_attribute_warn_unused_result__;
+
+/**
+ * Unmaps and closes a store. Contexts using the store must not send at the same time.
+ *
+ * @param[in] store - Pointer to a store, can be NULL.
+ */
+__apn_export__ void apn_token_store_close(apn_token_store_t *store);
+
+/**
+ * Adds a token or updates its timestamp if the new one is later.
+ *
+ * @param[in] store - Pointer to a store. Cannot be NULL.
+ * @param[in] token - Binary device token, 32 bytes. Cannot be NULL.
+ * @param[in] timestamp - Time (seconds since epoch) when the token became invalid.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`, ::APN_ERR_TOKEN_STORE_INVALID if
+ *      the table of the file is damaged.
+ */
+__apn_export__ apn_return apn_token_store_add(apn_token_store_t *const store, const uint8_t *const token,
+                                              uint32_t timestamp)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Removes a token, e.g. when the device registered it again after the timestamp reported by the feedback service.
+ *
+ * @param[in] store - Pointer to a store. Cannot be NULL.
+ * @param[in] token - Binary device token, 32 bytes. Cannot be NULL.
+ *
+ * @return 1 if the token was removed, 0 if it is not in the store
+ */
+__apn_export__ uint8_t apn_token_store_remove(apn_token_store_t *const store, const uint8_t *const token)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Checks whether a token is in the store.
+ *
+ * @param[in] store - Pointer to a store. Cannot be NULL.
+ * @param[in] token - Binary device token, 32 bytes. Cannot be NULL.
+ * @param[out] timestamp - Timestamp of the token. Can be NULL.
+ *
+ * @return 1 if the token is in the store, 0 otherwise
+ */
+__apn_export__ uint8_t apn_token_store_contains(apn_token_store_t *const store, const uint8_t *const token,
+                                                uint32_t *timestamp)
+        __apn_attribute_nonnull__((1, 2));
+
+/**
+ * Returns number of tokens in a store.
+ */
+__apn_export__ uint32_t apn_token_store_count(apn_token_store_t *const store)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Writes changes of a store to disk. Without this call they are written by the kernel in the background.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_token_store_sync(apn_token_store_t *const store)
+        __apn_attribute_nonnull__((1));
+
+/**
+ * Sets a store consulted and updated by a context. Tokens in the store are skipped by ::apn_send(),
+ * skipped tokens are counted as `tokens_suppressed` by ::apn_stats(). Tokens rejected by Apple as invalid
+ * and tokens received by ::apn_feedback() or ::apn_feedback_read() are added to the store.
+ *
+ * The store is not owned by the context and must stay open while it is set.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] store - Pointer to a store. NULL - do not use a store.
+ */
+__apn_export__ void apn_set_token_store(apn_ctx_t *const ctx, apn_token_store_t *const store)
+        __apn_attribute_nonnull__((1));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -37,6 +37,14 @@ uint8_t *apn_token_hex_to_binary(const char *const token) {
         errno = ENOMEM;
         return NULL;
     }
+    apn_token_hex_to_binary_r(token, binary_token);
+    return binary_token;
+}
+
+void apn_token_hex_to_binary_r(const char *const token, uint8_t *const binary_token) {
+    assert(token);
+    assert(binary_token);
+
     memset(binary_token, 0, APN_TOKEN_BINARY_SIZE);
 
     uint16_t j = 0;
@@ -51,7 +59,6 @@ uint8_t *apn_token_hex_to_binary(const char *const token) {
 #endif
         binary_token[j] = (uint8_t) tmp_binary;
     }
-    return binary_token;
 }
 
 char *apn_token_binary_to_hex(const uint8_t *const binary_token) {
@@ -36,6 +36,10 @@ uint8_t * apn_token_hex_to_binary(const char * const token)
         __apn_attribute_nonnull__((1))
         __apn_attribute_warn_unused_result__;
 
+/* Same as apn_token_hex_to_binary(), into a caller's buffer of APN_TOKEN_BINARY_SIZE bytes */
+void apn_token_hex_to_binary_r(const char * const token, uint8_t * const binary_token)
+        __apn_attribute_nonnull__((1, 2));
+
 char * apn_token_binary_to_hex(const uint8_t * const binary_token)
         __apn_attribute_nonnull__((1))
         __apn_attribute_warn_unused_result__;
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "apn_platform.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apn_trace_private.h"
+
+static const char *__apn_trace_phase_names[] = {
+        "unknown",
+        "resolve",
+        "connect",
+        "handshake",
+        "write_wait",
+        "write",
+        "write_blocked",
+        "error_wait",
+        "error_response",
+        "close",
+        "reconnect"
+};
+
+uint64_t apn_clock_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000
+           + (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+const char *apn_trace_phase_name(uint16_t phase) {
+    uint16_t span = APN_TRACE_SPAN(phase);
+    if (span >= sizeof(__apn_trace_phase_names) / sizeof(__apn_trace_phase_names[0])) {
+        span = 0;
+    }
+    return __apn_trace_phase_names[span];
+}
+
+struct __apn_trace *apn_trace_init(uint32_t capacity) {
+    if (0 == capacity) {
+        capacity = APN_TRACE_DEFAULT_CAPACITY;
+    }
+    if (capacity > (1u << 31)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    struct __apn_trace *trace = malloc(sizeof(struct __apn_trace));
+    if (!trace) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    trace->events = calloc(size, sizeof(apn_trace_event_t));
+    if (!trace->events) {
+        free(trace);
+        errno = ENOMEM;
+        return NULL;
+    }
+    trace->mask = size - 1;
+    trace->next = 0;
+    return trace;
+}
+
+void apn_trace_free(struct __apn_trace *trace) {
+    if (trace) {
+        free(trace->events);
+        free(trace);
+    }
+}
+
+apn_return apn_trace_write(const struct __apn_trace *const trace, const char *const path) {
+    uint64_t size = (uint64_t) trace->mask + 1;
+    uint64_t count = trace->next < size ? trace->next : size;
+    uint64_t first = trace->next - count;
+
+    apn_trace_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, APN_TRACE_FILE_MAGIC, sizeof(APN_TRACE_FILE_MAGIC));
+    header.version = APN_TRACE_FILE_VERSION;
+    header.event_size = sizeof(apn_trace_event_t);
+    header.count = count;
+    header.dropped = first;
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return APN_ERROR;
+    }
+
+    /* Ring may wrap: oldest events are at the end of the buffer */
+    size_t start = (size_t) (first & trace->mask);
+    size_t head = (size_t) ((size - start) < count ? (size - start) : count);
+    if (1 != fwrite(&header, sizeof(header), 1, file)
+        || head != fwrite(trace->events + start, sizeof(apn_trace_event_t), head, file)
+        || (count - head) != fwrite(trace->events, sizeof(apn_trace_event_t), (size_t) (count - head), file)) {
+        int errcode = errno;
+        fclose(file);
+        errno = errcode;
+        return APN_ERROR;
+    }
+    if (0 != fclose(file)) {
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_TRACE_H__
+#define __APN_TRACE_H__
+
+#include "apn_platform.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of events kept by a trace ring if capacity is not specified */
+#define APN_TRACE_DEFAULT_CAPACITY 65536
+
+/** Trace file magic, first 8 bytes of a file written by ::apn_trace_dump() */
+#define APN_TRACE_FILE_MAGIC "CAPNTRC"
+
+/** Trace file format version */
+#define APN_TRACE_FILE_VERSION 1
+
+/** Phase flag: event opens a span */
+#define APN_TRACE_BEGIN 0x100
+/** Phase flag: event closes a span */
+#define APN_TRACE_END 0x200
+
+/** Returns span of a phase, i.e. phase without ::APN_TRACE_BEGIN and ::APN_TRACE_END flags */
+#define APN_TRACE_SPAN(__phase) ((__phase) & 0xff)
+
+/**
+ * Send pipeline phases. A span is recorded as two events, `APN_TRACE_<SPAN> | APN_TRACE_BEGIN`
+ * and `APN_TRACE_<SPAN> | APN_TRACE_END`; events without flags are instants
+ */
+typedef enum __apn_trace_phase {
+    /** Name resolution, including address cache lookup */
+    APN_TRACE_RESOLVE = 1,
+    /** TCP connect */
+    APN_TRACE_CONNECT = 2,
+    /** TLS handshake */
+    APN_TRACE_HANDSHAKE = 3,
+    /** Waiting for the socket to become writable */
+    APN_TRACE_WRITE_WAIT = 4,
+    /** Writing one notification */
+    APN_TRACE_WRITE = 5,
+    /** SSL_write() could not proceed, socket buffer is full (instant) */
+    APN_TRACE_WRITE_BLOCKED = 6,
+    /** Waiting for an error response */
+    APN_TRACE_ERROR_WAIT = 7,
+    /** Error response received, `bytes` holds Apple error code (instant) */
+    APN_TRACE_ERROR_RESPONSE = 8,
+    /** Connection closed (instant) */
+    APN_TRACE_CLOSE = 9,
+    /** Reconnect after error, `bytes` holds error code (instant) */
+    APN_TRACE_RECONNECT = 10
+} apn_trace_phase;
+
+/**
+ * Trace event, 24 bytes
+ */
+typedef struct __apn_trace_event_t {
+    /** Monotonic clock, nanoseconds */
+    uint64_t timestamp;
+    /** Connection number within a context, starts from 1 */
+    uint32_t connection_id;
+    /** Notification identifier or 0 */
+    uint32_t frame_id;
+    /** Number of bytes or phase specific value */
+    uint32_t bytes;
+    /** ::apn_trace_phase optionally combined with ::APN_TRACE_BEGIN or ::APN_TRACE_END */
+    uint16_t phase;
+    uint16_t reserved;
+} apn_trace_event_t;
+
+/**
+ * Trace file header. Followed by `count` events in chronological order.
+ * Fields are in host byte order
+ */
+typedef struct __apn_trace_file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    /** Number of events in file */
+    uint64_t count;
+    /** Number of older events overwritten before the dump */
+    uint64_t dropped;
+} apn_trace_file_header_t;
+
+/**
+ * Returns name of a span, e.g. "connect" for ::APN_TRACE_CONNECT.
+ *
+ * @param[in] phase - Phase, flags are ignored
+ *
+ * @return Pointer to NULL-terminated string, "unknown" for unknown phases
+ */
+__apn_export__ const char *apn_trace_phase_name(uint16_t phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_TRACE_PRIVATE_H__
+#define __APN_TRACE_PRIVATE_H__
+
+#include "apn_platform.h"
+#include "apn_trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct __apn_trace {
+    apn_trace_event_t *events;
+    uint32_t mask;
+    uint64_t next;
+};
+
+/** Monotonic clock in nanoseconds */
+uint64_t apn_clock_ns(void);
+
+struct __apn_trace *apn_trace_init(uint32_t capacity);
+
+void apn_trace_free(struct __apn_trace *trace);
+
+apn_return apn_trace_write(const struct __apn_trace *const trace, const char *const path)
+        __apn_attribute_nonnull__((1, 2));
+
+/* A context is used by one thread at a time, so the ring is written without atomics */
+static inline void apn_trace_record(struct __apn_trace *const trace, uint16_t phase, uint32_t connection_id,
+                                    uint32_t frame_id, uint32_t bytes) {
+    apn_trace_event_t *event = &trace->events[trace->next++ & trace->mask];
+    event->timestamp = apn_clock_ns();
+    event->connection_id = connection_id;
+    event->frame_id = frame_id;
+    event->bytes = bytes;
+    event->phase = phase;
+    event->reserved = 0;
+}
+
+/** Records an event if tracing is enabled for `ctx`; a disabled trace costs one branch */
+#define APN_TRACE(__ctx, __phase, __frame_id, __bytes) \
+    do { \
+        if ((__ctx)->trace) { \
+            apn_trace_record((__ctx)->trace, (uint16_t) (__phase), (__ctx)->connection_id, (__frame_id), \
+                             (uint32_t) (__bytes)); \
+        } \
+    } while (0)
+
+#define APN_TRACE_BEGIN_SPAN(__ctx, __span, __frame_id) APN_TRACE(__ctx, (__span) | APN_TRACE_BEGIN, __frame_id, 0)
+#define APN_TRACE_END_SPAN(__ctx, __span, __frame_id, __bytes) \
+    APN_TRACE(__ctx, (__span) | APN_TRACE_END, __frame_id, __bytes)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
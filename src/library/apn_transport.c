@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "apn_transport.h"
+#include "apn_private.h"
+#include "apn_log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef APN_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+/* Buffers passed to the kernel by one write, the rest is written by the next call */
+#define APN_TRANSPORT_IOV_MAX 16
+
+#ifdef MSG_NOSIGNAL
+#define APN_TRANSPORT_SEND_FLAGS MSG_NOSIGNAL
+#else
+/* The socket has SO_NOSIGPIPE set or there is no SIGPIPE */
+#define APN_TRANSPORT_SEND_FLAGS 0
+#endif
+
+#ifdef _WIN32
+/* Maps the error of the last Winsock call to errno */
+static int __apn_transport_wsa_errno(void) {
+    switch (WSAGetLastError()) {
+        case WSAEWOULDBLOCK:
+            return EAGAIN;
+        case WSAEINTR:
+            return EINTR;
+        case WSAECONNRESET:
+        case WSAECONNABORTED:
+            return ECONNRESET;
+        case WSAETIMEDOUT:
+            return ETIMEDOUT;
+        default:
+            return EIO;
+    }
+}
+#endif
+
+static int __apn_transport_socket_read(void *user, void *buffer, size_t length) {
+    apn_ctx_t *ctx = user;
+#ifdef _WIN32
+    int received = recv(ctx->sock, buffer, (int) length, 0);
+    if (received < 0) {
+        errno = __apn_transport_wsa_errno();
+    }
+    return received;
+#else
+    return (int) recv(ctx->sock, buffer, length, 0);
+#endif
+}
+
+static int __apn_transport_socket_writev(void *user, const apn_iovec_t *iov, uint32_t count) {
+    apn_ctx_t *ctx = user;
+    if (count > APN_TRANSPORT_IOV_MAX) {
+        count = APN_TRANSPORT_IOV_MAX;
+    }
+#ifdef _WIN32
+    WSABUF buffers[APN_TRANSPORT_IOV_MAX];
+    DWORD sent = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i].buf = (char *) iov[i].base;
+        buffers[i].len = (ULONG) iov[i].length;
+    }
+    if (0 != WSASend(ctx->sock, buffers, count, &sent, 0, NULL, NULL)) {
+        errno = __apn_transport_wsa_errno();
+        return -1;
+    }
+    return (int) sent;
+#else
+    struct iovec buffers[APN_TRANSPORT_IOV_MAX];
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i].iov_base = (void *) iov[i].base;
+        buffers[i].iov_len = iov[i].length;
+    }
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = buffers;
+    message.msg_iovlen = count;
+    return (int) sendmsg(ctx->sock, &message, APN_TRANSPORT_SEND_FLAGS);
+#endif
+}
+
+static int __apn_transport_socket_poll(void *user, int events, uint32_t timeout) {
+    apn_ctx_t *ctx = user;
+    fd_set read_set;
+    fd_set write_set;
+    struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    if (events & APN_TRANSPORT_READ) {
+        FD_SET(ctx->sock, &read_set);
+    }
+    if (events & APN_TRANSPORT_WRITE) {
+        FD_SET(ctx->sock, &write_set);
+    }
+    int select_returned = select(ctx->sock + 1, &read_set, &write_set, NULL, &tv);
+    if (select_returned <= 0) {
+#ifdef _WIN32
+        if (select_returned < 0) {
+            errno = __apn_transport_wsa_errno();
+        }
+#endif
+        return select_returned;
+    }
+    int ready = 0;
+    if (FD_ISSET(ctx->sock, &read_set)) {
+        ready |= APN_TRANSPORT_READ;
+    }
+    if (FD_ISSET(ctx->sock, &write_set)) {
+        ready |= APN_TRANSPORT_WRITE;
+    }
+    return ready;
+}
+
+void apn_transport_socket(apn_ctx_t *const ctx, apn_transport_t *const transport) {
+    assert(ctx);
+    assert(transport);
+    transport->read = __apn_transport_socket_read;
+    transport->writev = __apn_transport_socket_writev;
+    transport->poll = __apn_transport_socket_poll;
+    transport->close = NULL;
+    transport->user = ctx;
+}
+
+apn_return apn_set_transport(apn_ctx_t *const ctx, const apn_transport_t *const transport) {
+    assert(ctx);
+    if (-1 != ctx->sock || ctx->ssl) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Transport cannot be changed while connected");
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+    if (!transport) {
+        apn_transport_socket(ctx, &ctx->transport);
+        ctx->custom_transport = 0;
+        return APN_SUCCESS;
+    }
+    if (!transport->read || !transport->writev || !transport->poll) {
+        apn_log(ctx, APN_LOG_LEVEL_ERROR, "Transport must implement read, writev and poll");
+        errno = EINVAL;
+        return APN_ERROR;
+    }
+    ctx->transport = *transport;
+    ctx->custom_transport = 1;
+    return APN_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_TRANSPORT_H__
+#define __APN_TRANSPORT_H__
+
+#include "apn_platform.h"
+#include "apn.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Transport is readable */
+#define APN_TRANSPORT_READ (1 << 0)
+/** Transport is writable */
+#define APN_TRANSPORT_WRITE (1 << 1)
+
+/**
+ * Buffer of a gathered write
+ */
+typedef struct __apn_iovec_t {
+    const void *base;
+    size_t length;
+} apn_iovec_t;
+
+/**
+ * I/O layer under TLS of binary protocol connections.
+ *
+ * TLS runs over memory buffers: records produced by OpenSSL are written with `writev`, records of
+ * the peer are read with `read`, the library never touches a socket itself. All functions are
+ * non-blocking, `poll` is called to wait. The default transport is a TCP socket to Apple.
+ *
+ * A transport set by ::apn_set_transport() replaces the socket: the library does not resolve
+ * the host nor connect, the TLS handshake starts right on the transport. This allows running
+ * connections on an application's event loop, on io_uring, or on an in-process loopback for benchmarks.
+ */
+typedef struct __apn_transport_t {
+    /**
+     * Reads up to `length` bytes.
+     * Returns the number of bytes read, 0 when the peer closed the connection or -1 on error
+     * with `errno` set, EAGAIN if nothing can be read now.
+     */
+    int (*read)(void *user, void *buffer, size_t length);
+    /**
+     * Writes `count` buffers in order, all records pending after encryption of a batch of
+     * notifications are passed in one call.
+     * Returns the number of bytes written, which can be less than the total, or -1 on error
+     * with `errno` set, EAGAIN if nothing can be written now.
+     */
+    int (*writev)(void *user, const apn_iovec_t *iov, uint32_t count);
+    /**
+     * Waits up to `timeout` milliseconds until the transport becomes readable or writable,
+     * `events` is a mask of ::APN_TRANSPORT_READ and ::APN_TRANSPORT_WRITE.
+     * Returns a mask of ready events, 0 on timeout or -1 on error with `errno` set.
+     */
+    int (*poll)(void *user, int events, uint32_t timeout);
+    /** Called when the connection is closed. Can be NULL */
+    void (*close)(void *user);
+    /** Passed to the functions above */
+    void *user;
+} apn_transport_t;
+
+/**
+ * Sets a transport binary protocol connections of a context run over, see ::apn_transport_t.
+ * Must be called while the context is not connected. HTTP/2 (::APN_OPTION_HTTP2) and kernel TLS
+ * (::APN_OPTION_KTLS) need a socket: connecting with the former fails, the latter is ignored.
+ *
+ * @param[in] ctx - Pointer to an initialized `ctx` structure. Cannot be NULL.
+ * @param[in] transport - Pointer to a transport, copied. `read`, `writev` and `poll` cannot be NULL.
+ * NULL - use a TCP socket.
+ *
+ * @return
+ *      - ::APN_SUCCESS on success.
+ *      - ::APN_ERROR on failure with error information stored in `errno`.
+ */
+__apn_export__ apn_return apn_set_transport(apn_ctx_t *const ctx, const apn_transport_t *const transport)
+        __apn_attribute_nonnull__((1));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
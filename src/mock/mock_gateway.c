@@ -0,0 +1,828 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * apn-mock-gateway - local stand-in for Apple Push Notification Service (binary protocol, command 2
+ * or HTTP/2 provider API) and Apple Push Feedback Service. Each connection is served by a forked process.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "apn_platform.h"
+
+#ifdef APN_HAVE_HTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+#define APN_MOCK_TOKEN_SIZE 32
+#define APN_MOCK_PAYLOAD_MAX_SIZE 2048
+#define APN_MOCK_MAX_REJECTED 1024
+#define APN_MOCK_READ_BUFFER 65536
+#define APN_MOCK_FEEDBACK_TUPLE_SIZE (4 + 2 + APN_MOCK_TOKEN_SIZE)
+/* Tuples per SSL_write(), fits one TLS record */
+#define APN_MOCK_FEEDBACK_TUPLES 400
+/* Counters in the -C file: accepted and rejected notifications, native 64-bit integers */
+#define APN_MOCK_COUNTERS 2
+
+enum __apn_mock_status {
+    APN_MOCK_STATUS_PROCESSING_ERROR = 1,
+    APN_MOCK_STATUS_MISSING_TOKEN = 2,
+    APN_MOCK_STATUS_MISSING_PAYLOAD = 4,
+    APN_MOCK_STATUS_INVALID_TOKEN_SIZE = 5,
+    APN_MOCK_STATUS_INVALID_PAYLOAD_SIZE = 7,
+    APN_MOCK_STATUS_INVALID_TOKEN = 8,
+    APN_MOCK_STATUS_SHUTDOWN = 10
+};
+
+struct __apn_mock_config {
+    const char *bind_host;
+    const char *gateway_port;
+    const char *feedback_port;
+    const char *cert_file;
+    const char *key_file;
+    const char *feedback_file;
+    const char *counters_file;
+    uint8_t rejected[APN_MOCK_MAX_REJECTED][APN_MOCK_TOKEN_SIZE];
+    uint32_t rejected_count;
+    uint8_t reject_prefix[APN_MOCK_TOKEN_SIZE];
+    uint32_t reject_prefix_size;
+    uint32_t shutdown_after;
+    uint32_t latency;
+    uint32_t read_rate;
+    uint8_t http2;
+    uint8_t verbose;
+};
+
+static struct __apn_mock_config config;
+
+/* Mapped from the -C file before connections are forked, so all of them add to the same counters */
+static uint64_t *counters = NULL;
+
+static uint64_t __apn_mock_clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void __apn_mock_sleep_us(uint64_t us) {
+    struct timespec ts = {(time_t) (us / 1000000), (long) (us % 1000000) * 1000};
+    while (-1 == nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static int __apn_mock_counters_map(const char *path) {
+    size_t size = APN_MOCK_COUNTERS * sizeof(uint64_t);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if (0 == ftruncate(fd, (off_t) size)) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == map) {
+        return -1;
+    }
+    counters = map;
+    return 0;
+}
+
+static void __apn_mock_count(uint8_t rejected) {
+    if (counters) {
+        __atomic_fetch_add(&counters[rejected ? 1 : 0], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int __apn_mock_hex_to_binary(const char *hex, uint8_t *binary, size_t binary_size) {
+    size_t hex_size = strlen(hex);
+    if (hex_size % 2 != 0 || hex_size / 2 > binary_size) {
+        return -1;
+    }
+    for (size_t i = 0; i < hex_size; i += 2) {
+        unsigned int byte = 0;
+        if (!isxdigit((unsigned char) hex[i]) || !isxdigit((unsigned char) hex[i + 1])
+            || 1 != sscanf(hex + i, "%2x", &byte)) {
+            return -1;
+        }
+        binary[i / 2] = (uint8_t) byte;
+    }
+    return (int) (hex_size / 2);
+}
+
+static int __apn_mock_token_rejected(const uint8_t *token) {
+    if (config.reject_prefix_size > 0 && 0 == memcmp(token, config.reject_prefix, config.reject_prefix_size)) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < config.rejected_count; i++) {
+        if (0 == memcmp(token, config.rejected[i], APN_MOCK_TOKEN_SIZE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void __apn_mock_send_error(SSL *ssl, uint8_t status, uint32_t id) {
+    uint8_t response[6];
+    uint32_t id_n = htonl(id);
+    response[0] = 8;
+    response[1] = status;
+    memcpy(response + 2, &id_n, sizeof(id_n));
+    if (config.latency > 0) {
+        __apn_mock_sleep_us((uint64_t) config.latency * 1000);
+    }
+    SSL_write(ssl, response, sizeof(response));
+}
+
+/*
+ * Parses one command 2 frame. Returns the number of consumed bytes, 0 if the frame is incomplete,
+ * or -1 if the connection must be closed, in which case `status` and `id` describe the error response.
+ */
+static long __apn_mock_parse_frame(const uint8_t *data, size_t size, uint8_t *status, uint32_t *id) {
+    uint32_t frame_size = 0;
+
+    if (size < 5) {
+        return 0;
+    }
+    if (data[0] != 2) {
+        *status = APN_MOCK_STATUS_PROCESSING_ERROR;
+        return -1;
+    }
+    memcpy(&frame_size, data + 1, sizeof(frame_size));
+    frame_size = ntohl(frame_size);
+    if (frame_size > APN_MOCK_READ_BUFFER - 5) {
+        *status = APN_MOCK_STATUS_PROCESSING_ERROR;
+        return -1;
+    }
+    if (size < 5 + (size_t) frame_size) {
+        return 0;
+    }
+
+    const uint8_t *item = data + 5;
+    const uint8_t *frame_end = item + frame_size;
+    const uint8_t *token = NULL;
+    uint16_t token_size = 0;
+    uint16_t payload_size = 0;
+    uint8_t has_payload = 0;
+
+    while (item + 3 <= frame_end) {
+        uint8_t item_id = item[0];
+        uint16_t item_size = 0;
+        memcpy(&item_size, item + 1, sizeof(item_size));
+        item_size = ntohs(item_size);
+        item += 3;
+        if (item + item_size > frame_end) {
+            *status = APN_MOCK_STATUS_PROCESSING_ERROR;
+            return -1;
+        }
+        switch (item_id) {
+            case 1:
+                token = item;
+                token_size = item_size;
+                break;
+            case 2:
+                has_payload = 1;
+                payload_size = item_size;
+                break;
+            case 3:
+                if (item_size == sizeof(uint32_t)) {
+                    memcpy(id, item, sizeof(uint32_t));
+                    *id = ntohl(*id);
+                }
+                break;
+            default:
+                break;
+        }
+        item += item_size;
+    }
+
+    if (!token) {
+        *status = APN_MOCK_STATUS_MISSING_TOKEN;
+        return -1;
+    }
+    if (token_size != APN_MOCK_TOKEN_SIZE) {
+        *status = APN_MOCK_STATUS_INVALID_TOKEN_SIZE;
+        return -1;
+    }
+    if (!has_payload || 0 == payload_size) {
+        *status = APN_MOCK_STATUS_MISSING_PAYLOAD;
+        return -1;
+    }
+    if (payload_size > APN_MOCK_PAYLOAD_MAX_SIZE) {
+        *status = APN_MOCK_STATUS_INVALID_PAYLOAD_SIZE;
+        return -1;
+    }
+    if (__apn_mock_token_rejected(token)) {
+        *status = APN_MOCK_STATUS_INVALID_TOKEN;
+        return -1;
+    }
+    return (long) (5 + frame_size);
+}
+
+static void __apn_mock_serve_gateway(SSL *ssl, const char *peer) {
+    uint8_t *buffer = malloc(APN_MOCK_READ_BUFFER);
+    size_t buffered = 0;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t started = __apn_mock_clock_us();
+    uint32_t last_id = 0;
+
+    if (!buffer) {
+        return;
+    }
+
+    for (;;) {
+        size_t to_read = APN_MOCK_READ_BUFFER - buffered;
+        if (config.read_rate > 0) {
+            /* Throttle the read side: read at most 10ms worth of data, then sleep for 10ms */
+            size_t chunk = config.read_rate / 100 > 0 ? config.read_rate / 100 : 1;
+            to_read = to_read < chunk ? to_read : chunk;
+        }
+
+        int bytes_read = SSL_read(ssl, buffer + buffered, (int) to_read);
+        if (bytes_read <= 0) {
+            break;
+        }
+        bytes += (uint64_t) bytes_read;
+        buffered += (size_t) bytes_read;
+
+        if (config.read_rate > 0) {
+            __apn_mock_sleep_us(10000);
+        }
+
+        size_t offset = 0;
+        for (;;) {
+            uint8_t status = 0;
+            uint32_t id = 0;
+            long consumed = __apn_mock_parse_frame(buffer + offset, buffered - offset, &status, &id);
+            if (consumed < 0) {
+                if (config.verbose) {
+                    fprintf(stderr, "[%s] rejecting notification %u with status %u\n", peer, id, status);
+                }
+                __apn_mock_count(1);
+                __apn_mock_send_error(ssl, status, id);
+                goto finish;
+            } else if (consumed == 0) {
+                break;
+            }
+            offset += (size_t) consumed;
+            frames++;
+            __apn_mock_count(0);
+            last_id = id;
+            if (config.shutdown_after > 0 && frames >= config.shutdown_after) {
+                if (config.verbose) {
+                    fprintf(stderr, "[%s] shutting down after notification %u\n", peer, id);
+                }
+                __apn_mock_send_error(ssl, APN_MOCK_STATUS_SHUTDOWN, last_id);
+                goto finish;
+            }
+        }
+        memmove(buffer, buffer + offset, buffered - offset);
+        buffered -= offset;
+    }
+
+    finish:
+    if (config.verbose) {
+        double seconds = (double) (__apn_mock_clock_us() - started) / 1e6;
+        fprintf(stderr, "[%s] %llu notification(s), %llu byte(s) in %.3f s (%.0f notifications/s)\n", peer,
+                (unsigned long long) frames, (unsigned long long) bytes, seconds,
+                seconds > 0 ? (double) frames / seconds : 0.0);
+    }
+    free(buffer);
+}
+
+static void __apn_mock_serve_feedback(SSL *ssl, const char *peer) {
+    if (!config.feedback_file) {
+        return;
+    }
+    FILE *file = fopen(config.feedback_file, "r");
+    if (!file) {
+        fprintf(stderr, "Unable to open %s: %s\n", config.feedback_file, strerror(errno));
+        return;
+    }
+
+    char line[256];
+    uint8_t buffer[APN_MOCK_FEEDBACK_TUPLES * APN_MOCK_FEEDBACK_TUPLE_SIZE];
+    uint32_t buffered = 0;
+    uint32_t sent = 0;
+    uint32_t timestamp_n = htonl((uint32_t) time(NULL));
+    uint16_t token_size_n = htons(APN_MOCK_TOKEN_SIZE);
+    while (fgets(line, sizeof(line), file)) {
+        uint8_t *tuple = buffer + buffered * APN_MOCK_FEEDBACK_TUPLE_SIZE;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (APN_MOCK_TOKEN_SIZE != __apn_mock_hex_to_binary(line, tuple + 6, APN_MOCK_TOKEN_SIZE)) {
+            continue;
+        }
+        memcpy(tuple, &timestamp_n, sizeof(timestamp_n));
+        memcpy(tuple + 4, &token_size_n, sizeof(token_size_n));
+        if (++buffered == APN_MOCK_FEEDBACK_TUPLES) {
+            if (SSL_write(ssl, buffer, (int) (buffered * APN_MOCK_FEEDBACK_TUPLE_SIZE)) <= 0) {
+                buffered = 0;
+                break;
+            }
+            sent += buffered;
+            buffered = 0;
+        }
+    }
+    if (buffered > 0 && SSL_write(ssl, buffer, (int) (buffered * APN_MOCK_FEEDBACK_TUPLE_SIZE)) > 0) {
+        sent += buffered;
+    }
+    fclose(file);
+    if (config.verbose) {
+        fprintf(stderr, "[%s] %u feedback tuple(s) sent\n", peer, sent);
+    }
+}
+
+#ifdef APN_HAVE_HTTP2
+#define APN_MOCK_HTTP2_PATH "/3/device/"
+#define APN_MOCK_HTTP2_MAX_STREAMS 1000
+
+static const char __apn_mock_http2_bad_token[] = "{\"reason\":\"BadDeviceToken\"}";
+
+struct __apn_mock_http2_stream {
+    uint8_t rejected;
+    size_t body_offset;
+};
+
+struct __apn_mock_http2 {
+    SSL *ssl;
+    const char *peer;
+    uint64_t requests;
+    uint64_t rejected;
+};
+
+static ssize_t __apn_mock_http2_send(nghttp2_session *session, const uint8_t *data, size_t length, int flags,
+                                     void *user_data) {
+    (void) session;
+    (void) flags;
+    struct __apn_mock_http2 *http2 = user_data;
+    int written = SSL_write(http2->ssl, data, (int) length);
+    return written <= 0 ? NGHTTP2_ERR_CALLBACK_FAILURE : (ssize_t) written;
+}
+
+static ssize_t __apn_mock_http2_read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+                                          uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
+    (void) session;
+    (void) stream_id;
+    (void) user_data;
+    struct __apn_mock_http2_stream *stream = source->ptr;
+    size_t left = sizeof(__apn_mock_http2_bad_token) - 1 - stream->body_offset;
+    size_t chunk = left < length ? left : length;
+    memcpy(buf, __apn_mock_http2_bad_token + stream->body_offset, chunk);
+    stream->body_offset += chunk;
+    if (stream->body_offset == sizeof(__apn_mock_http2_bad_token) - 1) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return (ssize_t) chunk;
+}
+
+static int __apn_mock_http2_on_begin_headers(nghttp2_session *session, const nghttp2_frame *frame,
+                                             void *user_data) {
+    (void) user_data;
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+        return 0;
+    }
+    struct __apn_mock_http2_stream *stream = calloc(1, sizeof(struct __apn_mock_http2_stream));
+    if (!stream) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+    return 0;
+}
+
+static int __apn_mock_http2_on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                                      size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
+                                      void *user_data) {
+    (void) flags;
+    (void) user_data;
+    struct __apn_mock_http2_stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    size_t prefix_length = sizeof(APN_MOCK_HTTP2_PATH) - 1;
+    if (!stream || namelen != 5 || 0 != memcmp(name, ":path", 5)) {
+        return 0;
+    }
+    char token_hex[APN_MOCK_TOKEN_SIZE * 2 + 1];
+    uint8_t token[APN_MOCK_TOKEN_SIZE];
+    if (valuelen != prefix_length + APN_MOCK_TOKEN_SIZE * 2 || 0 != memcmp(value, APN_MOCK_HTTP2_PATH, prefix_length)) {
+        stream->rejected = 1;
+        return 0;
+    }
+    memcpy(token_hex, value + prefix_length, APN_MOCK_TOKEN_SIZE * 2);
+    token_hex[APN_MOCK_TOKEN_SIZE * 2] = '\0';
+    stream->rejected = APN_MOCK_TOKEN_SIZE != __apn_mock_hex_to_binary(token_hex, token, APN_MOCK_TOKEN_SIZE)
+                       || __apn_mock_token_rejected(token);
+    return 0;
+}
+
+static int __apn_mock_http2_on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+    struct __apn_mock_http2 *http2 = user_data;
+    if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+        || !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+        return 0;
+    }
+    struct __apn_mock_http2_stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!stream) {
+        return 0;
+    }
+
+    http2->requests++;
+    if (stream->rejected) {
+        nghttp2_nv headers[] = {
+                {(uint8_t *) ":status", (uint8_t *) "400", 7, 3, NGHTTP2_NV_FLAG_NONE},
+                {(uint8_t *) "content-type", (uint8_t *) "application/json", 12, 16, NGHTTP2_NV_FLAG_NONE}
+        };
+        nghttp2_data_provider body;
+        body.source.ptr = stream;
+        body.read_callback = __apn_mock_http2_read_body;
+        http2->rejected++;
+        __apn_mock_count(1);
+        if (config.verbose) {
+            fprintf(stderr, "[%s] rejecting stream %d with status 400\n", http2->peer, frame->hd.stream_id);
+        }
+        nghttp2_submit_response(session, frame->hd.stream_id, headers, 2, &body);
+    } else {
+        nghttp2_nv headers[] = {
+                {(uint8_t *) ":status", (uint8_t *) "200", 7, 3, NGHTTP2_NV_FLAG_NONE}
+        };
+        __apn_mock_count(0);
+        nghttp2_submit_response(session, frame->hd.stream_id, headers, 1, NULL);
+    }
+
+    if (config.shutdown_after > 0 && http2->requests == config.shutdown_after) {
+        if (config.verbose) {
+            fprintf(stderr, "[%s] sending GOAWAY after stream %d\n", http2->peer, frame->hd.stream_id);
+        }
+        nghttp2_submit_goaway(session, NGHTTP2_FLAG_NONE, frame->hd.stream_id, NGHTTP2_NO_ERROR, NULL, 0);
+    }
+    return 0;
+}
+
+static int __apn_mock_http2_on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code,
+                                            void *user_data) {
+    (void) error_code;
+    (void) user_data;
+    free(nghttp2_session_get_stream_user_data(session, stream_id));
+    nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+    return 0;
+}
+
+static void __apn_mock_serve_http2(SSL *ssl, const char *peer) {
+    struct __apn_mock_http2 http2 = {ssl, peer, 0, 0};
+    nghttp2_session_callbacks *callbacks = NULL;
+    nghttp2_session *session = NULL;
+    uint8_t *buffer = malloc(APN_MOCK_READ_BUFFER);
+    uint64_t started = __apn_mock_clock_us();
+
+    if (!buffer || 0 != nghttp2_session_callbacks_new(&callbacks)) {
+        free(buffer);
+        return;
+    }
+    nghttp2_session_callbacks_set_send_callback(callbacks, __apn_mock_http2_send);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, __apn_mock_http2_on_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, __apn_mock_http2_on_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, __apn_mock_http2_on_frame_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, __apn_mock_http2_on_stream_close);
+    int ret = nghttp2_session_server_new(&session, callbacks, &http2);
+    nghttp2_session_callbacks_del(callbacks);
+    if (0 != ret) {
+        free(buffer);
+        return;
+    }
+
+    nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, APN_MOCK_HTTP2_MAX_STREAMS}};
+    nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings, 1);
+
+    while (0 == nghttp2_session_send(session)
+           && (nghttp2_session_want_read(session) || nghttp2_session_want_write(session))) {
+        int bytes_read = SSL_read(ssl, buffer, APN_MOCK_READ_BUFFER);
+        if (bytes_read <= 0 || nghttp2_session_mem_recv(session, buffer, (size_t) bytes_read) < 0) {
+            break;
+        }
+    }
+
+    if (config.verbose) {
+        double seconds = (double) (__apn_mock_clock_us() - started) / 1e6;
+        fprintf(stderr, "[%s] %llu request(s), %llu rejected in %.3f s (%.0f requests/s)\n", peer,
+                (unsigned long long) http2.requests, (unsigned long long) http2.rejected, seconds,
+                seconds > 0 ? (double) http2.requests / seconds : 0.0);
+    }
+    nghttp2_session_del(session);
+    free(buffer);
+}
+
+static int __apn_mock_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+                                  unsigned int inlen, void *arg) {
+    (void) ssl;
+    (void) arg;
+    if (OPENSSL_NPN_NEGOTIATED != SSL_select_next_proto((unsigned char **) out, outlen,
+                                                        (const unsigned char *) "\x02h2", 3, in, inlen)) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+static int __apn_mock_listen(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *addrinfo = NULL;
+    int sock = -1;
+    int on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    if (0 != getaddrinfo(host, port, &hints, &addrinfo)) {
+        fprintf(stderr, "Unable to resolve %s:%s\n", host, port);
+        return -1;
+    }
+    sock = socket(addrinfo->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        freeaddrinfo(addrinfo);
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &on, sizeof(on));
+    if (0 != bind(sock, addrinfo->ai_addr, addrinfo->ai_addrlen) || 0 != listen(sock, 128)) {
+        fprintf(stderr, "Unable to listen on %s:%s: %s\n", host, port, strerror(errno));
+        close(sock);
+        freeaddrinfo(addrinfo);
+        return -1;
+    }
+    freeaddrinfo(addrinfo);
+    return sock;
+}
+
+static SSL_CTX *__apn_mock_ssl_ctx(void) {
+    SSL_CTX *ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+    if (!ssl_ctx) {
+        return NULL;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    /* The library connects with TLSv1 */
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
+    SSL_CTX_set_security_level(ssl_ctx, 0);
+#endif
+    if (1 != SSL_CTX_use_certificate_chain_file(ssl_ctx, config.cert_file)
+        || 1 != SSL_CTX_use_PrivateKey_file(ssl_ctx, config.key_file, SSL_FILETYPE_PEM)) {
+        fprintf(stderr, "Unable to use certificate %s and key %s: %s\n", config.cert_file, config.key_file,
+                ERR_error_string(ERR_get_error(), NULL));
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
+#ifdef APN_HAVE_HTTP2
+    if (config.http2) {
+        SSL_CTX_set_alpn_select_cb(ssl_ctx, __apn_mock_alpn_select, NULL);
+    }
+#endif
+    return ssl_ctx;
+}
+
+static void __apn_mock_handle(SSL_CTX *ssl_ctx, int sock, uint8_t feedback) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN] = "?";
+    char serv[8] = "?";
+    char peer[INET6_ADDRSTRLEN + 8 + 2];
+
+    if (0 != getpeername(sock, (struct sockaddr *) &addr, &addr_len)
+        || 0 != getnameinfo((struct sockaddr *) &addr, addr_len, host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV)) {
+        host[0] = '?';
+        host[1] = '\0';
+    }
+    snprintf(peer, sizeof(peer), "%s:%s", host, serv);
+
+    if (config.latency > 0) {
+        __apn_mock_sleep_us((uint64_t) config.latency * 1000);
+    }
+
+    SSL *ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(ssl, sock);
+    if (1 != SSL_accept(ssl)) {
+        fprintf(stderr, "[%s] SSL_accept() failed: %s\n", peer, ERR_error_string(ERR_get_error(), NULL));
+    } else {
+        if (config.verbose) {
+            fprintf(stderr, "[%s] %s connection accepted\n", peer, feedback ? "feedback" : "gateway");
+        }
+        if (feedback) {
+            __apn_mock_serve_feedback(ssl, peer);
+#ifdef APN_HAVE_HTTP2
+        } else if (config.http2) {
+            __apn_mock_serve_http2(ssl, peer);
+#endif
+        } else {
+            __apn_mock_serve_gateway(ssl, peer);
+        }
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(sock);
+}
+
+static void __apn_mock_usage(void) {
+    fprintf(stderr, "apn-mock-gateway - local Apple Push Notification Service stand-in for testing\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage: apn-mock-gateway -c CERT -k KEY [OPTION]\n");
+    fprintf(stderr, "    -h Print this message and exit\n");
+    fprintf(stderr, "    -c Path to PEM certificate (required)\n");
+    fprintf(stderr, "    -k Path to PEM private key (required)\n");
+    fprintf(stderr, "    -H Address to listen on (default 127.0.0.1)\n");
+    fprintf(stderr, "    -p Gateway port (default 2195)\n");
+    fprintf(stderr, "    -f Feedback port (default 2196)\n");
+    fprintf(stderr, "    -F Path to file with tokens returned by feedback service\n");
+#ifdef APN_HAVE_HTTP2
+    fprintf(stderr, "    -2 Serve HTTP/2 provider API instead of binary protocol on gateway port\n");
+#endif
+    fprintf(stderr, "    -r Token to reject with error 8 (HTTP/2: status 400), can be repeated\n");
+    fprintf(stderr, "    -x Reject tokens which start with hex prefix with error 8 (HTTP/2: status 400)\n");
+    fprintf(stderr, "    -s Send error 10 (shutdown, HTTP/2: GOAWAY) after N notifications per connection\n");
+    fprintf(stderr, "    -l Latency in milliseconds added to handshake and error responses\n");
+    fprintf(stderr, "    -b Limit read rate to N bytes per second per connection\n");
+    fprintf(stderr, "    -C Count accepted and rejected notifications of all connections in file, see apn-bench\n");
+    fprintf(stderr, "    -v Print per-connection statistics\n");
+}
+
+int main(int argc, char **argv) {
+    int c = -1;
+
+    memset(&config, 0, sizeof(config));
+    config.bind_host = "127.0.0.1";
+    config.gateway_port = "2195";
+    config.feedback_port = "2196";
+
+    while ((c = getopt(argc, argv, "hc:k:H:p:f:F:r:x:s:l:b:C:v2")) != -1) {
+        switch (c) {
+            case 'c':
+                config.cert_file = optarg;
+                break;
+            case 'k':
+                config.key_file = optarg;
+                break;
+            case 'H':
+                config.bind_host = optarg;
+                break;
+            case 'p':
+                config.gateway_port = optarg;
+                break;
+            case 'f':
+                config.feedback_port = optarg;
+                break;
+            case 'F':
+                config.feedback_file = optarg;
+                break;
+            case 'r':
+                if (config.rejected_count >= APN_MOCK_MAX_REJECTED
+                    || APN_MOCK_TOKEN_SIZE != __apn_mock_hex_to_binary(optarg, config.rejected[config.rejected_count],
+                                                                       APN_MOCK_TOKEN_SIZE)) {
+                    fprintf(stderr, "Invalid token: %s\n", optarg);
+                    return 1;
+                }
+                config.rejected_count++;
+                break;
+            case 'x': {
+                int size = __apn_mock_hex_to_binary(optarg, config.reject_prefix, APN_MOCK_TOKEN_SIZE);
+                if (size <= 0) {
+                    fprintf(stderr, "Invalid token prefix: %s\n", optarg);
+                    return 1;
+                }
+                config.reject_prefix_size = (uint32_t) size;
+                break;
+            }
+            case 's':
+                config.shutdown_after = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                config.latency = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.read_rate = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                config.counters_file = optarg;
+                break;
+            case 'v':
+                config.verbose = 1;
+                break;
+#ifdef APN_HAVE_HTTP2
+            case '2':
+                config.http2 = 1;
+                break;
+#endif
+            case 'h':
+            default:
+                __apn_mock_usage();
+                return 1;
+        }
+    }
+
+    if (!config.cert_file || !config.key_file) {
+        __apn_mock_usage();
+        return 1;
+    }
+
+    if (config.counters_file && 0 != __apn_mock_counters_map(config.counters_file)) {
+        fprintf(stderr, "Unable to map %s: %s\n", config.counters_file, strerror(errno));
+        return 1;
+    }
+
+    SSL_load_error_strings();
+    SSL_library_init();
+
+    SSL_CTX *ssl_ctx = __apn_mock_ssl_ctx();
+    if (!ssl_ctx) {
+        return 1;
+    }
+
+    int gateway_sock = __apn_mock_listen(config.bind_host, config.gateway_port);
+    int feedback_sock = __apn_mock_listen(config.bind_host, config.feedback_port);
+    if (gateway_sock < 0 || feedback_sock < 0) {
+        SSL_CTX_free(ssl_ctx);
+        return 1;
+    }
+
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Listening on %s: gateway port %s, feedback port %s\n", config.bind_host, config.gateway_port,
+            config.feedback_port);
+
+    for (;;) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(gateway_sock, &read_set);
+        FD_SET(feedback_sock, &read_set);
+        int max_sock = gateway_sock > feedback_sock ? gateway_sock : feedback_sock;
+
+        if (select(max_sock + 1, &read_set, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "select() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (uint8_t feedback = 0; feedback < 2; feedback++) {
+            int listen_sock = feedback ? feedback_sock : gateway_sock;
+            if (!FD_ISSET(listen_sock, &read_set)) {
+                continue;
+            }
+            int sock = accept(listen_sock, NULL, NULL);
+            if (sock < 0) {
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(gateway_sock);
+                close(feedback_sock);
+                __apn_mock_handle(ssl_ctx, sock, feedback);
+                _exit(0);
+            } else if (pid < 0) {
+                fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+            }
+            close(sock);
+        }
+    }
+
+    close(gateway_sock);
+    close(feedback_sock);
+    SSL_CTX_free(ssl_ctx);
+    return 0;
+}
@@ -20,6 +20,11 @@
  * THE SOFTWARE.
  */
 
+/* getline() is POSIX.1-2008, the build asks for POSIX.1-2001 only */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -35,48 +40,26 @@
 #include "apn.h"
 #include "apn_array.h"
 #include "apn_payload.h"
+#include "apn_pool.h"
+#include "apn_token_store.h"
+#include "apn_spool.h"
 #include "apn_strings.h"
 #include "apn_strerror.h"
+#include "pusher_dedup.h"
+#include "pusher_log.h"
 
-#define CLOCK_BUFLEN 255
-#define TIME_FORMAT "%Y-%m-%d %H:%M:%S"
-time_t time_clock;
-char time_now[CLOCK_BUFLEN];
-char *logfile = NULL;
-
-
-static void __apn_logging(apn_log_levels level, const char *const message, uint32_t len) {
-    (void )len;
-    const char *prefix = NULL;
-    FILE *fp;
-    switch (level) {
-        case APN_LOG_LEVEL_ERROR:
-            prefix = "ERROR";
-            break;
-        case APN_LOG_LEVEL_INFO:
-            prefix = "INFO";
-            break;
-        case APN_LOG_LEVEL_DEBUG:
-            prefix = "DEBUG";
-            break;
-    }
-    time_clock = time(NULL);
-    strftime(time_now, CLOCK_BUFLEN, TIME_FORMAT, localtime(&time_clock));
-    if (NULL != logfile) {
-        fp = fopen(logfile, "a+");
-    }
-    if (NULL != fp) {
-        fprintf(fp, "%s %s apns ---> %s\n", time_now, prefix, message);
-        fclose(fp);
-    } else {
-        fprintf(stdout, "%s %s apns ---> %s\n", time_now, prefix, message);
-    }
-}
+#define APN_PUSHER_MAX_CONNECTIONS 64
 
 static void __apn_token_free(void *data) {
     free(data);
 }
 
+static void __apn_pusher_invalid_tokens(const char *const app_id, const apn_array_t *const tokens,
+                                        const uint32_t *const indices, uint32_t count, void *user) {
+    (void) app_id;
+    apn_invalid_tokens_bitmap_sink(tokens, indices, count, user);
+}
+
 static apn_array_t *__apn_split_tokens(char *const tokens) {
     apn_array_t *array = apn_array_init(20, __apn_token_free, NULL);
     if (array) {
@@ -162,7 +145,7 @@ static void __apn_pusher_usage(void) {
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage: apn-pusher [OPTION]\n");
     fprintf(stderr, "    -h Print this message and exit\n");
-    fprintf(stderr, "    -c Path to .p12 file (required)\n");
+    fprintf(stderr, "    -c Path to .p12 file (required unless -K is set)\n");
     fprintf(stderr, "    -P Passphrase string for .p12 file\n");
     fprintf(stderr, "    -p Passphrase for .p12 file. Will be asked from the tty\n");
     fprintf(stderr, "    -d Use sandbox mode\n");
@@ -176,6 +159,154 @@ static void __apn_pusher_usage(void) {
     fprintf(stderr, "    -T Path to file with tokens\n");
     fprintf(stderr, "    -o Path to logging file\n");
     fprintf(stderr, "    -v Make the operation more talkative\n");
+    fprintf(stderr, "    -S Print connection statistics to stdout, format: json or prometheus\n");
+    fprintf(stderr, "    -n Number of connections, tokens are balanced between them (default: 1)\n");
+    fprintf(stderr, "    -k Path to token store file, tokens in it are skipped and invalid tokens are added\n");
+    fprintf(stderr, "    -2 Use HTTP/2 provider API\n");
+    fprintf(stderr, "    -K Path to .p8 authentication key, used instead of .p12 file (HTTP/2 only)\n");
+    fprintf(stderr, "    -I Authentication key id\n");
+    fprintf(stderr, "    -E Team id\n");
+    fprintf(stderr, "    -B Topic, bundle id of the app (required with -K)\n");
+    fprintf(stderr, "    -L Hand TLS encryption to the kernel (Linux kTLS) when available\n");
+    fprintf(stderr, "    -Q Path to spool file: frames are built into it first and sent with one connection\n");
+}
+
+static void __apn_pusher_print_stats(const apn_stats_t *const stats, const char *const format) {
+    char *dump = (0 == strcmp(format, "json")) ? apn_stats_json(stats) : apn_stats_prometheus(stats, NULL);
+    if (dump) {
+        fprintf(stdout, "%s\n", dump);
+        free(dump);
+    }
+}
+
+static void __apn_pusher_print_result(apn_return result, const apn_array_t *const tokens,
+                                      const apn_token_bitmap_t *const invalid_tokens) {
+    uint32_t invalid_count = 0;
+    for (uint32_t i = 0; i < invalid_tokens->size; i++) {
+        if (invalid_tokens->bits[i / 8] & (1 << (i % 8))) {
+            invalid_count++;
+        }
+    }
+
+    if (APN_ERROR == result) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Could not send push: %s (errno: %d)\n", error, errno);
+        free(error);
+    } else {
+        fprintf(stderr, "Notification was sucessfully sent to %u device(s)\n",
+                apn_array_count(tokens) - invalid_count);
+    }
+
+    if (invalid_count > 0) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Invalid tokens:\n");
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < invalid_tokens->size; i++) {
+            if (invalid_tokens->bits[i / 8] & (1 << (i % 8))) {
+                fprintf(stderr, "    %u. %s\n", n++, (const char *) apn_array_item_at_index(tokens, i));
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+/* Builds a spool of frames and sends it, with sendfile() when the kernel encrypts the connection */
+static uint8_t __apn_pusher_send_spool(apn_ctx_t *const apn_ctx, const char *const spool_path,
+                                       const apn_payload_t *const payload, const apn_array_t *const tokens) {
+    if (APN_ERROR == apn_spool_create(spool_path, payload, tokens)) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to create spool %s: %s (errno: %d)\n", spool_path, error, errno);
+        free(error);
+        return 1;
+    }
+    apn_spool_t *spool = apn_spool_open(spool_path);
+    if (!spool) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to open spool %s: %s (errno: %d)\n", spool_path, error, errno);
+        free(error);
+        return 1;
+    }
+
+    apn_array_t *invalid_tokens = NULL;
+    apn_return result = apn_send_spool(apn_ctx, spool, 0, apn_spool_count(spool), &invalid_tokens);
+    uint32_t invalid_count = invalid_tokens ? apn_array_count(invalid_tokens) : 0;
+    if (APN_ERROR == result) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Could not send push: %s (errno: %d)\n", error, errno);
+        free(error);
+    } else {
+        fprintf(stderr, "Notification was sucessfully sent to %u device(s)\n", apn_spool_count(spool) - invalid_count);
+    }
+    if (invalid_count > 0) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Invalid tokens:\n");
+        for (uint32_t i = 0; i < invalid_count; i++) {
+            fprintf(stderr, "    %u. %s\n", i, (const char *) apn_array_item_at_index(invalid_tokens, i));
+        }
+        fprintf(stderr, "\n");
+    }
+
+    apn_array_free(invalid_tokens);
+    apn_spool_close(spool);
+    return APN_ERROR == result ? 1 : 0;
+}
+
+/* Sends through a pool of connections, idle connections take over tokens left to slower ones */
+static uint8_t __apn_pusher_send_pool(const apn_ctx_t *const apn_ctx, const apn_identity_t *const credentials,
+                                      uint32_t connections, uint8_t verbose,
+                                      const apn_payload_t *const payload, apn_array_t *const tokens,
+                                      const char *const stats_format, apn_token_store_t *const token_store,
+                                      apn_token_bitmap_t *const invalid_tokens) {
+    apn_pool_t *pool = apn_pool_init();
+    if (!pool) {
+        fprintf(stderr, "Unable to init connection pool: %d\n", errno);
+        return 1;
+    }
+
+    apn_identity_t identity;
+    memset(&identity, 0, sizeof(identity));
+    identity.app_id = "apn-pusher";
+    identity.pkcs12_file = credentials->pkcs12_file;
+    identity.pkcs12_pass = credentials->pkcs12_pass;
+    identity.protocol = credentials->protocol;
+    identity.auth_key_file = credentials->auth_key_file;
+    identity.auth_key_id = credentials->auth_key_id;
+    identity.auth_team_id = credentials->auth_team_id;
+    identity.topic = credentials->topic;
+    identity.mode = apn_mode(apn_ctx);
+    identity.options = apn_behavior(apn_ctx) & APN_OPTION_KTLS;
+    identity.connections = connections;
+    identity.token_store = token_store;
+    if (verbose) {
+        identity.log_callback = apn_pusher_log;
+        identity.log_level = APN_LOG_LEVEL_INFO | APN_LOG_LEVEL_ERROR;
+    }
+
+    uint8_t ret = 0;
+    if (APN_ERROR == apn_pool_add_identity(pool, &identity)) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to init connections: %s (errno: %d)\n", error, errno);
+        free(error);
+        apn_pool_free(pool);
+        return 1;
+    }
+
+    apn_pool_set_invalid_tokens_sink(pool, __apn_pusher_invalid_tokens, invalid_tokens);
+
+    apn_return result = apn_pool_send(pool, identity.app_id, payload, tokens);
+    if (APN_ERROR == result) {
+        ret = 1;
+    }
+    __apn_pusher_print_result(result, tokens, invalid_tokens);
+
+    if (stats_format) {
+        apn_stats_t stats;
+        apn_pool_stats(pool, identity.app_id, &stats);
+        __apn_pusher_print_stats(&stats, stats_format);
+    }
+
+    apn_pool_free(pool);
+    return ret;
 }
 
 int main(int argc, char **argv) {
@@ -210,8 +341,18 @@ int main(int argc, char **argv) {
     char *p12_pass = NULL;
     uint8_t ret = 0;
     uint8_t rpassword = 0;
+    uint8_t verbose = 0;
+    char *logfile = NULL;
+    const char *stats_format = NULL;
+    uint32_t connections = 1;
+    const char *token_store_path = NULL;
+    apn_token_store_t *token_store = NULL;
+    apn_token_bitmap_t invalid_tokens = {NULL, 0};
+    const char *spool_path = NULL;
+    apn_identity_t credentials;
+    memset(&credentials, 0, sizeof(credentials));
 
-    const char *const opts = "ahc:P:pdm:b:s:i:e:y:t:T:o:v";
+    const char *const opts = "ahc:P:pdm:b:s:i:e:y:t:T:o:vS:n:k:2K:I:E:B:LQ:";
     int c = -1;
     while ((c = getopt(argc, argv, opts)) != -1) {
         switch (c) {
@@ -264,8 +405,47 @@ int main(int argc, char **argv) {
                 logfile = apn_strndup(optarg, strlen(optarg));
                 break;
             case 'v':
-                apn_set_log_callback(apn_ctx, __apn_logging);
-                apn_set_log_level(apn_ctx, APN_LOG_LEVEL_INFO | APN_LOG_LEVEL_ERROR);
+                verbose = 1;
+                break;
+            case 'S':
+                if (0 != strcmp(optarg, "json") && 0 != strcmp(optarg, "prometheus")) {
+                    fprintf(stderr, "Unknown statistics format: %s\n", optarg);
+                    ret = 1;
+                    goto finish;
+                }
+                stats_format = optarg;
+                break;
+            case 'n':
+                connections = (uint32_t) atoi(optarg);
+                if (connections < 1 || connections > APN_PUSHER_MAX_CONNECTIONS) {
+                    fprintf(stderr, "Number of connections must be between 1 and %d\n", APN_PUSHER_MAX_CONNECTIONS);
+                    ret = 1;
+                    goto finish;
+                }
+                break;
+            case 'k':
+                token_store_path = optarg;
+                break;
+            case '2':
+                credentials.protocol = APN_PROTOCOL_HTTP2;
+                break;
+            case 'K':
+                credentials.auth_key_file = optarg;
+                break;
+            case 'I':
+                credentials.auth_key_id = optarg;
+                break;
+            case 'E':
+                credentials.auth_team_id = optarg;
+                break;
+            case 'B':
+                credentials.topic = optarg;
+                break;
+            case 'L':
+                apn_set_behavior(apn_ctx, apn_behavior(apn_ctx) | APN_OPTION_KTLS);
+                break;
+            case 'Q':
+                spool_path = optarg;
                 break;
             case '?':
                 if (optopt == 'c') {
@@ -279,7 +459,35 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (p12) {
+    if (APN_ERROR == apn_set_protocol(apn_ctx, credentials.protocol)) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to use HTTP/2: %s (errno: %d)\n", error, errno);
+        free(error);
+        ret = 1;
+        goto finish;
+    }
+    if (credentials.topic) {
+        apn_set_topic(apn_ctx, credentials.topic);
+    }
+    if (spool_path && (APN_PROTOCOL_HTTP2 == credentials.protocol || connections > 1)) {
+        fprintf(stderr, "Spool is sent with the binary protocol over one connection\n");
+        ret = 1;
+        goto finish;
+    }
+
+    if (credentials.auth_key_file) {
+        if (APN_PROTOCOL_HTTP2 != credentials.protocol) {
+            fprintf(stderr, "Authentication key requires HTTP/2 (-2)\n");
+            ret = 1;
+            goto finish;
+        }
+        if (!credentials.auth_key_id || !credentials.auth_team_id || !credentials.topic) {
+            fprintf(stderr, "Missing key id, team id or topic\n");
+            ret = 1;
+            goto finish;
+        }
+        apn_set_auth_key(apn_ctx, credentials.auth_key_file, credentials.auth_key_id, credentials.auth_team_id);
+    } else if (p12) {
         if(rpassword) {
             printf("Enter .p12 file password: ");
             size_t p12_pass_len = 1024;
@@ -317,33 +525,79 @@ int main(int argc, char **argv) {
         goto finish;
     }
 
+    uint32_t duplicates = 0;
+    if (APN_ERROR == apn_pusher_dedup(tokens, &duplicates)) {
+        char *error = apn_error_string(errno);
+        fprintf(stderr, "Unable to remove duplicate tokens: %s (errno: %d)\n", error, errno);
+        free(error);
+        ret = 1;
+        goto finish;
+    }
+    if (duplicates > 0) {
+        fprintf(stderr, "%u duplicate token(s) removed\n", duplicates);
+    }
+
+    if (verbose) {
+        if (APN_ERROR == apn_pusher_log_open(logfile)) {
+            char error[250] = {0};
+            apn_strerror(errno, error, sizeof(error) - 1);
+            fprintf(stderr, "Unable to open log file %s: %s (errno: %d)\n", logfile ? logfile : "stdout", error, errno);
+            ret = 1;
+            goto finish;
+        }
+        apn_set_log_callback(apn_ctx, apn_pusher_log);
+        apn_set_log_level(apn_ctx, APN_LOG_LEVEL_INFO | APN_LOG_LEVEL_ERROR);
+    }
+
+    /* One bit per token instead of a copy of each invalid token */
+    invalid_tokens.size = apn_array_count(tokens);
+    invalid_tokens.bits = calloc((invalid_tokens.size + 7) / 8, 1);
+    if (!invalid_tokens.bits) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        ret = 1;
+        goto finish;
+    }
+    apn_set_invalid_tokens_sink(apn_ctx, apn_invalid_tokens_bitmap_sink, &invalid_tokens);
+
+    if (token_store_path) {
+        token_store = apn_token_store_open(token_store_path, 0);
+        if (!token_store) {
+            char *error = apn_error_string(errno);
+            fprintf(stderr, "Unable to open token store %s: %s (errno: %d)\n", token_store_path, error, errno);
+            free(error);
+            ret = 1;
+            goto finish;
+        }
+        apn_set_token_store(apn_ctx, token_store);
+    }
+
+    if (connections > 1) {
+        credentials.pkcs12_file = p12;
+        credentials.pkcs12_pass = p12_pass;
+        ret = __apn_pusher_send_pool(apn_ctx, &credentials, connections, verbose, payload, tokens, stats_format,
+                                     token_store, &invalid_tokens);
+        goto finish;
+    }
+
     if (APN_ERROR == apn_connect(apn_ctx)) {
         char *error = apn_error_string(errno);
         fprintf(stderr, "Could not connected to Apple Push Notification Service: %s (errno: %d)\n", error, errno);
         ret = 1;
         free(error);
+    } else if (spool_path) {
+        ret = __apn_pusher_send_spool(apn_ctx, spool_path, payload, tokens);
     } else {
-        apn_array_t *invalid_tokens = NULL;
-        if (APN_ERROR == apn_send(apn_ctx, payload, tokens, &invalid_tokens)) {
+        apn_return result = apn_send(apn_ctx, payload, tokens, NULL);
+        if (APN_ERROR == result) {
             ret = 1;
-            char *error = apn_error_string(errno);
-            fprintf(stderr, "Could not send push: %s (errno: %d)\n", error, errno);
-            free(error);
-        } else {
-            fprintf(stderr, "Notification was sucessfully sent to %u device(s)\n",
-                    apn_array_count(tokens) - ((invalid_tokens) ? apn_array_count(invalid_tokens) : 0));
         }
+        __apn_pusher_print_result(result, tokens, &invalid_tokens);
+    }
 
-        if (invalid_tokens) {
-            fprintf(stderr, "\n");
-            fprintf(stderr, "Invalid tokens:\n");
-            uint32_t i = 0;
-            for (; i < apn_array_count(invalid_tokens); i++) {
-                fprintf(stderr, "    %u. %s\n", i, (const char *)apn_array_item_at_index(invalid_tokens, i));
-            }
-            fprintf(stderr, "\n");
-            apn_array_free(invalid_tokens);
-        }
+    if (stats_format) {
+        apn_stats_t stats;
+        apn_stats(apn_ctx, &stats);
+        __apn_pusher_print_stats(&stats, stats_format);
     }
 
     finish:
@@ -351,6 +605,10 @@ int main(int argc, char **argv) {
     apn_strfree(&p12);
 
     apn_free(apn_ctx);
+    apn_token_store_close(token_store);
+    free(invalid_tokens.bits);
+    apn_pusher_log_close();
+    apn_strfree(&logfile);
     apn_payload_free(payload);
     apn_array_free(tokens);
     apn_library_free();
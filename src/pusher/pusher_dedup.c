@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "apn_array.h"
+#include "pusher_dedup.h"
+
+#define APN_PUSHER_DEDUP_TOKEN_LENGTH 64
+#define APN_PUSHER_DEDUP_TOKEN_SIZE 32
+#define APN_PUSHER_DEDUP_MAX_THREADS 32
+#define APN_PUSHER_DEDUP_MIN_TOKENS_PER_THREAD 65536
+#define APN_PUSHER_DEDUP_PARTITION_BITS 12
+#define APN_PUSHER_DEDUP_PARTITIONS (1U << APN_PUSHER_DEDUP_PARTITION_BITS)
+
+/*
+ * Three parallel passes over the array:
+ *   1. every thread hashes the binary form of tokens in its slice and counts them per partition,
+ *   2. every thread scatters (hash, index) records of its slice to the partitions (radix partitioning),
+ *   3. threads take partitions one by one and insert their records into a small hash set, a token found in
+ *      the set is marked as a duplicate.
+ * Records of a partition come from consecutive slices in index order, so the first occurrence is kept.
+ * Only hashes and indices are moved around, token strings are read again only to confirm equal hashes.
+ */
+struct __apn_pusher_dedup_record {
+    uint64_t hash;
+    uint32_t index;
+};
+
+struct __apn_pusher_dedup {
+    apn_array_t *tokens;
+    uint32_t count;
+    uint32_t threads;
+    /* Hash of each token, 0 if the token is not 64 hex digits */
+    uint64_t *hashes;
+    /* Per thread: number of records in each partition, then the write position of the next one */
+    uint32_t *offsets;
+    uint32_t partitions[APN_PUSHER_DEDUP_PARTITIONS + 1];
+    struct __apn_pusher_dedup_record *records;
+    uint8_t *duplicates;
+    uint32_t next_partition;
+    uint32_t removed;
+    int error;
+};
+
+struct __apn_pusher_dedup_worker {
+    struct __apn_pusher_dedup *dedup;
+    uint32_t thread;
+    void (*pass)(struct __apn_pusher_dedup *const dedup, uint32_t thread);
+};
+
+/* Value of a hex digit plus one, 0 for other characters */
+static uint8_t __apn_pusher_dedup_hex[256];
+static pthread_once_t __apn_pusher_dedup_hex_once = PTHREAD_ONCE_INIT;
+
+static void __apn_pusher_dedup_hex_init(void) {
+    for (uint32_t i = 0; i < 10; i++) {
+        __apn_pusher_dedup_hex['0' + i] = (uint8_t) (i + 1);
+    }
+    for (uint32_t i = 0; i < 6; i++) {
+        __apn_pusher_dedup_hex['a' + i] = (uint8_t) (i + 11);
+        __apn_pusher_dedup_hex['A' + i] = (uint8_t) (i + 11);
+    }
+}
+
+/* Stops at the first character which is not a hex digit, so a shorter token is not read past its end */
+static uint8_t __apn_pusher_dedup_parse(const char *const hex, uint8_t *const binary) {
+    const unsigned char *digits = (const unsigned char *) hex;
+    for (uint32_t i = 0; i < APN_PUSHER_DEDUP_TOKEN_SIZE; i++) {
+        uint8_t high = __apn_pusher_dedup_hex[digits[2 * i]];
+        if (!high) {
+            return 0;
+        }
+        uint8_t low = __apn_pusher_dedup_hex[digits[2 * i + 1]];
+        if (!low) {
+            return 0;
+        }
+        binary[i] = (uint8_t) ((high - 1) << 4 | (low - 1));
+    }
+    return '\0' == hex[APN_PUSHER_DEDUP_TOKEN_LENGTH];
+}
+
+static uint64_t __apn_pusher_dedup_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t __apn_pusher_dedup_hash(const char *const token) {
+    uint8_t binary[APN_PUSHER_DEDUP_TOKEN_SIZE];
+    uint64_t words[APN_PUSHER_DEDUP_TOKEN_SIZE / sizeof(uint64_t)];
+    if (!token || !__apn_pusher_dedup_parse(token, binary)) {
+        return 0;
+    }
+    memcpy(words, binary, sizeof(words));
+    uint64_t hash = __apn_pusher_dedup_mix(words[0] ^ __apn_pusher_dedup_mix(words[1] ^ __apn_pusher_dedup_mix(
+            words[2] ^ __apn_pusher_dedup_mix(words[3]))));
+    return hash ? hash : 1;
+}
+
+static uint32_t __apn_pusher_dedup_partition(uint64_t hash) {
+    return (uint32_t) (hash >> (64 - APN_PUSHER_DEDUP_PARTITION_BITS));
+}
+
+static void __apn_pusher_dedup_slice(const struct __apn_pusher_dedup *const dedup, uint32_t thread,
+                                     uint32_t *const begin, uint32_t *const end) {
+    *begin = (uint32_t) ((uint64_t) dedup->count * thread / dedup->threads);
+    *end = (uint32_t) ((uint64_t) dedup->count * (thread + 1) / dedup->threads);
+}
+
+static void __apn_pusher_dedup_count(struct __apn_pusher_dedup *const dedup, uint32_t thread) {
+    uint32_t begin, end;
+    uint32_t *counts = dedup->offsets + (size_t) thread * APN_PUSHER_DEDUP_PARTITIONS;
+    __apn_pusher_dedup_slice(dedup, thread, &begin, &end);
+    for (uint32_t i = begin; i < end; i++) {
+        uint64_t hash = __apn_pusher_dedup_hash(apn_array_item_at_index(dedup->tokens, i));
+        dedup->hashes[i] = hash;
+        if (hash) {
+            counts[__apn_pusher_dedup_partition(hash)]++;
+        }
+    }
+}
+
+static void __apn_pusher_dedup_scatter(struct __apn_pusher_dedup *const dedup, uint32_t thread) {
+    uint32_t begin, end;
+    uint32_t *offsets = dedup->offsets + (size_t) thread * APN_PUSHER_DEDUP_PARTITIONS;
+    __apn_pusher_dedup_slice(dedup, thread, &begin, &end);
+    for (uint32_t i = begin; i < end; i++) {
+        uint64_t hash = dedup->hashes[i];
+        if (hash) {
+            struct __apn_pusher_dedup_record *record = &dedup->records[offsets[__apn_pusher_dedup_partition(hash)]++];
+            record->hash = hash;
+            record->index = i;
+        }
+    }
+}
+
+static uint8_t __apn_pusher_dedup_equal(const struct __apn_pusher_dedup *const dedup, uint32_t left,
+                                        uint32_t right) {
+    const char *left_token = apn_array_item_at_index(dedup->tokens, left);
+    const char *right_token = apn_array_item_at_index(dedup->tokens, right);
+    return 0 == strncasecmp(left_token, right_token, APN_PUSHER_DEDUP_TOKEN_LENGTH);
+}
+
+static void __apn_pusher_dedup_partitions(struct __apn_pusher_dedup *const dedup, uint32_t thread) {
+    (void) thread;
+    uint32_t removed = 0;
+    uint32_t *table = NULL;
+    uint32_t table_size = 0;
+
+    for (;;) {
+        uint32_t partition = __atomic_fetch_add(&dedup->next_partition, 1, __ATOMIC_RELAXED);
+        if (partition >= APN_PUSHER_DEDUP_PARTITIONS) {
+            break;
+        }
+        const struct __apn_pusher_dedup_record *records = dedup->records + dedup->partitions[partition];
+        uint32_t count = dedup->partitions[partition + 1] - dedup->partitions[partition];
+        if (0 == count) {
+            continue;
+        }
+
+        /* Open addressing set of record positions + 1, at most half full; fits in cache for a partition */
+        uint32_t size = 16;
+        while (size < 2 * count) {
+            size <<= 1;
+        }
+        if (size > table_size) {
+            uint32_t *grown = realloc(table, sizeof(uint32_t) * size);
+            if (!grown) {
+                dedup->error = ENOMEM;
+                break;
+            }
+            table = grown;
+            table_size = size;
+        }
+        memset(table, 0, sizeof(uint32_t) * size);
+
+        /* Records are in index order, so the first occurrence of a token is the one kept */
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t slot = (uint32_t) records[i].hash & (size - 1);
+            for (; table[slot]; slot = (slot + 1) & (size - 1)) {
+                const struct __apn_pusher_dedup_record *kept = &records[table[slot] - 1];
+                if (kept->hash == records[i].hash && __apn_pusher_dedup_equal(dedup, kept->index, records[i].index)) {
+                    break;
+                }
+            }
+            if (table[slot]) {
+                dedup->duplicates[records[i].index] = 1;
+                removed++;
+            } else {
+                table[slot] = i + 1;
+            }
+        }
+    }
+    free(table);
+    __atomic_fetch_add(&dedup->removed, removed, __ATOMIC_RELAXED);
+}
+
+static void *__apn_pusher_dedup_thread(void *arg) {
+    struct __apn_pusher_dedup_worker *worker = arg;
+    worker->pass(worker->dedup, worker->thread);
+    return NULL;
+}
+
+static apn_return __apn_pusher_dedup_run(struct __apn_pusher_dedup *const dedup,
+                                         void (*pass)(struct __apn_pusher_dedup *const, uint32_t)) {
+    struct __apn_pusher_dedup_worker workers[APN_PUSHER_DEDUP_MAX_THREADS];
+    pthread_t threads[APN_PUSHER_DEDUP_MAX_THREADS];
+    uint32_t started = 1;
+    int ret = 0;
+
+    for (; started < dedup->threads; started++) {
+        workers[started].dedup = dedup;
+        workers[started].thread = started;
+        workers[started].pass = pass;
+        if (0 != (ret = pthread_create(&threads[started], NULL, __apn_pusher_dedup_thread, &workers[started]))) {
+            break;
+        }
+    }
+    if (0 == ret) {
+        pass(dedup, 0);
+    }
+    for (uint32_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (0 != ret) {
+        errno = ret;
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
+static uint32_t __apn_pusher_dedup_threads(uint32_t count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cpus > 0 ? (uint32_t) cpus : 1;
+    if (threads > APN_PUSHER_DEDUP_MAX_THREADS) {
+        threads = APN_PUSHER_DEDUP_MAX_THREADS;
+    }
+    if (threads > count / APN_PUSHER_DEDUP_MIN_TOKENS_PER_THREAD) {
+        threads = count / APN_PUSHER_DEDUP_MIN_TOKENS_PER_THREAD;
+    }
+    return threads > 0 ? threads : 1;
+}
+
+apn_return apn_pusher_dedup(apn_array_t *const tokens, uint32_t *const removed) {
+    struct __apn_pusher_dedup dedup;
+    memset(&dedup, 0, sizeof(dedup));
+    dedup.tokens = tokens;
+    dedup.count = apn_array_count(tokens);
+    dedup.threads = __apn_pusher_dedup_threads(dedup.count);
+
+    if (removed) {
+        *removed = 0;
+    }
+    if (dedup.count < 2) {
+        return APN_SUCCESS;
+    }
+
+    pthread_once(&__apn_pusher_dedup_hex_once, __apn_pusher_dedup_hex_init);
+
+    apn_return ret = APN_ERROR;
+    dedup.hashes = malloc(sizeof(uint64_t) * dedup.count);
+    dedup.offsets = calloc((size_t) dedup.threads * APN_PUSHER_DEDUP_PARTITIONS, sizeof(uint32_t));
+    dedup.duplicates = calloc(dedup.count, sizeof(uint8_t));
+    if (!dedup.hashes || !dedup.offsets || !dedup.duplicates) {
+        errno = ENOMEM;
+        goto finish;
+    }
+
+    if (APN_ERROR == __apn_pusher_dedup_run(&dedup, __apn_pusher_dedup_count)) {
+        goto finish;
+    }
+
+    /* Turn per thread counts into write positions: partition by partition, thread by thread */
+    uint32_t position = 0;
+    for (uint32_t partition = 0; partition < APN_PUSHER_DEDUP_PARTITIONS; partition++) {
+        dedup.partitions[partition] = position;
+        for (uint32_t thread = 0; thread < dedup.threads; thread++) {
+            uint32_t *offset = &dedup.offsets[(size_t) thread * APN_PUSHER_DEDUP_PARTITIONS + partition];
+            uint32_t count = *offset;
+            *offset = position;
+            position += count;
+        }
+    }
+    dedup.partitions[APN_PUSHER_DEDUP_PARTITIONS] = position;
+
+    dedup.records = malloc(sizeof(struct __apn_pusher_dedup_record) * (position > 0 ? position : 1));
+    if (!dedup.records) {
+        errno = ENOMEM;
+        goto finish;
+    }
+    if (APN_ERROR == __apn_pusher_dedup_run(&dedup, __apn_pusher_dedup_scatter) ||
+        APN_ERROR == __apn_pusher_dedup_run(&dedup, __apn_pusher_dedup_partitions)) {
+        goto finish;
+    }
+    if (dedup.error) {
+        errno = dedup.error;
+        goto finish;
+    }
+
+    if (dedup.removed > 0) {
+        for (uint32_t i = 0; i < dedup.count; i++) {
+            if (dedup.duplicates[i]) {
+                apn_array_remove(tokens, i);
+            }
+        }
+        apn_array_compact(tokens);
+    }
+    if (removed) {
+        *removed = dedup.removed;
+    }
+    ret = APN_SUCCESS;
+
+    finish:
+    free(dedup.hashes);
+    free(dedup.offsets);
+    free(dedup.records);
+    free(dedup.duplicates);
+    return ret;
+}
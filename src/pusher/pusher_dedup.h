@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __APN_PUSHER_DEDUP_H__
+#define __APN_PUSHER_DEDUP_H__
+
+#include <stdint.h>
+
+#include "apn.h"
+
+/**
+ * Removes repeated device tokens from `tokens`, keeping the first occurrence of each. Tokens are compared in
+ * binary form, so the same token written in upper and lower case is a duplicate. Strings which are not
+ * 64 hex digits are left as is. Hashing, partitioning and deduplication of partitions run on all CPUs.
+ *
+ * @param[in, out] tokens - Array of hex tokens created with free() as destructor
+ * @param[out] removed - Number of removed duplicates. Can be NULL
+ *
+ * @return ::APN_SUCCESS or ::APN_ERROR with errno set, `tokens` is not changed on error
+ */
+apn_return apn_pusher_dedup(apn_array_t *const tokens, uint32_t *const removed);
+
+#endif
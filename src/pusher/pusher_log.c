@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* SA_RESTART is an XSI extension, hidden by the POSIX.1-2001 build flags */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apn_strings.h"
+#include "pusher_log.h"
+
+#define APN_PUSHER_LOG_SLOTS 1024
+#define APN_PUSHER_LOG_MESSAGE_SIZE 1024
+#define APN_PUSHER_LOG_WAIT_MS 100
+#define APN_PUSHER_LOG_TIME_FORMAT "%Y-%m-%d %H:%M:%S"
+
+/*
+ * Bounded multi-producer single-consumer ring (D. Vyukov's bounded queue). A slot is free for
+ * position `pos` when its sequence equals `pos` and holds a message when it equals `pos + 1`.
+ * Producers never take a lock; they wait only when the ring is full.
+ */
+struct __apn_pusher_log_slot {
+    size_t sequence;
+    time_t time;
+    apn_log_levels level;
+    uint32_t length;
+    char message[APN_PUSHER_LOG_MESSAGE_SIZE];
+};
+
+static struct __apn_pusher_log_slot *__apn_pusher_log_ring = NULL;
+static size_t __apn_pusher_log_tail = 0;
+static size_t __apn_pusher_log_head = 0;
+
+static pthread_t __apn_pusher_log_thread;
+static pthread_mutex_t __apn_pusher_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __apn_pusher_log_cond = PTHREAD_COND_INITIALIZER;
+static int __apn_pusher_log_waiting = 0;
+static int __apn_pusher_log_stop = 0;
+
+static volatile sig_atomic_t __apn_pusher_log_reopen = 0;
+static char *__apn_pusher_log_path = NULL;
+static FILE *__apn_pusher_log_file = NULL;
+
+static time_t __apn_pusher_log_cached_second = (time_t) -1;
+static char __apn_pusher_log_cached_time[32];
+
+static void __apn_pusher_log_sighup(int signum) {
+    (void) signum;
+    __apn_pusher_log_reopen = 1;
+}
+
+static FILE *__apn_pusher_log_fopen(void) {
+    if (!__apn_pusher_log_path) {
+        return stdout;
+    }
+    FILE *file = fopen(__apn_pusher_log_path, "a");
+    if (file) {
+        setvbuf(file, NULL, _IOFBF, 64 * 1024);
+    }
+    return file;
+}
+
+static const char *__apn_pusher_log_time(time_t now) {
+    if (now != __apn_pusher_log_cached_second) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(__apn_pusher_log_cached_time, sizeof(__apn_pusher_log_cached_time), APN_PUSHER_LOG_TIME_FORMAT,
+                 &tm);
+        __apn_pusher_log_cached_second = now;
+    }
+    return __apn_pusher_log_cached_time;
+}
+
+static const char *__apn_pusher_log_prefix(apn_log_levels level) {
+    switch (level) {
+        case APN_LOG_LEVEL_ERROR:
+            return "ERROR";
+        case APN_LOG_LEVEL_INFO:
+            return "INFO";
+        case APN_LOG_LEVEL_DEBUG:
+            return "DEBUG";
+    }
+    return "";
+}
+
+static void __apn_pusher_log_check_reopen(void) {
+    if (!__apn_pusher_log_reopen) {
+        return;
+    }
+    __apn_pusher_log_reopen = 0;
+    if (__apn_pusher_log_file == stdout) {
+        return;
+    }
+    FILE *file = __apn_pusher_log_fopen();
+    if (file) {
+        if (__apn_pusher_log_file) {
+            fclose(__apn_pusher_log_file);
+        }
+        __apn_pusher_log_file = file;
+    } else {
+        fprintf(stderr, "Unable to reopen log file %s: %s\n", __apn_pusher_log_path, strerror(errno));
+    }
+}
+
+/* Writes all queued messages, returns number of written messages */
+static size_t __apn_pusher_log_drain(void) {
+    size_t written = 0;
+    for (;;) {
+        struct __apn_pusher_log_slot *slot =
+                &__apn_pusher_log_ring[__apn_pusher_log_head & (APN_PUSHER_LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != __apn_pusher_log_head + 1) {
+            break;
+        }
+        if (__apn_pusher_log_file) {
+            fprintf(__apn_pusher_log_file, "%s %s apns ---> %.*s\n", __apn_pusher_log_time(slot->time),
+                    __apn_pusher_log_prefix(slot->level), (int) slot->length, slot->message);
+        }
+        __atomic_store_n(&slot->sequence, __apn_pusher_log_head + APN_PUSHER_LOG_SLOTS, __ATOMIC_RELEASE);
+        __apn_pusher_log_head++;
+        written++;
+    }
+    return written;
+}
+
+static void *__apn_pusher_log_writer(void *arg) {
+    (void) arg;
+    for (;;) {
+        __apn_pusher_log_check_reopen();
+        if (__apn_pusher_log_drain() > 0) {
+            continue;
+        }
+        if (__apn_pusher_log_file) {
+            fflush(__apn_pusher_log_file);
+        }
+
+        pthread_mutex_lock(&__apn_pusher_log_mutex);
+        if (__apn_pusher_log_stop) {
+            pthread_mutex_unlock(&__apn_pusher_log_mutex);
+            break;
+        }
+        __atomic_store_n(&__apn_pusher_log_waiting, 1, __ATOMIC_SEQ_CST);
+        struct __apn_pusher_log_slot *slot =
+                &__apn_pusher_log_ring[__apn_pusher_log_head & (APN_PUSHER_LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != __apn_pusher_log_head + 1) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += APN_PUSHER_LOG_WAIT_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&__apn_pusher_log_cond, &__apn_pusher_log_mutex, &deadline);
+        }
+        __atomic_store_n(&__apn_pusher_log_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&__apn_pusher_log_mutex);
+    }
+
+    __apn_pusher_log_drain();
+    if (__apn_pusher_log_file) {
+        fflush(__apn_pusher_log_file);
+    }
+    return NULL;
+}
+
+apn_return apn_pusher_log_open(const char *const path) {
+    if (path) {
+        __apn_pusher_log_path = apn_strndup(path, strlen(path));
+        if (!__apn_pusher_log_path) {
+            return APN_ERROR;
+        }
+    }
+    __apn_pusher_log_file = __apn_pusher_log_fopen();
+    if (!__apn_pusher_log_file) {
+        free(__apn_pusher_log_path);
+        __apn_pusher_log_path = NULL;
+        return APN_ERROR;
+    }
+
+    __apn_pusher_log_ring = calloc(APN_PUSHER_LOG_SLOTS, sizeof(struct __apn_pusher_log_slot));
+    if (!__apn_pusher_log_ring) {
+        apn_pusher_log_close();
+        errno = ENOMEM;
+        return APN_ERROR;
+    }
+    for (size_t i = 0; i < APN_PUSHER_LOG_SLOTS; i++) {
+        __apn_pusher_log_ring[i].sequence = i;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = __apn_pusher_log_sighup;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, NULL);
+
+    int ret = pthread_create(&__apn_pusher_log_thread, NULL, __apn_pusher_log_writer, NULL);
+    if (0 != ret) {
+        free(__apn_pusher_log_ring);
+        __apn_pusher_log_ring = NULL;
+        apn_pusher_log_close();
+        errno = ret;
+        return APN_ERROR;
+    }
+    return APN_SUCCESS;
+}
+
+void apn_pusher_log(apn_log_levels level, const char *const message, uint32_t len) {
+    if (!__apn_pusher_log_ring) {
+        return;
+    }
+
+    struct __apn_pusher_log_slot *slot = NULL;
+    size_t pos = __atomic_load_n(&__apn_pusher_log_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &__apn_pusher_log_ring[pos & (APN_PUSHER_LOG_SLOTS - 1)];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (0 == diff) {
+            if (__atomic_compare_exchange_n(&__apn_pusher_log_tail, &pos, pos + 1, 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Ring is full: let the writer catch up */
+            sched_yield();
+            pos = __atomic_load_n(&__apn_pusher_log_tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&__apn_pusher_log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->time = time(NULL);
+    slot->level = level;
+    slot->length = len < APN_PUSHER_LOG_MESSAGE_SIZE ? len : APN_PUSHER_LOG_MESSAGE_SIZE;
+    memcpy(slot->message, message, slot->length);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&__apn_pusher_log_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&__apn_pusher_log_mutex);
+        pthread_cond_signal(&__apn_pusher_log_cond);
+        pthread_mutex_unlock(&__apn_pusher_log_mutex);
+    }
+}
+
+void apn_pusher_log_close(void) {
+    if (__apn_pusher_log_ring) {
+        pthread_mutex_lock(&__apn_pusher_log_mutex);
+        __apn_pusher_log_stop = 1;
+        pthread_cond_signal(&__apn_pusher_log_cond);
+        pthread_mutex_unlock(&__apn_pusher_log_mutex);
+        pthread_join(__apn_pusher_log_thread, NULL);
+        free(__apn_pusher_log_ring);
+        __apn_pusher_log_ring = NULL;
+    }
+    if (__apn_pusher_log_file && __apn_pusher_log_file != stdout) {
+        fclose(__apn_pusher_log_file);
+    }
+    __apn_pusher_log_file = NULL;
+    free(__apn_pusher_log_path);
+    __apn_pusher_log_path = NULL;
+}
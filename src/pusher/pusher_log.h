@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_PUSHER_LOG_H__
+#define __APN_PUSHER_LOG_H__
+
+#include <stdint.h>
+
+#include "apn.h"
+
+/**
+ * Starts the log writer thread. Messages are written to `path` or to stdout if `path` is NULL.
+ * The file is kept open and reopened on SIGHUP, so it can be rotated by logrotate.
+ */
+apn_return apn_pusher_log_open(const char *const path);
+
+/** Log callback, see ::apn_set_log_callback(). Queues the message and returns without blocking on I/O */
+void apn_pusher_log(apn_log_levels level, const char *const message, uint32_t len);
+
+/** Writes queued messages and stops the writer thread */
+void apn_pusher_log_close(void);
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "test.h"
+
+#define APN_TEST_COUNTERS 2
+#define APN_TEST_MAX_GATEWAY_ARGS 32
+#define APN_TEST_GATEWAY_START_TIMEOUT 5000
+#define APN_TEST_COUNTERS_TIMEOUT 10000
+#define APN_TEST_COUNTERS_SETTLE 200
+
+uint32_t apn_test_failures = 0;
+
+void apn_test_sleep_ms(uint32_t ms) {
+    struct timespec ts = {(time_t) (ms / 1000), (long) (ms % 1000) * 1000000L};
+    while (-1 == nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/* Self-signed certificate for localhost, used by the gateway and as the client certificate */
+static int __apn_test_certificate(const char *const cert_file, const char *const key_file) {
+    int ret = -1;
+    EVP_PKEY *key = NULL;
+    X509 *cert = NULL;
+    FILE *file = NULL;
+
+    EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    if (!key_ctx || EVP_PKEY_keygen_init(key_ctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(key_ctx, 2048) <= 0 ||
+        EVP_PKEY_keygen(key_ctx, &key) <= 0) {
+        goto finish;
+    }
+    if (!(cert = X509_new())) {
+        goto finish;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_get_notAfter(cert), 7 * 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (!X509_sign(cert, key, EVP_sha256())) {
+        goto finish;
+    }
+
+    if (!(file = fopen(key_file, "w")) || !PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL)) {
+        goto finish;
+    }
+    fclose(file);
+    if (!(file = fopen(cert_file, "w")) || !PEM_write_X509(file, cert)) {
+        goto finish;
+    }
+    ret = 0;
+
+    finish:
+    if (file) {
+        fclose(file);
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    EVP_PKEY_CTX_free(key_ctx);
+    return ret;
+}
+
+static uint8_t __apn_test_port_open(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return 0;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    uint8_t open = 0 == connect(sock, (struct sockaddr *) &address, sizeof(address));
+    close(sock);
+    return open;
+}
+
+static pid_t __apn_test_gateway_start(const apn_test_env_t *const env, const char *const path,
+                                      const char *const *options) {
+    char port[8];
+    char feedback_port[8];
+    snprintf(port, sizeof(port), "%u", env->port);
+    snprintf(feedback_port, sizeof(feedback_port), "%u", env->port + 1);
+
+    const char *args[APN_TEST_MAX_GATEWAY_ARGS] = {
+            path, "-c", env->cert_file, "-k", env->key_file, "-p", port, "-f", feedback_port, "-C", env->counters_file
+    };
+    uint32_t count = 11;
+    for (; options && *options && count < APN_TEST_MAX_GATEWAY_ARGS - 1; options++) {
+        args[count++] = *options;
+    }
+    args[count] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (0 == pid) {
+        /* Own process group, so the connection processes forked by the gateway are stopped with it */
+        setpgid(0, 0);
+        int log = open(env->log_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+            close(log);
+        }
+        execv(path, (char *const *) args);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+
+    /* The gateway listens once the certificate is loaded and the counters file is mapped */
+    for (uint32_t waited = 0; waited < APN_TEST_GATEWAY_START_TIMEOUT; waited += 10) {
+        if (__apn_test_port_open(env->port)) {
+            return pid;
+        }
+        if (pid == waitpid(pid, NULL, WNOHANG)) {
+            return -1;
+        }
+        apn_test_sleep_ms(10);
+    }
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static const volatile uint64_t *__apn_test_counters_map(const char *const path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    void *map = mmap(NULL, APN_TEST_COUNTERS * sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return MAP_FAILED == map ? NULL : map;
+}
+
+void apn_test_env_init(apn_test_env_t *const env, const char *const name, int argc, char **argv,
+                       const char *const *options) {
+    memset(env, 0, sizeof(apn_test_env_t));
+    env->name = name;
+    env->gateway = -1;
+
+    unsigned long port = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+    if (port == 0 || port > 65534) {
+        fprintf(stderr, "Usage: %s GATEWAY PORT\n", argv[0]);
+        exit(2);
+    }
+    env->port = (uint16_t) port;
+    snprintf(env->cert_file, sizeof(env->cert_file), "%s-cert.pem", name);
+    snprintf(env->key_file, sizeof(env->key_file), "%s-key.pem", name);
+    snprintf(env->counters_file, sizeof(env->counters_file), "%s.counters", name);
+    snprintf(env->log_file, sizeof(env->log_file), "%s-gateway.log", name);
+
+    if (APN_ERROR == apn_library_init()) {
+        fprintf(stderr, "%s: unable to initialize the library\n", name);
+        exit(1);
+    }
+    if (0 != __apn_test_certificate(env->cert_file, env->key_file)) {
+        fprintf(stderr, "%s: unable to write a test certificate\n", name);
+        exit(1);
+    }
+    if (__apn_test_port_open(env->port)) {
+        fprintf(stderr, "%s: port %u is in use\n", name, env->port);
+        exit(1);
+    }
+    if ((env->gateway = __apn_test_gateway_start(env, argv[1], options)) < 0) {
+        fprintf(stderr, "%s: unable to start %s, see %s\n", name, argv[1], env->log_file);
+        exit(1);
+    }
+    if (!(env->counters = __apn_test_counters_map(env->counters_file))) {
+        fprintf(stderr, "%s: unable to map %s: %s\n", name, env->counters_file, strerror(errno));
+        kill(-env->gateway, SIGKILL);
+        exit(1);
+    }
+}
+
+int apn_test_env_finish(apn_test_env_t *const env) {
+    if (env->gateway > 0) {
+        kill(-env->gateway, SIGTERM);
+        waitpid(env->gateway, NULL, 0);
+        env->gateway = -1;
+    }
+    if (env->counters) {
+        munmap((void *) env->counters, APN_TEST_COUNTERS * sizeof(uint64_t));
+        env->counters = NULL;
+    }
+    return apn_test_result(env->name);
+}
+
+int apn_test_result(const char *const name) {
+    if (apn_test_failures > 0) {
+        fprintf(stderr, "%s: %u check(s) failed\n", name, apn_test_failures);
+        return 1;
+    }
+    fprintf(stderr, "%s: OK\n", name);
+    return 0;
+}
+
+apn_ctx_t *apn_test_ctx(const apn_test_env_t *const env, uint32_t options, const apn_transport_t *const transport) {
+    apn_ctx_t *ctx = apn_init();
+    if (!ctx) {
+        return NULL;
+    }
+    apn_set_behavior(ctx, options | APN_OPTION_NO_CERT_MODE_CHECK);
+    if (APN_ERROR == apn_set_certificate(ctx, env->cert_file, env->key_file, NULL) ||
+        APN_ERROR == apn_set_gateway(ctx, "127.0.0.1", env->port) ||
+        (transport && APN_ERROR == apn_set_transport(ctx, transport)) ||
+        APN_ERROR == apn_connect(ctx)) {
+        char error[APN_ERROR_STRING_SIZE];
+        fprintf(stderr, "%s: unable to connect: %s\n", env->name, apn_error_string_r(errno, error, sizeof(error)));
+        apn_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void apn_test_counters_read(const apn_test_env_t *const env, uint64_t *const base) {
+    for (uint32_t i = 0; i < APN_TEST_COUNTERS; i++) {
+        base[i] = __atomic_load_n(&env->counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+uint8_t apn_test_counters_wait(const apn_test_env_t *const env, const uint64_t *const base, uint64_t accepted,
+                               uint64_t rejected) {
+    uint64_t counters[APN_TEST_COUNTERS];
+    for (uint32_t waited = 0; waited < APN_TEST_COUNTERS_TIMEOUT; waited += 10) {
+        apn_test_counters_read(env, counters);
+        if (counters[0] - base[0] >= accepted && counters[1] - base[1] >= rejected) {
+            break;
+        }
+        apn_test_sleep_ms(10);
+    }
+    apn_test_sleep_ms(APN_TEST_COUNTERS_SETTLE);
+    apn_test_counters_read(env, counters);
+    if (counters[0] - base[0] != accepted || counters[1] - base[1] != rejected) {
+        fprintf(stderr, "%s: gateway counted %llu accepted and %llu rejected notifications, expected %llu and %llu\n",
+                env->name, (unsigned long long) (counters[0] - base[0]), (unsigned long long) (counters[1] - base[1]),
+                (unsigned long long) accepted, (unsigned long long) rejected);
+        return 0;
+    }
+    return 1;
+}
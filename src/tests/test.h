@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __APN_TEST_H__
+#define __APN_TEST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "apn.h"
+#include "apn_transport.h"
+
+/*
+ * Helpers of the tests run by ctest. Every test gets the path of apn-mock-gateway and a port from CMake,
+ * starts its own gateway on that port and the next one (feedback) and creates its files in the working
+ * directory, so tests can run in parallel.
+ */
+
+#define APN_TEST_PATH_SIZE 256
+
+typedef struct __apn_test_env {
+    const char *name;
+    uint16_t port;
+    pid_t gateway;
+    /* Accepted and rejected notifications of all gateway connections, see apn-mock-gateway -C */
+    const volatile uint64_t *counters;
+    char cert_file[APN_TEST_PATH_SIZE];
+    char key_file[APN_TEST_PATH_SIZE];
+    char counters_file[APN_TEST_PATH_SIZE];
+    char log_file[APN_TEST_PATH_SIZE];
+} apn_test_env_t;
+
+extern uint32_t apn_test_failures;
+
+#define APN_TEST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            apn_test_failures++; \
+        } \
+    } while (0)
+
+/**
+ * Parses `test GATEWAY PORT`, writes a self-signed certificate and starts apn-mock-gateway with
+ * `options` (NULL-terminated, can be NULL) added to its command line. Exits the process on failure.
+ */
+void apn_test_env_init(apn_test_env_t *const env, const char *const name, int argc, char **argv,
+                       const char *const *options);
+
+/** Stops the gateway, prints the result and returns the exit code of the test */
+int apn_test_env_finish(apn_test_env_t *const env);
+
+/** Prints the result of test `name` and returns its exit code, for tests which do not need a gateway */
+int apn_test_result(const char *const name);
+
+/**
+ * Creates a context connected to the gateway of `env` with `options` and ::APN_OPTION_NO_CERT_MODE_CHECK,
+ * over `transport` if it is not NULL. Returns NULL on failure.
+ */
+apn_ctx_t *apn_test_ctx(const apn_test_env_t *const env, uint32_t options, const apn_transport_t *const transport);
+
+/**
+ * Waits until the gateway counted `accepted` and `rejected` notifications since `base` (counters read
+ * before sending). Gives the gateway another moment to count notifications it should not have received.
+ * Returns 1 if the counters match.
+ */
+uint8_t apn_test_counters_wait(const apn_test_env_t *const env, const uint64_t *const base, uint64_t accepted,
+                               uint64_t rejected);
+
+/** Copies the current counters into `base` */
+void apn_test_counters_read(const apn_test_env_t *const env, uint64_t *const base);
+
+void apn_test_sleep_ms(uint32_t ms);
+
+#endif
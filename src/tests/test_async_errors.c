@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apn.h"
+#include "apn_payload.h"
+#include "../bench/bench.h"
+#include "test.h"
+
+/*
+ * APN_OPTION_ASYNC_ERRORS: apn_send() returns without waiting for error responses, errors of the frames in
+ * flight are drained by the next apn_send() or by apn_check_errors(). Every rejected token must be reported
+ * once with its own index and every other notification must reach the gateway once, which holds only if
+ * sending resumes right after the rejected frame id.
+ */
+
+#define APN_TEST_TOKENS 2000
+#define APN_TEST_SEND_LATENCY_MAX_MS 500
+
+/* Each rejected token costs a reconnect, so there are a few of them: first, consecutive and last tokens */
+static const uint32_t invalid_indices[] = {0, 1, 2, 733, APN_TEST_TOKENS - 1};
+static const uint32_t invalid_last[] = {APN_TEST_TOKENS - 1};
+static const uint32_t invalid_middle[] = {1, 1200};
+
+struct __apn_test_batch {
+    apn_array_t *tokens;
+    uint8_t *reported;
+    uint32_t invalid;
+};
+
+static struct __apn_test_batch batches[2];
+static uint32_t misreported = 0;
+
+static void __apn_test_invalid_token(const char *const token, uint32_t index) {
+    for (uint32_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+        struct __apn_test_batch *batch = &batches[i];
+        if (batch->tokens && index < apn_array_count(batch->tokens) &&
+            0 == strcmp(token, apn_array_item_at_index(batch->tokens, index))) {
+            if (0 != strncmp(token, APN_BENCH_INVALID_PREFIX, strlen(APN_BENCH_INVALID_PREFIX)) ||
+                batch->reported[index]++) {
+                misreported++;
+            }
+            return;
+        }
+    }
+    misreported++;
+}
+
+static void __apn_test_batch_init(struct __apn_test_batch *const batch, uint64_t seed, const uint32_t *const invalid,
+                                  uint32_t invalid_count) {
+    batch->tokens = apn_bench_tokens(APN_TEST_TOKENS, 0, seed);
+    batch->reported = calloc(APN_TEST_TOKENS, sizeof(uint8_t));
+    if (!batch->tokens || !batch->reported) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < invalid_count; i++) {
+        char *token = apn_array_item_at_index(batch->tokens, invalid[i]);
+        memcpy(token, APN_BENCH_INVALID_PREFIX, strlen(APN_BENCH_INVALID_PREFIX));
+    }
+    batch->invalid = invalid_count;
+}
+
+static void __apn_test_batch_free(struct __apn_test_batch *const batch) {
+    apn_array_free(batch->tokens);
+    free(batch->reported);
+    memset(batch, 0, sizeof(struct __apn_test_batch));
+}
+
+static uint32_t __apn_test_reported(const struct __apn_test_batch *const batch) {
+    uint32_t reported = 0;
+    for (uint32_t i = 0; i < APN_TEST_TOKENS; i++) {
+        reported += batch->reported[i];
+    }
+    return reported;
+}
+
+/* Calls apn_check_errors() until no error response arrives, checks the indices it returns */
+static void __apn_test_drain(apn_ctx_t *const ctx, const struct __apn_test_batch *const batch) {
+    uint32_t index = 0;
+    while (APN_ERROR == apn_check_errors(ctx, 1000, &index)) {
+        APN_TEST_CHECK(APN_ERR_TOKEN_INVALID == errno);
+        if (APN_ERR_TOKEN_INVALID != errno) {
+            break;
+        }
+        APN_TEST_CHECK(index < APN_TEST_TOKENS);
+        APN_TEST_CHECK(index < APN_TEST_TOKENS && 0 == strncmp(apn_array_item_at_index(batch->tokens, index),
+                                                               APN_BENCH_INVALID_PREFIX,
+                                                               strlen(APN_BENCH_INVALID_PREFIX)));
+    }
+}
+
+static void __apn_test_single_send(const apn_test_env_t *const env, apn_ctx_t *const ctx,
+                                   const apn_payload_t *const payload) {
+    uint64_t counters[2];
+    apn_test_counters_read(env, counters);
+    apn_array_t *tokens = apn_bench_tokens(1, 0, 3);
+    uint64_t start = apn_bench_clock_ns();
+    APN_TEST_CHECK(APN_SUCCESS == apn_send(ctx, payload, tokens, NULL));
+    uint64_t elapsed_ms = (apn_bench_clock_ns() - start) / 1000000;
+    APN_TEST_CHECK(elapsed_ms < APN_TEST_SEND_LATENCY_MAX_MS);
+    APN_TEST_CHECK(APN_SUCCESS == apn_check_errors(ctx, 200, NULL));
+    APN_TEST_CHECK(apn_test_counters_wait(env, counters, 1, 0));
+    apn_array_free(tokens);
+}
+
+static void __apn_test_one_array(const apn_test_env_t *const env, apn_ctx_t *const ctx,
+                                 const apn_payload_t *const payload) {
+    uint64_t counters[2];
+    apn_test_counters_read(env, counters);
+    __apn_test_batch_init(&batches[0], 7, invalid_indices, sizeof(invalid_indices) / sizeof(invalid_indices[0]));
+
+    APN_TEST_CHECK(APN_SUCCESS == apn_send(ctx, payload, batches[0].tokens, NULL));
+    __apn_test_drain(ctx, &batches[0]);
+
+    APN_TEST_CHECK(__apn_test_reported(&batches[0]) == batches[0].invalid);
+    APN_TEST_CHECK(apn_test_counters_wait(env, counters, APN_TEST_TOKENS - batches[0].invalid, batches[0].invalid));
+    __apn_test_batch_free(&batches[0]);
+}
+
+/* The error response to the last token of the first array is drained by the apn_send() of the second one */
+static void __apn_test_two_arrays(const apn_test_env_t *const env, apn_ctx_t *const ctx,
+                                  const apn_payload_t *const payload) {
+    uint64_t counters[2];
+    apn_test_counters_read(env, counters);
+    __apn_test_batch_init(&batches[0], 11, invalid_last, sizeof(invalid_last) / sizeof(invalid_last[0]));
+    __apn_test_batch_init(&batches[1], 13, invalid_middle, sizeof(invalid_middle) / sizeof(invalid_middle[0]));
+
+    APN_TEST_CHECK(APN_SUCCESS == apn_send(ctx, payload, batches[0].tokens, NULL));
+    APN_TEST_CHECK(APN_SUCCESS == apn_send(ctx, payload, batches[1].tokens, NULL));
+    __apn_test_drain(ctx, &batches[1]);
+
+    uint32_t invalid = batches[0].invalid + batches[1].invalid;
+    APN_TEST_CHECK(__apn_test_reported(&batches[0]) == batches[0].invalid);
+    APN_TEST_CHECK(__apn_test_reported(&batches[1]) == batches[1].invalid);
+    APN_TEST_CHECK(apn_test_counters_wait(env, counters, 2 * APN_TEST_TOKENS - invalid, invalid));
+    __apn_test_batch_free(&batches[0]);
+    __apn_test_batch_free(&batches[1]);
+}
+
+int main(int argc, char **argv) {
+    static const char *const options[] = {"-x", "dead", NULL};
+    apn_test_env_t env;
+    apn_test_env_init(&env, "async_errors", argc, argv, options);
+
+    apn_payload_t *payload = apn_payload_init();
+    apn_ctx_t *ctx = apn_test_ctx(&env, APN_OPTION_RECONNECT | APN_OPTION_ASYNC_ERRORS, NULL);
+    APN_TEST_CHECK(NULL != ctx);
+    if (payload && ctx) {
+        apn_payload_set_body(payload, "async errors");
+        apn_set_invalid_token_callback(ctx, __apn_test_invalid_token);
+        __apn_test_single_send(&env, ctx, payload);
+        __apn_test_one_array(&env, ctx, payload);
+        __apn_test_two_arrays(&env, ctx, payload);
+        APN_TEST_CHECK(0 == misreported);
+    }
+    apn_free(ctx);
+    apn_payload_free(payload);
+    return apn_test_env_finish(&env);
+}
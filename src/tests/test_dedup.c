@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "apn.h"
+#include "apn_array.h"
+#include "../bench/bench.h"
+#include "../pusher/pusher_dedup.h"
+#include "test.h"
+
+/*
+ * apn_pusher_dedup() partitions tokens by hash and deduplicates the partitions on several threads. Its result
+ * must be the one of a plain serial pass: the first occurrence of every binary token is kept in place, later
+ * ones are removed whatever the case of their hex digits, strings which are not tokens are kept as they are.
+ * The serial pass here sorts (token, index) pairs and drops every pair equal to the previous one.
+ */
+
+#define APN_TEST_TOKEN_SIZE 32
+#define APN_TEST_TOKEN_LENGTH 64
+
+struct __apn_test_token {
+    uint8_t binary[APN_TEST_TOKEN_SIZE];
+    uint32_t index;
+};
+
+static void __apn_test_token_free(void *token) {
+    free(token);
+}
+
+static int __apn_test_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static uint8_t __apn_test_parse(const char *const hex, uint8_t *const binary) {
+    if (APN_TEST_TOKEN_LENGTH != strlen(hex)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < APN_TEST_TOKEN_SIZE; i++) {
+        int high = __apn_test_hex_digit(hex[2 * i]);
+        int low = __apn_test_hex_digit(hex[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return 0;
+        }
+        binary[i] = (uint8_t) (high << 4 | low);
+    }
+    return 1;
+}
+
+static int __apn_test_compare(const void *a, const void *b) {
+    const struct __apn_test_token *left = a;
+    const struct __apn_test_token *right = b;
+    int ret = memcmp(left->binary, right->binary, APN_TEST_TOKEN_SIZE);
+    if (ret) {
+        return ret;
+    }
+    return (left->index > right->index) - (left->index < right->index);
+}
+
+/* Hex of `binary` with the case of every digit picked at random */
+static char *__apn_test_token_string(const uint8_t *const binary, uint64_t *state) {
+    static const char lower[] = "0123456789abcdef";
+    static const char upper[] = "0123456789ABCDEF";
+    char *token = malloc(APN_TEST_TOKEN_LENGTH + 1);
+    if (!token) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < APN_TEST_TOKEN_LENGTH; i++) {
+        uint8_t nibble = (uint8_t) ((binary[i / 2] >> ((i % 2) ? 0 : 4)) & 0x0F);
+        token[i] = (apn_bench_random(state) & 1) ? upper[nibble] : lower[nibble];
+    }
+    token[APN_TEST_TOKEN_LENGTH] = '\0';
+    return token;
+}
+
+/* Strings which are not tokens: too short, not hex, and a repeated one */
+static char *__apn_test_invalid_string(uint32_t kind, uint64_t *state) {
+    char *string = malloc(APN_TEST_TOKEN_LENGTH + 1);
+    if (!string) {
+        return NULL;
+    }
+    memset(string, 'a', APN_TEST_TOKEN_LENGTH);
+    string[APN_TEST_TOKEN_LENGTH] = '\0';
+    switch (kind % 3) {
+        case 0:
+            string[APN_TEST_TOKEN_LENGTH - 1] = '\0';
+            break;
+        case 1:
+            string[apn_bench_random(state) % APN_TEST_TOKEN_LENGTH] = 'g';
+            break;
+        default:
+            strcpy(string, "not a token");
+            break;
+    }
+    return string;
+}
+
+/* `count` strings drawn from `unique` binary tokens, one in a hundred is not a token */
+static apn_array_t *__apn_test_tokens(uint32_t count, uint32_t unique, uint64_t seed) {
+    uint64_t state = seed;
+    uint8_t *pool = malloc((size_t) unique * APN_TEST_TOKEN_SIZE);
+    apn_array_t *tokens = apn_array_init(count, __apn_test_token_free, NULL);
+    if (!pool || !tokens) {
+        free(pool);
+        apn_array_free(tokens);
+        return NULL;
+    }
+    for (size_t i = 0; i < (size_t) unique * APN_TEST_TOKEN_SIZE; i++) {
+        pool[i] = (uint8_t) apn_bench_random(&state);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t random = apn_bench_random(&state);
+        char *token = 0 == random % 100 ? __apn_test_invalid_string(random / 100, &state) :
+                      __apn_test_token_string(pool + (size_t) (random % unique) * APN_TEST_TOKEN_SIZE, &state);
+        if (!token) {
+            apn_array_free(tokens);
+            tokens = NULL;
+            break;
+        }
+        apn_array_insert(tokens, token);
+    }
+    free(pool);
+    return tokens;
+}
+
+/* Strings kept by the serial pass, in order. They are compared by pointer with the result of apn_pusher_dedup() */
+static const char **__apn_test_serial_dedup(const apn_array_t *const tokens, uint32_t *const kept) {
+    uint32_t count = apn_array_count(tokens);
+    struct __apn_test_token *parsed = malloc(sizeof(struct __apn_test_token) * (count > 0 ? count : 1));
+    uint8_t *duplicates = calloc(count > 0 ? count : 1, sizeof(uint8_t));
+    const char **result = malloc(sizeof(char *) * (count > 0 ? count : 1));
+    if (!parsed || !duplicates || !result) {
+        free(parsed);
+        free(duplicates);
+        free(result);
+        return NULL;
+    }
+
+    uint32_t valid = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (__apn_test_parse(apn_array_item_at_index(tokens, i), parsed[valid].binary)) {
+            parsed[valid++].index = i;
+        }
+    }
+    qsort(parsed, valid, sizeof(struct __apn_test_token), __apn_test_compare);
+    for (uint32_t i = 1; i < valid; i++) {
+        if (0 == memcmp(parsed[i].binary, parsed[i - 1].binary, APN_TEST_TOKEN_SIZE)) {
+            duplicates[parsed[i].index] = 1;
+        }
+    }
+
+    *kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!duplicates[i]) {
+            result[(*kept)++] = apn_array_item_at_index(tokens, i);
+        }
+    }
+    free(parsed);
+    free(duplicates);
+    return result;
+}
+
+static void __apn_test_dedup(uint32_t count, uint32_t unique, uint64_t seed) {
+    apn_array_t *tokens = __apn_test_tokens(count, unique, seed);
+    APN_TEST_CHECK(NULL != tokens);
+    if (!tokens) {
+        return;
+    }
+    uint32_t kept = 0;
+    const char **expected = __apn_test_serial_dedup(tokens, &kept);
+    APN_TEST_CHECK(NULL != expected);
+    if (expected) {
+        uint32_t removed = 0;
+        APN_TEST_CHECK(APN_SUCCESS == apn_pusher_dedup(tokens, &removed));
+        APN_TEST_CHECK(count - kept == removed);
+        APN_TEST_CHECK(kept == apn_array_count(tokens));
+        uint32_t mismatches = 0;
+        for (uint32_t i = 0; i < kept && i < apn_array_count(tokens); i++) {
+            if (expected[i] != apn_array_item_at_index(tokens, i)) {
+                mismatches++;
+            }
+        }
+        APN_TEST_CHECK(0 == mismatches);
+        free(expected);
+    }
+    apn_array_free(tokens);
+}
+
+int main(void) {
+    __apn_test_dedup(0, 1, 29);
+    __apn_test_dedup(1, 1, 29);
+    /* Few tokens: one thread; every token repeated many times */
+    __apn_test_dedup(1000, 100, 31);
+    /* Enough tokens for several threads, many of them repeated */
+    __apn_test_dedup(400000, 300000, 37);
+    return apn_test_result("dedup");
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "apn.h"
+#include "apn_payload.h"
+#include "apn_transport.h"
+#include "../bench/bench.h"
+#include "test.h"
+
+/*
+ * A batch of frames is encrypted and passed to the transport in one writev(). When the transport takes only
+ * a part of it and the connection then breaks, sending must resume right after the last frame whose records
+ * were written completely: frames before it reached the gateway, frames after it did not. The transport
+ * below cuts a batch inside a TLS record a few times, every notification must reach the gateway exactly once.
+ */
+
+#define APN_TEST_TOKENS 2000
+#define APN_TEST_FAULTS 3
+#define APN_TEST_FAULT_MIN_BATCH 4096
+#define APN_TEST_MAX_IOV 64
+
+struct __apn_test_transport {
+    uint16_t port;
+    int sock;
+    uint32_t faults;
+    uint8_t broken;
+};
+
+static int __apn_test_transport_open(struct __apn_test_transport *const transport) {
+    if (transport->sock >= 0) {
+        return 0;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(transport->port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (0 != connect(sock, (struct sockaddr *) &address, sizeof(address))) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    transport->sock = sock;
+    transport->broken = 0;
+    return 0;
+}
+
+static int __apn_test_transport_read(void *user, void *buffer, size_t length) {
+    struct __apn_test_transport *transport = user;
+    if (0 != __apn_test_transport_open(transport)) {
+        return -1;
+    }
+    return (int) recv(transport->sock, buffer, length, 0);
+}
+
+static int __apn_test_transport_writev(void *user, const apn_iovec_t *iov, uint32_t count) {
+    struct __apn_test_transport *transport = user;
+    if (0 != __apn_test_transport_open(transport)) {
+        return -1;
+    }
+    if (transport->broken) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    struct iovec vectors[APN_TEST_MAX_IOV];
+    size_t total = 0;
+    if (count > APN_TEST_MAX_IOV) {
+        count = APN_TEST_MAX_IOV;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        vectors[i].iov_base = (void *) iov[i].base;
+        vectors[i].iov_len = iov[i].length;
+        total += iov[i].length;
+    }
+
+    if (transport->faults > 0 && total > APN_TEST_FAULT_MIN_BATCH) {
+        /* Take a bit more than half of the first buffer, so the cut falls inside a record, then break */
+        size_t part = total / 2 + 7;
+        if (part > iov[0].length) {
+            part = iov[0].length;
+        }
+        int flags = fcntl(transport->sock, F_GETFL);
+        fcntl(transport->sock, F_SETFL, flags & ~O_NONBLOCK);
+        ssize_t written = send(transport->sock, iov[0].base, part, 0);
+        fcntl(transport->sock, F_SETFL, flags);
+        transport->faults--;
+        transport->broken = 1;
+        return (int) written;
+    }
+    return (int) writev(transport->sock, vectors, (int) count);
+}
+
+static int __apn_test_transport_poll(void *user, int events, uint32_t timeout) {
+    struct __apn_test_transport *transport = user;
+    if (0 != __apn_test_transport_open(transport)) {
+        return -1;
+    }
+    struct pollfd descriptor;
+    descriptor.fd = transport->sock;
+    descriptor.events = (short) (((events & APN_TRANSPORT_READ) ? POLLIN : 0) |
+                                 ((events & APN_TRANSPORT_WRITE) ? POLLOUT : 0));
+    descriptor.revents = 0;
+    int ready = poll(&descriptor, 1, (int) timeout);
+    if (ready <= 0) {
+        return ready;
+    }
+    return ((descriptor.revents & (POLLIN | POLLHUP | POLLERR)) ? APN_TRANSPORT_READ : 0) |
+           ((descriptor.revents & POLLOUT) ? APN_TRANSPORT_WRITE : 0);
+}
+
+static void __apn_test_transport_close(void *user) {
+    struct __apn_test_transport *transport = user;
+    if (transport->sock >= 0) {
+        close(transport->sock);
+        transport->sock = -1;
+    }
+}
+
+int main(int argc, char **argv) {
+    apn_test_env_t env;
+    apn_test_env_init(&env, "partial_flush", argc, argv, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct __apn_test_transport transport_state = {env.port, -1, APN_TEST_FAULTS, 0};
+    apn_transport_t transport = {
+            __apn_test_transport_read, __apn_test_transport_writev, __apn_test_transport_poll,
+            __apn_test_transport_close, &transport_state
+    };
+
+    uint64_t counters[2];
+    apn_test_counters_read(&env, counters);
+
+    apn_payload_t *payload = apn_payload_init();
+    apn_array_t *tokens = apn_bench_tokens(APN_TEST_TOKENS, 0, 17);
+    apn_ctx_t *ctx = apn_test_ctx(&env, APN_OPTION_RECONNECT, &transport);
+    APN_TEST_CHECK(NULL != ctx);
+    if (payload && tokens && ctx) {
+        apn_payload_set_body(payload, "partial flush");
+        APN_TEST_CHECK(APN_SUCCESS == apn_send(ctx, payload, tokens, NULL));
+        APN_TEST_CHECK(0 == transport_state.faults);
+        apn_free(ctx);
+        ctx = NULL;
+        APN_TEST_CHECK(apn_test_counters_wait(&env, counters, APN_TEST_TOKENS, 0));
+    }
+    apn_free(ctx);
+    apn_array_free(tokens);
+    apn_payload_free(payload);
+    return apn_test_env_finish(&env);
+}
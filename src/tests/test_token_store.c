@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apn.h"
+#include "apn_payload.h"
+#include "apn_token_store.h"
+#include "apn_tokens.h"
+#include "../bench/bench.h"
+#include "test.h"
+
+/*
+ * Tokens rejected by the gateway are added to the store, survive closing and reopening it, including after
+ * the table grew, and are not sent again by a context using the store. A damaged file is refused when it is
+ * opened, and a table damaged in a way the header does not show makes lookups fail instead of looping.
+ */
+
+#define APN_TEST_STORE_FILE "token_store.tks"
+#define APN_TEST_TOKENS 1000
+#define APN_TEST_GROWTH_TOKENS 5000
+
+/* File layout of apn_token_store.c: header, Bloom filter of 2 bytes per slot, slots of token, timestamp, used */
+#define APN_TEST_STORE_HEADER_SIZE 32
+#define APN_TEST_STORE_SLOTS 1024
+#define APN_TEST_STORE_SLOT_SIZE 40
+#define APN_TEST_STORE_SLOT_USED_OFFSET 36
+
+static const uint32_t invalid_indices[] = {5, 600};
+
+static uint8_t __apn_test_contains(apn_token_store_t *const store, const char *const token) {
+    uint8_t binary[APN_TOKEN_BINARY_SIZE];
+    apn_token_hex_to_binary_r(token, binary);
+    return apn_token_store_contains(store, binary, NULL);
+}
+
+static uint8_t __apn_test_is_invalid(uint32_t index) {
+    for (uint32_t i = 0; i < sizeof(invalid_indices) / sizeof(invalid_indices[0]); i++) {
+        if (invalid_indices[i] == index) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void __apn_test_check_contents(apn_token_store_t *const store, const apn_array_t *const tokens) {
+    APN_TEST_CHECK(sizeof(invalid_indices) / sizeof(invalid_indices[0]) == apn_token_store_count(store));
+    for (uint32_t i = 0; i < APN_TEST_TOKENS; i++) {
+        APN_TEST_CHECK(__apn_test_is_invalid(i) == __apn_test_contains(store, apn_array_item_at_index(tokens, i)));
+    }
+}
+
+static void __apn_test_send(const apn_test_env_t *const env, apn_token_store_t *const store,
+                            const apn_payload_t *const payload, apn_array_t *const tokens, uint64_t rejected) {
+    uint64_t counters[2];
+    apn_test_counters_read(env, counters);
+    apn_ctx_t *ctx = apn_test_ctx(env, APN_OPTION_RECONNECT, NULL);
+    APN_TEST_CHECK(NULL != ctx);
+    if (!ctx) {
+        return;
+    }
+    apn_set_token_store(ctx, store);
+    APN_TEST_CHECK(APN_SUCCESS == apn_send(ctx, payload, tokens, NULL));
+
+    apn_stats_t stats;
+    apn_stats(ctx, &stats);
+    APN_TEST_CHECK(stats.tokens_suppressed == (rejected ? 0 : sizeof(invalid_indices) / sizeof(invalid_indices[0])));
+    apn_free(ctx);
+
+    uint32_t invalid = sizeof(invalid_indices) / sizeof(invalid_indices[0]);
+    APN_TEST_CHECK(apn_test_counters_wait(env, counters, APN_TEST_TOKENS - invalid, rejected));
+}
+
+static void __apn_test_rejected_tokens(const apn_test_env_t *const env, const apn_payload_t *const payload) {
+    apn_array_t *tokens = apn_bench_tokens(APN_TEST_TOKENS, 0, 19);
+    if (!tokens) {
+        APN_TEST_CHECK(NULL != tokens);
+        return;
+    }
+    for (uint32_t i = 0; i < sizeof(invalid_indices) / sizeof(invalid_indices[0]); i++) {
+        char *token = apn_array_item_at_index(tokens, invalid_indices[i]);
+        memcpy(token, APN_BENCH_INVALID_PREFIX, strlen(APN_BENCH_INVALID_PREFIX));
+    }
+
+    unlink(APN_TEST_STORE_FILE);
+    apn_token_store_t *store = apn_token_store_open(APN_TEST_STORE_FILE, 0);
+    APN_TEST_CHECK(NULL != store);
+    if (store) {
+        /* Rejected tokens are added to the store */
+        __apn_test_send(env, store, payload, tokens, sizeof(invalid_indices) / sizeof(invalid_indices[0]));
+        __apn_test_check_contents(store, tokens);
+        apn_token_store_close(store);
+    }
+
+    store = apn_token_store_open(APN_TEST_STORE_FILE, 0);
+    APN_TEST_CHECK(NULL != store);
+    if (store) {
+        /* They are still there after reopening and are not sent again */
+        __apn_test_check_contents(store, tokens);
+        __apn_test_send(env, store, payload, tokens, 0);
+
+        uint8_t binary[APN_TOKEN_BINARY_SIZE];
+        apn_token_hex_to_binary_r(apn_array_item_at_index(tokens, invalid_indices[0]), binary);
+        APN_TEST_CHECK(1 == apn_token_store_remove(store, binary));
+        APN_TEST_CHECK(0 == apn_token_store_contains(store, binary, NULL));
+        APN_TEST_CHECK(0 == apn_token_store_remove(store, binary));
+        apn_token_store_close(store);
+    }
+    apn_array_free(tokens);
+}
+
+static void __apn_test_growth(void) {
+    unlink(APN_TEST_STORE_FILE);
+    apn_token_store_t *store = apn_token_store_open(APN_TEST_STORE_FILE, 16);
+    APN_TEST_CHECK(NULL != store);
+    if (!store) {
+        return;
+    }
+    uint64_t state = 23;
+    uint8_t token[APN_TOKEN_BINARY_SIZE];
+    for (uint32_t i = 0; i < APN_TEST_GROWTH_TOKENS; i++) {
+        for (uint32_t j = 0; j < APN_TOKEN_BINARY_SIZE; j++) {
+            token[j] = (uint8_t) apn_bench_random(&state);
+        }
+        APN_TEST_CHECK(APN_SUCCESS == apn_token_store_add(store, token, i + 1));
+    }
+    APN_TEST_CHECK(APN_TEST_GROWTH_TOKENS == apn_token_store_count(store));
+    apn_token_store_close(store);
+
+    store = apn_token_store_open(APN_TEST_STORE_FILE, 16);
+    APN_TEST_CHECK(NULL != store);
+    if (!store) {
+        return;
+    }
+    APN_TEST_CHECK(APN_TEST_GROWTH_TOKENS == apn_token_store_count(store));
+    state = 23;
+    for (uint32_t i = 0; i < APN_TEST_GROWTH_TOKENS; i++) {
+        for (uint32_t j = 0; j < APN_TOKEN_BINARY_SIZE; j++) {
+            token[j] = (uint8_t) apn_bench_random(&state);
+        }
+        uint32_t timestamp = 0;
+        APN_TEST_CHECK(1 == apn_token_store_contains(store, token, &timestamp));
+        APN_TEST_CHECK(i + 1 == timestamp);
+    }
+    apn_token_store_close(store);
+}
+
+static uint8_t __apn_test_write_at(int fd, const void *const data, size_t size, off_t offset) {
+    return offset == lseek(fd, offset, SEEK_SET) && (ssize_t) size == write(fd, data, size);
+}
+
+static void __apn_test_damaged_files(void) {
+    /* Not a store */
+    FILE *file = fopen(APN_TEST_STORE_FILE, "w");
+    APN_TEST_CHECK(NULL != file);
+    if (!file) {
+        return;
+    }
+    for (uint32_t i = 0; i < 4096; i++) {
+        fputc('x', file);
+    }
+    fclose(file);
+    errno = 0;
+    APN_TEST_CHECK(NULL == apn_token_store_open(APN_TEST_STORE_FILE, 0));
+    APN_TEST_CHECK(APN_ERR_TOKEN_STORE_INVALID == errno);
+
+    /* Every slot used while the header counts one token */
+    unlink(APN_TEST_STORE_FILE);
+    uint8_t token[APN_TOKEN_BINARY_SIZE];
+    memset(token, 0x5A, sizeof(token));
+    apn_token_store_t *store = apn_token_store_open(APN_TEST_STORE_FILE, APN_TEST_STORE_SLOTS / 2);
+    APN_TEST_CHECK(NULL != store);
+    if (!store) {
+        return;
+    }
+    APN_TEST_CHECK(APN_SUCCESS == apn_token_store_add(store, token, 1));
+    apn_token_store_close(store);
+
+    int fd = open(APN_TEST_STORE_FILE, O_RDWR);
+    APN_TEST_CHECK(fd >= 0);
+    if (fd < 0) {
+        return;
+    }
+    off_t slots = APN_TEST_STORE_HEADER_SIZE + 2 * APN_TEST_STORE_SLOTS;
+    uint8_t slot[APN_TEST_STORE_SLOT_SIZE];
+    uint8_t bloom[2 * APN_TEST_STORE_SLOTS];
+    memset(bloom, 0xFF, sizeof(bloom));
+    APN_TEST_CHECK(__apn_test_write_at(fd, bloom, sizeof(bloom), APN_TEST_STORE_HEADER_SIZE));
+    for (uint32_t i = 0; i < APN_TEST_STORE_SLOTS; i++) {
+        memset(slot, 0, sizeof(slot));
+        memcpy(slot, &i, sizeof(i));
+        slot[APN_TEST_STORE_SLOT_USED_OFFSET] = 1;
+        APN_TEST_CHECK(__apn_test_write_at(fd, slot, sizeof(slot), slots + (off_t) i * APN_TEST_STORE_SLOT_SIZE));
+    }
+    close(fd);
+
+    store = apn_token_store_open(APN_TEST_STORE_FILE, 0);
+    APN_TEST_CHECK(NULL != store);
+    if (!store) {
+        return;
+    }
+    memset(token, 0xA5, sizeof(token));
+    APN_TEST_CHECK(0 == apn_token_store_contains(store, token, NULL));
+    APN_TEST_CHECK(0 == apn_token_store_remove(store, token));
+    errno = 0;
+    APN_TEST_CHECK(APN_ERROR == apn_token_store_add(store, token, 1));
+    APN_TEST_CHECK(APN_ERR_TOKEN_STORE_INVALID == errno);
+    apn_token_store_close(store);
+}
+
+int main(int argc, char **argv) {
+    static const char *const options[] = {"-x", "dead", NULL};
+    apn_test_env_t env;
+    apn_test_env_init(&env, "token_store", argc, argv, options);
+
+    apn_payload_t *payload = apn_payload_init();
+    APN_TEST_CHECK(NULL != payload);
+    if (payload) {
+        apn_payload_set_body(payload, "token store");
+        __apn_test_rejected_tokens(&env, payload);
+    }
+    __apn_test_growth();
+    __apn_test_damaged_files();
+    unlink(APN_TEST_STORE_FILE);
+    apn_payload_free(payload);
+    return apn_test_env_finish(&env);
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2013-2015 Anton Dobkin <anton.dobkin@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Converts a trace written by apn_trace_dump() to Chrome trace-event JSON, which can be
+ * opened in chrome://tracing or Perfetto. Each connection is shown as a separate thread.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apn.h"
+#include "apn_trace.h"
+
+static void __apn_trace2json_usage(void) {
+    fprintf(stderr, "Usage: apn-trace2json [OPTION] FILE\n");
+    fprintf(stderr, "    -h Print this message and exit\n");
+    fprintf(stderr, "    -o Write JSON to file instead of stdout\n");
+}
+
+static int __apn_trace2json_read_header(FILE *in, apn_trace_file_header_t *header) {
+    if (1 != fread(header, sizeof(*header), 1, in)) {
+        fprintf(stderr, "Unable to read trace header\n");
+        return -1;
+    }
+    if (0 != memcmp(header->magic, APN_TRACE_FILE_MAGIC, sizeof(APN_TRACE_FILE_MAGIC))) {
+        fprintf(stderr, "Not a trace file\n");
+        return -1;
+    }
+    if (header->version != APN_TRACE_FILE_VERSION || header->event_size != sizeof(apn_trace_event_t)) {
+        fprintf(stderr, "Unsupported trace file version %u (event size %u)\n", header->version,
+                header->event_size);
+        return -1;
+    }
+    return 0;
+}
+
+static void __apn_trace2json_event(FILE *out, const apn_trace_event_t *event, uint64_t origin, uint8_t first) {
+    const char *ph = "i";
+    if (event->phase & APN_TRACE_BEGIN) {
+        ph = "B";
+    } else if (event->phase & APN_TRACE_END) {
+        ph = "E";
+    }
+    uint64_t ts = event->timestamp - origin;
+    fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"apn\",\"ph\":\"%s\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%u",
+            first ? "" : ",", apn_trace_phase_name(event->phase), ph,
+            (unsigned long long) (ts / 1000), (unsigned long long) (ts % 1000), event->connection_id);
+    if ('i' == ph[0]) {
+        fprintf(out, ",\"s\":\"t\"");
+    }
+    fprintf(out, ",\"args\":{\"frame_id\":%u,\"bytes\":%u}}", event->frame_id, event->bytes);
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "ho:")) != -1) {
+        switch (c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+            default:
+                __apn_trace2json_usage();
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        __apn_trace2json_usage();
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (!in) {
+        fprintf(stderr, "Unable to open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    apn_trace_file_header_t header;
+    if (0 != __apn_trace2json_read_header(in, &header)) {
+        fclose(in);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Unable to open %s: %s\n", output, strerror(errno));
+        fclose(in);
+        return 1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"version\":\"%s\",\"dropped\":%llu},\"traceEvents\":[",
+            apn_version_string(), (unsigned long long) header.dropped);
+
+    int ret = 0;
+    uint64_t origin = 0;
+    apn_trace_event_t event;
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (1 != fread(&event, sizeof(event), 1, in)) {
+            fprintf(stderr, "Trace file is truncated: %llu of %llu events read\n", (unsigned long long) i,
+                    (unsigned long long) header.count);
+            ret = 1;
+            break;
+        }
+        if (0 == i) {
+            origin = event.timestamp;
+        }
+        __apn_trace2json_event(out, &event, origin, 0 == i);
+    }
+    fprintf(out, "\n]}\n");
+
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}